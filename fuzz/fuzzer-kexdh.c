@@ -24,7 +24,7 @@ static void setup() {
 	/* Pre-generate parameters */
 	int i;
 	for (i = 0; i < NUM_PARAMS; i++) {
-		dh_params[i] = gen_kexdh_param();
+		dh_params[i] = gen_kexdh_param(keep_newkeys->algo_kex);
 	}
 }
 
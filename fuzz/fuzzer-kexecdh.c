@@ -33,7 +33,7 @@ static void setup() {
 	int i;
 	for (i = 0; i < NUM_PARAMS; i++) {
 		ses.newkeys->algo_kex = ecdh[i % 3];
-		ecdh_params[i] = gen_kexecdh_param();
+		ecdh_params[i] = gen_kexecdh_param(ses.newkeys->algo_kex);
 	}
 }
 
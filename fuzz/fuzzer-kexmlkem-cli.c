@@ -28,7 +28,7 @@ int LLVMFuzzerTestOneInput(const uint8_t *Data, size_t Size) {
 		sign_key *hostkey = cli_opts.privkeys->first->item;
 		ses.newkeys = keep_newkeys;
 
-		struct kex_pqhybrid_param *param = gen_kexpqhybrid_param();
+		struct kex_pqhybrid_param *param = gen_kexpqhybrid_param(ses.newkeys->algo_kex);
 
 		buffer * q_s = buf_getstringbuf(fuzz.input);
 
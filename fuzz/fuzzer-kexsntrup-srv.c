@@ -27,7 +27,7 @@ int LLVMFuzzerTestOneInput(const uint8_t *Data, size_t Size) {
 	if (setjmp(fuzz.jmp) == 0) {
 		ses.newkeys = keep_newkeys;
 
-		struct kex_pqhybrid_param *param = gen_kexpqhybrid_param();
+		struct kex_pqhybrid_param *param = gen_kexpqhybrid_param(ses.newkeys->algo_kex);
 
 		buffer * q_c = buf_getstringbuf(fuzz.input);
 
@@ -59,7 +59,7 @@ extern const struct ChanType cli_chan_agent;
 
 int svr_agentreq(struct ChanSess * chansess);
 void svr_agentcleanup(struct ChanSess * chansess);
-void svr_agentset(const struct ChanSess *chansess);
+char *svr_agentpath(const struct ChanSess *chansess);
 
 #endif /* DROPBEAR_SVR_AGENTFWD */
 
@@ -39,10 +39,28 @@ void send_msg_userauth_success(void);
 void send_msg_userauth_banner(const buffer *msg);
 void svr_auth_password(int valid_user);
 void svr_auth_pubkey(int valid_user);
+void svr_pubkey_index_free(void);
 void svr_auth_pam(int valid_user);
 void svr_switch_user(void);
 void svr_raise_gid_utmp(void);
 void svr_restore_gid(void);
+#ifdef HAVE_GETGROUPLIST
+int check_group_membership(gid_t check_gid, const char* username, gid_t user_gid);
+#endif
+
+/* svr-pwcache.c */
+void svr_pwcache_fill_passwd(const char *username);
+#ifdef HAVE_GETGROUPLIST
+int svr_pwcache_group_member(gid_t check_gid, const char* username, gid_t user_gid);
+#endif
+void svr_pwcache_close(void);
+#if DROPBEAR_SVR_PWCACHE
+void svr_pwcache_init(const int *closefds, unsigned int nclosefds);
+int svr_pwcache_new_session(void);
+int svr_pwcache_reexec_fd(void);
+void svr_pwcache_setfd(int fd);
+void svr_pwcache_flush(void);
+#endif
 
 struct PubKeyOptions;
 #if DROPBEAR_SVR_PUBKEY_OPTIONS_BUILT
@@ -41,6 +41,7 @@
 #define CHAN_EXTEND_SIZE 3 /* how many extra slots to add when we need more */
 
 struct ChanType;
+struct ChanLocal;
 
 struct Channel {
 
@@ -62,6 +63,14 @@ struct Channel {
 							 initially NULL */
 	circbuffer *extrabuf; /* extended-data for the program - used like writebuf
 					     but for stderr */
+#if DROPBEAR_CHANNEL_SPLICE
+	/* Holds data for writefd ahead of writebuf when bufpipe[0] != -1, it
+	 * is moved from the pipe to writefd with splice(). Created the first
+	 * time that writefd would block if use_bufpipe is set */
+	int bufpipe[2];
+	unsigned int bufpipe_used;
+	int use_bufpipe;
+#endif
 
 	/* whether close/eof messages have been exchanged */
 	int sent_close, recv_close;
@@ -83,7 +92,22 @@ struct Channel {
 
 	const struct ChanType* type;
 
+	/* Set when the local end is handled within this process, rather than
+	 * by readfd/writefd. NULL otherwise */
+	const struct ChanLocal* local;
+
 	enum dropbear_prio prio;
+	/* Bytes that a normal priority channel may still send in the current
+	 * round of the scheduler in channelio() */
+	int sched_deficit;
+	/* whether setchannelfds() asked select() about the readfds */
+	int sched_polled;
+
+#if DROPBEAR_SESSION_STATS
+	unsigned long long stat_bytes_in, stat_bytes_out;
+	/* times that transwindow was used up */
+	unsigned int stat_window_stalls;
+#endif
 };
 
 struct ChanType {
@@ -102,12 +126,30 @@ struct ChanType {
 	void (*cleanup)(const struct Channel*);
 };
 
+/* The local end of a channel that is handled in-process, such as the
+ * builtin sftp server. Set up with channel_set_local() */
+struct ChanLocal {
+	/* Consumes what it can of the data in channel->writebuf */
+	void (*consume)(struct Channel*);
+	/* Returns 1 if output() has data to send, 0 if not yet, or -1 once
+	 * there will be no more data */
+	int (*output_ready)(struct Channel*);
+	/* Fills data with up to maxlen bytes, returning the length */
+	unsigned int (*output)(struct Channel*, unsigned char *data,
+			unsigned int maxlen);
+};
+
 /* Callback for connect_remote/connect_streamlocal. errstring may be NULL if result == DROPBEAR_SUCCESS */
 void channel_connect_done(int result, int sock, void* user_data, const char* errstring);
 
 void chaninitialise(const struct ChanType *chantypes[]);
 void chancleanup(void);
-void setchannelfds(fd_set *readfds, fd_set *writefds, int allow_reads);
+#if DROPBEAR_IDLE_RECLAIM
+void channel_reclaim_idle(void);
+#endif
+/* Returns nonzero if an in-process channel has data to send, so select()
+ * shouldn't wait */
+int setchannelfds(fd_set *readfds, fd_set *writefds);
 void channelio(const fd_set *readfd, const fd_set *writefd);
 struct Channel* getchannel(void);
 /* Returns an arbitrary channel that is in a ready state - not
@@ -126,6 +168,7 @@ void recv_msg_channel_eof(void);
 
 void common_recv_msg_channel_data(struct Channel *channel, int fd, 
 		circbuffer * buf);
+void channel_set_local(struct Channel *channel, const struct ChanLocal *local);
 
 #if DROPBEAR_CLIENT
 extern const struct ChanType clichansess;
@@ -133,6 +176,7 @@ extern const struct ChanType clichansess;
 
 #if DROPBEAR_LISTENERS || DROPBEAR_CLIENT
 int send_msg_channel_open_init(int fd, const struct ChanType *type);
+int send_msg_channel_open_typed(int fd, const struct ChanType *type, void *typedata);
 void recv_msg_channel_open_confirmation(void);
 void recv_msg_channel_open_failure(void);
 #endif
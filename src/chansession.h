@@ -74,6 +74,10 @@ struct ChanSess {
 	char * agentfile;
 	char * agentdir;
 #endif
+
+#if DROPBEAR_SFTPSERVER_BUILTIN
+	struct SftpServer * sftp;
+#endif
 };
 
 struct ChildPid {
@@ -90,6 +94,11 @@ void cli_chansess_winchange(void);
 #if DROPBEAR_CLI_NETCAT
 void cli_send_netcat_request(void);
 #endif
+#if DROPBEAR_CLI_MULTIPLEX
+void cli_mux_client(void);
+void cli_mux_master_start(void);
+void cli_mux_master_cleanup(void);
+#endif
 
 void svr_chansessinitialise(void);
 void svr_chansess_checksignal(void);
@@ -131,3 +131,12 @@ void cbuf_incrread(circbuffer *cbuf, unsigned int len) {
 	cbuf->used -= len;
 	cbuf->readpos = (cbuf->readpos + len) % cbuf->size;
 }
+
+void cbuf_release(circbuffer *cbuf) {
+	if (cbuf->data && cbuf->used == 0) {
+		m_burn(cbuf->data, cbuf->size);
+		m_free(cbuf->data);
+		cbuf->readpos = 0;
+		cbuf->writepos = 0;
+	}
+}
@@ -49,4 +49,7 @@ void cbuf_readptrs(const circbuffer *cbuf,
 unsigned char* cbuf_writeptr(circbuffer *cbuf, unsigned int len);
 void cbuf_incrwrite(circbuffer *cbuf, unsigned int len);
 void cbuf_incrread(circbuffer *cbuf, unsigned int len);
+/* Frees the storage of an empty buffer, it is allocated again on the
+ * next write */
+void cbuf_release(circbuffer *cbuf);
 #endif
@@ -37,10 +37,10 @@
 #include "runopts.h"
 #include "signkey.h"
 #include "ecc.h"
+#include "knownhosts.h"
 
 
 static void checkhostkey(const unsigned char* keyblob, unsigned int keybloblen);
-#define MAX_KNOWNHOSTS_LINE 4500
 
 static void cli_kex_free_param(void) {
 #if DROPBEAR_NORMAL_DH
@@ -86,25 +86,25 @@ void send_msg_kexdh_init() {
 	switch (ses.newkeys->algo_kex->mode) {
 #if DROPBEAR_NORMAL_DH
 		case DROPBEAR_KEX_NORMAL_DH:
-			cli_ses.dh_param = gen_kexdh_param();
+			cli_ses.dh_param = kex_take_param();
 			buf_putmpint(ses.writepayload, &cli_ses.dh_param->pub);
 			break;
 #endif
 #if DROPBEAR_ECDH
 		case DROPBEAR_KEX_ECDH:
-			cli_ses.ecdh_param = gen_kexecdh_param();
+			cli_ses.ecdh_param = kex_take_param();
 			buf_put_ecc_raw_pubkey_string(ses.writepayload, &cli_ses.ecdh_param->key);
 			break;
 #endif
 #if DROPBEAR_CURVE25519
 		case DROPBEAR_KEX_CURVE25519:
-			cli_ses.curve25519_param = gen_kexcurve25519_param();
+			cli_ses.curve25519_param = kex_take_param();
 			buf_putstring(ses.writepayload, cli_ses.curve25519_param->pub, CURVE25519_LEN);
 			break;
 #endif
 #if DROPBEAR_PQHYBRID
 		case DROPBEAR_KEX_PQHYBRID:
-			cli_ses.pqhybrid_param = gen_kexpqhybrid_param();
+			cli_ses.pqhybrid_param = kex_take_param();
 			buf_putbufstring(ses.writepayload, cli_ses.pqhybrid_param->concat_public);
 			break;
 #endif
@@ -263,7 +263,9 @@ static void ask_to_confirm(const unsigned char* keyblob, unsigned int keybloblen
 	dropbear_exit("Didn't validate host key");
 }
 
-static FILE* open_known_hosts_file(int * readonly)
+/* Opens ~/.ssh/known_hosts, the path is returned in *ret_filename
+ * which the caller must free */
+static FILE* open_known_hosts_file(int * readonly, char ** ret_filename)
 {
 	FILE * hostsfile = NULL;
 	char * filename = NULL;
@@ -319,20 +321,83 @@ static FILE* open_known_hosts_file(int * readonly)
 	}	
 
 out:
-	m_free(filename);
+	if (hostsfile) {
+		*ret_filename = filename;
+	} else {
+		m_free(filename);
+	}
 	return hostsfile;
 }
 
+/* Checks a known_hosts line for the server's hostname and key type.
+ * Returns DROPBEAR_SUCCESS if the key matches, DROPBEAR_FAILURE if the line
+ * isn't for this host and key type, and exits if the key is different */
+static int checkhostkey_line(buffer *line,
+		const unsigned char* keyblob, unsigned int keybloblen,
+		const char *algoname, unsigned int algolen, char **fingerprint) {
+	int ret;
+
+	/* The line is too short to be sensible */
+	/* "30" is 'enough to hold ssh-dss plus the spaces, ie so we don't
+	 * buf_getfoo() past the end and die horribly - the base64 parsing
+	 * code is what tiptoes up to the end nicely */
+	if (line->len < (strlen(cli_opts.remotehost)+30) ) {
+		TRACE(("line is too short to be sensible"))
+		return DROPBEAR_FAILURE;
+	}
+
+	/* Compare hostnames, plain or hashed */
+	if (knownhosts_match_host(line, cli_opts.remotehost) != DROPBEAR_SUCCESS) {
+		return DROPBEAR_FAILURE;
+	}
+
+	if (line->pos + algolen + 1 > line->len
+		|| strncmp((const char *) buf_getptr(line, algolen), algoname, algolen) != 0) {
+		TRACE(("algo doesn't match"))
+		return DROPBEAR_FAILURE;
+	}
+
+	buf_incrpos(line, algolen);
+	if (buf_getbyte(line) != ' ') {
+		TRACE(("missing space after algo"))
+		return DROPBEAR_FAILURE;
+	}
+
+	/* Now we're at the interesting hostkey */
+	ret = cmp_base64_key(keyblob, keybloblen, (const unsigned char *) algoname, algolen,
+					line, fingerprint);
+
+	if (ret == DROPBEAR_SUCCESS) {
+		/* Good matching key */
+		DEBUG1(("server match %s", *fingerprint))
+		return DROPBEAR_SUCCESS;
+	}
+
+	/* The keys didn't match. eep. Note that we're "leaking"
+	   the fingerprint strings here, but we're exiting anyway */
+	dropbear_exit("\n\n%s host key mismatch for %s !\n"
+				"Fingerprint is %s\n"
+				"Expected %s\n"
+				"If you know that the host key is correct you can\nremove the bad entry from ~/.ssh/known_hosts", 
+				algoname,
+				cli_opts.remotehost,
+				sign_key_fingerprint(keyblob, keybloblen),
+				*fingerprint ? *fingerprint : "UNKNOWN");
+	return DROPBEAR_FAILURE;
+}
+
 static void checkhostkey(const unsigned char* keyblob, unsigned int keybloblen) {
 
 	FILE *hostsfile = NULL;
+	char *filename = NULL;
 	int readonly = 0;
 	unsigned int hostlen, algolen;
 	unsigned long len;
 	const char *algoname = NULL;
 	char * fingerprint = NULL;
 	buffer * line = NULL;
-	int ret;
+	long *offsets = NULL;
+	unsigned int num_offsets, i;
 
 	if (cli_opts.no_hostkey_check) {
 		dropbear_log(LOG_INFO, "Caution, skipping hostkey check for %s\n", cli_opts.remotehost);
@@ -341,7 +406,7 @@ static void checkhostkey(const unsigned char* keyblob, unsigned int keybloblen)
 
 	algoname = signkey_name_from_type(ses.newkeys->algo_hostkey, &algolen);
 
-	hostsfile = open_known_hosts_file(&readonly);
+	hostsfile = open_known_hosts_file(&readonly, &filename);
 	if (!hostsfile)	{
 		ask_to_confirm(keyblob, keybloblen, algoname);
 		/* ask_to_confirm will exit upon failure */
@@ -351,66 +416,33 @@ static void checkhostkey(const unsigned char* keyblob, unsigned int keybloblen)
 	line = buf_new(MAX_KNOWNHOSTS_LINE);
 	hostlen = strlen(cli_opts.remotehost);
 
-	do {
-		if (buf_getline(line, hostsfile) == DROPBEAR_FAILURE) {
-			TRACE(("failed reading line: prob EOF"))
-			break;
-		}
-
-		/* The line is too short to be sensible */
-		/* "30" is 'enough to hold ssh-dss plus the spaces, ie so we don't
-		 * buf_getfoo() past the end and die horribly - the base64 parsing
-		 * code is what tiptoes up to the end nicely */
-		if (line->len < (hostlen+30) ) {
-			TRACE(("line is too short to be sensible"))
-			continue;
-		}
-
-		/* Compare hostnames */
-		if (strncmp(cli_opts.remotehost, (const char *) buf_getptr(line, hostlen),
-					hostlen) != 0) {
-			continue;
-		}
-
-		buf_incrpos(line, hostlen);
-		if (buf_getbyte(line) != ' ') {
-			/* there wasn't a space after the hostname, something dodgy */
-			TRACE(("missing space afte matching hostname"))
-			continue;
-		}
-
-		if (strncmp((const char *) buf_getptr(line, algolen), algoname, algolen) != 0) {
-			TRACE(("algo doesn't match"))
-			continue;
-		}
-
-		buf_incrpos(line, algolen);
-		if (buf_getbyte(line) != ' ') {
-			TRACE(("missing space after algo"))
-			continue;
-		}
-
-		/* Now we're at the interesting hostkey */
-		ret = cmp_base64_key(keyblob, keybloblen, (const unsigned char *) algoname, algolen,
-						line, &fingerprint);
-
-		if (ret == DROPBEAR_SUCCESS) {
-			/* Good matching key */
-			DEBUG1(("server match %s", fingerprint))
-			goto out;
+	if (knownhosts_index_lookup(hostsfile, filename, cli_opts.remotehost,
+			&offsets, &num_offsets) == DROPBEAR_SUCCESS) {
+		/* only read the lines that the index found */
+		for (i = 0; i < num_offsets; i++) {
+			if (fseek(hostsfile, offsets[i], SEEK_SET) != 0
+				|| buf_getline(line, hostsfile) == DROPBEAR_FAILURE) {
+				TRACE(("failed reading indexed line"))
+				break;
+			}
+			if (checkhostkey_line(line, keyblob, keybloblen,
+					algoname, algolen, &fingerprint) == DROPBEAR_SUCCESS) {
+				goto out;
+			}
 		}
-
-		/* The keys didn't match. eep. Note that we're "leaking"
-		   the fingerprint strings here, but we're exiting anyway */
-		dropbear_exit("\n\n%s host key mismatch for %s !\n"
-					"Fingerprint is %s\n"
-					"Expected %s\n"
-					"If you know that the host key is correct you can\nremove the bad entry from ~/.ssh/known_hosts", 
-					algoname,
-					cli_opts.remotehost,
-					sign_key_fingerprint(keyblob, keybloblen),
-					fingerprint ? fingerprint : "UNKNOWN");
-	} while (1); /* keep going 'til something happens */
+	} else {
+		fseek(hostsfile, 0, SEEK_SET);
+		do {
+			if (buf_getline(line, hostsfile) == DROPBEAR_FAILURE) {
+				TRACE(("failed reading line: prob EOF"))
+				break;
+			}
+			if (checkhostkey_line(line, keyblob, keybloblen,
+					algoname, algolen, &fingerprint) == DROPBEAR_SUCCESS) {
+				goto out;
+			}
+		} while (1); /* keep going 'til something happens */
+	}
 
 	/* Key doesn't exist yet */
 	ask_to_confirm(keyblob, keybloblen, algoname);
@@ -449,6 +481,8 @@ out:
 	if (line != NULL) {
 		buf_free(line);
 	}
+	m_free(offsets);
+	m_free(filename);
 	m_free(fingerprint);
 }
 
@@ -0,0 +1,481 @@
+/*
+ * Dropbear - a SSH2 server
+ * 
+ * Copyright (c) 2026 Matt Johnston
+ * All rights reserved.
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE. */
+
+#include "includes.h"
+#include "dbutil.h"
+#include "buffer.h"
+#include "atomicio.h"
+#include "knownhosts.h"
+
+/* known_hosts lookup for dbclient.
+
+   Large known_hosts files get an index file alongside, "known_hosts.dbidx".
+   It holds a header recording the known_hosts file it was built from,
+   then a table of (hash of hostname, line offset) sorted by hash, which is
+   binary searched with pread(). OpenSSH hashed hostnames can't be looked
+   up that way since each has its own salt, so their decoded salt and hash
+   follow in a second table which is checked in full - that still avoids
+   reading and decoding the known_hosts lines themselves.
+
+   The index only gives candidate lines, the caller checks them as for a
+   linear scan. Any change to known_hosts (including dbclient adding a host)
+   makes the index stale, and it is rebuilt by the next lookup. The index
+   is replaced with rename() so concurrent dbclients see a complete file. */
+
+#define KNOWNHOSTS_HASH_MAGIC "|1|"
+#define KNOWNHOSTS_INDEX_SUFFIX ".dbidx"
+#define KNOWNHOSTS_INDEX_MAGIC "DBKHIDX1"
+/* records read at a time when checking hashed entries */
+#define KNOWNHOSTS_HASHED_CHUNK 128
+
+struct knownhosts_idx_header {
+	char magic[8];
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	uint64_t mtime;
+	uint64_t ctime;
+	uint32_t num_plain;
+	uint32_t num_hashed;
+};
+
+struct knownhosts_idx_plain {
+	uint32_t hash;
+	uint32_t offset;
+};
+
+struct knownhosts_idx_hashed {
+	unsigned char salt[SHA1_HASH_SIZE];
+	unsigned char hash[SHA1_HASH_SIZE];
+	uint32_t offset;
+};
+
+/* Advances line->pos to after the next "end" character, returning the
+ * number of bytes before it. *found is set if it was seen */
+static unsigned int knownhosts_field(buffer *line, char end, int *found) {
+	unsigned int len;
+
+	*found = 0;
+	for (len = 0; line->pos < line->len; len++) {
+		if (buf_getbyte(line) == end) {
+			*found = 1;
+			break;
+		}
+	}
+	return len;
+}
+
+#if DROPBEAR_CLI_HASHED_KNOWNHOSTS
+/* Decodes len base64 bytes at line->pos which must be a SHA1 sized value,
+ * and skips the following separator */
+static int knownhosts_decode_sha1(buffer *line, unsigned int len,
+		unsigned char *out) {
+	/* base64_decode() wants room for whole blocks */
+	unsigned char tmp[SHA1_HASH_SIZE + 3];
+	unsigned long outlen = sizeof(tmp);
+
+	if (len == 0
+		|| base64_decode(buf_getptr(line, len), len, tmp, &outlen) != CRYPT_OK
+		|| outlen != SHA1_HASH_SIZE) {
+		return DROPBEAR_FAILURE;
+	}
+	memcpy(out, tmp, SHA1_HASH_SIZE);
+	buf_incrpos(line, len + 1);
+	return DROPBEAR_SUCCESS;
+}
+#endif
+
+/* Decodes an OpenSSH "|1|salt|hash " hostname at the start of line.
+ * On success line->pos is left after the space */
+static int knownhosts_parse_hashed(buffer *line,
+		unsigned char *salt, unsigned char *hash) {
+#if DROPBEAR_CLI_HASHED_KNOWNHOSTS
+	unsigned int pos, len;
+	int found;
+
+	buf_setpos(line, 0);
+	if (line->len < strlen(KNOWNHOSTS_HASH_MAGIC)
+		|| memcmp(buf_getptr(line, strlen(KNOWNHOSTS_HASH_MAGIC)),
+			KNOWNHOSTS_HASH_MAGIC, strlen(KNOWNHOSTS_HASH_MAGIC)) != 0) {
+		return DROPBEAR_FAILURE;
+	}
+	buf_incrpos(line, strlen(KNOWNHOSTS_HASH_MAGIC));
+
+	pos = line->pos;
+	len = knownhosts_field(line, '|', &found);
+	buf_setpos(line, pos);
+	if (!found || knownhosts_decode_sha1(line, len, salt) != DROPBEAR_SUCCESS) {
+		return DROPBEAR_FAILURE;
+	}
+
+	pos = line->pos;
+	len = knownhosts_field(line, ' ', &found);
+	buf_setpos(line, pos);
+	if (!found || knownhosts_decode_sha1(line, len, hash) != DROPBEAR_SUCCESS) {
+		return DROPBEAR_FAILURE;
+	}
+	return DROPBEAR_SUCCESS;
+#else
+	(void)line;
+	(void)salt;
+	(void)hash;
+	return DROPBEAR_FAILURE;
+#endif
+}
+
+#if DROPBEAR_CLI_HASHED_KNOWNHOSTS
+/* Returns whether HMAC-SHA1(salt, host) equals hash */
+static int knownhosts_hashed_matches(const unsigned char *salt,
+		const unsigned char *hash, const char *host) {
+	unsigned char out[SHA1_HASH_SIZE];
+	unsigned long outlen = sizeof(out);
+
+	/* sha1 isn't otherwise registered. Returns the existing index
+	 * if it is already */
+	if (hmac_memory(register_hash(&sha1_desc), salt, SHA1_HASH_SIZE,
+			(const unsigned char *)host, strlen(host), out, &outlen) != CRYPT_OK) {
+		return 0;
+	}
+	return memcmp(out, hash, SHA1_HASH_SIZE) == 0;
+}
+#endif
+
+int knownhosts_match_host(buffer *line, const char *host) {
+	unsigned char salt[SHA1_HASH_SIZE];
+	unsigned char hash[SHA1_HASH_SIZE];
+	unsigned int hostlen = strlen(host);
+
+	if (knownhosts_parse_hashed(line, salt, hash) == DROPBEAR_SUCCESS) {
+#if DROPBEAR_CLI_HASHED_KNOWNHOSTS
+		if (knownhosts_hashed_matches(salt, hash, host)) {
+			return DROPBEAR_SUCCESS;
+		}
+#endif
+		return DROPBEAR_FAILURE;
+	}
+
+	buf_setpos(line, 0);
+	if (line->len < hostlen + 1) {
+		return DROPBEAR_FAILURE;
+	}
+	if (strncmp(host, (const char *) buf_getptr(line, hostlen), hostlen) != 0) {
+		return DROPBEAR_FAILURE;
+	}
+	buf_incrpos(line, hostlen);
+	if (buf_getbyte(line) != ' ') {
+		/* there wasn't a space after the hostname, something dodgy */
+		TRACE(("missing space after matching hostname"))
+		return DROPBEAR_FAILURE;
+	}
+	return DROPBEAR_SUCCESS;
+}
+
+static int knownhosts_plain_cmp(const void *a, const void *b) {
+	const struct knownhosts_idx_plain *pa = a, *pb = b;
+	if (pa->hash != pb->hash) {
+		return pa->hash < pb->hash ? -1 : 1;
+	}
+	if (pa->offset != pb->offset) {
+		return pa->offset < pb->offset ? -1 : 1;
+	}
+	return 0;
+}
+
+static int knownhosts_offset_cmp(const void *a, const void *b) {
+	const long *oa = a, *ob = b;
+	if (*oa != *ob) {
+		return *oa < *ob ? -1 : 1;
+	}
+	return 0;
+}
+
+static void knownhosts_fill_header(struct knownhosts_idx_header *hdr,
+		const struct stat *st) {
+	memset(hdr, 0x0, sizeof(*hdr));
+	memcpy(hdr->magic, KNOWNHOSTS_INDEX_MAGIC, sizeof(hdr->magic));
+	hdr->dev = st->st_dev;
+	hdr->ino = st->st_ino;
+	hdr->size = st->st_size;
+	hdr->mtime = st->st_mtime;
+	hdr->ctime = st->st_ctime;
+}
+
+/* Reads hostsfile and writes a new index to idxname */
+static int knownhosts_index_build(FILE *hostsfile, const char *idxname,
+		const struct stat *st) {
+	struct knownhosts_idx_header hdr;
+	struct knownhosts_idx_plain *plain = NULL;
+	struct knownhosts_idx_hashed *hashed = NULL;
+	unsigned int plain_size = 0, hashed_size = 0;
+	buffer *line = NULL;
+	char *tmpname = NULL;
+	size_t tmplen;
+	int fd = -1;
+	int ret = DROPBEAR_FAILURE;
+
+	knownhosts_fill_header(&hdr, st);
+
+	fseek(hostsfile, 0, SEEK_SET);
+	line = buf_new(MAX_KNOWNHOSTS_LINE);
+	while (1) {
+		long offset = ftell(hostsfile);
+		struct knownhosts_idx_hashed h;
+
+		if (offset < 0 || buf_getline(line, hostsfile) == DROPBEAR_FAILURE) {
+			break;
+		}
+		if (line->len == 0) {
+			continue;
+		}
+
+		if (knownhosts_parse_hashed(line, h.salt, h.hash) == DROPBEAR_SUCCESS) {
+			if (hdr.num_hashed == hashed_size) {
+				hashed_size = MAX(64, hashed_size * 2);
+				hashed = m_realloc(hashed, hashed_size * sizeof(*hashed));
+			}
+			h.offset = offset;
+			hashed[hdr.num_hashed++] = h;
+		} else {
+			unsigned int len;
+			int found;
+			buf_setpos(line, 0);
+			len = knownhosts_field(line, ' ', &found);
+			if (!found) {
+				continue;
+			}
+			if (hdr.num_plain == plain_size) {
+				plain_size = MAX(64, plain_size * 2);
+				plain = m_realloc(plain, plain_size * sizeof(*plain));
+			}
+			buf_setpos(line, 0);
+			plain[hdr.num_plain].hash = fnv1a_hash(buf_getptr(line, len), len);
+			plain[hdr.num_plain].offset = offset;
+			hdr.num_plain++;
+		}
+	}
+	if (hdr.num_plain > 0) {
+		qsort(plain, hdr.num_plain, sizeof(*plain), knownhosts_plain_cmp);
+	}
+
+	tmplen = strlen(idxname) + 8;
+	tmpname = m_malloc(tmplen);
+	snprintf(tmpname, tmplen, "%s.XXXXXX", idxname);
+	fd = mkstemp(tmpname);
+	if (fd < 0) {
+		TRACE(("knownhosts_index_build: can't create %s: %s", tmpname, strerror(errno)))
+		goto out;
+	}
+	if (atomicio(vwrite, fd, &hdr, sizeof(hdr)) != sizeof(hdr)
+		|| (hdr.num_plain > 0 && atomicio(vwrite, fd, plain, hdr.num_plain * sizeof(*plain))
+				!= hdr.num_plain * sizeof(*plain))
+		|| (hdr.num_hashed > 0 && atomicio(vwrite, fd, hashed, hdr.num_hashed * sizeof(*hashed))
+				!= hdr.num_hashed * sizeof(*hashed))) {
+		TRACE(("knownhosts_index_build: write failed: %s", strerror(errno)))
+		goto out;
+	}
+	if (close(fd) != 0) {
+		fd = -1;
+		goto out;
+	}
+	fd = -1;
+	if (rename(tmpname, idxname) != 0) {
+		TRACE(("knownhosts_index_build: rename failed: %s", strerror(errno)))
+		goto out;
+	}
+	TRACE(("knownhosts_index_build: %u plain %u hashed entries", hdr.num_plain, hdr.num_hashed))
+	ret = DROPBEAR_SUCCESS;
+
+out:
+	if (fd >= 0) {
+		m_close(fd);
+	}
+	if (ret != DROPBEAR_SUCCESS && tmpname) {
+		unlink(tmpname);
+	}
+	m_free(tmpname);
+	m_free(plain);
+	m_free(hashed);
+	buf_free(line);
+	return ret;
+}
+
+/* Opens idxname if it is an index of the known_hosts file st, returning
+ * the fd or -1 */
+static int knownhosts_index_open(const char *idxname, const struct stat *st,
+		struct knownhosts_idx_header *hdr) {
+	struct knownhosts_idx_header want;
+	struct stat idxst;
+	int fd;
+
+	fd = open(idxname, O_RDONLY);
+	if (fd < 0) {
+		return -1;
+	}
+	knownhosts_fill_header(&want, st);
+	if (fstat(fd, &idxst) != 0
+		|| pread(fd, hdr, sizeof(*hdr), 0) != sizeof(*hdr)
+		|| memcmp(hdr->magic, want.magic, sizeof(hdr->magic)) != 0
+		|| hdr->dev != want.dev
+		|| hdr->ino != want.ino
+		|| hdr->size != want.size
+		|| hdr->mtime != want.mtime
+		|| hdr->ctime != want.ctime
+		|| (uint64_t)idxst.st_size != sizeof(*hdr)
+			+ (uint64_t)hdr->num_plain * sizeof(struct knownhosts_idx_plain)
+			+ (uint64_t)hdr->num_hashed * sizeof(struct knownhosts_idx_hashed)) {
+		TRACE(("knownhosts_index_open: %s is stale", idxname))
+		m_close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int knownhosts_read_plain(int fd, uint32_t i,
+		struct knownhosts_idx_plain *rec) {
+	off_t pos = sizeof(struct knownhosts_idx_header) + (off_t)i * sizeof(*rec);
+	if (pread(fd, rec, sizeof(*rec), pos) != sizeof(*rec)) {
+		return DROPBEAR_FAILURE;
+	}
+	return DROPBEAR_SUCCESS;
+}
+
+static void knownhosts_add_offset(long **offsets, unsigned int *num,
+		unsigned int *size, long offset) {
+	if (*num == *size) {
+		*size = MAX(8, *size * 2);
+		*offsets = m_realloc(*offsets, *size * sizeof(**offsets));
+	}
+	(*offsets)[(*num)++] = offset;
+}
+
+int knownhosts_index_lookup(FILE *hostsfile, const char *filename,
+		const char *host, long **offsets, unsigned int *num_offsets) {
+	struct knownhosts_idx_header hdr;
+	struct knownhosts_idx_plain rec;
+	struct stat st;
+	char *idxname = NULL;
+	size_t idxlen;
+	uint32_t hash, lo, hi;
+	unsigned int size = 0;
+	int fd = -1;
+	int ret = DROPBEAR_FAILURE;
+
+	*offsets = NULL;
+	*num_offsets = 0;
+
+	if (DROPBEAR_CLI_KNOWNHOSTS_INDEX_SIZE == 0) {
+		return DROPBEAR_FAILURE;
+	}
+	if (fstat(fileno(hostsfile), &st) != 0
+		|| st.st_size < DROPBEAR_CLI_KNOWNHOSTS_INDEX_SIZE
+		|| (uint64_t)st.st_size > 0xffffffff) {
+		return DROPBEAR_FAILURE;
+	}
+
+	idxlen = strlen(filename) + strlen(KNOWNHOSTS_INDEX_SUFFIX) + 1;
+	idxname = m_malloc(idxlen);
+	snprintf(idxname, idxlen, "%s%s", filename, KNOWNHOSTS_INDEX_SUFFIX);
+
+	fd = knownhosts_index_open(idxname, &st, &hdr);
+	if (fd < 0) {
+		TRACE(("knownhosts_index_lookup: rebuilding %s", idxname))
+		if (knownhosts_index_build(hostsfile, idxname, &st) == DROPBEAR_SUCCESS) {
+			fd = knownhosts_index_open(idxname, &st, &hdr);
+		}
+	}
+	if (fd < 0) {
+		goto out;
+	}
+
+	/* find the first plain entry for the hostname's hash */
+	hash = fnv1a_hash(host, strlen(host));
+	lo = 0;
+	hi = hdr.num_plain;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (knownhosts_read_plain(fd, mid, &rec) == DROPBEAR_FAILURE) {
+			goto out;
+		}
+		if (rec.hash < hash) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	for (; lo < hdr.num_plain; lo++) {
+		if (knownhosts_read_plain(fd, lo, &rec) == DROPBEAR_FAILURE) {
+			goto out;
+		}
+		if (rec.hash != hash) {
+			break;
+		}
+		knownhosts_add_offset(offsets, num_offsets, &size, rec.offset);
+	}
+
+#if DROPBEAR_CLI_HASHED_KNOWNHOSTS
+	/* hashed hostnames have to be checked individually */
+	if (hdr.num_hashed > 0) {
+		struct knownhosts_idx_hashed *chunk = NULL;
+		off_t pos = sizeof(hdr) + (off_t)hdr.num_plain * sizeof(rec);
+		uint32_t i, j, n;
+		int ok = 1;
+
+		chunk = m_malloc(KNOWNHOSTS_HASHED_CHUNK * sizeof(*chunk));
+		for (i = 0; i < hdr.num_hashed; i += n) {
+			n = MIN(KNOWNHOSTS_HASHED_CHUNK, hdr.num_hashed - i);
+			if (pread(fd, chunk, n * sizeof(*chunk), pos + (off_t)i * sizeof(*chunk))
+					!= (ssize_t)(n * sizeof(*chunk))) {
+				ok = 0;
+				break;
+			}
+			for (j = 0; j < n; j++) {
+				if (knownhosts_hashed_matches(chunk[j].salt, chunk[j].hash, host)) {
+					knownhosts_add_offset(offsets, num_offsets, &size, chunk[j].offset);
+				}
+			}
+		}
+		m_free(chunk);
+		if (!ok) {
+			goto out;
+		}
+	}
+#endif
+
+	if (*num_offsets > 1) {
+		qsort(*offsets, *num_offsets, sizeof(**offsets), knownhosts_offset_cmp);
+	}
+	TRACE(("knownhosts_index_lookup: %u candidates for %s", *num_offsets, host))
+	ret = DROPBEAR_SUCCESS;
+
+out:
+	if (fd >= 0) {
+		m_close(fd);
+	}
+	if (ret != DROPBEAR_SUCCESS) {
+		m_free(*offsets);
+		*num_offsets = 0;
+	}
+	m_free(idxname);
+	return ret;
+}
@@ -28,6 +28,7 @@
 #include "dbutil.h"
 #include "runopts.h"
 #include "session.h"
+#include "chansession.h"
 #include "dbrandom.h"
 #include "crypto_desc.h"
 #include "netio.h"
@@ -76,6 +77,11 @@ int main(int argc, char ** argv) {
 		dropbear_exit("signal() error");
 	}
 
+#if DROPBEAR_CLI_MULTIPLEX
+	/* Doesn't return if a ControlMaster ran the command */
+	cli_mux_client();
+#endif
+
 #if DROPBEAR_CLI_PROXYCMD
 	if (cli_opts.proxycmd
 #if DROPBEAR_CLI_MULTIHOP
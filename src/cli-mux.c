@@ -0,0 +1,681 @@
+/*
+ * Dropbear - a SSH2 server
+ * 
+ * Copyright (c) 2026 Matt Johnston
+ * All rights reserved.
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE. */
+
+#include "includes.h"
+#include "dbutil.h"
+#include "buffer.h"
+#include "session.h"
+#include "channel.h"
+#include "chansession.h"
+#include "listener.h"
+#include "atomicio.h"
+#include "runopts.h"
+#include "ssh.h"
+#include "timer.h"
+
+/* Connection sharing, like OpenSSH's ControlMaster.
+
+   A master dbclient listens on a unix socket at ControlPath once it has
+   authenticated. A later dbclient for a plain command (no pty or
+   forwarding) connects to that socket and sends the command along with its
+   stdin, stdout and stderr as SCM_RIGHTS. The master opens a new session
+   channel using those fds, and when the channel closes it writes the exit
+   status back for the waiting dbclient to exit with.
+
+   Request, client to master, all in one sendmsg() with the fds:
+	uint32	length of the rest
+	uint32	MUX_VERSION
+	string	command
+	boolean	is subsystem
+   Reply, master to client:
+	uint32	exit status
+   The socket is closed without a reply if the channel couldn't be opened. */
+
+#if DROPBEAR_CLI_MULTIPLEX
+
+#define MUX_VERSION 1
+/* enough for a command up to about 32kB */
+#define MUX_MAX_REQUEST 32768
+/* how long the master waits for a connected client to send its request */
+#define MUX_REQUEST_TIMEOUT 5
+/* fds accepted from a client in one message, only 3 are valid */
+#define MUX_MAX_FDS 8
+
+#ifndef MSG_CMSG_CLOEXEC
+#define MSG_CMSG_CLOEXEC 0
+#endif
+
+struct MuxSession {
+	int ctlfd;
+	int fds[3];
+	/* set once the channel owns fds */
+	int started;
+	char *cmd;
+	int is_subsystem;
+	int exitcode;
+};
+
+static int mux_initchansess(struct Channel *channel);
+static void mux_chansessreq(struct Channel *channel);
+static void mux_cleanup(const struct Channel *channel);
+
+static const struct ChanType cli_chan_mux = {
+	"session", /* name */
+	mux_initchansess, /* inithandler */
+	NULL, /* checkclosehandler */
+	mux_chansessreq, /* reqhandler */
+	NULL, /* closehandler */
+	mux_cleanup, /* cleanup */
+};
+
+/* The listening socket path, only set in the master */
+static char *mux_listen_path = NULL;
+
+/* Returns ControlPath with ~ and %h, %p, %r, %% expanded, or NULL if
+ * there isn't one. Must be freed by the caller */
+static char* mux_control_path(void) {
+	char *path = NULL, *ret = NULL;
+	buffer *buf = NULL;
+	const char *p = NULL;
+
+	if (!cli_opts.control_path) {
+		return NULL;
+	}
+
+	path = expand_homedir_path(cli_opts.control_path);
+	buf = buf_new(strlen(path) + 300);
+	for (p = path; *p; p++) {
+		const char *sub = NULL;
+		if (*p != '%') {
+			buf_putbyte(buf, *p);
+			continue;
+		}
+		p++;
+		switch (*p) {
+			case 'h':
+				sub = cli_opts.remotehost;
+				break;
+			case 'p':
+				sub = cli_opts.remoteport;
+				break;
+			case 'r':
+				sub = cli_opts.username;
+				break;
+			case '%':
+				sub = "%";
+				break;
+			default:
+				dropbear_exit("Bad ControlPath token '%%%c'", *p ? *p : ' ');
+		}
+		if (buf->len + strlen(sub) + 1 > buf->size) {
+			dropbear_exit("ControlPath is too long");
+		}
+		buf_putbytes(buf, (const unsigned char*)sub, strlen(sub));
+	}
+	buf_putbyte(buf, '\0');
+	buf_setpos(buf, 0);
+	ret = m_strdup((const char*)buf_getptr(buf, buf->len));
+
+	buf_free(buf);
+	m_free(path);
+	return ret;
+}
+
+/* Whether this invocation can run its command through a master */
+static int mux_client_usable(void) {
+	if (!cli_opts.cmd || cli_opts.wantpty || cli_opts.no_cmd
+			|| cli_opts.backgrounded) {
+		return 0;
+	}
+#if DROPBEAR_CLI_NETCAT
+	if (cli_opts.netcat_host) {
+		return 0;
+	}
+#endif
+#if DROPBEAR_CLI_LOCALTCPFWD
+	if (cli_opts.localfwds->first) {
+		return 0;
+	}
+#endif
+#if DROPBEAR_CLI_REMOTETCPFWD
+	if (cli_opts.remotefwds->first) {
+		return 0;
+	}
+#endif
+#if DROPBEAR_CLI_AGENTFWD
+	if (cli_opts.agent_fwd) {
+		return 0;
+	}
+#endif
+	return 1;
+}
+
+void cli_mux_client() {
+	char *path = NULL;
+	int fd = -1;
+	buffer *buf = NULL;
+	struct msghdr msg;
+	struct iovec iov;
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(3 * sizeof(int))];
+	} cmsgbuf;
+	struct cmsghdr *cmsg = NULL;
+	int stdfds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+	int stdflags[3];
+	unsigned char reply[4];
+	unsigned int i, exitcode;
+	size_t got;
+
+	if (cli_opts.control_master == CONTROL_MASTER_YES || !mux_client_usable()) {
+		return;
+	}
+	path = mux_control_path();
+	if (!path) {
+		return;
+	}
+	fd = connect_unix(path);
+	if (fd < 0) {
+		TRACE(("cli_mux_client: no master at %s", path))
+		m_free(path);
+		return;
+	}
+	TRACE(("cli_mux_client: using master at %s", path))
+	m_free(path);
+
+	buf = buf_new(MUX_MAX_REQUEST);
+	buf_putint(buf, 0); /* length, filled in below */
+	buf_putint(buf, MUX_VERSION);
+	if (strlen(cli_opts.cmd) > MUX_MAX_REQUEST - 20) {
+		dropbear_exit("Command too long for ControlPath");
+	}
+	buf_putstring(buf, cli_opts.cmd, strlen(cli_opts.cmd));
+	buf_putbyte(buf, cli_opts.is_subsystem ? 1 : 0);
+	buf_setpos(buf, 0);
+	buf_putint(buf, buf->len - 4);
+
+	memset(&msg, 0x0, sizeof(msg));
+	memset(&cmsgbuf, 0x0, sizeof(cmsgbuf));
+	buf_setpos(buf, 0);
+	iov.iov_base = buf_getptr(buf, buf->len);
+	iov.iov_len = buf->len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cmsgbuf.buf;
+	msg.msg_controllen = sizeof(cmsgbuf.buf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(stdfds));
+	memcpy(CMSG_DATA(cmsg), stdfds, sizeof(stdfds));
+
+	/* The master makes them non-blocking, that is shared with us */
+	for (i = 0; i < 3; i++) {
+		stdflags[i] = fcntl(stdfds[i], F_GETFL, 0);
+	}
+
+	if (sendmsg(fd, &msg, 0) != (ssize_t)buf->len) {
+		dropbear_exit("Failed sending to control master: %s", strerror(errno));
+	}
+	buf_free(buf);
+
+	got = atomicio(read, fd, reply, sizeof(reply));
+
+	for (i = 0; i < 3; i++) {
+		(void)fcntl(stdfds[i], F_SETFL, stdflags[i]);
+	}
+	if (got != sizeof(reply)) {
+		dropbear_exit("Control master closed the session");
+	}
+	exitcode = ((unsigned int)reply[0] << 24) | (reply[1] << 16)
+		| (reply[2] << 8) | reply[3];
+	m_close(fd);
+	exit(exitcode);
+}
+
+/* A client that has connected and hasn't sent all of its request. Its
+ * socket is read by a listener, so a slow client doesn't hold up the
+ * session */
+struct MuxPending {
+	struct Listener *listener;
+	buffer *buf;
+	int fds[3];
+	struct dropbear_timer timeout;
+};
+
+static void mux_close_fds(int *fds, unsigned int nfds) {
+	unsigned int i;
+	for (i = 0; i < nfds; i++) {
+		m_close(fds[i]);
+		fds[i] = -1;
+	}
+}
+
+static void mux_pending_cleanup(const struct Listener *listener) {
+	struct MuxPending *pending = listener->typedata;
+
+	timer_cancel(&pending->timeout);
+	mux_close_fds(pending->fds, 3);
+	buf_free(pending->buf);
+	m_free(pending);
+}
+
+static void mux_pending_timeout(void *arg) {
+	struct MuxPending *pending = arg;
+	TRACE(("mux: client didn't send its request in time"))
+	remove_listener(pending->listener);
+}
+
+/* Whether the connected client is our user, or root */
+static int mux_check_peer(int sock) {
+	uid_t uid;
+#if defined(SO_PEERCRED)
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) {
+		TRACE(("mux: SO_PEERCRED failed: %s", strerror(errno)))
+		return DROPBEAR_FAILURE;
+	}
+	uid = cred.uid;
+#elif defined(HAVE_GETPEEREID)
+	gid_t gid;
+
+	if (getpeereid(sock, &uid, &gid) < 0) {
+		TRACE(("mux: getpeereid failed: %s", strerror(errno)))
+		return DROPBEAR_FAILURE;
+	}
+#else
+	/* the socket's permissions are all there is */
+	(void)sock;
+	uid = getuid();
+#endif
+	if (uid != 0 && uid != getuid()) {
+		dropbear_log(LOG_WARNING, "ControlPath client with uid %d refused",
+			(int)uid);
+		return DROPBEAR_FAILURE;
+	}
+	return DROPBEAR_SUCCESS;
+}
+
+/* Takes the fds passed with a message. Returns DROPBEAR_FAILURE if they
+ * aren't the client's three, after closing every fd received */
+static int mux_take_fds(struct MuxPending *pending, struct msghdr *msg) {
+	struct cmsghdr *cmsg = NULL;
+	int got[MUX_MAX_FDS];
+	unsigned int ngot = 0, n, i;
+	int ok = 1;
+
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS
+				|| cmsg->cmsg_len < CMSG_LEN(0)) {
+			continue;
+		}
+		n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (i = 0; i < n; i++) {
+			int fd;
+			memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+			if (ngot < MUX_MAX_FDS) {
+				got[ngot++] = fd;
+			} else {
+				m_close(fd);
+				ok = 0;
+			}
+		}
+	}
+
+	if (msg->msg_flags & MSG_CTRUNC) {
+		TRACE(("mux: control data truncated"))
+		ok = 0;
+	}
+	if (ngot > 0 && (ngot != 3 || pending->fds[0] >= 0)) {
+		TRACE(("mux: got %u fds", ngot))
+		ok = 0;
+	}
+	if (!ok) {
+		mux_close_fds(got, ngot);
+		return DROPBEAR_FAILURE;
+	}
+	if (ngot == 3) {
+		memcpy(pending->fds, got, sizeof(pending->fds));
+	}
+	return DROPBEAR_SUCCESS;
+}
+
+/* Parses a complete request. Returns NULL if it's bad */
+static struct MuxSession* mux_parse_request(buffer *buf) {
+	struct MuxSession *mux = NULL;
+	unsigned int len, cmdlen, version;
+
+	/* Check the layout before using buf_get functions, which would exit */
+	buf_setpos(buf, 0);
+	len = buf_getint(buf);
+	if (len != buf->len - 4 || len < 4 + 4 + 1) {
+		return NULL;
+	}
+	version = buf_getint(buf);
+	cmdlen = buf_getint(buf);
+	if (version != MUX_VERSION || cmdlen != len - (4 + 4 + 1)) {
+		TRACE(("mux_parse_request: bad request"))
+		return NULL;
+	}
+	buf_setpos(buf, 8);
+
+	mux = m_malloc(sizeof(*mux));
+	mux->cmd = buf_getstring(buf, NULL);
+	mux->is_subsystem = buf_getbool(buf);
+	mux->started = 0;
+	mux->exitcode = EXIT_SUCCESS;
+	return mux;
+}
+
+/* Opens the channel for a client's request */
+static void mux_start(struct MuxSession *mux) {
+	TRACE(("mux_start: command '%s'", mux->cmd))
+
+	if (send_msg_channel_open_typed(mux->fds[0], &cli_chan_mux, mux)
+			== DROPBEAR_FAILURE) {
+		mux_close_fds(mux->fds, 3);
+		m_close(mux->ctlfd);
+		m_free(mux->cmd);
+		m_free(mux);
+		return;
+	}
+	encrypt_packet();
+}
+
+/* Reads what a client has sent of its request */
+static void mux_read(const struct Listener *listener, int sock) {
+	struct MuxPending *pending = listener->typedata;
+	struct MuxSession *mux = NULL;
+	buffer *buf = pending->buf;
+	struct msghdr msg;
+	struct iovec iov;
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(MUX_MAX_FDS * sizeof(int))];
+	} cmsgbuf;
+	unsigned int len;
+	ssize_t n;
+
+	if (buf->len == buf->size) {
+		TRACE(("mux_read: request too long"))
+		remove_listener(pending->listener);
+		return;
+	}
+
+	memset(&msg, 0x0, sizeof(msg));
+	memset(&cmsgbuf, 0x0, sizeof(cmsgbuf));
+	iov.iov_base = buf_getwriteptr(buf, buf->size - buf->len);
+	iov.iov_len = buf->size - buf->len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cmsgbuf.buf;
+	msg.msg_controllen = sizeof(cmsgbuf.buf);
+
+	n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+	if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) {
+		return;
+	}
+	if (n > 0) {
+		buf_incrwritepos(buf, n);
+	}
+	if (mux_take_fds(pending, &msg) == DROPBEAR_FAILURE || n <= 0) {
+		TRACE(("mux_read: client failed"))
+		remove_listener(pending->listener);
+		return;
+	}
+
+	if (buf->len < 4) {
+		return;
+	}
+	buf_setpos(buf, 0);
+	len = buf_getint(buf);
+	if (len > buf->size - 4) {
+		TRACE(("mux_read: request too long"))
+		remove_listener(pending->listener);
+		return;
+	}
+	if (buf->len - 4 < len) {
+		/* wait for the rest */
+		return;
+	}
+
+	if (pending->fds[0] < 0 || buf->len - 4 != len
+			|| (mux = mux_parse_request(buf)) == NULL) {
+		TRACE(("mux_read: bad request"))
+		remove_listener(pending->listener);
+		return;
+	}
+
+	/* The channel takes the socket and fds */
+	mux->ctlfd = sock;
+	memcpy(mux->fds, pending->fds, sizeof(mux->fds));
+	pending->fds[0] = pending->fds[1] = pending->fds[2] = -1;
+	pending->listener->nsocks = 0;
+	remove_listener(pending->listener);
+
+	mux_start(mux);
+}
+
+static void mux_accept(const struct Listener *UNUSED(listener), int sock) {
+	struct MuxPending *pending = NULL;
+	int fd;
+
+	fd = accept(sock, NULL, NULL);
+	if (fd < 0) {
+		TRACE(("mux_accept: accept failed"))
+		return;
+	}
+	if (mux_check_peer(fd) == DROPBEAR_FAILURE) {
+		m_close(fd);
+		return;
+	}
+	setnonblocking(fd);
+
+	pending = m_malloc(sizeof(*pending));
+	pending->buf = buf_new(MUX_MAX_REQUEST);
+	pending->fds[0] = pending->fds[1] = pending->fds[2] = -1;
+	timer_init(&pending->timeout, mux_pending_timeout, pending);
+
+	/* new_listener will close the sock if it fails */
+	pending->listener = new_listener(&fd, 1, LISTENER_TYPE_DEFAULT, pending,
+		mux_read, mux_pending_cleanup);
+	if (pending->listener == NULL) {
+		buf_free(pending->buf);
+		m_free(pending);
+		return;
+	}
+	timer_after_ms(&pending->timeout, MUX_REQUEST_TIMEOUT * 1000);
+}
+
+static int mux_initchansess(struct Channel *channel) {
+	struct MuxSession *mux = channel->typedata;
+	char *reqtype = mux->is_subsystem ? "subsystem" : "exec";
+
+	channel->readfd = mux->fds[0];
+	channel->writefd = mux->fds[1];
+	channel->errfd = mux->fds[2];
+	setnonblocking(channel->readfd);
+	setnonblocking(channel->writefd);
+	setnonblocking(channel->errfd);
+	ses.maxfd = MAX(ses.maxfd, channel->writefd);
+	ses.maxfd = MAX(ses.maxfd, channel->errfd);
+	channel->extrabuf = cbuf_new(opts.recv_window);
+	channel->bidir_fd = 0;
+	mux->started = 1;
+
+	start_send_channel_request(channel, reqtype);
+	buf_putbyte(ses.writepayload, 0); /* Don't want replies */
+	buf_putstring(ses.writepayload, mux->cmd, strlen(mux->cmd));
+	encrypt_packet();
+	return 0;
+}
+
+static void mux_chansessreq(struct Channel *channel) {
+	struct MuxSession *mux = channel->typedata;
+	char *type = NULL;
+	int wantreply;
+
+	type = buf_getstring(ses.payload, NULL);
+	wantreply = buf_getbool(ses.payload);
+
+	if (strcmp(type, "exit-status") == 0) {
+		mux->exitcode = buf_getint(ses.payload);
+		TRACE(("mux got exit-status of '%d'", mux->exitcode))
+	} else if (strcmp(type, "exit-signal") == 0) {
+		TRACE(("mux got exit-signal, ignoring it"))
+	} else if (wantreply) {
+		send_msg_channel_failure(channel);
+	}
+	m_free(type);
+}
+
+/* Tell the waiting client the exit status */
+static void mux_cleanup(const struct Channel *channel) {
+	struct MuxSession *mux = channel->typedata;
+	unsigned char reply[4];
+
+	if (mux->started) {
+		reply[0] = (mux->exitcode >> 24) & 0xff;
+		reply[1] = (mux->exitcode >> 16) & 0xff;
+		reply[2] = (mux->exitcode >> 8) & 0xff;
+		reply[3] = mux->exitcode & 0xff;
+		/* Nothing to do if the client has gone */
+		(void)atomicio(vwrite, mux->ctlfd, reply, sizeof(reply));
+	} else {
+		/* fds[0] was the channel's initial fd, closed already */
+		m_close(mux->fds[1]);
+		m_close(mux->fds[2]);
+	}
+	m_close(mux->ctlfd);
+	m_free(mux->cmd);
+	m_free(mux);
+}
+
+/* A stale socket is replaced by the next master anyway, but tidy up
+ * when killed */
+static void mux_sighandler(int UNUSED(signo)) {
+	if (mux_listen_path) {
+		unlink(mux_listen_path);
+	}
+	_exit(1);
+}
+
+static void mux_set_sighandler(int signo) {
+	struct sigaction sa;
+	/* Leave other handlers, eg for a proxy command */
+	if (sigaction(signo, NULL, &sa) == 0 && sa.sa_handler == SIG_DFL) {
+		signal(signo, mux_sighandler);
+	}
+}
+
+void cli_mux_master_start() {
+	struct sockaddr_un addr;
+	struct Listener *listener = NULL;
+	char *path = NULL;
+	mode_t old_umask;
+	int fd = -1, other;
+
+	if (cli_opts.control_master == CONTROL_MASTER_NO) {
+		return;
+	}
+	path = mux_control_path();
+	if (!path) {
+		return;
+	}
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		dropbear_log(LOG_WARNING, "ControlPath '%s' is too long", path);
+		goto fail;
+	}
+
+	memset(&addr, 0x0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strlcpy(addr.sun_path, path, sizeof(addr.sun_path));
+
+	fd = socket(PF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		goto fail;
+	}
+
+	old_umask = umask(0077);
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		if (errno != EADDRINUSE) {
+			umask(old_umask);
+			dropbear_log(LOG_WARNING, "Failed binding ControlPath '%s': %s",
+				path, strerror(errno));
+			goto fail;
+		}
+		/* Replace a stale socket, but not a running master */
+		other = connect_unix(path);
+		if (other >= 0) {
+			m_close(other);
+			umask(old_umask);
+			dropbear_log(LOG_INFO, "ControlPath '%s' is already in use", path);
+			goto fail;
+		}
+		unlink(path);
+		if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+			umask(old_umask);
+			dropbear_log(LOG_WARNING, "Failed binding ControlPath '%s': %s",
+				path, strerror(errno));
+			goto fail;
+		}
+	}
+	umask(old_umask);
+
+	if (listen(fd, 20) < 0) {
+		dropbear_log(LOG_WARNING, "Failed listening on ControlPath '%s': %s",
+			path, strerror(errno));
+		unlink(path);
+		goto fail;
+	}
+	setnonblocking(fd);
+
+	mux_listen_path = path;
+	path = NULL;
+	mux_set_sighandler(SIGTERM);
+	mux_set_sighandler(SIGHUP);
+
+	/* new_listener will close the sock if it fails */
+	listener = new_listener(&fd, 1, LISTENER_TYPE_DEFAULT, NULL, mux_accept, NULL);
+	if (listener == NULL) {
+		cli_mux_master_cleanup();
+	}
+	TRACE(("cli_mux_master_start: listening on %s", mux_listen_path))
+	return;
+
+fail:
+	m_close(fd);
+	m_free(path);
+}
+
+void cli_mux_master_cleanup() {
+	if (mux_listen_path) {
+		unlink(mux_listen_path);
+		m_free(mux_listen_path);
+	}
+}
+
+#endif /* DROPBEAR_CLI_MULTIPLEX */
@@ -163,6 +163,10 @@ void cli_getopts(int argc, char ** argv) {
 #endif
 #if DROPBEAR_CLI_ANYTCPFWD
 	cli_opts.exit_on_fwd_failure = 0;
+#endif
+#if DROPBEAR_CLI_MULTIPLEX
+	cli_opts.control_path = NULL;
+	cli_opts.control_master = CONTROL_MASTER_NO;
 #endif
 	cli_opts.disable_trivial_auth = 0;
 	cli_opts.password_authentication = 1;
@@ -994,6 +998,10 @@ static void add_extendedopt(const char* origstr) {
 			"\tBindAddress\n"
 #ifndef DISABLE_ZLIB
 			"\tCompression\n"
+#endif
+#if DROPBEAR_CLI_MULTIPLEX
+			"\tControlMaster\n"
+			"\tControlPath\n"
 #endif
 			"\tDisableTrivialAuth\n"
 #if DROPBEAR_CLI_ANYTCPFWD
@@ -1045,6 +1053,27 @@ static void add_extendedopt(const char* origstr) {
 		return;
 	}
 
+#if DROPBEAR_CLI_MULTIPLEX
+	if (match_extendedopt(&optstr, "ControlMaster") == DROPBEAR_SUCCESS) {
+		if (strcmp(optstr, "auto") == 0) {
+			cli_opts.control_master = CONTROL_MASTER_AUTO;
+		} else if (parse_flag_value(optstr)) {
+			cli_opts.control_master = CONTROL_MASTER_YES;
+		} else {
+			cli_opts.control_master = CONTROL_MASTER_NO;
+		}
+		return;
+	}
+
+	if (match_extendedopt(&optstr, "ControlPath") == DROPBEAR_SUCCESS) {
+		m_free(cli_opts.control_path);
+		if (strcmp(optstr, "none") != 0) {
+			cli_opts.control_path = m_strdup(optstr);
+		}
+		return;
+	}
+#endif
+
 	if (match_extendedopt(&optstr, "DisableTrivialAuth") == DROPBEAR_SUCCESS) {
 		cli_opts.disable_trivial_auth = parse_flag_value(optstr);
 		return;
@@ -105,6 +105,7 @@ void cli_connected(int result, int sock, void* userdata, const char *errstring)
 	myses->sock_in = myses->sock_out = sock;
 	DEBUG1(("cli_connected"))
 	ses.socket_prio = DROPBEAR_PRIO_NORMAL;
+	ses.lowdelay_chan = 0;
 	/* switches to lowdelay */
 	update_channel_prio();
 }
@@ -293,6 +294,10 @@ static void cli_sessionloop() {
 							errno, strerror(errno));
 				}
 			}
+
+#if DROPBEAR_CLI_MULTIPLEX
+			cli_mux_master_start();
+#endif
 			
 #if DROPBEAR_CLI_NETCAT
 			if (cli_opts.netcat_host) {
@@ -354,6 +359,10 @@ static void cli_session_cleanup(void) {
 
 	kill_proxy_command();
 
+#if DROPBEAR_CLI_MULTIPLEX
+	cli_mux_master_cleanup();
+#endif
+
 	/* Set std{in,out,err} back to non-blocking - busybox ash dies nastily if
 	 * we don't revert the flags */
 	/* Ignore return value since there's nothing we can do */
@@ -46,19 +46,41 @@ static int writechannel(struct Channel* channel, int fd, circbuffer *cbuf,
 static void send_msg_channel_window_adjust(const struct Channel *channel,
 		unsigned int incr);
 static void send_msg_channel_data(struct Channel *channel, int isextended);
+static void discard_channel_data(buffer *directbuf);
 static void send_msg_channel_eof(struct Channel *channel);
 static void send_msg_channel_close(struct Channel *channel);
 static void remove_channel(struct Channel *channel);
 static unsigned int write_pending(const struct Channel * channel);
 static void check_close(struct Channel *channel);
 static void close_chan_fd(struct Channel *channel, int fd, int how);
+static void check_window_adjust(struct Channel *channel);
+static void local_channel_io(struct Channel *channel);
+static int queue_has_space(const struct Channel *channel);
+static void send_channel_reads(const fd_set *readfds);
+#if DROPBEAR_CHANNEL_SPLICE
+static void bufpipe_init(struct Channel *channel);
+static unsigned int bufpipe_put(struct Channel *channel,
+	const unsigned char *data, unsigned int len);
+static void splicechannel(struct Channel *channel);
+#endif
 
 #define FD_UNINIT (-2)
 #define FD_CLOSED (-1)
+/* readfd/writefd of a channel with a ChanLocal */
+#define FD_LOCAL (-3)
 
 #define ERRFD_IS_READ(channel) ((channel)->extrabuf == NULL)
 #define ERRFD_IS_WRITE(channel) (!ERRFD_IS_READ(channel))
 
+/* Limits on ses.writequeue_len for reading more channel data. Low delay
+ * channels may queue beyond normal ones, and normal channels queue less
+ * while a low delay channel is open so that its data waits behind less */
+#define CHAN_QUEUE_LOWDELAY (4*TRANS_MAX_PAYLOAD_LEN)
+#define CHAN_QUEUE_NORMAL (2*TRANS_MAX_PAYLOAD_LEN)
+#define CHAN_QUEUE_NORMAL_SHARED (TRANS_MAX_PAYLOAD_LEN)
+/* Bytes given to each normal priority channel per scheduler round */
+#define CHAN_SCHED_QUANTUM (TRANS_MAX_PAYLOAD_LEN)
+
 /* allow space for:
  * 1 byte  byte      SSH_MSG_CHANNEL_DATA
  * 4 bytes uint32    recipient channel
@@ -99,6 +121,26 @@ void chancleanup() {
 	TRACE(("leave chancleanup"))
 }
 
+#if DROPBEAR_IDLE_RECLAIM
+/* Frees channel buffers which don't hold data, for an idle session */
+void channel_reclaim_idle() {
+	unsigned int i;
+
+	for (i = 0; i < ses.chansize; i++) {
+		struct Channel *channel = ses.channels[i];
+		if (channel == NULL) {
+			continue;
+		}
+		if (channel->writebuf) {
+			cbuf_release(channel->writebuf);
+		}
+		if (channel->extrabuf) {
+			cbuf_release(channel->extrabuf);
+		}
+	}
+}
+#endif
+
 /* Create a new channel entry, send a reply confirm or failure */
 /* If remotechan, transwindow and transmaxpacket are not know (for a new
  * outgoing connection, with them to be filled on confirmation), they should
@@ -153,16 +195,24 @@ static struct Channel* newchannel(unsigned int remotechan,
 	newchan->writefd = FD_UNINIT;
 	newchan->readfd = FD_UNINIT;
 	newchan->errfd = FD_CLOSED; /* this isn't always set to start with */
+	newchan->local = NULL;
 	newchan->await_open = 0;
 
 	newchan->writebuf = cbuf_new(opts.recv_window);
 	newchan->recvwindow = opts.recv_window;
 
 	newchan->extrabuf = NULL; /* The user code can set it up */
+#if DROPBEAR_CHANNEL_SPLICE
+	newchan->bufpipe[0] = newchan->bufpipe[1] = -1;
+	newchan->bufpipe_used = 0;
+	newchan->use_bufpipe = 0;
+#endif
 	newchan->recvdonelen = 0;
 	newchan->recvmaxpacket = RECV_MAX_CHANNEL_DATA_LEN;
 
 	newchan->prio = DROPBEAR_PRIO_NORMAL;
+	newchan->sched_deficit = 0;
+	newchan->sched_polled = 0;
 
 	ses.channels[i] = newchan;
 	ses.chancount++;
@@ -213,24 +263,18 @@ void channelio(const fd_set *readfds, const fd_set *writefds) {
 			continue;
 		}
 
-		/* read data and send it over the wire */
-		if (channel->readfd >= 0 && FD_ISSET(channel->readfd, readfds)) {
-			TRACE(("send normal readfd"))
-			send_msg_channel_data(channel, 0);
-			do_check_close = 1;
-		}
-
-		/* read stderr data and send it over the wire */
-		if (ERRFD_IS_READ(channel) && channel->errfd >= 0 
-			&& FD_ISSET(channel->errfd, readfds)) {
-				TRACE(("send normal errfd"))
-				send_msg_channel_data(channel, 1);
-			do_check_close = 1;
-		}
-
 		/* write to program/pipe stdin */
 		if (channel->writefd >= 0 && FD_ISSET(channel->writefd, writefds)) {
-			writechannel(channel, channel->writefd, channel->writebuf, NULL, NULL);
+#if DROPBEAR_CHANNEL_SPLICE
+			/* the pipe's data comes before writebuf's */
+			if (channel->bufpipe_used > 0) {
+				splicechannel(channel);
+			}
+			if (channel->bufpipe_used == 0 && channel->writefd >= 0)
+#endif
+			{
+				writechannel(channel, channel->writefd, channel->writebuf, NULL, NULL);
+			}
 			do_check_close = 1;
 		}
 		
@@ -241,6 +285,11 @@ void channelio(const fd_set *readfds, const fd_set *writefds) {
 			do_check_close = 1;
 		}
 
+		if (channel->local) {
+			local_channel_io(channel);
+			do_check_close = 1;
+		}
+
 		if (ses.channel_signal_pending) {
 			/* SIGCHLD can change channel state for server sessions */
 			do_check_close = 1;
@@ -252,17 +301,187 @@ void channelio(const fd_set *readfds, const fd_set *writefds) {
 		}
 	}
 
+	/* read data and send it over the wire */
+	send_channel_reads(readfds);
+
 #if DROPBEAR_LISTENERS
 	handle_listeners(readfds);
 #endif
 }
 
+/* Returns true if a channel may read more data into the write queue */
+static int queue_has_space(const struct Channel *channel) {
+	unsigned int limit = CHAN_QUEUE_NORMAL;
+
+	if (channel->prio == DROPBEAR_PRIO_LOWDELAY) {
+		limit = CHAN_QUEUE_LOWDELAY;
+	} else if (ses.lowdelay_chan) {
+		limit = CHAN_QUEUE_NORMAL_SHARED;
+	}
+	return ses.writequeue_len <= limit;
+}
+
+static int channel_readable(const struct Channel *channel, const fd_set *readfds) {
+	return (channel->readfd >= 0 && FD_ISSET(channel->readfd, readfds))
+		|| (ERRFD_IS_READ(channel) && channel->errfd >= 0
+			&& FD_ISSET(channel->errfd, readfds));
+}
+
+/* Reads once from each of a channel's fds that select() found readable,
+ * returns the number of bytes sent */
+static unsigned int send_channel_fds(struct Channel *channel, const fd_set *readfds) {
+	unsigned int transwindow = channel->transwindow;
+
+	if (channel->readfd >= 0 && FD_ISSET(channel->readfd, readfds)) {
+		TRACE(("send normal readfd"))
+		send_msg_channel_data(channel, 0);
+	}
+
+	/* read stderr data and send it over the wire */
+	if (ERRFD_IS_READ(channel) && channel->errfd >= 0
+		&& FD_ISSET(channel->errfd, readfds)) {
+		TRACE(("send normal errfd"))
+		send_msg_channel_data(channel, 1);
+	}
+
+	return transwindow - channel->transwindow;
+}
+
+/* Sends data from the channels that select() found readable. Low delay
+ * channels go first. Normal channels then share the write queue with
+ * deficit round robin, so that a channel reading small packets gets as
+ * much bandwidth as one reading large packets. Each round gives every
+ * readable channel CHAN_SCHED_QUANTUM bytes and a channel can read while
+ * it has some left. A channel only reads once per fd here, so a round
+ * spans several calls and the next starts once no readable channel has
+ * bytes left. */
+static void send_channel_reads(const fd_set *readfds) {
+	struct Channel *channel;
+	unsigned int i, k, n, start;
+	int new_round = 1;
+
+	for (i = 0; i < ses.chansize; i++) {
+		channel = ses.channels[i];
+		if (channel == NULL) {
+			continue;
+		}
+		if (!channel_readable(channel, readfds)) {
+			/* An idle channel doesn't keep what it had left. One that
+			 * was held back, such as by a full queue, still has data
+			 * and keeps it. Overspent bytes are never forgiven */
+			if (channel->sched_polled && channel->sched_deficit > 0) {
+				channel->sched_deficit = 0;
+			}
+			continue;
+		}
+		if (channel->prio == DROPBEAR_PRIO_LOWDELAY) {
+#if DROPBEAR_SESSION_STATS
+			ses.stats.lowdelay_queue_max = MAX(ses.stats.lowdelay_queue_max,
+				ses.writequeue_len);
+#endif
+			send_channel_fds(channel, readfds);
+			check_close(channel);
+		} else if (channel->sched_deficit > 0) {
+			new_round = 0;
+		}
+	}
+
+	if (new_round) {
+		for (i = 0; i < ses.chansize; i++) {
+			channel = ses.channels[i];
+			if (channel && channel->prio != DROPBEAR_PRIO_LOWDELAY
+					&& channel_readable(channel, readfds)) {
+				channel->sched_deficit += CHAN_SCHED_QUANTUM;
+			}
+		}
+	}
+
+	n = ses.chansize;
+	start = ses.chan_sched_next;
+	for (k = 0; k < n; k++) {
+		i = (start + k) % n;
+		channel = ses.channels[i];
+		if (channel == NULL || channel->prio == DROPBEAR_PRIO_LOWDELAY
+				|| channel->sched_deficit <= 0
+				|| !channel_readable(channel, readfds)) {
+			continue;
+		}
+		if (!queue_has_space(channel) && !channel->read_mangler) {
+			/* this channel goes first next time */
+			TRACE2(("send_channel_reads: queue full at channel %d", i))
+			ses.chan_sched_next = i;
+			return;
+		}
+		channel->sched_deficit -= send_channel_fds(channel, readfds);
+		check_close(channel);
+	}
+}
+
+/* Returns 1 if an in-process channel can send data now, 0 if not, or -1
+ * once it has no more to send */
+static int local_read_ready(struct Channel *channel) {
+	int ready = channel->local->output_ready(channel);
+	if (ready > 0 && !(channel->transwindow > 0
+			&& ses.dataallowed && queue_has_space(channel))) {
+		return 0;
+	}
+	return ready;
+}
+
+/* The equivalent of fd reads and writes for a channel with a ChanLocal */
+static void local_channel_io(struct Channel *channel) {
+
+	if (channel->writefd == FD_LOCAL && cbuf_getused(channel->writebuf) > 0) {
+		unsigned int used = cbuf_getused(channel->writebuf);
+		channel->local->consume(channel);
+		channel->recvdonelen += used - cbuf_getused(channel->writebuf);
+		check_window_adjust(channel);
+	}
+
+	while (channel->readfd == FD_LOCAL) {
+		unsigned int transwindow = channel->transwindow;
+		int ready = local_read_ready(channel);
+
+		if (ready < 0) {
+			close_chan_fd(channel, channel->readfd, SHUT_RD);
+		}
+		if (ready <= 0) {
+			break;
+		}
+		send_msg_channel_data(channel, 0);
+		if (channel->transwindow == transwindow) {
+			/* nothing was sent */
+			break;
+		}
+	}
+}
+
+/* Handles the local end of a channel in-process, rather than with
+ * file descriptors */
+void channel_set_local(struct Channel *channel, const struct ChanLocal *local) {
+	channel->local = local;
+	channel->readfd = channel->writefd = FD_LOCAL;
+	/* so that each direction is closed separately */
+	channel->bidir_fd = 1;
+	channel->errfd = FD_CLOSED;
+}
+
+
+/* Amount of data waiting to be written to writefd */
+static unsigned int writebuf_used(const struct Channel *channel) {
+#if DROPBEAR_CHANNEL_SPLICE
+	return channel->bufpipe_used + cbuf_getused(channel->writebuf);
+#else
+	return cbuf_getused(channel->writebuf);
+#endif
+}
 
 /* Returns true if there is data remaining to be written to stdin or
  * stderr of a channel's endpoint. */
 static unsigned int write_pending(const struct Channel * channel) {
 
-	if (channel->writefd >= 0 && cbuf_getused(channel->writebuf) > 0) {
+	if ((channel->writefd >= 0 || channel->writefd == FD_LOCAL)
+			&& writebuf_used(channel) > 0) {
 		return 1;
 	} else if (channel->errfd >= 0 && channel->extrabuf && 
 			cbuf_getused(channel->extrabuf) > 0) {
@@ -355,6 +574,9 @@ void channel_connect_done(int result, int sock, void* user_data, const char* err
 		channel->readfd = channel->writefd = sock;
 		channel->bidir_fd = 1;
 		channel->conn_pending = NULL;
+#if DROPBEAR_CHANNEL_SPLICE
+		channel->use_bufpipe = IS_DROPBEAR_SERVER;
+#endif
 		send_msg_channel_open_confirmation(channel, channel->recvwindow,
 				channel->recvmaxpacket);
 		TRACE(("leave channel_connect_done: success"))
@@ -520,12 +742,7 @@ static int writechannel(struct Channel* channel, int fd, circbuffer *cbuf,
 	ret = writechannel_fallback(channel, fd, cbuf, moredata, morelen);
 #endif
 
-	/* Window adjust handling */
-	if (channel->recvdonelen >= RECV_WINDOWEXTEND) {
-		send_msg_channel_window_adjust(channel, channel->recvdonelen);
-		channel->recvwindow += channel->recvdonelen;
-		channel->recvdonelen = 0;
-	}
+	check_window_adjust(channel);
 
 	dropbear_assert(channel->recvwindow <= opts.recv_window);
 	dropbear_assert(channel->recvwindow <= cbuf_getavail(channel->writebuf));
@@ -537,12 +754,22 @@ static int writechannel(struct Channel* channel, int fd, circbuffer *cbuf,
 }
 
 
+/* Extends the remote's window once enough data has been consumed */
+static void check_window_adjust(struct Channel *channel) {
+	if (channel->recvdonelen >= RECV_WINDOWEXTEND) {
+		send_msg_channel_window_adjust(channel, channel->recvdonelen);
+		channel->recvwindow += channel->recvdonelen;
+		channel->recvdonelen = 0;
+	}
+}
+
 /* Set the file descriptors for the main select in session.c
  * This avoid channels which don't have any window available, are closed, etc*/
-void setchannelfds(fd_set *readfds, fd_set *writefds, int allow_reads) {
+int setchannelfds(fd_set *readfds, fd_set *writefds) {
 	
 	unsigned int i;
 	struct Channel * channel;
+	int local_ready = 0;
 	
 	for (i = 0; i < ses.chansize; i++) {
 
@@ -557,7 +784,8 @@ void setchannelfds(fd_set *readfds, fd_set *writefds, int allow_reads) {
 		FD if there's the possibility of "~."" to kill an 
 		interactive session (the read_mangler) */
 		if (channel->transwindow > 0
-		   && ((ses.dataallowed && allow_reads) || channel->read_mangler)) {
+		   && ((ses.dataallowed && queue_has_space(channel))
+			   || channel->read_mangler)) {
 
 			if (channel->readfd >= 0) {
 				dropbear_fd_set(channel->readfd, readfds);
@@ -566,10 +794,13 @@ void setchannelfds(fd_set *readfds, fd_set *writefds, int allow_reads) {
 			if (ERRFD_IS_READ(channel) && channel->errfd >= 0) {
 					dropbear_fd_set(channel->errfd, readfds);
 			}
+			channel->sched_polled = 1;
+		} else {
+			channel->sched_polled = 0;
 		}
 
 		/* Stuff from the wire */
-		if (channel->writefd >= 0 && cbuf_getused(channel->writebuf) > 0) {
+		if (channel->writefd >= 0 && writebuf_used(channel) > 0) {
 				dropbear_fd_set(channel->writefd, writefds);
 		}
 
@@ -578,12 +809,18 @@ void setchannelfds(fd_set *readfds, fd_set *writefds, int allow_reads) {
 				dropbear_fd_set(channel->errfd, writefds);
 		}
 
+		if (channel->readfd == FD_LOCAL
+				&& local_read_ready(channel) != 0) {
+			local_ready = 1;
+		}
+
 	} /* foreach channel */
 
 #if DROPBEAR_LISTENERS
 	set_listener_fds(readfds);
 #endif
 
+	return local_ready;
 }
 
 /* handle the channel EOF event, by closing the channel filedescriptor. The
@@ -627,6 +864,13 @@ static void remove_channel(struct Channel * channel) {
 	TRACE(("enter remove_channel"))
 	TRACE(("channel index is %d", channel->index))
 
+#if DROPBEAR_SESSION_STATS
+	dropbear_log(LOG_INFO, "Channel stats: index=%u type=%s bytes_in=%llu "
+		"bytes_out=%llu window_stalls=%u", channel->index, channel->type->name,
+		channel->stat_bytes_in, channel->stat_bytes_out,
+		channel->stat_window_stalls);
+#endif
+
 	cbuf_free(channel->writebuf);
 	channel->writebuf = NULL;
 
@@ -647,6 +891,11 @@ static void remove_channel(struct Channel * channel) {
 		m_close(channel->errfd);
 	}
 
+#if DROPBEAR_CHANNEL_SPLICE
+	m_close(channel->bufpipe[0]);
+	m_close(channel->bufpipe[1]);
+#endif
+
 	if (channel->type->cleanup) {
 		channel->type->cleanup(channel);
 	}
@@ -697,8 +946,9 @@ void recv_msg_channel_request() {
 static void send_msg_channel_data(struct Channel *channel, int isextended) {
 
 	int len;
-	size_t maxlen, size_pos;
+	size_t maxlen, size_pos, headerlen;
 	int fd;
+	buffer *payload = NULL, *directbuf = NULL;
 
 	CHECKCLEARTOWRITE();
 
@@ -711,31 +961,45 @@ static void send_msg_channel_data(struct Channel *channel, int isextended) {
 		fd = channel->readfd;
 	}
 	TRACE(("enter send_msg_channel_data isextended %d fd %d", isextended, fd))
-	dropbear_assert(fd >= 0);
+	dropbear_assert(fd >= 0 || (channel->local && !isextended));
 
-	maxlen = MIN(channel->transwindow, channel->transmaxpacket);
-	/* -(1+4+4) is SSH_MSG_CHANNEL_DATA, channel number, string length, and 
+	/* SSH_MSG_CHANNEL_DATA, channel number, string length, and 
 	 * exttype if is extended */
-	maxlen = MIN(maxlen, 
-			ses.writepayload->size - 1 - 4 - 4 - (isextended ? 4 : 0));
+	headerlen = 1 + 4 + 4 + (isextended ? 4 : 0);
+	maxlen = MIN(channel->transwindow, channel->transmaxpacket);
+	maxlen = MIN(maxlen, ses.writepayload->size - headerlen);
 	TRACE(("maxlen %zd", maxlen))
 	if (maxlen == 0) {
 		TRACE(("leave send_msg_channel_data: no window"))
 		return;
 	}
 
-	buf_putbyte(ses.writepayload, 
+	/* Read straight into the wire packet where possible, that avoids
+	 * copying the payload in encrypt_packet() */
+	directbuf = new_direct_packet(headerlen + maxlen);
+	payload = directbuf ? directbuf : ses.writepayload;
+
+	buf_putbyte(payload, 
 			isextended ? SSH_MSG_CHANNEL_EXTENDED_DATA : SSH_MSG_CHANNEL_DATA);
-	buf_putint(ses.writepayload, channel->remotechan);
+	buf_putint(payload, channel->remotechan);
 	if (isextended) {
-		buf_putint(ses.writepayload, SSH_EXTENDED_DATA_STDERR);
+		buf_putint(payload, SSH_EXTENDED_DATA_STDERR);
 	}
 	/* a dummy size first ...*/
-	size_pos = ses.writepayload->pos;
-	buf_putint(ses.writepayload, 0);
+	size_pos = payload->pos;
+	buf_putint(payload, 0);
 
 	/* read the data */
-	len = read(fd, buf_getwriteptr(ses.writepayload, maxlen), maxlen);
+	if (channel->local) {
+		len = channel->local->output(channel, buf_getwriteptr(payload, maxlen), maxlen);
+		if (len == 0) {
+			discard_channel_data(directbuf);
+			TRACE(("leave send_msg_channel_data: nothing from local"))
+			return;
+		}
+	} else {
+		len = read(fd, buf_getwriteptr(payload, maxlen), maxlen);
+	}
 
 	if (len <= 0) {
 		if (len == 0 || errno != EINTR) {
@@ -744,34 +1008,54 @@ static void send_msg_channel_data(struct Channel *channel, int isextended) {
 			in which case it can be treated the same as EOF */
 			close_chan_fd(channel, fd, SHUT_RD);
 		}
-		buf_setpos(ses.writepayload, 0);
-		buf_setlen(ses.writepayload, 0);
+		discard_channel_data(directbuf);
 		TRACE(("leave send_msg_channel_data: len %d read err %d or EOF for fd %d", 
 					len, errno, fd))
 		return;
 	}
 
 	if (channel->read_mangler) {
-		channel->read_mangler(channel, buf_getwriteptr(ses.writepayload, len), &len);
+		channel->read_mangler(channel, buf_getwriteptr(payload, len), &len);
 		if (len == 0) {
-			buf_setpos(ses.writepayload, 0);
-			buf_setlen(ses.writepayload, 0);
+			discard_channel_data(directbuf);
 			return;
 		}
 	}
 
 	TRACE(("send_msg_channel_data: len %d fd %d", len, fd))
-	buf_incrwritepos(ses.writepayload, len);
+	buf_incrwritepos(payload, len);
 	/* ... real size here */
-	buf_setpos(ses.writepayload, size_pos);
-	buf_putint(ses.writepayload, len);
+	buf_setpos(payload, size_pos);
+	buf_putint(payload, len);
 
 	channel->transwindow -= len;
+#if DROPBEAR_SESSION_STATS
+	channel->stat_bytes_out += len;
+	SES_STAT_ADD(chan_bytes_out, len);
+	if (channel->transwindow == 0) {
+		channel->stat_window_stalls++;
+		SES_STAT_ADD(chan_window_stalls, 1);
+	}
+#endif
 
-	encrypt_packet();
+	if (directbuf) {
+		encrypt_direct_packet(directbuf);
+	} else {
+		encrypt_packet();
+	}
 	TRACE(("leave send_msg_channel_data"))
 }
 
+/* Drop a partially built channel data packet */
+static void discard_channel_data(buffer *directbuf) {
+	if (directbuf) {
+		buf_free(directbuf);
+	} else {
+		buf_setpos(ses.writepayload, 0);
+		buf_setlen(ses.writepayload, 0);
+	}
+}
+
 /* We receive channel data */
 void recv_msg_channel_data() {
 
@@ -800,7 +1084,7 @@ void common_recv_msg_channel_data(struct Channel *channel, int fd,
 		dropbear_exit("Received data after eof");
 	}
 
-	if (fd < 0 || !cbuf) {
+	if ((fd < 0 && fd != FD_LOCAL) || !cbuf) {
 		/* If we have encountered failed write, the far side might still
 		 * be sending data without having yet received our close notification.
 		 * We just drop the data. */
@@ -821,11 +1105,25 @@ void common_recv_msg_channel_data(struct Channel *channel, int fd,
 
 	dropbear_assert(channel->recvwindow >= datalen);
 	channel->recvwindow -= datalen;
+#if DROPBEAR_SESSION_STATS
+	channel->stat_bytes_in += datalen;
+	SES_STAT_ADD(chan_bytes_in, datalen);
+#endif
 	dropbear_assert(channel->recvwindow <= opts.recv_window);
 
-	/* Attempt to write the data immediately without having to put it in the circular buffer */
-	consumed = datalen;
-	res = writechannel(channel, fd, cbuf, buf_getptr(ses.payload, datalen), &consumed);
+	/* Attempt to write the data immediately without having to put it in the circular buffer.
+	 * In-process channels consume it from the buffer in channelio() */
+	consumed = 0;
+	res = DROPBEAR_SUCCESS;
+	if (fd != FD_LOCAL
+#if DROPBEAR_CHANNEL_SPLICE
+			/* data already in the pipe must be written first */
+			&& channel->bufpipe_used == 0
+#endif
+			) {
+		consumed = datalen;
+		res = writechannel(channel, fd, cbuf, buf_getptr(ses.payload, datalen), &consumed);
+	}
 
 	datalen -= consumed;
 	buf_incrpos(ses.payload, consumed);
@@ -836,6 +1134,21 @@ void common_recv_msg_channel_data(struct Channel *channel, int fd,
 	 * is payload data.
 	 * If the writechannel() failed then remaining data is discarded */
 	if (res == DROPBEAR_SUCCESS) {
+#if DROPBEAR_CHANNEL_SPLICE
+		/* Once data is in writebuf, further data follows it there
+		 * until it has been written */
+		if (datalen > 0 && cbuf_getused(cbuf) == 0) {
+			if (channel->use_bufpipe && channel->bufpipe[1] < 0) {
+				bufpipe_init(channel);
+			}
+			if (channel->bufpipe[1] >= 0) {
+				consumed = bufpipe_put(channel,
+					buf_getptr(ses.payload, datalen), datalen);
+				buf_incrpos(ses.payload, consumed);
+				datalen -= consumed;
+			}
+		}
+#endif
 		len = datalen;
 		while (len > 0) {
 			buflen = cbuf_writelen(cbuf);
@@ -852,6 +1165,84 @@ void common_recv_msg_channel_data(struct Channel *channel, int fd,
 	TRACE(("leave recv_msg_channel_data"))
 }
 
+#if DROPBEAR_CHANNEL_SPLICE
+/* Sets up a pipe to hold data for writefd ahead of writebuf. The data
+ * can then be moved to the socket with splice() rather than copied again.
+ * It is only created once writefd can't keep up, so that forwards which
+ * never fill their socket don't each hold a pipe. writebuf is used as
+ * normal if the pipe can't be created.
+ * vmsplice() isn't used to fill the pipe since it would reference the
+ * payload buffer's pages rather than copy them, and that buffer is
+ * reused for the next packet */
+static void bufpipe_init(struct Channel *channel) {
+#ifdef F_SETPIPE_SZ
+	int fds[2];
+	/* A partly sent page at the start and a partly filled page at the
+	 * end can't be used for other data */
+	int size = opts.recv_window + 2 * sysconf(_SC_PAGESIZE);
+
+	/* only tried once */
+	channel->use_bufpipe = 0;
+
+	if (pipe2(fds, O_CLOEXEC | O_NONBLOCK) < 0) {
+		TRACE(("bufpipe_init: pipe2 failed: %s", strerror(errno)))
+		return;
+	}
+	if (fcntl(fds[1], F_SETPIPE_SZ, size) < size) {
+		/* may be over the user's pipe limits */
+		TRACE(("bufpipe_init: F_SETPIPE_SZ %d failed: %s", size, strerror(errno)))
+		m_close(fds[0]);
+		m_close(fds[1]);
+		return;
+	}
+	channel->bufpipe[0] = fds[0];
+	channel->bufpipe[1] = fds[1];
+	TRACE(("bufpipe_init: channel %d using pipe of %d", channel->index, size))
+#else
+	channel->use_bufpipe = 0;
+#endif
+}
+
+/* Queues data that couldn't be written to writefd yet. Returns the length
+ * that fit in the pipe, the caller puts the rest in writebuf */
+static unsigned int bufpipe_put(struct Channel *channel,
+		const unsigned char *data, unsigned int len) {
+	ssize_t written;
+
+	do {
+		written = write(channel->bufpipe[1], data, len);
+	} while (written < 0 && errno == EINTR);
+	if (written < 0) {
+		/* full, the pipe's pages can hold less than its size */
+		TRACE(("bufpipe_put: write failed: %s", strerror(errno)))
+		written = 0;
+	}
+	channel->bufpipe_used += written;
+	return written;
+}
+
+/* Moves data from the pipe to writefd, the equivalent of writechannel() */
+static void splicechannel(struct Channel *channel) {
+	ssize_t len;
+
+	TRACE(("enter splicechannel fd %d", channel->writefd))
+	len = splice(channel->bufpipe[0], NULL, channel->writefd, NULL,
+		channel->bufpipe_used, SPLICE_F_NONBLOCK | SPLICE_F_MOVE);
+	if (len < 0) {
+		if (errno != EINTR && errno != EAGAIN) {
+			TRACE(("channel splice error fd %d %s", channel->writefd, strerror(errno)))
+			close_chan_fd(channel, channel->writefd, SHUT_WR);
+		}
+		TRACE(("leave splicechannel"))
+		return;
+	}
+	channel->bufpipe_used -= len;
+	channel->recvdonelen += len;
+	check_window_adjust(channel);
+	TRACE(("leave splicechannel"))
+}
+#endif /* DROPBEAR_CHANNEL_SPLICE */
+
 /* Increment the outgoing data window for a channel - the remote end limits
  * the amount of data which may be transmitted, this window is decremented
  * as data is sent, and incremented upon receiving window-adjust messages */
@@ -1055,7 +1446,9 @@ static void close_chan_fd(struct Channel *channel, int fd, int how) {
 
 	if (channel->bidir_fd) {
 		TRACE(("SHUTDOWN(%d, %d)", fd, how))
-		shutdown(fd, how);
+		if (fd >= 0) {
+			shutdown(fd, how);
+		}
 		if (how == 0) {
 			closeout = 1;
 		} else {
@@ -1098,6 +1491,13 @@ static void close_chan_fd(struct Channel *channel, int fd, int how) {
  * completion. It is mandatory for the caller to encrypt_packet() if
  * a channel is returned. NULL is returned on failure. */
 int send_msg_channel_open_init(int fd, const struct ChanType *type) {
+	return send_msg_channel_open_typed(fd, type, NULL);
+}
+
+/* As for send_msg_channel_open_init(), also setting the new channel's
+ * typedata. The type's cleanup handler is responsible for typedata
+ * once this returns success */
+int send_msg_channel_open_typed(int fd, const struct ChanType *type, void *typedata) {
 
 	struct Channel* chan;
 
@@ -1107,6 +1507,7 @@ int send_msg_channel_open_init(int fd, const struct ChanType *type) {
 		TRACE(("leave send_msg_channel_open_init() - FAILED in newchannel()"))
 		return DROPBEAR_FAILURE;
 	}
+	chan->typedata = typedata;
 
 	/* Outbound opened channels don't make use of in-progress connections,
 	 * we can set it up straight away */
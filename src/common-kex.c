@@ -172,6 +172,7 @@ void send_msg_newkeys() {
 	ses.kexstate.sentnewkeys = 1;
 	if (ses.kexstate.donefirstkex) {
 		ses.kexstate.donesecondkex = 1;
+		SES_STAT_ADD(rekeys, 1);
 	}
 	ses.kexstate.donefirstkex = 1;
 	ses.dataallowed = 1; /* we can send other packets again now */
@@ -253,7 +254,12 @@ static void kexinitialise() {
 
 	ses.kexstate.our_first_follows_matches = 0;
 
+#if DROPBEAR_KEX_PREGEN
+	ses.kexstate.tookparam = 0;
+#endif
+
 	ses.kexstate.lastkextime = monotonic_now();
+	timer_at(&ses.rekey_timer, ses.kexstate.lastkextime + KEX_REKEY_TIMEOUT);
 
 }
 
@@ -606,6 +612,150 @@ void finish_kexhashbuf(void) {
 	}
 }
 
+/* Generate our side's ephemeral param for a kex algorithm, returning
+ * a struct kex_*_param according to the mode */
+void *gen_kex_param(const struct dropbear_kex *algo_kex) {
+	switch (algo_kex->mode) {
+#if DROPBEAR_NORMAL_DH
+		case DROPBEAR_KEX_NORMAL_DH:
+			return gen_kexdh_param(algo_kex);
+#endif
+#if DROPBEAR_ECDH
+		case DROPBEAR_KEX_ECDH:
+			return gen_kexecdh_param(algo_kex);
+#endif
+#if DROPBEAR_CURVE25519
+		case DROPBEAR_KEX_CURVE25519:
+			return gen_kexcurve25519_param();
+#endif
+#if DROPBEAR_PQHYBRID
+		case DROPBEAR_KEX_PQHYBRID:
+			return gen_kexpqhybrid_param(algo_kex);
+#endif
+	}
+	dropbear_exit("Bad kex mode");
+	return NULL;
+}
+
+void free_kex_param(const struct dropbear_kex *algo_kex, void *param) {
+	switch (algo_kex->mode) {
+#if DROPBEAR_NORMAL_DH
+		case DROPBEAR_KEX_NORMAL_DH:
+			free_kexdh_param(param);
+			break;
+#endif
+#if DROPBEAR_ECDH
+		case DROPBEAR_KEX_ECDH:
+			free_kexecdh_param(param);
+			break;
+#endif
+#if DROPBEAR_CURVE25519
+		case DROPBEAR_KEX_CURVE25519:
+			free_kexcurve25519_param(param);
+			break;
+#endif
+#if DROPBEAR_PQHYBRID
+		case DROPBEAR_KEX_PQHYBRID:
+			free_kexpqhybrid_param(param);
+			break;
+#endif
+	}
+}
+
+#if DROPBEAR_KEX_PREGEN
+/* The kex algorithm our next ephemeral param will be needed for, or NULL
+ * if it isn't worth generating one yet */
+static const struct dropbear_kex *pregen_target(void) {
+	time_t now;
+
+	if (ses.newkeys && !ses.kexstate.tookparam) {
+		/* kex in progress and our param is still needed, for example
+		   the server waiting for kexdh init */
+		if (ses.newkeys->algo_kex) {
+			return ses.newkeys->algo_kex;
+		}
+		/* Not negotiated yet, a rekey will usually choose the
+		   same algorithm as last time */
+		return ses.keys->algo_kex;
+	}
+
+	if (ses.newkeys || !ses.keys->algo_kex) {
+		return NULL;
+	}
+
+	/* The same algorithm will be negotiated on rekey, only spend
+	   the time once it is getting close */
+	now = monotonic_now();
+	if (ses.kexstate.needrekey
+		|| now - ses.kexstate.lastkextime >= KEX_PREGEN_TIMEOUT
+		|| ses.kexstate.datarecv+ses.kexstate.datatrans >= KEX_PREGEN_DATA) {
+		return ses.keys->algo_kex;
+	}
+	return NULL;
+}
+#endif /* DROPBEAR_KEX_PREGEN */
+
+/* Returns our ephemeral param for the negotiated ses.newkeys->algo_kex,
+ * a struct kex_*_param according to the kex mode. A param generated in
+ * advance is used if available, it is only ever handed out once.
+ * The caller frees it with the matching free_kex*_param() */
+void *kex_take_param(void) {
+	const struct dropbear_kex *algo_kex = ses.newkeys->algo_kex;
+#if DROPBEAR_KEX_PREGEN
+	void *param = NULL;
+
+	ses.kexstate.tookparam = 1;
+	if (ses.pregen_param && ses.pregen_algo == algo_kex) {
+		TRACE(("kex_take_param: using pregenerated param"))
+		param = ses.pregen_param;
+		ses.pregen_param = NULL;
+		ses.pregen_algo = NULL;
+		return param;
+	}
+	/* A different algorithm was negotiated */
+	kex_free_pregen();
+#endif
+	return gen_kex_param(algo_kex);
+}
+
+/* Whether the main loop should call kex_pregen_param() when it
+ * has nothing else to do */
+int kex_pregen_wanted(void) {
+#if DROPBEAR_KEX_PREGEN
+#if DROPBEAR_FUZZ
+	if (fuzz.fuzzing) {
+		return 0;
+	}
+#endif
+	return ses.pregen_param == NULL && pregen_target() != NULL;
+#else
+	return 0;
+#endif
+}
+
+void kex_pregen_param(void) {
+#if DROPBEAR_KEX_PREGEN
+	const struct dropbear_kex *algo_kex = pregen_target();
+
+	if (ses.pregen_param || !algo_kex) {
+		return;
+	}
+	TRACE(("kex_pregen_param: generating"))
+	ses.pregen_param = gen_kex_param(algo_kex);
+	ses.pregen_algo = algo_kex;
+#endif
+}
+
+void kex_free_pregen(void) {
+#if DROPBEAR_KEX_PREGEN
+	if (ses.pregen_param) {
+		free_kex_param(ses.pregen_algo, ses.pregen_param);
+		ses.pregen_param = NULL;
+		ses.pregen_algo = NULL;
+	}
+#endif
+}
+
 /* read the other side's algo list. buf_match_algo is a callback to match
  * algos for the client or server. */
 static void read_kex_algos() {
@@ -36,10 +36,17 @@
 #include "runopts.h"
 #include "netio.h"
 
-static void checktimeouts(void);
-static long select_timeout(void);
+static void settimeouts(void);
+static void checkrekey(void);
+static long elapsed(time_t now, time_t prev);
+#if DROPBEAR_IDLE_RECLAIM
+static void reclaim_idle(void);
+#endif
 static int ident_readln(int fd, char* buf, int count);
 static void read_session_identification(void);
+#if DROPBEAR_SESSION_STATS
+static void sigusr1_stats_handler(int dummy);
+#endif
 
 struct sshsession ses; /* GLOBAL */
 
@@ -87,6 +94,7 @@ void common_session_init(int sock_in, int sock_out) {
 	ses.last_packet_time_idle = now;
 	ses.last_packet_time_any_sent = 0;
 	ses.last_packet_time_keepalive_sent = 0;
+	settimeouts();
 	
 #if DROPBEAR_FUZZ
 	if (!fuzz.fuzzing)
@@ -99,7 +107,15 @@ void common_session_init(int sock_in, int sock_out) {
 	setnonblocking(ses.signal_pipe[1]);
 	ses.maxfd = MAX(ses.maxfd, ses.signal_pipe[0]);
 	ses.maxfd = MAX(ses.maxfd, ses.signal_pipe[1]);
+#if DROPBEAR_SESSION_STATS
+	if (signal(SIGUSR1, sigusr1_stats_handler) == SIG_ERR) {
+		dropbear_exit("signal() error");
 	}
+#endif
+	}
+#if DROPBEAR_SESSION_STATS
+	ses.stats.start_time = now;
+#endif
 	
 	ses.writepayload = buf_new(TRANS_MAX_PAYLOAD_LEN);
 	ses.transseq = 0;
@@ -158,18 +174,44 @@ void common_session_init(int sock_in, int sock_out) {
 	TRACE(("leave session_init"))
 }
 
+/* While reading packets is paused, notices if the remote side closes the
+ * connection. Once it has sent more data that is left until reading
+ * resumes. */
+static void check_paused_read(void) {
+	char c;
+	ssize_t len;
+
+	len = recv(ses.sock_in, &c, 1, MSG_PEEK);
+	if (len == 0) {
+		ses.remoteclosed();
+	}
+	if (len < 0) {
+		if (errno == EINTR || errno == EAGAIN) {
+			return;
+		}
+		if (errno != ENOTSOCK) {
+			dropbear_exit("Error reading: %s", strerror(errno));
+		}
+	}
+	/* data, or it can't be checked */
+	ses.paused_data = 1;
+}
+
 void session_loop(void(*loophandler)(void)) {
 
 	fd_set readfd, writefd;
 	struct timeval timeout;
+	long wait_ms;
+	int local_ready;
 	int val;
 
 	/* main loop, select()s for all sockets in use */
 	for(;;) {
 		const int writequeue_has_space = (ses.writequeue_len <= 2*TRANS_MAX_PAYLOAD_LEN);
+		/* If a kex keypair can be generated in advance, only poll here.
+		   It is generated below if nothing else is ready */
+		const int idle_pregen = kex_pregen_wanted();
 
-		timeout.tv_sec = select_timeout();
-		timeout.tv_usec = 0;
 		DROPBEAR_FD_ZERO(&writefd);
 		DROPBEAR_FD_ZERO(&readfd);
 
@@ -185,20 +227,21 @@ void session_loop(void(*loophandler)(void)) {
 		}
 
 		/* set up for channels which can be read/written */
-		setchannelfds(&readfd, &writefd, writequeue_has_space);
+		local_ready = setchannelfds(&readfd, &writefd);
 
 		/* Pending connections to test */
-		set_connect_fds(&writefd);
+		set_connect_fds(&readfd, &writefd);
 
 		/* We delay reading from the input socket during initial setup until
 		after we have written out our initial KEXINIT packet (empty writequeue). 
 		This means our initial packet can be in-flight while we're doing a blocking
 		read for the remote ident.
 		We also avoid reading from the socket if the writequeue is full, that avoids
-		replies backing up */
+		replies backing up, or while a request is still being handled */
 		if (ses.sock_in != -1 
 			&& (ses.remoteident || isempty(&ses.writequeue)) 
-			&& writequeue_has_space) {
+			&& writequeue_has_space
+			&& !(ses.read_paused && ses.paused_data)) {
 			dropbear_fd_set(ses.sock_in, &readfd);
 		}
 
@@ -208,7 +251,36 @@ void session_loop(void(*loophandler)(void)) {
 			dropbear_fd_set(ses.sock_out, &writefd);
 		}
 
+#if DROPBEAR_IDLE_RECLAIM
+		if (ses.idle_reclaim_due) {
+			reclaim_idle();
+		} else if (ses.idle_reclaim_time != ses.last_packet_time_idle
+				&& !timer_pending(&ses.reclaim_timer)) {
+			/* there has been activity since the last reclaim */
+			timer_at(&ses.reclaim_timer,
+				ses.last_packet_time_idle + DROPBEAR_IDLE_RECLAIM);
+		}
+#endif
+
+		/* sleep until the next timer is due */
+		wait_ms = timer_next_ms();
+		if (wait_ms < 0) {
+			wait_ms = KEX_REKEY_TIMEOUT * 1000L;
+		}
+		if (idle_pregen || ses.kexstate.needrekey || local_ready) {
+			wait_ms = 0;
+		}
+		timeout.tv_sec = wait_ms / 1000;
+		timeout.tv_usec = (wait_ms % 1000) * 1000;
+
 		val = select(ses.maxfd+1, &readfd, &writefd, NULL, &timeout);
+		SES_STAT_ADD(wakeups, 1);
+
+#if DROPBEAR_IDLE_RECLAIM
+		if (ses.writepayload == NULL) {
+			ses.writepayload = buf_new(TRANS_MAX_PAYLOAD_LEN);
+		}
+#endif
 
 		if (ses.exitflag) {
 			dropbear_exit("Terminated by signal");
@@ -226,6 +298,10 @@ void session_loop(void(*loophandler)(void)) {
 			DROPBEAR_FD_ZERO(&writefd);
 			DROPBEAR_FD_ZERO(&readfd);
 		}
+
+		if (val == 0 && idle_pregen) {
+			kex_pregen_param();
+		}
 		
 		/* We'll just empty out the pipe if required. We don't do
 		any thing with the data, since the pipe's purpose is purely to
@@ -238,8 +314,16 @@ void session_loop(void(*loophandler)(void)) {
 			ses.channel_signal_pending = 1;
 		}
 
-		/* check for auth timeout, rekeying required etc */
-		checktimeouts();
+#if DROPBEAR_SESSION_STATS
+		if (ses.stats_requested) {
+			ses.stats_requested = 0;
+			session_log_stats("signal");
+		}
+#endif
+
+		/* auth timeout, keepalives etc */
+		timer_run();
+		checkrekey();
 
 		/* process session socket's incoming data */
 		if (ses.sock_in != -1) {
@@ -247,6 +331,8 @@ void session_loop(void(*loophandler)(void)) {
 				if (!ses.remoteident) {
 					/* blocking read of the version string */
 					read_session_identification();
+				} else if (ses.read_paused) {
+					check_paused_read();
 				} else {
 					read_packet();
 				}
@@ -263,7 +349,7 @@ void session_loop(void(*loophandler)(void)) {
 		were being held up during a KEX */
 		maybe_flush_reply_queue();
 
-		handle_connect_fds(&writefd);
+		handle_connect_fds(&readfd, &writefd);
 
 		/* loop handler prior to channelio, in case the server loophandler closes
 		channels on process exit */
@@ -304,6 +390,10 @@ void session_cleanup() {
 		return;
 	}
 
+#if DROPBEAR_SESSION_STATS
+	session_log_stats("close");
+#endif
+
 	/* BEWARE of changing order of functions here. */
 
 	/* Must be before extra_session_cleanup() */
@@ -320,12 +410,15 @@ void session_cleanup() {
 	remove_all_listeners();
 
 	remove_connect_pending();
+	remove_resolve_cache();
+	timer_cleanup();
 
 	while (!isempty(&ses.writequeue)) {
 		buf_free(dequeue(&ses.writequeue));
 	}
 
 	m_free(ses.newkeys);
+	kex_free_pregen();
 #ifndef DISABLE_ZLIB
 	if (ses.keys->recv.zstream != NULL) {
 		if (inflateEnd(ses.keys->recv.zstream) == Z_STREAM_ERROR) {
@@ -351,7 +444,11 @@ void session_cleanup() {
 
 	cleanup_buf(&ses.session_id);
 	cleanup_buf(&ses.hash);
+	if (ses.payload == ses.decompress_buf) {
+		ses.payload = NULL;
+	}
 	cleanup_buf(&ses.payload);
+	cleanup_buf(&ses.decompress_buf);
 	cleanup_buf(&ses.readbuf);
 	cleanup_buf(&ses.writepayload);
 	cleanup_buf(&ses.kexhashbuf);
@@ -455,7 +552,7 @@ static int ident_readln(int fd, char* buf, int count) {
 			return -1;
 		}
 
-		checktimeouts();
+		timer_run();
 		
 		/* Have to go one byte at a time, since we don't want to read past
 		 * the end, and have to somehow shove bytes back into the normal
@@ -541,109 +638,159 @@ static long elapsed(time_t now, time_t prev) {
 	return (long)del;
 }
 
-/* Check all timeouts which are required. Currently these are the time for
- * user authentication, and the automatic rekeying. */
-static void checktimeouts() {
-
-	time_t now;
-	now = monotonic_now();
+static void timeout_auth(void *UNUSED(arg)) {
+	if (IS_DROPBEAR_SERVER && ses.authstate.authdone != 1) {
+		dropbear_close("Timeout before auth");
+	}
+}
 
-	if (IS_DROPBEAR_SERVER && ses.authstate.authdone != 1
-		&& elapsed(now, ses.connect_time) >= AUTH_TIMEOUT) {
-			dropbear_close("Timeout before auth");
+static void timeout_rekey(void *UNUSED(arg)) {
+	/* kexinitialise() sets the timer again after a key exchange */
+	if (ses.kexstate.sentkexinit) {
+		return;
 	}
 
 	/* we can't rekey if we haven't done remote ident exchange yet */
 	if (ses.remoteident == NULL) {
+		timer_at(&ses.rekey_timer, monotonic_now() + KEX_REKEY_TIMEOUT);
 		return;
 	}
 
-	if (!ses.kexstate.sentkexinit
-			&& (elapsed(now, ses.kexstate.lastkextime) >= KEX_REKEY_TIMEOUT
-			|| ses.kexstate.datarecv+ses.kexstate.datatrans >= KEX_REKEY_DATA
-			|| ses.kexstate.needrekey)) {
-		TRACE(("rekeying after timeout or max data reached"))
-		ses.kexstate.needrekey = 0;
-		send_msg_kexinit();
-	}
+	TRACE(("rekeying after timeout"))
+	ses.kexstate.needrekey = 0;
+	send_msg_kexinit();
+}
 
-	if (opts.keepalive_secs > 0 && ses.authstate.authdone) {
-		/* Avoid sending keepalives prior to auth - those are
-		not valid pre-auth packet types */
+static void timeout_keepalive(void *UNUSED(arg)) {
+	const long secs = opts.keepalive_secs;
+	time_t now, next;
 
-		/* Send keepalives if we've been idle */
-		if (elapsed(now, ses.last_packet_time_any_sent) >= opts.keepalive_secs) {
-			send_msg_keepalive();
-		}
+	now = monotonic_now();
 
-		/* Also send an explicit keepalive message to trigger a response
-		if the remote end hasn't sent us anything */
-		if (elapsed(now, ses.last_packet_time_keepalive_recv) >= opts.keepalive_secs
-			&& elapsed(now, ses.last_packet_time_keepalive_sent) >= opts.keepalive_secs) {
-			send_msg_keepalive();
-		}
+	/* Avoid sending keepalives prior to auth - those are
+	not valid pre-auth packet types */
+	if (!ses.authstate.authdone) {
+		timer_at(&ses.keepalive_timer, now + secs);
+		return;
+	}
 
-		if (elapsed(now, ses.last_packet_time_keepalive_recv)
-			>= opts.keepalive_secs * DEFAULT_KEEPALIVE_LIMIT) {
-			dropbear_exit("Keepalive timeout");
-		}
+	/* Send keepalives if we've been idle */
+	if (elapsed(now, ses.last_packet_time_any_sent) >= secs) {
+		send_msg_keepalive();
 	}
 
-	if (opts.idle_timeout_secs > 0
-			&& elapsed(now, ses.last_packet_time_idle) >= opts.idle_timeout_secs) {
-		dropbear_close("Idle timeout");
+	/* Also send an explicit keepalive message to trigger a response
+	if the remote end hasn't sent us anything */
+	if (elapsed(now, ses.last_packet_time_keepalive_recv) >= secs
+		&& elapsed(now, ses.last_packet_time_keepalive_sent) >= secs) {
+		send_msg_keepalive();
 	}
 
-	if (opts.max_duration_secs > 0
-			&& elapsed(now, ses.connect_time) >= opts.max_duration_secs) {
-		dropbear_close("Max duration reached");
+	if (elapsed(now, ses.last_packet_time_keepalive_recv)
+		>= secs * DEFAULT_KEEPALIVE_LIMIT) {
+		dropbear_exit("Keepalive timeout");
 	}
+
+	/* whichever of those is due first */
+	next = MIN(ses.last_packet_time_any_sent,
+		MAX(ses.last_packet_time_keepalive_recv, ses.last_packet_time_keepalive_sent))
+		+ secs;
+	next = MIN(next, ses.last_packet_time_keepalive_recv + secs * DEFAULT_KEEPALIVE_LIMIT);
+	timer_at(&ses.keepalive_timer, MAX(next, now + 1));
 }
 
-static void update_timeout(long limit, time_t now, time_t last_event, long * timeout) {
-	TRACE2(("update_timeout limit %ld, now %llu, last %llu, timeout %ld",
-		limit,
-		(unsigned long long)now,
-		(unsigned long long)last_event, *timeout))
-	if (last_event > 0 && limit > 0) {
-		*timeout = MIN(*timeout, MAX(0, limit - elapsed(now, last_event)));
-		TRACE2(("new timeout %ld", *timeout))
+static void timeout_idle(void *UNUSED(arg)) {
+	if (elapsed(monotonic_now(), ses.last_packet_time_idle) >= opts.idle_timeout_secs) {
+		dropbear_close("Idle timeout");
 	}
+	timer_at(&ses.idle_timer, ses.last_packet_time_idle + opts.idle_timeout_secs);
 }
 
-static long select_timeout() {
-	/* determine the minimum timeout that might be required, so
-	as to avoid waking when unneccessary */
-	long timeout = KEX_REKEY_TIMEOUT;
-	time_t now = monotonic_now();
+static void timeout_max_duration(void *UNUSED(arg)) {
+	dropbear_close("Max duration reached");
+}
 
-	if (!ses.kexstate.sentkexinit) {
-		update_timeout(KEX_REKEY_TIMEOUT, now, ses.kexstate.lastkextime, &timeout);
+#if DROPBEAR_IDLE_RECLAIM
+static void timeout_reclaim(void *UNUSED(arg)) {
+	if (elapsed(monotonic_now(), ses.last_packet_time_idle) >= DROPBEAR_IDLE_RECLAIM) {
+		/* writepayload can only be freed before select() */
+		ses.idle_reclaim_due = 1;
+	} else {
+		timer_at(&ses.reclaim_timer,
+			ses.last_packet_time_idle + DROPBEAR_IDLE_RECLAIM);
 	}
-	if (ses.kexstate.needrekey) {
-		timeout = 0;
+}
+#endif
+
+/* Sets up timers for the time for user authentication, automatic
+ * rekeying, keepalives and so on. Each one is checked when it fires
+ * and set again if the time it watches has moved on. */
+static void settimeouts() {
+	timer_init(&ses.auth_timer, timeout_auth, NULL);
+	timer_at(&ses.auth_timer, ses.connect_time + AUTH_TIMEOUT);
+
+	/* set by kexinitialise() */
+	timer_init(&ses.rekey_timer, timeout_rekey, NULL);
+
+	timer_init(&ses.keepalive_timer, timeout_keepalive, NULL);
+	if (opts.keepalive_secs > 0) {
+		timer_at(&ses.keepalive_timer, ses.connect_time + opts.keepalive_secs);
 	}
 
-	if (ses.authstate.authdone != 1 && IS_DROPBEAR_SERVER) {
-		/* AUTH_TIMEOUT is only relevant before authdone */
-		update_timeout(AUTH_TIMEOUT, now, ses.connect_time, &timeout);
+	timer_init(&ses.idle_timer, timeout_idle, NULL);
+	if (opts.idle_timeout_secs > 0) {
+		timer_at(&ses.idle_timer,
+			ses.last_packet_time_idle + opts.idle_timeout_secs);
 	}
 
-	if (ses.authstate.authdone) {
-		update_timeout(opts.keepalive_secs, now,
-			MAX(ses.last_packet_time_keepalive_recv, ses.last_packet_time_keepalive_sent),
-			&timeout);
+	timer_init(&ses.max_duration_timer, timeout_max_duration, NULL);
+	if (opts.max_duration_secs > 0) {
+		timer_at(&ses.max_duration_timer,
+			ses.connect_time + opts.max_duration_secs);
 	}
 
-	update_timeout(opts.idle_timeout_secs, now, ses.last_packet_time_idle,
-		&timeout);
+#if DROPBEAR_IDLE_RECLAIM
+	/* set in session_loop() */
+	timer_init(&ses.reclaim_timer, timeout_reclaim, NULL);
+#endif
+}
 
-	update_timeout(opts.max_duration_secs, now, ses.connect_time,
-		&timeout);
+/* Rekeying after a data limit or on request, checked each time around
+ * the loop since these aren't timed */
+static void checkrekey() {
+	if (ses.remoteident != NULL
+			&& !ses.kexstate.sentkexinit
+			&& (ses.kexstate.datarecv+ses.kexstate.datatrans >= KEX_REKEY_DATA
+			|| ses.kexstate.needrekey)) {
+		TRACE(("rekeying after max data reached"))
+		ses.kexstate.needrekey = 0;
+		send_msg_kexinit();
+	}
+}
 
-	/* clamp negative timeouts to zero - event has already triggered */
-	return MAX(timeout, 0);
+#if DROPBEAR_IDLE_RECLAIM
+/* Called before select() once the session has been idle for
+ * DROPBEAR_IDLE_RECLAIM. Only buffers that hold no data are freed.
+ * Compression state can't be reset since the peer's zlib stream depends
+ * on it. */
+static void reclaim_idle() {
+	TRACE(("reclaim_idle: rss before %ld kB", get_rss_kb()))
+	ses.idle_reclaim_time = ses.last_packet_time_idle;
+	ses.idle_reclaim_due = 0;
+
+	/* Allocated again once select() returns */
+	if (ses.writepayload->len == 0) {
+		cleanup_buf(&ses.writepayload);
+	}
+	cleanup_buf(&ses.decompress_buf);
+	channel_reclaim_idle();
+#ifdef HAVE_MALLOC_TRIM
+	malloc_trim(0);
+#endif
+	SES_STAT_ADD(idle_reclaims, 1);
+	TRACE(("reclaim_idle: rss after %ld kB", get_rss_kb()))
 }
+#endif
 
 const char* get_user_shell() {
 	/* an empty shell should be interpreted as "/bin/sh" */
@@ -699,7 +846,7 @@ void fill_passwd(const char* username) {
 /* Called when channels are modified */
 void update_channel_prio() {
 	enum dropbear_prio new_prio;
-	int any = 0;
+	int any = 0, lowdelay_chan;
 	unsigned int i;
 
 	TRACE(("update_channel_prio"))
@@ -733,5 +880,57 @@ void update_channel_prio() {
 		set_sock_priority(ses.sock_out, new_prio);
 		ses.socket_prio = new_prio;
 	}
+
+	lowdelay_chan = any && new_prio == DROPBEAR_PRIO_LOWDELAY;
+	if (lowdelay_chan != ses.lowdelay_chan) {
+		set_sock_notsent_lowat(ses.sock_out, lowdelay_chan);
+		ses.lowdelay_chan = lowdelay_chan;
+	}
+}
+
+#if DROPBEAR_SESSION_STATS
+/* Nanosecond timestamp for timing counters */
+unsigned long long session_stat_clock(void) {
+	struct timespec ts;
+	gettime_wrapper(&ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Logs the session's counters as a single line of key=value pairs */
+void session_log_stats(const char *reason) {
+	const struct session_stats *st = &ses.stats;
+
+	dropbear_log(LOG_INFO, "Session stats (%s): duration=%lld "
+		"packets_in=%llu packets_out=%llu bytes_in=%llu bytes_out=%llu "
+		"reads=%llu writes=%llu wakeups=%llu "
+		"encrypt_us=%llu decrypt_us=%llu mac_us=%llu rekeys=%u "
+		"writequeue_max=%u lowdelay_queue_max=%u "
+		"chan_bytes_in=%llu chan_bytes_out=%llu "
+		"chan_window_stalls=%u resolve_cache_hits=%u resolve_cache_misses=%u "
+		"idle_reclaims=%u rss_kb=%ld",
+		reason, (long long)(monotonic_now() - st->start_time),
+		st->packets_in, st->packets_out, st->bytes_in, st->bytes_out,
+		st->reads, st->writes, st->wakeups,
+		st->encrypt_ns / 1000, st->decrypt_ns / 1000, st->mac_ns / 1000,
+		st->rekeys, st->writequeue_max, st->lowdelay_queue_max,
+		st->chan_bytes_in,
+		st->chan_bytes_out, st->chan_window_stalls,
+		st->resolve_cache_hits, st->resolve_cache_misses,
+		st->idle_reclaims, get_rss_kb());
 }
 
+static void sigusr1_stats_handler(int UNUSED(dummy)) {
+	const int saved_errno = errno;
+
+	ses.stats_requested = 1;
+	/* Wake up the main select() loop, as for SIGCHLD */
+	while (1) {
+		if (write(ses.signal_pipe[1], &ses.isserver, 1) == 1
+				|| errno != EINTR) {
+			break;
+		}
+	}
+
+	errno = saved_errno;
+}
+#endif
@@ -51,6 +51,11 @@ static int runprog(const char *multipath,
 			return dropbearconvert_main(argc, argv);
 		}
 #endif
+#ifdef DBMULTI_dropbearbench
+		if (strcmp(progname, "dropbearbench") == 0) {
+			return dropbearbench_main(argc, argv);
+		}
+#endif
 #ifdef DBMULTI_scp
 		if (strcmp(progname, "scp") == 0) {
 			return scp_main(argc, argv);
@@ -94,6 +99,9 @@ int main(int argc, char ** argv) {
 #ifdef DBMULTI_dropbearconvert
 			"'dropbearconvert' - the key converter\n"
 #endif
+#ifdef DBMULTI_dropbearbench
+			"'dropbearbench' - crypto benchmarks\n"
+#endif
 #ifdef DBMULTI_scp
 			"'scp' - secure copy\n"
 #endif
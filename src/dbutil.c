@@ -266,6 +266,67 @@ int connect_unix(const char* path) {
 }
 #endif
 
+/* Pipes for the stdin, stdout and stderr of a command to spawn.
+ * errfds may be NULL to leave stderr alone */
+static int spawn_pipes(int infds[2], int outfds[2], int *errfds) {
+	if (pipe(infds) != 0) {
+		return DROPBEAR_FAILURE;
+	}
+	if (pipe(outfds) != 0) {
+		return DROPBEAR_FAILURE;
+	}
+	if (errfds && pipe(errfds) != 0) {
+		return DROPBEAR_FAILURE;
+	}
+	return DROPBEAR_SUCCESS;
+}
+
+/* Moves spawn_pipes() to stdin/stdout/stderr in the child. Only makes
+ * system calls, so is safe after vfork() */
+static int spawn_redirect(int infds[2], int outfds[2], int *errfds) {
+	const int FDIN = 0;
+	const int FDOUT = 1;
+
+	if ((dup2(infds[FDIN], STDIN_FILENO) < 0) ||
+		(dup2(outfds[FDOUT], STDOUT_FILENO) < 0) ||
+		(errfds && dup2(errfds[FDOUT], STDERR_FILENO) < 0)) {
+		return DROPBEAR_FAILURE;
+	}
+
+	close(infds[FDOUT]);
+	close(infds[FDIN]);
+	close(outfds[FDIN]);
+	close(outfds[FDOUT]);
+	if (errfds)
+	{
+		close(errfds[FDIN]);
+		close(errfds[FDOUT]);
+	}
+	return DROPBEAR_SUCCESS;
+}
+
+/* Keeps the parent's ends of spawn_pipes() */
+static void spawn_parent_fds(int infds[2], int outfds[2], int *errfds,
+		int *ret_writefd, int *ret_readfd, int *ret_errfd) {
+	const int FDIN = 0;
+	const int FDOUT = 1;
+
+	close(infds[FDIN]);
+	close(outfds[FDOUT]);
+
+	setnonblocking(outfds[FDIN]);
+	setnonblocking(infds[FDOUT]);
+
+	if (errfds) {
+		close(errfds[FDOUT]);
+		setnonblocking(errfds[FDIN]);
+		*ret_errfd = errfds[FDIN];
+	}
+
+	*ret_writefd = infds[FDOUT];
+	*ret_readfd = outfds[FDIN];
+}
+
 /* Sets up a pipe for a, returning three non-blocking file descriptors
  * and the pid. exec_fn is the function that will actually execute the child process,
  * it will be run after the child has fork()ed, and is passed exec_data.
@@ -278,23 +339,13 @@ int spawn_command(void(*exec_fn)(const void *user_data), const void *exec_data,
 	int errfds[2];
 	pid_t pid;
 
-	const int FDIN = 0;
-	const int FDOUT = 1;
-
 #if DROPBEAR_FUZZ
 	if (fuzz.fuzzing) {
 		return fuzz_spawn_command(ret_writefd, ret_readfd, ret_errfd, ret_pid);
 	}
 #endif
 
-	/* redirect stdin/stdout/stderr */
-	if (pipe(infds) != 0) {
-		return DROPBEAR_FAILURE;
-	}
-	if (pipe(outfds) != 0) {
-		return DROPBEAR_FAILURE;
-	}
-	if (ret_errfd && pipe(errfds) != 0) {
+	if (spawn_pipes(infds, outfds, ret_errfd ? errfds : NULL) == DROPBEAR_FAILURE) {
 		return DROPBEAR_FAILURE;
 	}
 
@@ -317,59 +368,126 @@ int spawn_command(void(*exec_fn)(const void *user_data), const void *exec_data,
 			dropbear_exit("signal() error");
 		}
 
-		/* redirect stdin/stdout */
-
-		if ((dup2(infds[FDIN], STDIN_FILENO) < 0) ||
-			(dup2(outfds[FDOUT], STDOUT_FILENO) < 0) ||
-			(ret_errfd && dup2(errfds[FDOUT], STDERR_FILENO) < 0)) {
+		if (spawn_redirect(infds, outfds, ret_errfd ? errfds : NULL)
+				== DROPBEAR_FAILURE) {
 			TRACE(("leave noptycommand: error redirecting FDs"))
 			dropbear_exit("Child dup2() failure");
 		}
 
-		close(infds[FDOUT]);
-		close(infds[FDIN]);
-		close(outfds[FDIN]);
-		close(outfds[FDOUT]);
-		if (ret_errfd)
-		{
-			close(errfds[FDIN]);
-			close(errfds[FDOUT]);
-		}
-
 		exec_fn(exec_data);
 		/* not reached */
 		return DROPBEAR_FAILURE;
 	} else {
 		/* parent */
-		close(infds[FDIN]);
-		close(outfds[FDOUT]);
+		spawn_parent_fds(infds, outfds, ret_errfd ? errfds : NULL,
+			ret_writefd, ret_readfd, ret_errfd);
+		if (ret_pid) {
+			*ret_pid = pid;
+		}
+		return DROPBEAR_SUCCESS;
+	}
+}
 
-		setnonblocking(outfds[FDIN]);
-		setnonblocking(infds[FDOUT]);
+#if DROPBEAR_SVR_SPAWN_VFORK
+/* Runs in the child after vfork(). Memory is shared with the parent so
+ * this only makes system calls. Does not return */
+static void exec_vforked(struct spawn_exec *exec, const sigset_t *oldmask) {
+	struct sigaction sa;
+	unsigned int i;
+	int sig;
 
-		if (ret_errfd) {
-			close(errfds[FDOUT]);
-			setnonblocking(errfds[FDIN]);
+	/* Handlers would run on the parent's memory, exec would reset them
+	 * anyway. SIGPIPE is re-enabled as run_command() does */
+	for (sig = 1; sig < NSIG; sig++) {
+		if (sigaction(sig, NULL, &sa) < 0 || sa.sa_handler == SIG_DFL) {
+			continue;
+		}
+		if (sa.sa_handler != SIG_IGN || sig == SIGPIPE || sig == SIGCHLD) {
+			signal(sig, SIG_DFL);
 		}
+	}
+	sigprocmask(SIG_SETMASK, oldmask, NULL);
 
-		if (ret_pid) {
-			*ret_pid = pid;
+	if (chdir(exec->dir) < 0 && chdir("/") < 0) {
+		_exit(1);
+	}
+	if (exec->message) {
+		if (write(STDERR_FILENO, exec->message, strlen(exec->message)) < 0) {
+			/* nothing to do */
 		}
+	}
 
-		*ret_writefd = infds[FDOUT];
-		*ret_readfd = outfds[FDIN];
-		if (ret_errfd) {
-			*ret_errfd = errfds[FDIN];
+	/* Need to be sure FDs are closed here to avoid reading files as root */
+	for (i = 3; i <= exec->maxfd; i++) {
+		close(i);
+	}
+
+	execve(exec->path, exec->argv, exec->envp);
+	exec->exec_errno = errno;
+	_exit(1);
+}
+
+/* As spawn_command(), but the child is started with vfork() so that this
+ * process's memory isn't copied. exec describes the command, it is
+ * prepared beforehand since the child can't allocate or log */
+int spawn_exec_vfork(struct spawn_exec *exec,
+		int *ret_writefd, int *ret_readfd, int *ret_errfd, pid_t *ret_pid) {
+	int infds[2];
+	int outfds[2];
+	int errfds[2];
+	sigset_t allmask, oldmask;
+	pid_t pid;
+
+	if (spawn_pipes(infds, outfds, ret_errfd ? errfds : NULL) == DROPBEAR_FAILURE) {
+		return DROPBEAR_FAILURE;
+	}
+
+	exec->exec_errno = 0;
+	/* Signal handlers mustn't run in the child */
+	sigfillset(&allmask);
+	sigprocmask(SIG_BLOCK, &allmask, &oldmask);
+	pid = vfork();
+	if (pid == 0) {
+		if (spawn_redirect(infds, outfds, ret_errfd ? errfds : NULL)
+				== DROPBEAR_FAILURE) {
+			_exit(1);
 		}
-		return DROPBEAR_SUCCESS;
+		exec_vforked(exec, &oldmask);
+	}
+	sigprocmask(SIG_SETMASK, &oldmask, NULL);
+
+	if (pid < 0) {
+		return DROPBEAR_FAILURE;
+	}
+
+	/* The child has exec()ed or exited by now */
+	if (exec->exec_errno) {
+		dropbear_log(LOG_INFO, "Couldn't execute %s: %s", exec->path,
+			strerror(exec->exec_errno));
 	}
+
+	spawn_parent_fds(infds, outfds, ret_errfd ? errfds : NULL,
+		ret_writefd, ret_readfd, ret_errfd);
+	if (ret_pid) {
+		*ret_pid = pid;
+	}
+	return DROPBEAR_SUCCESS;
 }
+#endif /* DROPBEAR_SVR_SPAWN_VFORK */
 
 /* Runs a command with "sh -c". Will close FDs (except stdin/stdout/stderr) and
  * re-enabled SIGPIPE. If cmd is NULL, will run a login shell.
  */
 void run_shell_command(const char* cmd, unsigned int maxfd, char* usershell) {
 	char * argv[4];
+
+	shell_command_argv(argv, cmd, usershell);
+	run_command(usershell, argv, maxfd);
+}
+
+/* Fills argv[4] to run cmd with usershell, or a login shell if cmd is NULL.
+ * argv[0] is allocated for a login shell, usershell may be modified */
+void shell_command_argv(char **argv, const char* cmd, char* usershell) {
 	char * baseshell = NULL;
 
 	baseshell = basename(usershell);
@@ -391,8 +509,6 @@ void run_shell_command(const char* cmd, unsigned int maxfd, char* usershell) {
 		/* construct a shell of the form "-bash" etc */
 		argv[1] = NULL;
 	}
-
-	run_command(usershell, argv, maxfd);
 }
 
 void run_command(const char* argv0, char** args, unsigned int maxfd) {
@@ -657,6 +773,78 @@ void setnonblocking(int fd) {
 	TRACE(("leave setnonblocking"))
 }
 
+/* Sends fd with a single byte over the unix socket sock. Returns
+ * DROPBEAR_FAILURE with errno set if it wasn't sent */
+int send_fd(int sock, int fd) {
+	struct msghdr msg;
+	struct iovec iov;
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} cmsgbuf;
+	struct cmsghdr *cmsg = NULL;
+	char c = 0;
+	ssize_t len;
+
+	memset(&msg, 0x0, sizeof(msg));
+	memset(&cmsgbuf, 0x0, sizeof(cmsgbuf));
+	iov.iov_base = &c;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cmsgbuf.buf;
+	msg.msg_controllen = sizeof(cmsgbuf.buf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+	do {
+		len = sendmsg(sock, &msg, 0);
+	} while (len < 0 && errno == EINTR);
+
+	return len == 1 ? DROPBEAR_SUCCESS : DROPBEAR_FAILURE;
+}
+
+/* Receives a fd sent with send_fd(). Returns -1 once sock has closed or
+ * failed, or -2 if a byte was sent without a fd */
+int recv_fd(int sock) {
+	struct msghdr msg;
+	struct iovec iov;
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} cmsgbuf;
+	struct cmsghdr *cmsg = NULL;
+	char c;
+	ssize_t len;
+	int fd = -2;
+
+	memset(&msg, 0x0, sizeof(msg));
+	memset(&cmsgbuf, 0x0, sizeof(cmsgbuf));
+	iov.iov_base = &c;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cmsgbuf.buf;
+	msg.msg_controllen = sizeof(cmsgbuf.buf);
+
+	do {
+		len = recvmsg(sock, &msg, 0);
+	} while (len < 0 && errno == EINTR);
+	if (len <= 0) {
+		return -1;
+	}
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS
+			&& cmsg->cmsg_len == CMSG_LEN(sizeof(int))) {
+		memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+	}
+	return fd;
+}
+
 void disallow_core() {
 	struct rlimit lim = {0};
 	if (getrlimit(RLIMIT_CORE, &lim) < 0) {
@@ -732,6 +920,36 @@ int constant_time_memcmp(const void* a, const void *b, size_t n)
 	return c;
 }
 
+uint32_t fnv1a_hash(const void *data, size_t len) {
+	const unsigned char *p = data;
+	uint32_t h = 2166136261u;
+	size_t i;
+	for (i = 0; i < len; i++) {
+		h ^= p[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+long get_rss_kb() {
+	long rss = -1;
+#ifdef __linux__
+	/* second field is resident pages */
+	FILE *f = fopen("/proc/self/statm", "r");
+	if (f) {
+		long size;
+		if (fscanf(f, "%ld %ld", &size, &rss) != 2) {
+			rss = -1;
+		}
+		fclose(f);
+	}
+	if (rss >= 0) {
+		rss = rss * (sysconf(_SC_PAGESIZE) / 1024);
+	}
+#endif
+	return rss;
+}
+
 /* higher-resolution monotonic timestamp, falls back to gettimeofday */
 void gettime_wrapper(struct timespec *now) {
 	struct timeval tv;
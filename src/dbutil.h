@@ -62,7 +62,22 @@ char * stripcontrol(const char * text);
 
 int spawn_command(void(*exec_fn)(const void *user_data), const void *exec_data,
 		int *writefd, int *readfd, int *errfd, pid_t *pid);
+#if DROPBEAR_SVR_SPAWN_VFORK
+/* A command for spawn_exec_vfork() */
+struct spawn_exec {
+	const char *path;
+	char **argv;
+	char **envp;
+	const char *dir; /* working directory, "/" if it fails */
+	const char *message; /* written to the child's stderr first, may be NULL */
+	unsigned int maxfd; /* fds above stderr are closed, up to this */
+	int exec_errno; /* set by the child if execve() fails */
+};
+int spawn_exec_vfork(struct spawn_exec *exec,
+		int *writefd, int *readfd, int *errfd, pid_t *pid);
+#endif
 void run_shell_command(const char* cmd, unsigned int maxfd, char* usershell);
+void shell_command_argv(char **argv, const char* cmd, char* usershell);
 void run_command(const char* argv0, char** args, unsigned int maxfd);
 #if ENABLE_CONNECT_UNIX
 int connect_unix(const char* addr);
@@ -73,6 +88,8 @@ int buf_writefile(buffer * buf, const char * filename, int skip_exist);
 
 void m_close(int fd);
 void setnonblocking(int fd);
+int send_fd(int sock, int fd);
+int recv_fd(int sock);
 void disallow_core(void);
 int m_str_to_uint(const char* str, unsigned int *val);
 /* The same as snprintf() but exits rather than returning negative */
@@ -88,6 +105,12 @@ void cleantext(char* dirtytext, int allow_whitespace);
 /* Returns 0 if a and b have the same contents */
 int constant_time_memcmp(const void* a, const void *b, size_t n);
 
+/* FNV-1a, for hash tables. Not cryptographic */
+uint32_t fnv1a_hash(const void *data, size_t len);
+
+/* Resident memory of this process in kB, or -1 if unknown */
+long get_rss_kb(void);
+
 /* Returns a time in seconds that doesn't go backwards - does not correspond to
 a real-world clock */
 time_t monotonic_now(void);
@@ -114,6 +137,7 @@ int dropbear_main(int argc, char ** argv, const char * multipath);
 int cli_main(int argc, char ** argv);
 int dropbearkey_main(int argc, char ** argv);
 int dropbearconvert_main(int argc, char ** argv);
+int dropbearbench_main(int argc, char ** argv);
 int scp_main(int argc, char ** argv);
 
 #define ARRAY_SIZE(x) (sizeof(x)/sizeof(x[0]))
@@ -76,6 +76,19 @@ IMPORTANT: Some options will require "make clean" after changes */
 #define DROPBEAR_SVR_LOCALSTREAMFWD 1
 #define DROPBEAR_SVR_REMOTESTREAMFWD 1
 
+/* Buffer data for the server's outbound TCP and unix socket forwards in
+ * a pipe rather than a circular buffer, and move it to the socket with
+ * splice(). This saves a copy when the socket can't keep up.
+ * Only used where splice() is available (Linux). Each forwarded
+ * connection uses two more file descriptors. */
+#define DROPBEAR_SVR_SPLICE_FWD 1
+
+/* Seconds to remember hostname lookups for outbound connections within a
+ * session, so that many forwarded connections to the same host don't
+ * each wait for DNS. 0 disables the cache. Changed DNS records won't be
+ * seen by the session until the entry expires. */
+#define DROPBEAR_RESOLVE_CACHE_TIME 60
+
 /* Enable Authentication Agent Forwarding */
 #define DROPBEAR_SVR_AGENTFWD 1
 #define DROPBEAR_CLI_AGENTFWD 1
@@ -166,6 +179,10 @@ IMPORTANT: Some options will require "make clean" after changes */
 
 /* RSA must be >=1024 */
 #define DROPBEAR_DEFAULT_RSA_SIZE 2048
+/* Search for the two primes of a new RSA key at the same time, one of
+ * them in a forked process. Roughly halves generation time on a machine
+ * with more than one core. */
+#define DROPBEAR_RSA_PARALLEL_KEYGEN 1
 /* DSS is always 1024 */
 /* ECDSA defaults to largest size configured, usually 521 */
 /* Ed25519 is always 256 */
@@ -230,6 +247,11 @@ group1 in Dropbear server too */
  * interoperability) */
 #define DROPBEAR_ZLIB_WINDOW_BITS 15
 
+/* With compression enabled, send stored (uncompressed) zlib blocks for a
+ * while when outgoing data isn't compressing, such as archives or media
+ * files. This saves CPU time, the stream is still valid zlib */
+#define DROPBEAR_ZLIB_ADAPTIVE 1
+
 /* Whether to do reverse DNS lookups. */
 #define DO_HOST_LOOKUP 0
 
@@ -250,6 +272,11 @@ group1 in Dropbear server too */
  * You can't enable both PASSWORD and PAM. */
 #define DROPBEAR_SVR_PAM_AUTH 0
 
+/* Run the PAM transaction in a helper process, so the session keeps
+ * handling its connection (keepalives, timeouts) while a slow PAM stack
+ * such as RADIUS or LDAP works. */
+#define DROPBEAR_SVR_PAM_ASYNC 1
+
 /* ~/.ssh/authorized_keys authentication.
  * You must define DROPBEAR_SVR_PUBKEY_AUTH in order to use plugins. */
 #define DROPBEAR_SVR_PUBKEY_AUTH 1
@@ -272,6 +299,20 @@ group1 in Dropbear server too */
  */
 #define DROPBEAR_DEFAULT_CLI_AUTHKEY "~/.ssh/id_dropbear"
 
+/* dbclient keeps a sorted index "known_hosts.dbidx" next to known_hosts
+ * files of at least this many bytes, so that a connection doesn't need
+ * to read the whole file. 0 disables the index. */
+#define DROPBEAR_CLI_KNOWNHOSTS_INDEX_SIZE 65536
+
+/* Recognise OpenSSH hashed hostnames "|1|salt|hash" in known_hosts, as
+ * written with HashKnownHosts. These use HMAC-SHA1 */
+#define DROPBEAR_CLI_HASHED_KNOWNHOSTS 1
+
+/* Allow dbclient -o ControlMaster/ControlPath to share one connection
+ * between several invocations for the same host, passing the command and
+ * stdio over a unix socket. Commands with a pty use their own connection */
+#define DROPBEAR_CLI_MULTIPLEX 1
+
 /* Per client configuration file
 */
 #define DROPBEAR_USE_SSH_CONFIG 0
@@ -305,6 +346,22 @@ group1 in Dropbear server too */
  * come from many IPs */
 #define MAX_UNAUTH_CLIENTS 30
 
+/* Rate limit for new connections from each source /24 (IPv4) or /64 (IPv6),
+ * in connections per minute with bursts of up to MAX_UNAUTH_BURST_PER_IP.
+ * Each failed authentication attempt costs more than the previous one, so
+ * brute force clients are shut out for longer. Connections over the limit
+ * are closed before the server forks. 0 disables it, -x server option
+ * overrides */
+#define MAX_UNAUTH_RATE_PER_IP 0
+#define MAX_UNAUTH_BURST_PER_IP 20
+
+/* Global limit on new connections per second, which bounds the CPU spent
+ * on key exchange before authentication. Only sources that have recently
+ * authenticated can use the bottom half of this budget, so an attacker can't
+ * shut them out, though new clients can still be refused. 0 disables it,
+ * -x server option overrides */
+#define MAX_UNAUTH_RATE 0
+
 /* Default maximum number of failed authentication tries (server option) */
 /* -T server option overrides */
 #define MAX_AUTH_TRIES 10
@@ -333,6 +390,36 @@ group1 in Dropbear server too */
 #define DROPBEAR_SVR_DROP_PRIVS DROPBEAR_SVR_MULTIUSER
 #endif
 
+/* Start non-interactive commands ("ssh host command") with vfork() rather
+ * than fork(), so the session's memory isn't copied for every command.
+ * Requires DROPBEAR_SVR_DROP_PRIVS, since the child runs as the session's
+ * user. Sessions with a pty or X11 forwarding still use fork(). */
+#define DROPBEAR_SVR_VFORK_EXEC 1
+
+/* Write utmp/wtmp/lastlog login records from a helper process, so that
+ * logins and logouts don't wait for the writes (slow on NFS or a busy
+ * /var). Records are still written in order. Only used when running as
+ * a daemon, not with -i. */
+#define DROPBEAR_SVR_LOGINQUEUE 1
+
+/* Cache user lookups (passwd, shadow and -G group membership) in a helper
+ * process forked by the daemon, so repeat logins don't wait for a slow
+ * name service such as LDAP. Entries are kept for
+ * DROPBEAR_SVR_PWCACHE_TTL seconds. Changes to /etc/passwd, /etc/shadow
+ * or /etc/group clear the cache, as does sending the daemon SIGUSR1.
+ * Note that a change in a remote directory, such as a disabled account,
+ * isn't seen until the entry expires. Only used when running as a daemon,
+ * not with -i. */
+#define DROPBEAR_SVR_PWCACHE 1
+#define DROPBEAR_SVR_PWCACHE_TTL 60
+
+/* Pass the host keys, banner and -G group that the daemon loaded at
+ * startup to each re-executed session, so it doesn't read and parse the
+ * files again before its first packet. Sessions use the keys the daemon
+ * started with, as they would without re-exec. Needs memfd_create()
+ * (Linux). */
+#define DROPBEAR_SVR_SNAPSHOT 1
+
 /* Delay introduced before closing an unauthenticated session (seconds).
    Disabled by default, can be set to say 30 seconds to reduce the speed
    of password brute forcing. Note that there is a risk of denial of
@@ -358,6 +445,12 @@ group1 in Dropbear server too */
 #define DROPBEAR_SFTPSERVER 1
 #define SFTPSERVER_PATH "/usr/libexec/sftp-server"
 
+/* Serve the sftp subsystem with Dropbear's own SFTP version 3 server,
+ * which runs within the session process rather than as SFTPSERVER_PATH.
+ * File data is read straight into the outgoing packets.
+ * A forced command of "internal-sftp" also uses it. */
+#define DROPBEAR_SFTPSERVER_BUILTIN 0
+
 /* This is used by the scp binary when used as a client binary. If you're
  * not using the Dropbear client, you'll need to change it */
 #define DROPBEAR_PATH_SSH_PROGRAM "/usr/bin/dbclient"
@@ -367,6 +460,18 @@ group1 in Dropbear server too */
  * shell/sftp session etc. */
 #define LOG_COMMANDS 0
 
+/* Whether to keep per-session counters of packets, bytes, syscalls and
+ * time spent in crypto. They are logged when a session closes, or when
+ * a session process receives SIGUSR1. This can show whether a slow
+ * session is limited by the network or by the CPU. */
+#define DROPBEAR_SESSION_STATS 0
+
+/* Seconds without traffic after which a session frees its empty channel
+ * buffers and packet buffer and returns free memory to the system, which
+ * reduces the memory used by many idle sessions. They are allocated again
+ * when traffic resumes. 0 disables. */
+#define DROPBEAR_IDLE_RECLAIM 60
+
 /* Window size limits. These tend to be a trade-off between memory
    usage and network performance: */
 /* Size of the network receive window. This amount of memory is allocated
@@ -0,0 +1,642 @@
+/*
+ * Dropbear - a SSH2 server
+ * 
+ * Copyright (c) 2026 Matt Johnston
+ * All rights reserved.
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE. */
+
+#include "includes.h"
+#include "dbutil.h"
+#include "algo.h"
+#include "buffer.h"
+#include "session.h"
+#include "kex.h"
+#include "bignum.h"
+#include "signkey.h"
+#include "genrsa.h"
+#include "gendss.h"
+#include "gened25519.h"
+#include "ecdsa.h"
+#include "ecc.h"
+#include "gensignkey.h"
+#include "crypto_desc.h"
+#include "dbrandom.h"
+#include "packet.h"
+
+/* Microbenchmarks for Dropbear's own crypto paths: the cipher modes and
+ * MACs used for packets, key exchange, and host key signatures.
+ * Each result is printed as a JSON object on its own line so that runs
+ * from different builds can be compared by scripts. */
+
+#define BENCH_DEFAULT_MSEC 500
+/* Size of the data for each cipher/MAC operation, a typical full packet */
+#define BENCH_PACKET_LEN 32768
+
+static unsigned long bench_msec = BENCH_DEFAULT_MSEC;
+static const char *bench_filter = NULL;
+
+/* time spent in setup steps, subtracted from the measurement */
+static uint64_t excluded_ns, excluded_cycles;
+static uint64_t exclude_start_ns, exclude_start_cycles;
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) {
+		dropbear_exit("clock_gettime failed");
+	}
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Returns 0 when there is no cycle counter */
+static uint64_t now_cycles(void) {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	return __builtin_ia32_rdtsc();
+#else
+	return 0;
+#endif
+}
+
+static void exclude_begin(void) {
+	exclude_start_ns = now_ns();
+	exclude_start_cycles = now_cycles();
+}
+
+static void exclude_end(void) {
+	excluded_ns += now_ns() - exclude_start_ns;
+	excluded_cycles += now_cycles() - exclude_start_cycles;
+}
+
+/* Whether the benchmarks for name in group are to be run */
+static int bench_selected(const char *group, const char *name) {
+	return bench_filter == NULL || strstr(name, bench_filter) != NULL
+		|| strstr(group, bench_filter) != NULL;
+}
+
+/* Runs op(arg) repeatedly for bench_msec and prints the result.
+ * bytes is the amount of data processed per op, or 0 */
+static void run_bench(const char *group, const char *name, const char *op,
+		unsigned int bytes, void (*fn)(void*), void *arg) {
+	unsigned long iters = 0;
+	uint64_t start_ns, start_cycles, total_ns, total_cycles;
+	double ns_per_op;
+
+	if (!bench_selected(group, name)) {
+		return;
+	}
+
+	/* warm up */
+	fn(arg);
+
+	excluded_ns = excluded_cycles = 0;
+	start_ns = now_ns();
+	start_cycles = now_cycles();
+	do {
+		fn(arg);
+		iters++;
+		total_ns = now_ns() - start_ns;
+	} while (total_ns < bench_msec * 1000000);
+	total_cycles = now_cycles() - start_cycles;
+
+	total_ns -= MIN(excluded_ns, total_ns);
+	total_cycles -= MIN(excluded_cycles, total_cycles);
+	ns_per_op = (double)total_ns / iters;
+
+	printf("{\"group\": \"%s\", \"name\": \"%s\", \"op\": \"%s\", "
+			"\"iterations\": %lu, \"ns_per_op\": %.1f",
+			group, name, op, iters, ns_per_op);
+	if (bytes > 0) {
+		printf(", \"bytes_per_op\": %u, \"mb_per_s\": %.2f",
+				bytes, bytes * 1000.0 / ns_per_op);
+		if (total_cycles > 0) {
+			printf(", \"cycles_per_byte\": %.2f",
+					(double)total_cycles / iters / bytes);
+		}
+	}
+	printf("}\n");
+	fflush(stdout);
+}
+
+/* Packet ciphers */
+
+struct cipher_bench {
+	const struct dropbear_cipher *cipher;
+	const struct dropbear_cipher_mode *mode;
+	struct key_context_directional enc, dec;
+	unsigned int seq;
+	unsigned char *in, *out, *ct;
+	unsigned int len, taglen;
+};
+
+static void cipher_start(struct cipher_bench *cb,
+		struct key_context_directional *kcd) {
+	unsigned char key[MAX_KEY_LEN], iv[MAX_IV_LEN];
+	int idx = -1;
+
+	memset(key, 0x2a, sizeof(key));
+	memset(iv, 0x55, sizeof(iv));
+	if (cb->cipher->cipherdesc->name != NULL) {
+		idx = find_cipher(cb->cipher->cipherdesc->name);
+		if (idx < 0) {
+			dropbear_exit("Crypto error");
+		}
+	}
+	if (cb->mode->start(idx, iv, key, cb->cipher->keysize, 0,
+				&kcd->cipher_state) != CRYPT_OK) {
+		dropbear_exit("Crypto error");
+	}
+}
+
+static void cipher_crypt(struct cipher_bench *cb,
+		struct key_context_directional *kcd, const unsigned char *in,
+		unsigned char *out, int direction) {
+	int ret;
+#if DROPBEAR_AEAD_MODE
+	if (cb->mode->aead_crypt) {
+		ret = cb->mode->aead_crypt(cb->seq, in, out, cb->len, cb->taglen,
+				&kcd->cipher_state, direction);
+	} else
+#endif
+	if (direction == LTC_ENCRYPT) {
+		ret = cb->mode->encrypt(in, out, cb->len, &kcd->cipher_state);
+	} else {
+		ret = cb->mode->decrypt(in, out, cb->len, &kcd->cipher_state);
+	}
+	if (ret != CRYPT_OK) {
+		dropbear_exit("Crypto error");
+	}
+}
+
+static void bench_encrypt(void *arg) {
+	struct cipher_bench *cb = arg;
+	cb->seq++;
+	cipher_crypt(cb, &cb->enc, cb->in, cb->out, LTC_ENCRYPT);
+}
+
+static void bench_decrypt(void *arg) {
+	struct cipher_bench *cb = arg;
+	/* the decrypting state has to follow the same sequence, such as
+	   the CTR counter, so each op decrypts a freshly encrypted packet */
+	exclude_begin();
+	cb->seq++;
+	cipher_crypt(cb, &cb->enc, cb->in, cb->ct, LTC_ENCRYPT);
+	exclude_end();
+	cipher_crypt(cb, &cb->dec, cb->ct, cb->out, LTC_DECRYPT);
+}
+
+static void bench_ciphers(void) {
+	unsigned int i;
+
+	for (i = 0; sshciphers[i].name != NULL; i++) {
+		struct cipher_bench cb;
+
+		memset(&cb, 0, sizeof(cb));
+		cb.cipher = sshciphers[i].data;
+		cb.mode = sshciphers[i].mode;
+		if (cb.cipher == NULL || cb.cipher->cipherdesc == NULL
+				|| !bench_selected("cipher", sshciphers[i].name)) {
+			continue;
+		}
+		/* payload plus length field */
+		cb.len = BENCH_PACKET_LEN + 4;
+#if DROPBEAR_AEAD_MODE
+		if (cb.mode->aead_crypt) {
+			cb.taglen = cb.mode->aead_mac->hashsize;
+		}
+#endif
+		cb.in = m_malloc(cb.len + cb.taglen);
+		cb.out = m_malloc(cb.len + cb.taglen);
+		cb.ct = m_malloc(cb.len + cb.taglen);
+		genrandom(cb.in, cb.len);
+		cipher_start(&cb, &cb.enc);
+		cipher_start(&cb, &cb.dec);
+
+		run_bench("cipher", sshciphers[i].name, "encrypt", cb.len,
+				bench_encrypt, &cb);
+		run_bench("cipher", sshciphers[i].name, "decrypt", cb.len,
+				bench_decrypt, &cb);
+
+		m_burn(&cb.enc, sizeof(cb.enc));
+		m_burn(&cb.dec, sizeof(cb.dec));
+		m_free(cb.in);
+		m_free(cb.out);
+		m_free(cb.ct);
+	}
+}
+
+/* MACs */
+
+struct mac_bench {
+	struct key_context_directional kcd;
+	unsigned int seq;
+	buffer *packet;
+};
+
+static void bench_mac(void *arg) {
+	struct mac_bench *mb = arg;
+	unsigned char mac[MAX_MAC_LEN];
+
+	make_mac(mb->seq++, &mb->kcd, mb->packet, mb->packet->len, mac);
+}
+
+static void bench_macs(void) {
+	unsigned int i;
+
+	for (i = 0; sshhashes[i].name != NULL; i++) {
+		struct mac_bench mb;
+
+		memset(&mb, 0, sizeof(mb));
+		mb.kcd.algo_mac = sshhashes[i].data;
+		if (mb.kcd.algo_mac == NULL || mb.kcd.algo_mac->hash_desc == NULL
+				|| !bench_selected("mac", sshhashes[i].name)) {
+			continue;
+		}
+		mb.kcd.hash_index = find_hash(mb.kcd.algo_mac->hash_desc->name);
+		if (mb.kcd.hash_index < 0) {
+			dropbear_exit("Crypto error");
+		}
+		genrandom(mb.kcd.mackey, sizeof(mb.kcd.mackey));
+		/* payload plus length field, as for the ciphers */
+		mb.packet = buf_new(BENCH_PACKET_LEN + 4);
+		genrandom(buf_getwriteptr(mb.packet, BENCH_PACKET_LEN + 4),
+				BENCH_PACKET_LEN + 4);
+		buf_incrwritepos(mb.packet, BENCH_PACKET_LEN + 4);
+
+		run_bench("mac", sshhashes[i].name, "mac", mb.packet->len,
+				bench_mac, &mb);
+
+		m_burn(&mb.kcd, sizeof(mb.kcd));
+		buf_free(mb.packet);
+	}
+}
+
+/* Host keys */
+
+static sign_key *hostkeys[DROPBEAR_SIGNKEY_NUM_NAMED];
+
+static sign_key *get_hostkey(enum signkey_type type) {
+	sign_key *key = NULL;
+	unsigned int bits;
+
+	if (hostkeys[type]) {
+		return hostkeys[type];
+	}
+
+	bits = signkey_generate_get_bits(type, 0);
+	key = new_sign_key();
+	switch (type) {
+#if DROPBEAR_RSA
+		case DROPBEAR_SIGNKEY_RSA:
+			key->rsakey = gen_rsa_priv_key(bits);
+			break;
+#endif
+#if DROPBEAR_DSS
+		case DROPBEAR_SIGNKEY_DSS:
+			key->dsskey = gen_dss_priv_key(bits);
+			break;
+#endif
+#if DROPBEAR_ECDSA
+		case DROPBEAR_SIGNKEY_ECDSA_NISTP256:
+		case DROPBEAR_SIGNKEY_ECDSA_NISTP384:
+		case DROPBEAR_SIGNKEY_ECDSA_NISTP521:
+			*signkey_key_ptr(key, type) = gen_ecdsa_priv_key(bits);
+			break;
+#endif
+#if DROPBEAR_ED25519
+		case DROPBEAR_SIGNKEY_ED25519:
+			key->ed25519key = gen_ed25519_priv_key(bits);
+			break;
+#endif
+		default:
+			/* security keys can't be generated, verify only */
+			sign_key_free(key);
+			return NULL;
+	}
+	key->type = type;
+	hostkeys[type] = key;
+	return key;
+}
+
+struct sig_bench {
+	sign_key *key;
+	enum signature_type sigtype;
+	buffer *data;
+	buffer *sig;
+};
+
+static void bench_sign(void *arg) {
+	struct sig_bench *sb = arg;
+	buf_setpos(sb->sig, 0);
+	buf_setlen(sb->sig, 0);
+	buf_put_sign(sb->sig, sb->key, sb->sigtype, sb->data);
+}
+
+static void bench_verify(void *arg) {
+	struct sig_bench *sb = arg;
+	buf_setpos(sb->sig, 0);
+	if (buf_verify(sb->sig, sb->key, sb->sigtype, sb->data) != DROPBEAR_SUCCESS) {
+		dropbear_exit("Verify failed");
+	}
+}
+
+static void bench_signatures(void) {
+	unsigned int i;
+
+	for (i = 0; sigalgs[i].name != NULL; i++) {
+		struct sig_bench sb;
+
+		if (!bench_selected("hostkey", sigalgs[i].name)) {
+			continue;
+		}
+		sb.sigtype = sigalgs[i].val;
+		sb.key = get_hostkey(signkey_type_from_signature(sb.sigtype));
+		if (sb.key == NULL) {
+			continue;
+		}
+		/* a sha512 exchange hash */
+		sb.data = buf_new(64);
+		genrandom(buf_getwriteptr(sb.data, 64), 64);
+		buf_incrwritepos(sb.data, 64);
+		sb.sig = buf_new(MAX_PUBKEY_SIZE);
+
+		run_bench("hostkey", sigalgs[i].name, "sign", 0, bench_sign, &sb);
+		run_bench("hostkey", sigalgs[i].name, "verify", 0, bench_verify, &sb);
+
+		buf_free(sb.data);
+		buf_free(sb.sig);
+	}
+}
+
+/* Key exchange. Both sides are run in the same process, switching
+ * ses.isserver as a real client/server would be */
+#if DROPBEAR_SERVER && DROPBEAR_CLIENT
+
+struct kex_bench {
+	const struct dropbear_kex *algo_kex;
+	sign_key *hostkey;
+	/* public values sent by each side, in the wire format */
+	buffer *pub_client;
+	buffer *pub_server;
+};
+
+/* Our public value, as would be sent in kexdh init or reply */
+static buffer *kex_public(const struct dropbear_kex *algo_kex, void *param) {
+	buffer *buf = buf_new(MAX_KEX_PARTS);
+	switch (algo_kex->mode) {
+#if DROPBEAR_NORMAL_DH
+		case DROPBEAR_KEX_NORMAL_DH:
+			buf_putmpint(buf, &((struct kex_dh_param*)param)->pub);
+			break;
+#endif
+#if DROPBEAR_ECDH
+		case DROPBEAR_KEX_ECDH:
+			buf_put_ecc_raw_pubkey_string(buf, &((struct kex_ecdh_param*)param)->key);
+			break;
+#endif
+#if DROPBEAR_CURVE25519
+		case DROPBEAR_KEX_CURVE25519:
+			buf_putstring(buf, ((struct kex_curve25519_param*)param)->pub,
+					CURVE25519_LEN);
+			break;
+#endif
+#if DROPBEAR_PQHYBRID
+		case DROPBEAR_KEX_PQHYBRID:
+			buf_putbufstring(buf, ((struct kex_pqhybrid_param*)param)->concat_public);
+			break;
+#endif
+	}
+	buf_setpos(buf, 0);
+	return buf;
+}
+
+/* Equivalent to processing the kexdh init or reply packet */
+static void kex_comb(struct kex_bench *kb, void *param, buffer *pub_them) {
+	buffer *q = NULL;
+
+	ses.kexhashbuf = buf_new(KEXHASHBUF_MAX_INTS);
+	buf_setpos(pub_them, 0);
+	switch (kb->algo_kex->mode) {
+#if DROPBEAR_NORMAL_DH
+		case DROPBEAR_KEX_NORMAL_DH:
+			{
+			DEF_MP_INT(dh_pub_them);
+			m_mp_init(&dh_pub_them);
+			if (buf_getmpint(pub_them, &dh_pub_them) != DROPBEAR_SUCCESS) {
+				dropbear_exit("Bad kex value");
+			}
+			kexdh_comb_key(param, &dh_pub_them, kb->hostkey);
+			mp_clear(&dh_pub_them);
+			}
+			break;
+#endif
+#if DROPBEAR_ECDH
+		case DROPBEAR_KEX_ECDH:
+			q = buf_getstringbuf(pub_them);
+			kexecdh_comb_key(param, q, kb->hostkey);
+			break;
+#endif
+#if DROPBEAR_CURVE25519
+		case DROPBEAR_KEX_CURVE25519:
+			q = buf_getstringbuf(pub_them);
+			kexcurve25519_comb_key(param, q, kb->hostkey);
+			break;
+#endif
+#if DROPBEAR_PQHYBRID
+		case DROPBEAR_KEX_PQHYBRID:
+			q = buf_getstringbuf(pub_them);
+			kexpqhybrid_comb_key(param, q, kb->hostkey);
+			break;
+#endif
+	}
+
+	if (q) {
+		buf_free(q);
+	}
+	/* kexhashbuf is freed by finish_kexhashbuf() */
+	if (ses.dh_K) {
+		mp_clear(ses.dh_K);
+		m_free(ses.dh_K);
+	}
+	if (ses.dh_K_bytes) {
+		buf_burn_free(ses.dh_K_bytes);
+		ses.dh_K_bytes = NULL;
+	}
+	buf_burn_free(ses.hash);
+	ses.hash = NULL;
+}
+
+static void bench_kex_keygen(void *arg) {
+	struct kex_bench *kb = arg;
+	ses.isserver = 0;
+	free_kex_param(kb->algo_kex, gen_kex_param(kb->algo_kex));
+}
+
+/* server: generate a param, then compute the shared secret and hash
+ * from the client's public value. */
+static void bench_kex_server(void *arg) {
+	struct kex_bench *kb = arg;
+	void *param = NULL;
+
+	ses.isserver = 1;
+	param = gen_kex_param(kb->algo_kex);
+	kex_comb(kb, param, kb->pub_client);
+	if (kb->pub_server == NULL) {
+		/* keep a reply for the client benchmark */
+		kb->pub_server = kex_public(kb->algo_kex, param);
+	}
+	free_kex_param(kb->algo_kex, param);
+}
+
+/* client: the combine step only, from the server's reply */
+static void bench_kex_client(void *arg) {
+	struct kex_bench *kb = arg;
+	void *param = NULL;
+
+	ses.isserver = 0;
+	exclude_begin();
+	param = gen_kex_param(kb->algo_kex);
+	exclude_end();
+	kex_comb(kb, param, kb->pub_server);
+	free_kex_param(kb->algo_kex, param);
+}
+
+static void bench_kex(void) {
+	unsigned int i, j;
+	struct key_context newkeys;
+	int dup;
+
+	memset(&newkeys, 0, sizeof(newkeys));
+	ses.newkeys = &newkeys;
+
+	for (i = 0; sshkex[i].name != NULL; i++) {
+		struct kex_bench kb;
+		void *param = NULL;
+
+		memset(&kb, 0, sizeof(kb));
+		kb.algo_kex = sshkex[i].data;
+		if (kb.algo_kex == NULL) {
+			/* kexguess2 and ext-info markers */
+			continue;
+		}
+		/* some algorithms are listed under several names */
+		dup = 0;
+		for (j = 0; j < i; j++) {
+			if (sshkex[j].data == kb.algo_kex
+					&& bench_selected("kex", sshkex[j].name)) {
+				dup = 1;
+			}
+		}
+		if (dup || !bench_selected("kex", sshkex[i].name)) {
+			continue;
+		}
+
+#if DROPBEAR_ED25519
+		newkeys.algo_hostkey = DROPBEAR_SIGNKEY_ED25519;
+#elif DROPBEAR_ECDSA
+		newkeys.algo_hostkey = DROPBEAR_SIGNKEY_ECDSA_NISTP256;
+#else
+		newkeys.algo_hostkey = DROPBEAR_SIGNKEY_RSA;
+#endif
+		kb.hostkey = get_hostkey(newkeys.algo_hostkey);
+		newkeys.algo_kex = kb.algo_kex;
+
+		ses.isserver = 0;
+		param = gen_kex_param(kb.algo_kex);
+		kb.pub_client = kex_public(kb.algo_kex, param);
+		free_kex_param(kb.algo_kex, param);
+
+		run_bench("kex", sshkex[i].name, "keygen", 0, bench_kex_keygen, &kb);
+		run_bench("kex", sshkex[i].name, "server", 0, bench_kex_server, &kb);
+		if (kb.pub_server) {
+			run_bench("kex", sshkex[i].name, "client_combine", 0,
+					bench_kex_client, &kb);
+		}
+
+		buf_free(kb.pub_client);
+		if (kb.pub_server) {
+			buf_free(kb.pub_server);
+		}
+	}
+
+	ses.newkeys = NULL;
+	if (ses.session_id) {
+		buf_free(ses.session_id);
+		ses.session_id = NULL;
+	}
+}
+#endif /* DROPBEAR_SERVER && DROPBEAR_CLIENT */
+
+static void printhelp(const char *progname) {
+	fprintf(stderr, "Usage: %s [-t msec] [filter]\n"
+					"Benchmarks the compiled in ciphers, MACs, key exchange\n"
+					"and host key algorithms. Results are printed as a JSON\n"
+					"object per line.\n"
+					"-t msec	Time to run each benchmark for (default %d)\n"
+					"filter	Only run benchmarks with a group or name containing filter\n"
+					, progname, BENCH_DEFAULT_MSEC);
+}
+
+#if defined(DBMULTI_dropbearbench) || !DROPBEAR_MULTI
+#if defined(DBMULTI_dropbearbench) && DROPBEAR_MULTI
+int dropbearbench_main(int argc, char ** argv) {
+#else
+int main(int argc, char ** argv) {
+#endif
+	int i;
+	unsigned int j;
+	char *msectext = NULL;
+
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-t") == 0 && i+1 < argc) {
+			msectext = argv[++i];
+		} else if (argv[i][0] == '-') {
+			printhelp(argv[0]);
+			exit(EXIT_FAILURE);
+		} else {
+			bench_filter = argv[i];
+		}
+	}
+
+	if (msectext) {
+		if (m_str_to_uint(msectext, &j) == DROPBEAR_FAILURE || j == 0) {
+			fprintf(stderr, "Bad time '%s'\n", msectext);
+			exit(EXIT_FAILURE);
+		}
+		bench_msec = j;
+	}
+
+	crypto_init();
+	seedrandom();
+
+	bench_ciphers();
+	bench_macs();
+	bench_signatures();
+#if DROPBEAR_SERVER && DROPBEAR_CLIENT
+	bench_kex();
+#endif
+
+	for (j = 0; j < DROPBEAR_SIGNKEY_NUM_NAMED; j++) {
+		if (hostkeys[j]) {
+			sign_key_free(hostkeys[j]);
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
+#endif
@@ -33,13 +33,195 @@
 
 #if DROPBEAR_RSA
 
+/* Candidates for a prime are sieved by the odd primes below
+ * RSA_SIEVE_LIMIT before Rabin-Miller testing. mp_mod_d() needs them to
+ * fit an mp_digit. */
+#define RSA_SIEVE_LIMIT 32768
+/* Number of odd candidates sieved at a time */
+#define RSA_SIEVE_WINDOW 4096
+
+struct rsa_sieve {
+	unsigned int *primes;
+	unsigned int nprimes;
+};
+
 static void getrsaprime(mp_int* prime, mp_int *primeminus, 
-		const mp_int* rsa_e, unsigned int size_bytes);
+		const mp_int* rsa_e, unsigned int size_bytes,
+		const struct rsa_sieve *sieve);
+
+#if DROPBEAR_RSA_PARALLEL_KEYGEN
+/* Set in the forked child, which must only leave with _exit() so that
+ * it doesn't run the parent's atexit handlers or session cleanup */
+static int rsa_in_child = 0;
+#endif
+
+static void rsa_fail(void) {
+#if DROPBEAR_RSA_PARALLEL_KEYGEN
+	if (rsa_in_child) {
+		_exit(EXIT_FAILURE);
+	}
+#endif
+	fprintf(stderr, "RSA generation failed\n");
+	exit(1);
+}
+
+static void rsa_sieve_init(struct rsa_sieve *sieve) {
+	unsigned char *composite;
+	unsigned int i, j;
+
+	composite = m_malloc(RSA_SIEVE_LIMIT);
+	sieve->primes = m_malloc(RSA_SIEVE_LIMIT/2 * sizeof(*sieve->primes));
+	sieve->nprimes = 0;
+	for (i = 3; i < RSA_SIEVE_LIMIT; i += 2) {
+		if (composite[i]) {
+			continue;
+		}
+		sieve->primes[sieve->nprimes++] = i;
+		for (j = i*i; j < RSA_SIEVE_LIMIT; j += 2*i) {
+			composite[j] = 1;
+		}
+	}
+	m_free(composite);
+}
+
+#if DROPBEAR_RSA_PARALLEL_KEYGEN
+/* One of the primes is searched for by a forked child, which writes it to
+ * a pipe, while the parent searches for the other */
+struct rsa_child {
+	pid_t pid;
+	int fd;
+};
+
+/* dropbear_exit() in the child, for example from m_malloc() */
+static void rsa_child_exit(int exitcode, const char* format, va_list param)
+	ATTRIB_NORETURN;
+
+static void rsa_child_exit(int exitcode, const char* format, va_list param) {
+#if DEBUG_TRACE
+	char exitmsg[150];
+
+	vsnprintf(exitmsg, sizeof(exitmsg), format, param);
+	TRACE(("rsa: child exited: %s", exitmsg))
+#else
+	(void)format;
+	(void)param;
+#endif
+	_exit(exitcode);
+}
+
+/* Returns DROPBEAR_FAILURE if the child couldn't be started */
+static int rsa_child_start(struct rsa_child *child, const mp_int* rsa_e,
+		unsigned int size_bytes, const struct rsa_sieve *sieve) {
+	unsigned char seed[32];
+	unsigned char *buf;
+	size_t len, written;
+	ssize_t ret;
+	int fds[2];
+	DEF_MP_INT(prime);
+	DEF_MP_INT(primeminus);
+
+	if (pipe(fds) < 0) {
+		TRACE(("rsa: pipe failed: %s", strerror(errno)))
+		return DROPBEAR_FAILURE;
+	}
+
+	/* so that the child's random stream differs from the parent's */
+	genrandom(seed, sizeof(seed));
+
+	child->pid = fork();
+	if (child->pid < 0) {
+		TRACE(("rsa: fork failed: %s", strerror(errno)))
+		m_close(fds[0]);
+		m_close(fds[1]);
+		m_burn(seed, sizeof(seed));
+		return DROPBEAR_FAILURE;
+	}
+
+	if (child->pid == 0) {
+		rsa_in_child = 1;
+		_dropbear_exit = rsa_child_exit;
+		m_close(fds[0]);
+		addrandom(seed, sizeof(seed));
+		m_burn(seed, sizeof(seed));
+
+		m_mp_init_multi(&prime, &primeminus, NULL);
+		getrsaprime(&prime, &primeminus, rsa_e, size_bytes, sieve);
+
+		/* the prime can carry into an extra byte, the parent
+		 * checks the size */
+		buf = m_malloc(size_bytes + 1);
+		len = mp_ubin_size(&prime);
+		if (len > size_bytes + 1
+			|| mp_to_ubin(&prime, &buf[size_bytes + 1 - len], len, &written) != MP_OKAY) {
+			_exit(EXIT_FAILURE);
+		}
+		for (len = 0; len < size_bytes + 1; len += ret) {
+			ret = write(fds[1], &buf[len], size_bytes + 1 - len);
+			if (ret < 0 && errno == EINTR) {
+				ret = 0;
+			} else if (ret <= 0) {
+				_exit(EXIT_FAILURE);
+			}
+		}
+		m_burn(buf, size_bytes + 1);
+		_exit(EXIT_SUCCESS);
+	}
+
+	m_burn(seed, sizeof(seed));
+	m_close(fds[1]);
+	child->fd = fds[0];
+	return DROPBEAR_SUCCESS;
+}
+
+/* Waits for the child's prime. Returns DROPBEAR_FAILURE if the child
+ * failed */
+static int rsa_child_finish(const struct rsa_child *child, mp_int *prime,
+		mp_int *primeminus, unsigned int size_bytes) {
+	unsigned char *buf;
+	size_t len;
+	ssize_t ret = 0;
+	int status = 0;
+
+	buf = m_malloc(size_bytes + 1);
+	for (len = 0; len < size_bytes + 1; len += ret) {
+		ret = read(child->fd, &buf[len], size_bytes + 1 - len);
+		if (ret < 0 && errno == EINTR) {
+			ret = 0;
+		} else if (ret <= 0) {
+			break;
+		}
+	}
+	m_close(child->fd);
+	while (waitpid(child->pid, &status, 0) < 0 && errno == EINTR) {
+	}
+
+	if (len != size_bytes + 1 || !WIFEXITED(status)
+		|| WEXITSTATUS(status) != EXIT_SUCCESS) {
+		TRACE(("rsa: child failed, status 0x%x", status))
+		m_burn(buf, size_bytes + 1);
+		m_free(buf);
+		return DROPBEAR_FAILURE;
+	}
+
+	bytes_to_mp(prime, buf, size_bytes + 1);
+	m_burn(buf, size_bytes + 1);
+	m_free(buf);
+	if (mp_sub_d(prime, 1, primeminus) != MP_OKAY) {
+		rsa_fail();
+	}
+	return DROPBEAR_SUCCESS;
+}
+#endif /* DROPBEAR_RSA_PARALLEL_KEYGEN */
 
 /* mostly taken from libtomcrypt's rsa key generation routine */
 dropbear_rsa_key * gen_rsa_priv_key(unsigned int size) {
 
 	dropbear_rsa_key * key;
+	struct rsa_sieve sieve;
+#if DROPBEAR_RSA_PARALLEL_KEYGEN
+	struct rsa_child child;
+	int have_child;
+#endif
 	DEF_MP_INT(pminus);
 	DEF_MP_INT(qminus);
 	DEF_MP_INT(lcm);
@@ -54,14 +236,23 @@ dropbear_rsa_key * gen_rsa_priv_key(unsigned int size) {
 	m_mp_init_multi(&pminus, &lcm, &qminus, NULL);
 
 	mp_set_ul(key->e, RSA_E);
+	rsa_sieve_init(&sieve);
 
 	while (1) {
-		getrsaprime(key->p, &pminus, key->e, size/16);
-		getrsaprime(key->q, &qminus, key->e, size/16);
+#if DROPBEAR_RSA_PARALLEL_KEYGEN
+		have_child = rsa_child_start(&child, key->e, size/16, &sieve) == DROPBEAR_SUCCESS;
+		getrsaprime(key->p, &pminus, key->e, size/16, &sieve);
+		if (!have_child
+			|| rsa_child_finish(&child, key->q, &qminus, size/16) == DROPBEAR_FAILURE) {
+			getrsaprime(key->q, &qminus, key->e, size/16, &sieve);
+		}
+#else
+		getrsaprime(key->p, &pminus, key->e, size/16, &sieve);
+		getrsaprime(key->q, &qminus, key->e, size/16, &sieve);
+#endif
 
 		if (mp_mul(key->p, key->q, key->n) != MP_OKAY) {
-			fprintf(stderr, "RSA generation failed\n");
-			exit(1);
+			rsa_fail();
 		}
 
 		if ((unsigned int)mp_count_bits(key->n) == size) {
@@ -71,64 +262,108 @@ dropbear_rsa_key * gen_rsa_priv_key(unsigned int size) {
 
 	/* lcm(p-1, q-1) */
 	if (mp_lcm(&pminus, &qminus, &lcm) != MP_OKAY) {
-		fprintf(stderr, "RSA generation failed\n");
-		exit(1);
+		rsa_fail();
 	}
 
 	/* de = 1 mod lcm(p-1,q-1) */
 	/* therefore d = (e^-1) mod lcm(p-1,q-1) */
 	if (mp_invmod(key->e, &lcm, key->d) != MP_OKAY) {
-		fprintf(stderr, "RSA generation failed\n");
-		exit(1);
+		rsa_fail();
 	}
 
 	mp_clear_multi(&pminus, &qminus, &lcm, NULL);
+	m_free(sieve.primes);
 
 	return key;
 }	
 
 /* return a prime suitable for p or q */
 static void getrsaprime(mp_int* prime, mp_int *primeminus, 
-		const mp_int* rsa_e, unsigned int size_bytes) {
+		const mp_int* rsa_e, unsigned int size_bytes,
+		const struct rsa_sieve *sieve) {
 
 	unsigned char *buf;
-	int trials;
+	unsigned int *residues;
+	unsigned char composite[RSA_SIEVE_WINDOW];
+	unsigned int i, j, p, t;
+	int trials, isprime;
+	mp_digit r;
+	DEF_MP_INT(base);
 	DEF_MP_INT(temp_gcd);
 
 	buf = (unsigned char*)m_malloc(size_bytes);
+	residues = m_malloc(sieve->nprimes * sizeof(*residues));
+	m_mp_init_multi(&base, &temp_gcd, NULL);
+
+	/* generate a random odd number with the top two bits set, so that
+	   p*q has the full size, then search upwards from it */
+	genrandom(buf, size_bytes);
+	buf[0] |= 0xc0;
+	buf[size_bytes - 1] |= 0x01;
+	bytes_to_mp(&base, buf, size_bytes);
+	m_burn(buf, size_bytes);
+	m_free(buf);
+
+	trials = mp_prime_rabin_miller_trials(mp_count_bits(&base));
+
+	for (i = 0; i < sieve->nprimes; i++) {
+		if (mp_mod_d(&base, sieve->primes[i], &r) != MP_OKAY) {
+			rsa_fail();
+		}
+		residues[i] = r;
+	}
 
-	m_mp_init(&temp_gcd);
-	do {
-		/* generate a random odd number with MSB set, then find the
-		   the next prime above it */
-		genrandom(buf, size_bytes);
-		buf[0] |= 0x80;
+	while (1) {
+		/* composite[j] is set when base + 2j has a small factor */
+		memset(composite, 0x0, sizeof(composite));
+		for (i = 0; i < sieve->nprimes; i++) {
+			p = sieve->primes[i];
+			/* the first j with 2j = -base mod p */
+			t = (p - residues[i]) % p;
+			for (j = (t % 2 == 0) ? t/2 : (t + p)/2; j < RSA_SIEVE_WINDOW; j += p) {
+				composite[j] = 1;
+			}
+		}
 
-		bytes_to_mp(prime, buf, size_bytes);
+		for (j = 0; j < RSA_SIEVE_WINDOW; j++) {
+			if (composite[j]) {
+				continue;
+			}
+			if (mp_add_d(&base, 2*j, prime) != MP_OKAY
+				|| mp_prime_is_prime(prime, trials, &isprime) != MP_OKAY) {
+				rsa_fail();
+			}
+			if (!isprime) {
+				continue;
+			}
 
-		/* find the next integer which is prime */
-		trials = mp_prime_rabin_miller_trials(mp_count_bits(prime));
-		if (mp_prime_next_prime(prime, trials, 0) != MP_OKAY) {
-			fprintf(stderr, "RSA generation failed\n");
-			exit(1);
+			/* subtract one to get p-1 */
+			if (mp_sub_d(prime, 1, primeminus) != MP_OKAY) {
+				rsa_fail();
+			}
+			/* check relative primality to e */
+			if (mp_gcd(primeminus, rsa_e, &temp_gcd) != MP_OKAY) {
+				rsa_fail();
+			}
+			if (mp_cmp_d(&temp_gcd, 1) == MP_EQ) {
+				/* now we have a good value for result */
+				goto out;
+			}
 		}
 
-		/* subtract one to get p-1 */
-		if (mp_sub_d(prime, 1, primeminus) != MP_OKAY) {
-			fprintf(stderr, "RSA generation failed\n");
-			exit(1);
+		/* move on to the next window */
+		if (mp_add_d(&base, 2*RSA_SIEVE_WINDOW, &base) != MP_OKAY) {
+			rsa_fail();
 		}
-		/* check relative primality to e */
-		if (mp_gcd(primeminus, rsa_e, &temp_gcd) != MP_OKAY) {
-			fprintf(stderr, "RSA generation failed\n");
-			exit(1);
+		for (i = 0; i < sieve->nprimes; i++) {
+			residues[i] = (residues[i] + 2*RSA_SIEVE_WINDOW) % sieve->primes[i];
 		}
-	} while (mp_cmp_d(&temp_gcd, 1) != MP_EQ); /* while gcd(p-1, e) != 1 */
+	}
 
-	/* now we have a good value for result */
-	mp_clear(&temp_gcd);
-	m_burn(buf, size_bytes);
-	m_free(buf);
+out:
+	mp_clear_multi(&base, &temp_gcd, NULL);
+	m_burn(residues, sieve->nprimes * sizeof(*residues));
+	m_free(residues);
 }
 
 #endif /* DROPBEAR_RSA */
@@ -43,6 +43,7 @@
 #include <fcntl.h>
 #include <grp.h>
 #include <limits.h>
+#include <poll.h>
 #include <pwd.h>
 #include <signal.h>
 #include <stdlib.h>
@@ -139,6 +140,10 @@
 #include <sys/endian.h>
 #endif
 
+#ifdef HAVE_MALLOC_H
+#include <malloc.h>
+#endif
+
 #ifdef BUNDLED_LIBTOM
 #include "../libtomcrypt/src/headers/tomcrypt.h"
 #include "../libtommath/tommath.h"
@@ -9,16 +9,15 @@
 #include "kex.h"
 
 #if DROPBEAR_NORMAL_DH
-static void load_dh_p(mp_int * dh_p)
+static void load_dh_p(const struct dropbear_kex *algo_kex, mp_int * dh_p)
 {
-    bytes_to_mp(dh_p, ses.newkeys->algo_kex->dh_p_bytes, 
-        ses.newkeys->algo_kex->dh_p_len);
+    bytes_to_mp(dh_p, algo_kex->dh_p_bytes, algo_kex->dh_p_len);
 }
 
 /* Initialises and generate one side of the diffie-hellman key exchange values.
  * See the transport rfc 4253 section 8 for details */
 /* dh_pub and dh_priv MUST be already initialised */
-struct kex_dh_param *gen_kexdh_param() {
+struct kex_dh_param *gen_kexdh_param(const struct dropbear_kex *algo_kex) {
     struct kex_dh_param *param = NULL;
 
     DEF_MP_INT(dh_p);
@@ -31,7 +30,7 @@ struct kex_dh_param *gen_kexdh_param() {
     m_mp_init_multi(&param->pub, &param->priv, &dh_g, &dh_p, &dh_q, NULL);
 
     /* read the prime and generator*/
-    load_dh_p(&dh_p);
+    load_dh_p(algo_kex, &dh_p);
     
     mp_set_ul(&dh_g, DH_G_VAL);
 
@@ -73,7 +72,7 @@ void kexdh_comb_key(struct kex_dh_param *param, mp_int *dh_pub_them,
     mp_int *dh_e = NULL, *dh_f = NULL;
 
     m_mp_init_multi(&dh_p, &dh_p_min1, NULL);
-    load_dh_p(&dh_p);
+    load_dh_p(ses.newkeys->algo_kex, &dh_p);
 
     if (mp_sub_d(&dh_p, 1, &dh_p_min1) != MP_OKAY) { 
         dropbear_exit("Diffie-Hellman error");
@@ -8,9 +8,9 @@
 #include "kex.h"
 
 #if DROPBEAR_ECDH
-struct kex_ecdh_param *gen_kexecdh_param() {
+struct kex_ecdh_param *gen_kexecdh_param(const struct dropbear_kex *algo_kex) {
     struct kex_ecdh_param *param = m_malloc(sizeof(*param));
-    const struct dropbear_ecc_curve *curve = ses.newkeys->algo_kex->details;
+    const struct dropbear_ecc_curve *curve = algo_kex->details;
     if (ecc_make_key_ex(NULL, dropbear_ltc_prng, 
         &param->key, curve->dp) != CRYPT_OK) {
         dropbear_exit("ECC error");
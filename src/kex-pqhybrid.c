@@ -10,9 +10,9 @@
 
 #if DROPBEAR_PQHYBRID
 
-struct kex_pqhybrid_param *gen_kexpqhybrid_param() {
+struct kex_pqhybrid_param *gen_kexpqhybrid_param(const struct dropbear_kex *algo_kex) {
     struct kex_pqhybrid_param *param = m_malloc(sizeof(*param));
-    const struct dropbear_kem_desc *kem = ses.newkeys->algo_kex->details;
+    const struct dropbear_kem_desc *kem = algo_kex->details;
 
     param->curve25519 = gen_kexcurve25519_param();
 
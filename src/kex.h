@@ -36,15 +36,22 @@ void recv_msg_newkeys(void);
 void kexfirstinitialise(void);
 void finish_kexhashbuf(void);
 
+void *gen_kex_param(const struct dropbear_kex *algo_kex);
+void free_kex_param(const struct dropbear_kex *algo_kex, void *param);
+void *kex_take_param(void);
+int kex_pregen_wanted(void);
+void kex_pregen_param(void);
+void kex_free_pregen(void);
+
 #if DROPBEAR_NORMAL_DH
-struct kex_dh_param *gen_kexdh_param(void);
+struct kex_dh_param *gen_kexdh_param(const struct dropbear_kex *algo_kex);
 void free_kexdh_param(struct kex_dh_param *param);
 void kexdh_comb_key(struct kex_dh_param *param, mp_int *dh_pub_them,
 		sign_key *hostkey);
 #endif
 
 #if DROPBEAR_ECDH
-struct kex_ecdh_param *gen_kexecdh_param(void);
+struct kex_ecdh_param *gen_kexecdh_param(const struct dropbear_kex *algo_kex);
 void free_kexecdh_param(struct kex_ecdh_param *param);
 void kexecdh_comb_key(struct kex_ecdh_param *param, buffer *pub_them,
 		sign_key *hostkey);
@@ -62,7 +69,7 @@ void kexcurve25519_comb_key(const struct kex_curve25519_param *param, const buff
 #endif
 
 #if DROPBEAR_PQHYBRID
-struct kex_pqhybrid_param *gen_kexpqhybrid_param(void);
+struct kex_pqhybrid_param *gen_kexpqhybrid_param(const struct dropbear_kex *algo_kex);
 void free_kexpqhybrid_param(struct kex_pqhybrid_param *param);
 void kexpqhybrid_comb_key(struct kex_pqhybrid_param *param,
     buffer *buf_pub, sign_key *hostkey);
@@ -94,6 +101,9 @@ struct KEXState {
 	unsigned int recvfirstnewkeys; /* Set to 1 after the first valid newkeys has been received */
 
 	unsigned our_first_follows_matches : 1;
+#if DROPBEAR_KEX_PREGEN
+	unsigned tookparam : 1; /* kex_take_param() has been called this kex */
+#endif
 
 	/* Boolean indicating that strict kex mode is in use */
 	unsigned int strict_kex;
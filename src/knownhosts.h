@@ -0,0 +1,45 @@
+/*
+ * Dropbear - a SSH2 server
+ * 
+ * Copyright (c) 2026 Matt Johnston
+ * All rights reserved.
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE. */
+
+#ifndef DROPBEAR_KNOWNHOSTS_H_
+#define DROPBEAR_KNOWNHOSTS_H_
+
+#include "includes.h"
+#include "buffer.h"
+
+#define MAX_KNOWNHOSTS_LINE 4500
+
+/* Checks whether the hostname field at the start of a known_hosts line
+ * matches host, either plain or an OpenSSH hashed "|1|salt|hash" entry.
+ * On success line->pos is left after the following space. */
+int knownhosts_match_host(buffer *line, const char *host);
+
+/* Looks up host using an index alongside a large known_hosts file,
+ * (re)building it if it is out of date. On success *offsets is an
+ * allocated ascending list of the file offsets of lines which may be for
+ * host. Returns DROPBEAR_FAILURE if the caller should scan the file. */
+int knownhosts_index_lookup(FILE *hostsfile, const char *filename,
+		const char *host, long **offsets, unsigned int *num_offsets);
+
+#endif /* DROPBEAR_KNOWNHOSTS_H_ */
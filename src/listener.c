@@ -67,6 +67,10 @@ void handle_listeners(const fd_set * readfds) {
 				sock = listener->socks[j];
 				if (FD_ISSET(sock, readfds)) {
 					listener->acceptor(listener, sock);
+					if (ses.listeners[i] != listener) {
+						/* the acceptor removed it */
+						break;
+					}
 				}
 			}
 		}
@@ -0,0 +1,44 @@
+/*
+ * Dropbear - a SSH2 server
+ * 
+ * Copyright (c) 2026 Matt Johnston
+ * All rights reserved.
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE. */
+
+#ifndef DROPBEAR_LOGINQUEUE_H_
+#define DROPBEAR_LOGINQUEUE_H_
+
+#include "includes.h"
+#include "loginrec.h"
+
+/* As login_login() and login_logout(), but the record is passed to the
+ * helper process when it is running */
+void loginqueue_login(struct logininfo *li);
+void loginqueue_logout(struct logininfo *li);
+
+#if DROPBEAR_SVR_LOGINQUEUE
+void loginqueue_start(const int *closefds, unsigned int nclosefds);
+int loginqueue_new_session(void);
+int loginqueue_reexec_fd(void);
+void loginqueue_setfd(int fd);
+void loginqueue_bind(const char *username, const char *hostname);
+#endif
+
+#endif /* DROPBEAR_LOGINQUEUE_H_ */
@@ -306,6 +306,13 @@ login_write (struct logininfo *li)
 {
 	/* set the timestamp */
 	login_set_current_time(li);
+	login_write_record(li);
+}
+
+/* write the entry to each record type, the timestamp is already set */
+void
+login_write_record(struct logininfo *li)
+{
 #ifdef USE_LOGIN
 	syslogin_write_entry(li);
 #endif
@@ -1194,7 +1201,19 @@ syslogin_perform_login(struct logininfo *li)
 		return 0;
 	}
 	construct_utmp(li, ut);
+#if LOGIN_RECORD_ANY_PROCESS
+	/* login() takes the line and pid from the calling process, which is
+	 * the helper when records are queued. Do what it does with the
+	 * record's own */
+	setutent();
+	pututline(ut);
+#  ifdef HAVE_ENDUTENT
+	endutent();
+#  endif
+	updwtmp(WTMP_FILE, ut);
+#else
 	login(ut);
+#endif
 	free(ut);
 
 	return 1;
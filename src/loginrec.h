@@ -88,6 +88,17 @@
 
 #endif
 
+/* Whether records can be written by a process other than the one logging
+ * in, login() uses the caller's tty */
+#if !defined(USE_LOGIN)
+#  define LOGIN_RECORD_ANY_PROCESS 1
+#elif defined(HAVE_SETUTENT) && defined(HAVE_PUTUTLINE) \
+	&& defined(HAVE_UPDWTMP) && defined(WTMP_FILE)
+#  define LOGIN_RECORD_ANY_PROCESS DROPBEAR_SVR_LOGINQUEUE
+#else
+#  define LOGIN_RECORD_ANY_PROCESS 0
+#endif
+
 /* I hope that the presence of LASTLOG_FILE is enough to detect this */
 #if defined(LASTLOG_FILE) && !defined(DISABLE_LASTLOG)
 #  define USE_LASTLOG
@@ -171,6 +182,7 @@ int login_utmp_only(struct logininfo *li);
 
 /* record the entry */
 void login_write (struct logininfo *li);
+void login_write_record(struct logininfo *li);
 int login_log_entry(struct logininfo *li);
 
 /* produce various forms of the line filename */
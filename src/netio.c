@@ -4,10 +4,18 @@
 #include "session.h"
 #include "debug.h"
 #include "runopts.h"
+#include "atomicio.h"
+
+/* Room for the results from a resolver helper, around 90 addresses */
+#define RESOLVE_MAX_LEN 4096
 
 struct dropbear_progress_connection {
 	struct addrinfo *res;
-	struct addrinfo *res_iter;
+	/* res is from getaddrinfo(), otherwise a list of m_malloc()ed entries */
+	int res_gai;
+	/* res in the order to try, see connect_set_addrs() */
+	struct addrinfo **addrs;
+	unsigned int num_addrs, next_addr;
 
 	char *remotehost, *remoteport; /* For error reporting */
 
@@ -17,24 +25,87 @@ struct dropbear_progress_connection {
 	struct Queue *writequeue; /* A queue of encrypted packets to send with TCP fastopen,
 								or NULL. */
 
-	int sock;
+	/* Connection attempts in progress, -1 when unused */
+	int socks[DROPBEAR_CONNECT_MAX_ATTEMPTS];
+	/* Starts another attempt in parallel when it fires */
+	struct dropbear_timer attempt_timer;
+	/* An attempt has sent writequeue data with TCP fastopen, so can't
+	have others racing it */
+	int fastopen_sent;
+
+#if DROPBEAR_ASYNC_RESOLVE
+	/* Reading getaddrinfo() results from a helper process, or -1 */
+	int resolve_fd;
+	buffer *resolve_buf;
+#endif
 
 	char* errstring;
 	char *bind_address, *bind_port;
 	enum dropbear_prio prio;
 };
 
-/* Deallocate a progress connection. Removes from the pending list if iter!=NULL.
-Does not close sockets */
-static void remove_connect(struct dropbear_progress_connection *c, m_list_elem *iter) {
-	if (c->res) {
-		/* Only call freeaddrinfo if connection is not AF_UNIX. */
-		if (c->res->ai_family != AF_UNIX) {
-			freeaddrinfo(c->res);
-		} else {
+static void connect_attempt_timeout(void *arg);
+
+static struct dropbear_progress_connection* new_connect(const char *remotehost,
+	const char *remoteport, connect_callback cb, void *cb_data, enum dropbear_prio prio) {
+	struct dropbear_progress_connection *c = NULL;
+	unsigned int i;
+
+	c = m_malloc(sizeof(*c));
+	c->remotehost = m_strdup(remotehost);
+	c->remoteport = remoteport ? m_strdup(remoteport) : NULL;
+	c->cb = cb;
+	c->cb_data = cb_data;
+	c->prio = prio;
+	for (i = 0; i < DROPBEAR_CONNECT_MAX_ATTEMPTS; i++) {
+		c->socks[i] = -1;
+	}
+	timer_init(&c->attempt_timer, connect_attempt_timeout, c);
+#if DROPBEAR_ASYNC_RESOLVE
+	c->resolve_fd = -1;
+#endif
+
+	list_append(&ses.conn_pending, c);
+	return c;
+}
+
+static void free_addrs(struct dropbear_progress_connection *c) {
+	if (c->res_gai) {
+		freeaddrinfo(c->res);
+	} else {
+		while (c->res) {
+			struct addrinfo *next = c->res->ai_next;
 			m_free(c->res);
+			c->res = next;
 		}
 	}
+	c->res = NULL;
+	m_free(c->addrs);
+}
+
+/* Closes attempts which are still in progress */
+static void close_attempts(struct dropbear_progress_connection *c) {
+	unsigned int i;
+	for (i = 0; i < DROPBEAR_CONNECT_MAX_ATTEMPTS; i++) {
+		if (c->socks[i] >= 0) {
+			m_close(c->socks[i]);
+			c->socks[i] = -1;
+		}
+	}
+}
+
+/* Deallocate a progress connection. Removes from the pending list if iter!=NULL.
+Closes any sockets which haven't been passed to the callback */
+static void remove_connect(struct dropbear_progress_connection *c, m_list_elem *iter) {
+	close_attempts(c);
+	timer_cancel(&c->attempt_timer);
+#if DROPBEAR_ASYNC_RESOLVE
+	m_close(c->resolve_fd);
+	if (c->resolve_buf) {
+		buf_free(c->resolve_buf);
+	}
+#endif
+	free_addrs(c);
 	m_free(c->remotehost);
 	m_free(c->remoteport);
 	m_free(c->errstring);
@@ -59,22 +130,72 @@ void cancel_connect(struct dropbear_progress_connection *c) {
 	c->cb_data = NULL;
 }
 
-static void connect_try_next(struct dropbear_progress_connection *c) {
+/* Sets up the order to try addresses in c->res. As RFC8305 section 4,
+ * address families are alternated, starting with getaddrinfo()'s first
+ * preference. That way a broken IPv6 route doesn't have to time out
+ * for each IPv6 address before IPv4 is tried. */
+static void connect_set_addrs(struct dropbear_progress_connection *c) {
+	struct addrinfo *r = NULL, *same = NULL, *other = NULL;
+	unsigned int n = 0;
+	int want_same = 1;
+
+	for (r = c->res; r; r = r->ai_next) {
+		n++;
+	}
+	c->addrs = m_malloc(sizeof(*c->addrs) * MAX(n, 1));
+	c->num_addrs = n;
+	c->next_addr = 0;
+
+	same = other = c->res;
+	n = 0;
+	while (n < c->num_addrs) {
+		struct addrinfo **p = want_same ? &same : &other;
+		while (*p && ((*p)->ai_family == c->res->ai_family) != want_same) {
+			*p = (*p)->ai_next;
+		}
+		if (*p) {
+			c->addrs[n++] = *p;
+			*p = (*p)->ai_next;
+		}
+		want_same = !want_same;
+	}
+}
+
+static unsigned int num_attempts(const struct dropbear_progress_connection *c) {
+	unsigned int i, n = 0;
+	for (i = 0; i < DROPBEAR_CONNECT_MAX_ATTEMPTS; i++) {
+		if (c->socks[i] >= 0) {
+			n++;
+		}
+	}
+	return n;
+}
+
+/* Starts a connection attempt to the next address that can be tried.
+ * Returns 0 if there were no more addresses */
+static int connect_try_next(struct dropbear_progress_connection *c) {
 	struct addrinfo *r;
 	int err;
 	int res = 0;
 	int fastopen = 0;
 	int retry_errno = EINPROGRESS;
+	int sock = -1;
+	unsigned int slot;
 #if DROPBEAR_CLIENT_TCP_FAST_OPEN
 	struct msghdr message;
 #endif
 
-	for (r = c->res_iter; r; r = r->ai_next)
+	for (slot = 0; c->socks[slot] >= 0; slot++) {
+		dropbear_assert(slot < DROPBEAR_CONNECT_MAX_ATTEMPTS - 1);
+	}
+
+	while (c->next_addr < c->num_addrs)
 	{
-		dropbear_assert(c->sock == -1);
+		r = c->addrs[c->next_addr];
+		c->next_addr++;
 
-		c->sock = socket(r->ai_family, r->ai_socktype, r->ai_protocol);
-		if (c->sock < 0) {
+		sock = socket(r->ai_family, r->ai_socktype, r->ai_protocol);
+		if (sock < 0) {
 			continue;
 		}
 
@@ -100,11 +221,11 @@ static void connect_try_next(struct dropbear_progress_connection *c) {
 				snprintf(c->errstring, len, "Error resolving bind address '%s' (port %s). %s", 
 						c->bind_address, c->bind_port, gai_strerror(err));
 				TRACE(("Error resolving bind: %s", gai_strerror(err)))
-				close(c->sock);
-				c->sock = -1;
+				close(sock);
+				sock = -1;
 				continue;
 			}
-			res = bind(c->sock, bindaddr->ai_addr, bindaddr->ai_addrlen);
+			res = bind(sock, bindaddr->ai_addr, bindaddr->ai_addrlen);
 			freeaddrinfo(bindaddr);
 			bindaddr = NULL;
 			if (res < 0) {
@@ -115,16 +236,16 @@ static void connect_try_next(struct dropbear_progress_connection *c) {
 				c->errstring = m_malloc(len);
 				snprintf(c->errstring, len, "Error binding local address '%s' (port %s). %s", 
 						c->bind_address, c->bind_port, strerror(keep_errno));
-				close(c->sock);
-				c->sock = -1;
+				close(sock);
+				sock = -1;
 				continue;
 			}
 		}
 
-		ses.maxfd = MAX(ses.maxfd, c->sock);
-		set_sock_nodelay(c->sock);
-		set_sock_priority(c->sock, c->prio);
-		setnonblocking(c->sock);
+		ses.maxfd = MAX(ses.maxfd, sock);
+		set_sock_nodelay(sock);
+		set_sock_priority(sock, c->prio);
+		setnonblocking(sock);
 
 #if DROPBEAR_CLIENT_TCP_FAST_OPEN
 		fastopen = (c->writequeue != NULL && r->ai_family != AF_UNIX);
@@ -139,7 +260,7 @@ static void connect_try_next(struct dropbear_progress_connection *c) {
 			packet_queue_to_iovec(c->writequeue, iov, &iovlen);
 			message.msg_iov = iov;
 			message.msg_iovlen = iovlen;
-			res = sendmsg(c->sock, &message, MSG_FASTOPEN);
+			res = sendmsg(sock, &message, MSG_FASTOPEN);
 			/* Returns EINPROGRESS if FASTOPEN wasn't available */
 			if (res < 0) {
 				if (errno != EINPROGRESS) {
@@ -155,34 +276,289 @@ static void connect_try_next(struct dropbear_progress_connection *c) {
 				}
 			} else {
 				packet_queue_consume(c->writequeue, res);
+				c->fastopen_sent = 1;
 			}
 		}
 #endif
 
 		/* Normal connect(), used as fallback for TCP fastopen too */
 		if (!fastopen) {
-			res = connect(c->sock, r->ai_addr, r->ai_addrlen);
+			res = connect(sock, r->ai_addr, r->ai_addrlen);
 		}
 
 		if (res < 0 && errno != retry_errno) {
 			/* failure */
 			m_free(c->errstring);
 			c->errstring = m_strdup(strerror(errno));
-			close(c->sock);
-			c->sock = -1;
+			close(sock);
+			sock = -1;
 			continue;
 		} else {
 			/* new connection was successful, wait for it to complete */
+			TRACE(("connect_try_next: attempt %d to %s port %s",
+				c->next_addr, c->remotehost, c->remoteport))
+			c->socks[slot] = sock;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static void set_resolve_error(struct dropbear_progress_connection *c, const char *err) {
+	int len = 100 + strlen(c->remotehost) + strlen(c->remoteport) + strlen(err);
+	m_free(c->errstring);
+	c->errstring = m_malloc(len);
+	snprintf(c->errstring, len, "Error resolving '%s' port '%s'. %s",
+			c->remotehost, c->remoteport, err);
+	TRACE(("Error resolving: %s", err))
+}
+
+#if DROPBEAR_ASYNC_RESOLVE || DROPBEAR_RESOLVE_CACHE_TIME
+/* Addresses are passed from the resolver helper and kept in the cache as
+ * family, socktype, protocol and address for each getaddrinfo() result */
+static void put_addrinfo(buffer *buf, const struct addrinfo *res) {
+	const struct addrinfo *r = NULL;
+	for (r = res; r; r = r->ai_next) {
+		if (buf->len + 16 + r->ai_addrlen > buf->size) {
 			break;
 		}
+		buf_putint(buf, r->ai_family);
+		buf_putint(buf, r->ai_socktype);
+		buf_putint(buf, r->ai_protocol);
+		buf_putstring(buf, (const char*)r->ai_addr, r->ai_addrlen);
 	}
+}
 
-	if (r) {
-		c->res_iter = r->ai_next;
-	} else {
-		c->res_iter = NULL;
+/* Returns a list of m_malloc()ed entries from put_addrinfo() data, or NULL.
+ * Lengths are checked by hand rather than with buf_get functions, which
+ * would exit on a short read */
+static struct addrinfo* get_addrinfo(buffer *buf) {
+	struct addrinfo *res = NULL, **tail = &res;
+
+	while (buf->len - buf->pos >= 16) {
+		struct addrinfo *r = NULL;
+		int family, socktype, protocol;
+		unsigned int addrlen;
+
+		family = buf_getint(buf);
+		socktype = buf_getint(buf);
+		protocol = buf_getint(buf);
+		addrlen = buf_getint(buf);
+		if (addrlen > buf->len - buf->pos
+				|| addrlen > sizeof(struct sockaddr_storage)) {
+			break;
+		}
+		r = m_malloc(sizeof(*r) + addrlen);
+		r->ai_family = family;
+		r->ai_socktype = socktype;
+		r->ai_protocol = protocol;
+		r->ai_addrlen = addrlen;
+		r->ai_addr = (struct sockaddr*)(r + 1);
+		memcpy(r->ai_addr, buf_getptr(buf, addrlen), addrlen);
+		buf_incrpos(buf, addrlen);
+		*tail = r;
+		tail = &r->ai_next;
 	}
+	return res;
 }
+#endif
+
+#if DROPBEAR_RESOLVE_CACHE_TIME
+/* Lookups for outbound connections are kept for the rest of the session,
+ * up to DROPBEAR_RESOLVE_CACHE_TIME. getaddrinfo() doesn't give the DNS TTL */
+struct resolve_cache_entry {
+	char *host, *port;
+	buffer *addrs; /* as put_addrinfo() */
+	time_t expires; /* monotonic */
+};
+
+static void free_resolve_cache_entry(m_list_elem *elem) {
+	struct resolve_cache_entry *e = list_remove(elem);
+	m_free(e->host);
+	m_free(e->port);
+	buf_free(e->addrs);
+	m_free(e);
+}
+
+/* Returns the cached addresses for host and port, or NULL. Expired
+ * entries are removed */
+static buffer* resolve_cache_get(const char *host, const char *port) {
+	m_list_elem *iter = NULL, *next = NULL;
+	time_t now = monotonic_now();
+
+	for (iter = ses.resolve_cache.first; iter; iter = next) {
+		struct resolve_cache_entry *e = iter->item;
+		next = iter->next;
+		if (e->expires <= now) {
+			free_resolve_cache_entry(iter);
+			continue;
+		}
+		if (strcmp(e->host, host) == 0 && strcmp(e->port, port) == 0) {
+			buf_setpos(e->addrs, 0);
+			return e->addrs;
+		}
+	}
+	return NULL;
+}
+
+static void resolve_cache_put(const char *host, const char *port,
+		const unsigned char *addrs, unsigned int len) {
+	struct resolve_cache_entry *e = NULL;
+	m_list_elem *iter = NULL, *oldest = NULL;
+	unsigned int count = 0;
+
+	if (len == 0 || resolve_cache_get(host, port)) {
+		return;
+	}
+	for (iter = ses.resolve_cache.first; iter; iter = iter->next) {
+		e = iter->item;
+		if (!oldest || e->expires < ((struct resolve_cache_entry*)oldest->item)->expires) {
+			oldest = iter;
+		}
+		count++;
+	}
+	if (count >= DROPBEAR_RESOLVE_CACHE_SIZE) {
+		free_resolve_cache_entry(oldest);
+	}
+
+	e = m_malloc(sizeof(*e));
+	e->host = m_strdup(host);
+	e->port = m_strdup(port);
+	e->addrs = buf_new(len);
+	buf_putbytes(e->addrs, addrs, len);
+	e->expires = monotonic_now() + DROPBEAR_RESOLVE_CACHE_TIME;
+	list_append(&ses.resolve_cache, e);
+}
+#endif /* DROPBEAR_RESOLVE_CACHE_TIME */
+
+void remove_resolve_cache() {
+#if DROPBEAR_RESOLVE_CACHE_TIME
+	while (ses.resolve_cache.first) {
+		free_resolve_cache_entry(ses.resolve_cache.first);
+	}
+#endif
+}
+
+#if DROPBEAR_ASYNC_RESOLVE
+/* Runs in the helper process. Writes the getaddrinfo() error code then
+ * the results as put_addrinfo(), at most RESOLVE_MAX_LEN bytes */
+static void resolve_helper(int fd, const char *host, const char *port,
+		const struct addrinfo *hints) {
+	struct addrinfo *res = NULL;
+	buffer *buf = NULL;
+	int err, i;
+
+	/* Don't hold the session's sockets open while the lookup waits. Its
+	 * fds are below FD_SETSIZE or ses.maxfd, for select() */
+	for (i = 0; i < MAX(FD_SETSIZE, ses.maxfd + 1); i++) {
+		if (i != fd) {
+			close(i);
+		}
+	}
+
+	buf = buf_new(RESOLVE_MAX_LEN);
+	err = getaddrinfo(host, port, hints, &res);
+	buf_putint(buf, err);
+	if (err == 0) {
+		put_addrinfo(buf, res);
+		freeaddrinfo(res);
+	}
+	buf_setpos(buf, 0);
+	(void)atomicio(vwrite, fd, buf_getptr(buf, buf->len), buf->len);
+	_exit(0);
+}
+
+/* Runs getaddrinfo() in a helper process, so that a slow lookup doesn't
+ * hold up other channels in the session. The results are read by
+ * handle_connect_fds() */
+static int connect_resolve_async(struct dropbear_progress_connection *c,
+		const struct addrinfo *hints) {
+	int fds[2];
+	pid_t pid;
+
+	if (pipe(fds) < 0) {
+		return DROPBEAR_FAILURE;
+	}
+	pid = fork();
+	if (pid < 0) {
+		close(fds[0]);
+		close(fds[1]);
+		return DROPBEAR_FAILURE;
+	}
+	if (pid == 0) {
+		/* The intermediate process exits straight away, so the helper
+		is reparented and a server's SIGCHLD handling never sees it */
+		close(fds[0]);
+		if (fork() == 0) {
+			resolve_helper(fds[1], c->remotehost, c->remoteport, hints);
+		}
+		_exit(0);
+	}
+	close(fds[1]);
+	while (waitpid(pid, NULL, 0) < 0 && errno == EINTR) {}
+
+	TRACE(("resolving %s in the background", c->remotehost))
+	setnonblocking(fds[0]);
+	ses.maxfd = MAX(ses.maxfd, fds[0]);
+	c->resolve_fd = fds[0];
+	/* one more than the helper can write, to catch a bad reply */
+	c->resolve_buf = buf_new(RESOLVE_MAX_LEN + 1);
+	return DROPBEAR_SUCCESS;
+}
+
+/* Reads results from the helper, setting up c->res once it has all
+ * arrived */
+static void read_resolve_fd(struct dropbear_progress_connection *c) {
+	buffer *buf = c->resolve_buf;
+	ssize_t len;
+	int err;
+
+	len = read(c->resolve_fd, buf_getwriteptr(buf, buf->size - buf->len),
+			buf->size - buf->len);
+	if (len < 0 && (errno == EINTR || errno == EAGAIN)) {
+		return;
+	}
+	if (len > 0) {
+		buf_incrwritepos(buf, len);
+		if (buf->len < buf->size) {
+			return;
+		}
+	}
+
+	/* EOF, the helper has finished, or it sent too much */
+	m_close(c->resolve_fd);
+	c->resolve_fd = -1;
+
+	buf_setpos(buf, 0);
+	if (buf->len == buf->size) {
+		set_resolve_error(c, "Lookup result too long");
+		goto out;
+	}
+	if (buf->len < 4) {
+		set_resolve_error(c, "Lookup failed");
+		goto out;
+	}
+	err = buf_getint(buf);
+	if (err != 0) {
+		set_resolve_error(c, gai_strerror(err));
+		goto out;
+	}
+#if DROPBEAR_RESOLVE_CACHE_TIME
+	resolve_cache_put(c->remotehost, c->remoteport,
+		buf_getptr(buf, buf->len - buf->pos), buf->len - buf->pos);
+#endif
+	c->res = get_addrinfo(buf);
+	if (!c->res) {
+		set_resolve_error(c, "No addresses");
+	}
+	connect_set_addrs(c);
+
+out:
+	buf_free(c->resolve_buf);
+	c->resolve_buf = NULL;
+}
+#endif /* DROPBEAR_ASYNC_RESOLVE */
 
 /* Connect via TCP to a host. */
 struct dropbear_progress_connection *connect_remote(const char* remotehost, const char* remoteport,
@@ -193,15 +569,14 @@ struct dropbear_progress_connection *connect_remote(const char* remotehost, cons
 	int err;
 	struct addrinfo hints;
 
-	c = m_malloc(sizeof(*c));
-	c->remotehost = m_strdup(remotehost);
-	c->remoteport = m_strdup(remoteport);
-	c->sock = -1;
-	c->cb = cb;
-	c->cb_data = cb_data;
-	c->prio = prio;
+	c = new_connect(remotehost, remoteport, cb, cb_data, prio);
 
-	list_append(&ses.conn_pending, c);
+	if (bind_address) {
+		c->bind_address = m_strdup(bind_address);
+	}
+	if (bind_port) {
+		c->bind_port = m_strdup(bind_port);
+	}
 
 #if DROPBEAR_FUZZ
 	if (fuzz.fuzzing) {
@@ -214,23 +589,45 @@ struct dropbear_progress_connection *connect_remote(const char* remotehost, cons
 	hints.ai_socktype = SOCK_STREAM;
 	hints.ai_family = AF_UNSPEC;
 
+	/* Addresses can be converted immediately, only names need a lookup */
+	hints.ai_flags = AI_NUMERICHOST;
 	err = getaddrinfo(remotehost, remoteport, &hints, &c->res);
+	hints.ai_flags = 0;
+
+	if (err == EAI_NONAME) {
+#if DROPBEAR_RESOLVE_CACHE_TIME
+		buffer *cached = resolve_cache_get(remotehost, remoteport);
+		if (cached) {
+			TRACE(("resolve cache hit for %s port %s", remotehost, remoteport))
+			SES_STAT_ADD(resolve_cache_hits, 1);
+			c->res = get_addrinfo(cached);
+			connect_set_addrs(c);
+			return c;
+		}
+		SES_STAT_ADD(resolve_cache_misses, 1);
+#endif
+#if DROPBEAR_ASYNC_RESOLVE
+		if (connect_resolve_async(c, &hints) == DROPBEAR_SUCCESS) {
+			return c;
+		}
+#endif
+		err = getaddrinfo(remotehost, remoteport, &hints, &c->res);
+#if DROPBEAR_RESOLVE_CACHE_TIME
+		if (err == 0) {
+			buffer *addrs = buf_new(RESOLVE_MAX_LEN);
+			put_addrinfo(addrs, c->res);
+			resolve_cache_put(remotehost, remoteport, addrs->data, addrs->len);
+			buf_free(addrs);
+		}
+#endif
+	}
+
 	if (err) {
-		int len;
-		len = 100 + strlen(gai_strerror(err));
-		c->errstring = (char*)m_malloc(len);
-		snprintf(c->errstring, len, "Error resolving '%s' port '%s'. %s", 
-				remotehost, remoteport, gai_strerror(err));
-		TRACE(("Error resolving: %s", gai_strerror(err)))
+		c->res = NULL;
+		set_resolve_error(c, gai_strerror(err));
 	} else {
-		c->res_iter = c->res;
-	}
-	
-	if (bind_address) {
-		c->bind_address = m_strdup(bind_address);
-	}
-	if (bind_port) {
-		c->bind_port = m_strdup(bind_port);
+		c->res_gai = 1;
+		connect_set_addrs(c);
 	}
 
 	return c;
@@ -244,15 +641,7 @@ struct dropbear_progress_connection *connect_streamlocal(const char* localpath,
 	struct dropbear_progress_connection *c = NULL;
 	struct sockaddr_un *sunaddr;
 
-	c = m_malloc(sizeof(*c));
-	c->remotehost = m_strdup(localpath);
-	c->remoteport = NULL;
-	c->sock = -1;
-	c->cb = cb;
-	c->cb_data = cb_data;
-	c->prio = prio;
-
-	list_append(&ses.conn_pending, c);
+	c = new_connect(localpath, NULL, cb, cb_data, prio);
 
 #if DROPBEAR_FUZZ
 	if (fuzz.fuzzing) {
@@ -269,8 +658,8 @@ struct dropbear_progress_connection *connect_streamlocal(const char* localpath,
 
 	/*
 	 * Fake up a struct addrinfo for AF_UNIX connections.
-	 * remove_connect() must check ai_family
-	 * and use m_free() not freeaddrinfo() for AF_UNIX.
+	 * res_gai is unset so remove_connect() will use m_free() rather
+	 * than freeaddrinfo().
 	 */
 	c->res = m_malloc(sizeof(*c->res) + sizeof(*sunaddr));
 	c->res->ai_addr = (struct sockaddr *)(c->res + 1);
@@ -282,8 +671,7 @@ struct dropbear_progress_connection *connect_streamlocal(const char* localpath,
 	sunaddr->sun_family = AF_UNIX;
 	strlcpy(sunaddr->sun_path, localpath, sizeof(sunaddr->sun_path));
 
-	/* Copy to target iter */ 
-	c->res_iter = c->res;
+	connect_set_addrs(c);
 
 	return c;
 }
@@ -296,18 +684,51 @@ void remove_connect_pending() {
 }
 
 
-void set_connect_fds(fd_set *writefd) {
+/* Starts an attempt to the next address. As RFC8305 Happy Eyeballs, if
+it hasn't completed after DROPBEAR_CONNECT_ATTEMPT_DELAY another is
+started in parallel to the next address, and so on. */
+static void connect_start_attempt(struct dropbear_progress_connection *c) {
+	if (connect_try_next(c)) {
+		timer_after_ms(&c->attempt_timer, DROPBEAR_CONNECT_ATTEMPT_DELAY);
+	}
+}
+
+static void connect_attempt_timeout(void *arg) {
+	struct dropbear_progress_connection *c = arg;
+	if (num_attempts(c) < DROPBEAR_CONNECT_MAX_ATTEMPTS && !c->fastopen_sent) {
+		connect_start_attempt(c);
+	}
+}
+
+void set_connect_fds(fd_set *readfd, fd_set *writefd) {
 	m_list_elem *iter;
 	iter = ses.conn_pending.first;
 	while (iter) {
 		m_list_elem *next_iter = iter->next;
 		struct dropbear_progress_connection *c = iter->item;
+		unsigned int i;
+
+#if DROPBEAR_ASYNC_RESOLVE
+		if (c->resolve_fd >= 0) {
+			dropbear_fd_set(c->resolve_fd, readfd);
+			iter = next_iter;
+			continue;
+		}
+#else
+		(void)readfd;
+#endif
+
 		/* Set one going */
-		while (c->res_iter && c->sock < 0) {
-			connect_try_next(c);
+		if (num_attempts(c) == 0) {
+			connect_start_attempt(c);
 		}
-		if (c->sock >= 0) {
-			dropbear_fd_set(c->sock, writefd);
+
+		if (num_attempts(c) > 0) {
+			for (i = 0; i < DROPBEAR_CONNECT_MAX_ATTEMPTS; i++) {
+				if (c->socks[i] >= 0) {
+					dropbear_fd_set(c->socks[i], writefd);
+				}
+			}
 		} else {
 			/* Final failure */
 			if (!c->errstring) {
@@ -320,39 +741,62 @@ void set_connect_fds(fd_set *writefd) {
 	}
 }
 
-void handle_connect_fds(const fd_set *writefd) {
+void handle_connect_fds(const fd_set *readfd, const fd_set *writefd) {
 	m_list_elem *iter;
 	for (iter = ses.conn_pending.first; iter; iter = iter->next) {
-		int val;
-		socklen_t vallen = sizeof(val);
 		struct dropbear_progress_connection *c = iter->item;
+		unsigned int i;
 
-		if (c->sock < 0 || !FD_ISSET(c->sock, writefd)) {
+#if DROPBEAR_ASYNC_RESOLVE
+		if (c->resolve_fd >= 0) {
+			if (FD_ISSET(c->resolve_fd, readfd)) {
+				read_resolve_fd(c);
+			}
 			continue;
 		}
+#else
+		(void)readfd;
+#endif
 
-		TRACE(("handling %s port %s socket %d", c->remotehost, c->remoteport, c->sock));
+		for (i = 0; i < DROPBEAR_CONNECT_MAX_ATTEMPTS; i++) {
+			int val;
+			socklen_t vallen = sizeof(val);
+			int sock = c->socks[i];
 
-		if (getsockopt(c->sock, SOL_SOCKET, SO_ERROR, &val, &vallen) != 0) {
-			TRACE(("handle_connect_fds getsockopt(%d) SO_ERROR failed: %s", c->sock, strerror(errno)))
-			/* This isn't expected to happen - Unix has surprises though, continue gracefully. */
-			m_close(c->sock);
-			c->sock = -1;
-		} else if (val != 0) {
-			/* Connect failed */
-			TRACE(("connect to %s port %s failed.", c->remotehost, c->remoteport))
-			m_close(c->sock);
-			c->sock = -1;
+			if (sock < 0 || !FD_ISSET(sock, writefd)) {
+				continue;
+			}
 
-			m_free(c->errstring);
-			c->errstring = m_strdup(strerror(val));
-		} else {
-			/* New connection has been established */
-			c->cb(DROPBEAR_SUCCESS, c->sock, c->cb_data, NULL);
-			remove_connect(c, iter);
-			TRACE(("leave handle_connect_fds - success"))
-			/* Must return here - remove_connect() invalidates iter */
-			return; 
+			TRACE(("handling %s port %s socket %d", c->remotehost, c->remoteport, sock));
+
+			if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &val, &vallen) != 0) {
+				TRACE(("handle_connect_fds getsockopt(%d) SO_ERROR failed: %s", sock, strerror(errno)))
+				/* This isn't expected to happen - Unix has surprises though, continue gracefully. */
+				m_close(sock);
+				c->socks[i] = -1;
+			} else if (val != 0) {
+				/* Connect failed */
+				TRACE(("connect to %s port %s failed.", c->remotehost, c->remoteport))
+				m_close(sock);
+				c->socks[i] = -1;
+
+				m_free(c->errstring);
+				c->errstring = m_strdup(strerror(val));
+			} else {
+				/* New connection has been established, any others
+				that were racing it are closed */
+				c->socks[i] = -1;
+				close_attempts(c);
+				c->cb(DROPBEAR_SUCCESS, sock, c->cb_data, NULL);
+				remove_connect(c, iter);
+				TRACE(("leave handle_connect_fds - success"))
+				/* Must return here - remove_connect() invalidates iter */
+				return; 
+			}
+
+			/* Move on to the next address straight away */
+			c->fastopen_sent = 0;
+			timer_after_ms(&c->attempt_timer, 0);
 		}
 	}
 }
@@ -492,6 +936,23 @@ void set_sock_priority(int sock, enum dropbear_prio prio) {
 
 }
 
+/* Keep little unsent data in the kernel while a low delay channel is
+open, its data would otherwise wait behind it. Data stays in the
+writequeue instead where channel reads are held back. */
+void set_sock_notsent_lowat(int sock, int lowdelay_chan) {
+#ifdef TCP_NOTSENT_LOWAT
+	/* 0 is the system default */
+	int val = lowdelay_chan ? 16384 : 0;
+	int rc = setsockopt(sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, (void*)&val, sizeof(val));
+	if (rc < 0 && errno != ENOTSOCK && errno != EOPNOTSUPP) {
+		TRACE(("Couldn't set TCP_NOTSENT_LOWAT (%s)", strerror(errno)))
+	}
+#else
+	(void)sock;
+	(void)lowdelay_chan;
+#endif
+}
+
 /* from openssh/canohost.c avoid premature-optimization */
 int get_sock_port(int sock) {
 	struct sockaddr_storage from;
@@ -12,6 +12,7 @@ enum dropbear_prio {
 
 void set_sock_nodelay(int sock);
 void set_sock_priority(int sock, enum dropbear_prio prio);
+void set_sock_notsent_lowat(int sock, int lowdelay_chan);
 
 int get_sock_port(int sock);
 void get_socket_address(int fd, char **local_host, char **local_port,
@@ -38,11 +39,12 @@ struct dropbear_progress_connection * connect_streamlocal (const char* localpath
 	enum dropbear_prio prio);
 
 /* Sets up for select() */
-void set_connect_fds(fd_set *writefd);
+void set_connect_fds(fd_set *readfd, fd_set *writefd);
 /* Handles ready sockets after select() */
-void handle_connect_fds(const fd_set *writefd);
+void handle_connect_fds(const fd_set *readfd, const fd_set *writefd);
 /* Cleanup */
 void remove_connect_pending(void);
+void remove_resolve_cache(void);
 
 /* Doesn't actually stop the connect, but adds a dummy callback instead */
 void cancel_connect(struct dropbear_progress_connection *c);
@@ -38,9 +38,6 @@
 #include "runopts.h"
 
 static int read_packet_init(void);
-static void make_mac(unsigned int seqno, const struct key_context_directional * key_state,
-		buffer * clear_buf, unsigned int clear_len, 
-		unsigned char *output_mac);
 static int checkmac(void);
 
 /* For exact details see http://www.zlib.net/zlib_tech.html
@@ -49,9 +46,30 @@ static int checkmac(void);
  * exact multiple. */
 #define ZLIB_COMPRESS_EXPANSION (((RECV_MAX_PAYLOAD_LEN/16384)+1)*5 + 6)
 #define ZLIB_DECOMPRESS_INCR 1024
+#if DROPBEAR_ZLIB_ADAPTIVE
+/* Outgoing data is sampled ZLIB_ADAPT_SAMPLE bytes at a time. If a sample
+ * saved less than 1/ZLIB_ADAPT_MIN_SAVING of its size, stored blocks are sent
+ * for the next ZLIB_ADAPT_STORED_MIN bytes, doubling up to
+ * ZLIB_ADAPT_STORED_MAX while the data still doesn't compress */
+#define ZLIB_ADAPT_SAMPLE (64*1024)
+#define ZLIB_ADAPT_MIN_SAVING 16
+#define ZLIB_ADAPT_MIN_PACKET 512
+#define ZLIB_ADAPT_STORED_MIN (1024*1024)
+#define ZLIB_ADAPT_STORED_MAX (8*1024*1024)
+#endif
 #ifndef DISABLE_ZLIB
 static buffer* buf_decompress(const buffer* buf, unsigned int len);
 static void buf_compress(buffer * dest, buffer * src, unsigned int len);
+#if DROPBEAR_ZLIB_ADAPTIVE
+static void zlib_adapt_level(struct key_context_directional *ctx);
+static void zlib_adapt_sample(struct zlib_adapt *za, unsigned int len,
+		unsigned int complen);
+#endif
+#endif
+#if DROPBEAR_SESSION_STATS
+static unsigned long long crypt_timer_start(unsigned long long *mac_start);
+static unsigned long long crypt_timer_end(unsigned long long start,
+		unsigned long long mac_start);
 #endif
 
 /* non-blocking function writing out a current encrypted packet */
@@ -86,6 +104,7 @@ void write_packet() {
 #endif
 	{
 	written = writev(ses.sock_out, iov, iov_count);
+	SES_STAT_ADD(writes, 1);
 	if (written < 0) {
 		if (errno == EINTR || errno == EAGAIN) {
 			TRACE2(("leave write_packet: EINTR"))
@@ -98,6 +117,7 @@ void write_packet() {
 
 	packet_queue_consume(&ses.writequeue, written);
 	ses.writequeue_len -= written;
+	SES_STAT_ADD(bytes_out, written);
 
 	if (written == 0) {
 		ses.remoteclosed();
@@ -114,6 +134,7 @@ void write_packet() {
 	dropbear_assert(len > 0);
 	/* Try to write as much as possible */
 	written = write(ses.sock_out, buf_getptr(writebuf, len), len);
+	SES_STAT_ADD(writes, 1);
 
 	if (written < 0) {
 		if (errno == EINTR || errno == EAGAIN) {
@@ -129,6 +150,7 @@ void write_packet() {
 	}
 
 	ses.writequeue_len -= written;
+	SES_STAT_ADD(bytes_out, written);
 
 	if (written == len) {
 		/* We've finished with the packet, free it */
@@ -181,6 +203,7 @@ void read_packet() {
 		len = 0;
 	} else {
 		len = read(ses.sock_in, buf_getptr(ses.readbuf, maxlen), maxlen);
+		SES_STAT_ADD(reads, 1);
 
 		if (len == 0) {
 			ses.remoteclosed();
@@ -196,6 +219,7 @@ void read_packet() {
 		}
 
 		buf_incrpos(ses.readbuf, len);
+		SES_STAT_ADD(bytes_in, len);
 	}
 
 	if ((unsigned int)len == maxlen) {
@@ -218,7 +242,9 @@ static int read_packet_init() {
 	unsigned int len, plen;
 	unsigned int blocksize;
 	unsigned int macsize;
-
+#if DROPBEAR_SESSION_STATS
+	unsigned long long stat_start, stat_mac;
+#endif
 
 	blocksize = ses.keys->recv.algo_crypt->blocksize;
 	macsize = ses.keys->recv.algo_mac->hashsize;
@@ -233,6 +259,7 @@ static int read_packet_init() {
 	/* read the rest of the packet if possible */
 	slen = read(ses.sock_in, buf_getwriteptr(ses.readbuf, maxlen),
 			maxlen);
+	SES_STAT_ADD(reads, 1);
 	if (slen == 0) {
 		ses.remoteclosed();
 	}
@@ -245,6 +272,7 @@ static int read_packet_init() {
 	}
 
 	buf_incrwritepos(ses.readbuf, slen);
+	SES_STAT_ADD(bytes_in, slen);
 
 	if ((unsigned int)slen != maxlen) {
 		/* don't have enough bytes to determine length, get next time */
@@ -254,6 +282,9 @@ static int read_packet_init() {
 	/* now we have the first block, need to get packet length, so we decrypt
 	 * the first block (only need first 4 bytes) */
 	buf_setpos(ses.readbuf, 0);
+#if DROPBEAR_SESSION_STATS
+	stat_start = crypt_timer_start(&stat_mac);
+#endif
 #if DROPBEAR_AEAD_MODE
 	if (ses.keys->recv.crypt_mode->aead_crypt) {
 		if (ses.keys->recv.crypt_mode->aead_getlength(ses.recvseq,
@@ -275,6 +306,9 @@ static int read_packet_init() {
 		plen = buf_getint(ses.readbuf) + 4;
 		len = plen + macsize;
 	}
+#if DROPBEAR_SESSION_STATS
+	ses.stats.decrypt_ns += crypt_timer_end(stat_start, stat_mac);
+#endif
 
 	TRACE2(("packet size is %u, block %u mac %u", len, blocksize, macsize))
 
@@ -301,6 +335,9 @@ void decrypt_packet() {
 	unsigned char macsize;
 	unsigned int padlen;
 	unsigned int len;
+#if DROPBEAR_SESSION_STATS
+	unsigned long long stat_start, stat_mac;
+#endif
 
 	TRACE2(("enter decrypt_packet"))
 	blocksize = ses.keys->recv.algo_crypt->blocksize;
@@ -308,6 +345,9 @@ void decrypt_packet() {
 
 	ses.kexstate.datarecv += ses.readbuf->len;
 
+#if DROPBEAR_SESSION_STATS
+	stat_start = crypt_timer_start(&stat_mac);
+#endif
 #if DROPBEAR_AEAD_MODE
 	if (ses.keys->recv.crypt_mode->aead_crypt) {
 		/* first blocksize is not decrypted yet */
@@ -346,6 +386,9 @@ void decrypt_packet() {
 		}
 
 	}
+#if DROPBEAR_SESSION_STATS
+	ses.stats.decrypt_ns += crypt_timer_end(stat_start, stat_mac);
+#endif
 	
 #if DROPBEAR_FUZZ
 	fuzz_dump(ses.readbuf->data, ses.readbuf->len);
@@ -381,6 +424,7 @@ void decrypt_packet() {
 	ses.readbuf = NULL;
 
 	ses.recvseq++;
+	SES_STAT_ADD(packets_in, 1);
 
 	TRACE2(("leave decrypt_packet"))
 }
@@ -422,7 +466,8 @@ static int checkmac() {
 }
 
 #ifndef DISABLE_ZLIB
-/* returns a pointer to a newly created buffer */
+/* Decompresses into ses.decompress_buf and returns it. The buffer is
+ * reused for the next packet, callers must not free it */
 static buffer* buf_decompress(const buffer* buf, unsigned int len) {
 
 	int result;
@@ -431,8 +476,14 @@ static buffer* buf_decompress(const buffer* buf, unsigned int len) {
 
 	zstream = ses.keys->recv.zstream;
 	/* We use RECV_MAX_PAYLOAD_LEN+1 here to ensure that
-	   we can detect an oversized payload after inflate() */
-	ret = buf_new(RECV_MAX_PAYLOAD_LEN+1);
+	   we can detect an oversized payload after inflate().
+	   The buffer is reused for each packet */
+	if (ses.decompress_buf == NULL) {
+		ses.decompress_buf = buf_new(RECV_MAX_PAYLOAD_LEN+1);
+	}
+	ret = ses.decompress_buf;
+	buf_setpos(ret, 0);
+	buf_setlen(ret, 0);
 
 	zstream->avail_in = len;
 	zstream->next_in = buf_getptr(buf, len);
@@ -522,74 +573,42 @@ void maybe_flush_reply_queue() {
 	ses.reply_queue_len = 0;
 }
 	
-/* encrypt the writepayload, putting into writebuf, ready for write_packet()
- * to put on the wire */
-void encrypt_packet() {
-
-	unsigned char padlen;
+/* Size of a wire buffer that can hold an uncompressed payload of payload_len
+ * plus the packet header, padding and MAC */
+static unsigned int wire_packet_size(unsigned int payload_len) {
 	unsigned char blocksize, mac_size;
-	buffer * writebuf; /* the packet which will go on the wire. This is 
-	                      encrypted in-place. */
-	unsigned char packet_type;
-	unsigned int len, encrypt_buf_size;
-	unsigned char mac_bytes[MAX_MAC_LEN];
 
-	time_t now;
-	
-	TRACE2(("enter encrypt_packet()"))
-
-	buf_setpos(ses.writepayload, 0);
-	packet_type = buf_getbyte(ses.writepayload);
-	buf_setpos(ses.writepayload, 0);
-
-	TRACE2(("encrypt_packet type is %d", packet_type))
-	
-	if ((!ses.dataallowed && !packet_is_okay_kex(packet_type))) {
-		/* During key exchange only particular packets are allowed.
-			Since this packet_type isn't OK we just enqueue it to send 
-			after the KEX, see maybe_flush_reply_queue */
-		enqueue_reply_packet();
-		return;
-	}
-		
 	blocksize = ses.keys->trans.algo_crypt->blocksize;
 	mac_size = ses.keys->trans.algo_mac->hashsize;
 
 	/* Encrypted packet len is payload+5. We need to then make sure
 	 * there is enough space for padding or MIN_PACKET_LEN. 
 	 * Add extra 3 since we need at least 4 bytes of padding */
-	encrypt_buf_size = (ses.writepayload->len+4+1) 
+	return (payload_len+4+1) 
 		+ MAX(MIN_PACKET_LEN, blocksize) + 3
 	/* add space for the MAC at the end */
 				+ mac_size
-#ifndef DISABLE_ZLIB
-	/* some extra in case 'compression' makes it larger */
-				+ ZLIB_COMPRESS_EXPANSION
-#endif
 	/* and an extra cleartext (stripped before transmission) byte for the
 	 * packet type */
 				+ 1;
+}
 
-	writebuf = buf_new(encrypt_buf_size);
-	buf_setlen(writebuf, PACKET_PAYLOAD_OFF);
-	buf_setpos(writebuf, PACKET_PAYLOAD_OFF);
+/* pad, MAC and encrypt a wire packet in-place. The payload must already be
+ * at PACKET_PAYLOAD_OFF. The packet is then queued for write_packet() */
+static void seal_packet(buffer *writebuf, unsigned char packet_type) {
 
-#ifndef DISABLE_ZLIB
-	/* compression */
-	if (is_compress_trans()) {
-		buf_compress(writebuf, ses.writepayload, ses.writepayload->len);
-	} else
+	unsigned char padlen;
+	unsigned char blocksize, mac_size;
+	unsigned int len;
+	unsigned char mac_bytes[MAX_MAC_LEN];
+#if DROPBEAR_SESSION_STATS
+	unsigned long long stat_start, stat_mac;
 #endif
-	{
-		memcpy(buf_getwriteptr(writebuf, ses.writepayload->len),
-				buf_getptr(ses.writepayload, ses.writepayload->len),
-				ses.writepayload->len);
-		buf_incrwritepos(writebuf, ses.writepayload->len);
-	}
 
-	/* finished with payload */
-	buf_setpos(ses.writepayload, 0);
-	buf_setlen(ses.writepayload, 0);
+	time_t now;
+
+	blocksize = ses.keys->trans.algo_crypt->blocksize;
+	mac_size = ses.keys->trans.algo_mac->hashsize;
 
 	/* length of padding - packet length excluding the packetlength uint32
 	 * field in aead mode must be a multiple of blocksize, with a minimum of
@@ -620,6 +639,9 @@ void encrypt_packet() {
 	buf_incrlen(writebuf, padlen);
 	genrandom(buf_getptr(writebuf, padlen), padlen);
 
+#if DROPBEAR_SESSION_STATS
+	stat_start = crypt_timer_start(&stat_mac);
+#endif
 #if DROPBEAR_AEAD_MODE
 	if (ses.keys->trans.crypt_mode->aead_crypt) {
 		/* do the actual encryption, in-place */
@@ -656,6 +678,9 @@ void encrypt_packet() {
 		/* stick the MAC on it */
 		buf_putbytes(writebuf, mac_bytes, mac_size);
 	}
+#if DROPBEAR_SESSION_STATS
+	ses.stats.encrypt_ns += crypt_timer_end(stat_start, stat_mac);
+#endif
 
 	/* Update counts */
 	ses.kexstate.datatrans += writebuf->len;
@@ -664,6 +689,7 @@ void encrypt_packet() {
 
 	/* Update counts */
 	ses.transseq++;
+	SES_STAT_ADD(packets_out, 1);
 
 	now = monotonic_now();
 	ses.last_packet_time_any_sent = now;
@@ -676,26 +702,130 @@ void encrypt_packet() {
 		ses.last_packet_time_idle = now;
 
 	}
+}
+
+/* encrypt the writepayload, putting into writebuf, ready for write_packet()
+ * to put on the wire */
+void encrypt_packet() {
+
+	buffer * writebuf; /* the packet which will go on the wire. This is 
+	                      encrypted in-place. */
+	unsigned char packet_type;
+	unsigned int encrypt_buf_size;
+
+	TRACE2(("enter encrypt_packet()"))
+
+	buf_setpos(ses.writepayload, 0);
+	packet_type = buf_getbyte(ses.writepayload);
+	buf_setpos(ses.writepayload, 0);
+
+	TRACE2(("encrypt_packet type is %d", packet_type))
+	
+	if ((!ses.dataallowed && !packet_is_okay_kex(packet_type))) {
+		/* During key exchange only particular packets are allowed.
+			Since this packet_type isn't OK we just enqueue it to send 
+			after the KEX, see maybe_flush_reply_queue */
+		enqueue_reply_packet();
+		return;
+	}
+
+	encrypt_buf_size = wire_packet_size(ses.writepayload->len)
+#ifndef DISABLE_ZLIB
+	/* some extra in case 'compression' makes it larger */
+				+ ZLIB_COMPRESS_EXPANSION
+#endif
+				;
+
+	writebuf = buf_new(encrypt_buf_size);
+	buf_setlen(writebuf, PACKET_PAYLOAD_OFF);
+	buf_setpos(writebuf, PACKET_PAYLOAD_OFF);
+
+#ifndef DISABLE_ZLIB
+	/* compression */
+	if (is_compress_trans()) {
+		buf_compress(writebuf, ses.writepayload, ses.writepayload->len);
+	} else
+#endif
+	{
+		memcpy(buf_getwriteptr(writebuf, ses.writepayload->len),
+				buf_getptr(ses.writepayload, ses.writepayload->len),
+				ses.writepayload->len);
+		buf_incrwritepos(writebuf, ses.writepayload->len);
+	}
+
+	/* finished with payload */
+	buf_setpos(ses.writepayload, 0);
+	buf_setlen(ses.writepayload, 0);
+
+	seal_packet(writebuf, packet_type);
 
 	TRACE2(("leave encrypt_packet()"))
 }
 
+/* Returns a wire buffer that the caller can build a payload of up to
+ * max_payload_len bytes in directly, starting at the current position.
+ * This avoids copying bulk data through ses.writepayload. Returns NULL
+ * if the payload has to go through encrypt_packet() instead, because
+ * it will be compressed or deferred until KEX completes. */
+buffer* new_direct_packet(unsigned int max_payload_len) {
+	buffer *writebuf = NULL;
+
+	if (!ses.dataallowed) {
+		return NULL;
+	}
+#ifndef DISABLE_ZLIB
+	if (is_compress_trans()) {
+		return NULL;
+	}
+#endif
+
+	writebuf = buf_new(wire_packet_size(max_payload_len));
+	buf_setlen(writebuf, PACKET_PAYLOAD_OFF);
+	buf_setpos(writebuf, PACKET_PAYLOAD_OFF);
+	return writebuf;
+}
+
+/* Encrypts a packet from new_direct_packet() in-place and queues it.
+ * The payload is everything after PACKET_PAYLOAD_OFF */
+void encrypt_direct_packet(buffer *writebuf) {
+	unsigned char packet_type;
+
+	TRACE2(("enter encrypt_direct_packet()"))
+	dropbear_assert(ses.dataallowed);
+	dropbear_assert(writebuf->len > PACKET_PAYLOAD_OFF);
+
+	buf_setpos(writebuf, PACKET_PAYLOAD_OFF);
+	packet_type = buf_getbyte(writebuf);
+	buf_setpos(writebuf, writebuf->len);
+
+	TRACE2(("encrypt_direct_packet type is %d", packet_type))
+
+	seal_packet(writebuf, packet_type);
+	TRACE2(("leave encrypt_direct_packet()"))
+}
+
 void writebuf_enqueue(buffer * writebuf) {
 	/* enqueue the packet for sending. It will get freed after transmission. */
 	buf_setpos(writebuf, 0);
 	enqueue(&ses.writequeue, (void*)writebuf);
 	ses.writequeue_len += writebuf->len;
+#if DROPBEAR_SESSION_STATS
+	ses.stats.writequeue_max = MAX(ses.stats.writequeue_max, ses.writequeue_len);
+#endif
 }
 
 
 /* Create the packet mac, and append H(seqno|clearbuf) to the output */
 /* output_mac must have ses.keys->trans.algo_mac->hashsize bytes. */
-static void make_mac(unsigned int seqno, const struct key_context_directional * key_state,
+void make_mac(unsigned int seqno, const struct key_context_directional * key_state,
 		buffer * clear_buf, unsigned int clear_len, 
 		unsigned char *output_mac) {
 	unsigned char seqbuf[4];
 	unsigned long bufsize;
 	hmac_state hmac;
+#if DROPBEAR_SESSION_STATS
+	unsigned long long stat_start = session_stat_clock();
+#endif
 
 	if (key_state->algo_mac->hashsize > 0) {
 		/* calculate the mac */
@@ -725,6 +855,9 @@ static void make_mac(unsigned int seqno, const struct key_context_directional *
 			dropbear_exit("HMAC error");
 		}
 	}
+#if DROPBEAR_SESSION_STATS
+	ses.stats.mac_ns += session_stat_clock() - stat_start;
+#endif
 	TRACE2(("leave writemac"))
 }
 
@@ -736,6 +869,9 @@ static void buf_compress(buffer * dest, buffer * src, unsigned int len) {
 
 	unsigned int endpos = src->pos + len;
 	int result;
+#if DROPBEAR_ZLIB_ADAPTIVE
+	unsigned int startpos = dest->pos;
+#endif
 
 	TRACE2(("enter buf_compress"))
 
@@ -749,6 +885,10 @@ static void buf_compress(buffer * dest, buffer * src, unsigned int len) {
 	ses.keys->trans.zstream->next_out =
 		buf_getwriteptr(dest, ses.keys->trans.zstream->avail_out);
 
+#if DROPBEAR_ZLIB_ADAPTIVE
+	zlib_adapt_level(&ses.keys->trans);
+#endif
+
 	result = deflate(ses.keys->trans.zstream, Z_SYNC_FLUSH);
 
 	buf_setpos(src, endpos - ses.keys->trans.zstream->avail_in);
@@ -761,6 +901,83 @@ static void buf_compress(buffer * dest, buffer * src, unsigned int len) {
 
 	/* fails if destination buffer wasn't large enough */
 	dropbear_assert(ses.keys->trans.zstream->avail_in == 0);
+#if DROPBEAR_ZLIB_ADAPTIVE
+	zlib_adapt_sample(&ses.keys->trans.zadapt, len, dest->len - startpos);
+#endif
 	TRACE2(("leave buf_compress"))
 }
+
+#if DROPBEAR_ZLIB_ADAPTIVE
+/* Sets the zstream's level to match zadapt.stored. Output space must be
+ * set already since deflateParams() may flush */
+static void zlib_adapt_level(struct key_context_directional *ctx) {
+	struct zlib_adapt *za = &ctx->zadapt;
+	int result;
+
+	if (za->stored == za->stored_set) {
+		return;
+	}
+	TRACE(("zlib_adapt_level: %s", za->stored ? "stored" : "compressing"))
+	result = deflateParams(ctx->zstream,
+		za->stored ? Z_NO_COMPRESSION : Z_DEFAULT_COMPRESSION,
+		Z_DEFAULT_STRATEGY);
+	/* Older zlib returns Z_BUF_ERROR when there was nothing to flush */
+	if (result != Z_OK && result != Z_BUF_ERROR) {
+		dropbear_exit("zlib error");
+	}
+	za->stored_set = za->stored;
+}
+
+/* Decides whether the following packets should be compressed, after a
+ * packet of len bytes compressed to complen bytes */
+static void zlib_adapt_sample(struct zlib_adapt *za, unsigned int len,
+		unsigned int complen) {
+	if (za->stored) {
+		if (len < za->stored_left) {
+			za->stored_left -= len;
+		} else {
+			/* see whether it compresses again */
+			za->stored = 0;
+			za->sample_in = za->sample_out = 0;
+		}
+		return;
+	}
+
+	/* Small packets tell little about the data */
+	if (len < ZLIB_ADAPT_MIN_PACKET) {
+		return;
+	}
+	za->sample_in += len;
+	za->sample_out += complen;
+	if (za->sample_in < ZLIB_ADAPT_SAMPLE) {
+		return;
+	}
+
+	/* incompressible data grows slightly */
+	if (za->sample_out + za->sample_in / ZLIB_ADAPT_MIN_SAVING > za->sample_in) {
+		za->stored = 1;
+		za->stored_left = MAX(za->stored_span, ZLIB_ADAPT_STORED_MIN);
+		za->stored_span = MIN(za->stored_left * 2, ZLIB_ADAPT_STORED_MAX);
+		TRACE(("zlib_adapt_sample: %u compressed to %u, storing %u",
+			za->sample_in, za->sample_out, za->stored_left))
+	} else {
+		za->stored_span = 0;
+	}
+	za->sample_in = za->sample_out = 0;
+}
+#endif /* DROPBEAR_ZLIB_ADAPTIVE */
+#endif
+
+#if DROPBEAR_SESSION_STATS
+/* Time spent encrypting or decrypting, excluding any time in make_mac()
+ * meanwhile, which is counted separately */
+static unsigned long long crypt_timer_start(unsigned long long *mac_start) {
+	*mac_start = ses.stats.mac_ns;
+	return session_stat_clock();
+}
+
+static unsigned long long crypt_timer_end(unsigned long long start,
+		unsigned long long mac_start) {
+	return session_stat_clock() - start - (ses.stats.mac_ns - mac_start);
+}
 #endif
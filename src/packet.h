@@ -34,9 +34,17 @@ void write_packet(void);
 void read_packet(void);
 void decrypt_packet(void);
 void encrypt_packet(void);
+buffer* new_direct_packet(unsigned int max_payload_len);
+void encrypt_direct_packet(buffer *writebuf);
 
 void writebuf_enqueue(buffer * writebuf);
 
+struct key_context_directional;
+/* Also used by dropbearbench */
+void make_mac(unsigned int seqno, const struct key_context_directional * key_state,
+		buffer * clear_buf, unsigned int clear_len, 
+		unsigned char *output_mac);
+
 void process_packet(void);
 
 void maybe_flush_reply_queue(void);
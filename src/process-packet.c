@@ -159,7 +159,9 @@ void process_packet() {
 
 out:
 	ses.lastpacket = type;
-	buf_free(ses.payload);
+	if (ses.payload != ses.decompress_buf) {
+		buf_free(ses.payload);
+	}
 	ses.payload = NULL;
 
 	TRACE2(("leave process_packet"))
@@ -62,6 +62,14 @@ extern runopts opts;
 int readhostkey(const char * filename, sign_key * hostkey,
 	enum signkey_type *type);
 void load_all_hostkeys(void);
+void svr_snapshot_create(void);
+int svr_snapshot_reexec_fd(void);
+void svr_snapshot_open(int fd);
+int svr_snapshot_banner(void);
+#ifdef HAVE_GETGROUPLIST
+int svr_snapshot_group(void);
+#endif
+int svr_snapshot_hostkeys(void);
 void disable_sig_except(enum signature_type sig_type);
 
 typedef struct svr_runopts {
@@ -80,6 +88,15 @@ typedef struct svr_runopts {
 	/* Hidden "-2 childpipe_fd" flag indicates it's re-executing itself,
 	   stores the childpipe preauth file descriptor. Set to -1 otherwise. */
 	int reexec_childpipe;
+	/* Hidden "-3 fd" flag passes the login record queue to a re-executed
+	   session. Set to -1 otherwise. */
+	int reexec_loginqueue;
+	/* Hidden "-4 fd" flag passes the user cache to a re-executed
+	   session. Set to -1 otherwise. */
+	int reexec_pwcache;
+	/* Hidden "-5 fd" flag passes the startup snapshot (host keys, banner)
+	   to a re-executed session. Set to -1 otherwise. */
+	int reexec_snapshot;
 
 	/* Flags indicating whether to use ipv4 and ipv6 */
 	/* not used yet
@@ -106,6 +123,10 @@ typedef struct svr_runopts {
 	int allowblankpass;
 	int multiauthmethod;
 	unsigned int maxauthtries;
+	/* -x connection rate limits, 0 to disable */
+	unsigned int admit_rate;
+	unsigned int admit_burst;
+	unsigned int admit_global;
 
 #if DROPBEAR_SVR_REMOTEANYFWD
 	int noremotefwd;
@@ -207,6 +228,16 @@ typedef struct cli_runopts {
 	char *bind_address;
 	char *bind_port;
 	const char *keepalive_arg;
+#if DROPBEAR_CLI_MULTIPLEX
+	/* -o ControlPath, before expansion of ~ and %h etc */
+	char *control_path;
+	/* -o ControlMaster */
+	enum {
+		CONTROL_MASTER_NO,
+		CONTROL_MASTER_YES,
+		CONTROL_MASTER_AUTO,
+	} control_master;
+#endif
 } cli_runopts;
 
 extern cli_runopts cli_opts;
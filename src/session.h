@@ -38,6 +38,7 @@
 #include "chansession.h"
 #include "dbutil.h"
 #include "netio.h"
+#include "timer.h"
 #if DROPBEAR_PLUGIN
 #include "pubkeyapi.h"
 #endif
@@ -68,6 +69,20 @@ void cli_dropbear_exit(int exitcode, const char* format, va_list param) ATTRIB_N
 void cli_dropbear_log(int priority, const char* format, va_list param);
 void kill_proxy_command(void);
 
+#if !defined(DISABLE_ZLIB) && DROPBEAR_ZLIB_ADAPTIVE
+/* Adaptive compression of the transmit stream, see buf_compress() */
+struct zlib_adapt {
+	int stored; /* sending stored blocks rather than compressing */
+	int stored_set; /* what the zstream's level is set to */
+	/* while compressing, bytes in and out for the current sample */
+	unsigned int sample_in, sample_out;
+	/* while stored, bytes until compressing is tried again */
+	unsigned int stored_left;
+	/* length of the next stored run, grows while data doesn't compress */
+	unsigned int stored_span;
+};
+#endif
+
 /* crypto parameters that are stored individually for transmit and receive */
 struct key_context_directional {
 	const struct dropbear_cipher *algo_crypt;
@@ -77,6 +92,9 @@ struct key_context_directional {
 	int algo_comp; /* compression */
 #ifndef DISABLE_ZLIB
 	z_streamp zstream;
+#if DROPBEAR_ZLIB_ADAPTIVE
+	struct zlib_adapt zadapt; /* transmit only */
+#endif
 #endif
 	/* actual keys */
 	union {
@@ -107,6 +125,36 @@ struct key_context {
 	enum signature_type algo_signature; /* server signature type */
 };
 
+#if DROPBEAR_SESSION_STATS
+/* Logged by session_log_stats() */
+struct session_stats {
+	time_t start_time; /* monotonic */
+	unsigned long long packets_in, packets_out;
+	unsigned long long bytes_in, bytes_out; /* encrypted, on the socket */
+	unsigned long long reads, writes; /* syscalls on the socket */
+	unsigned long long wakeups; /* returns from select() */
+	/* In nanoseconds. For AEAD modes the MAC is included in
+	   encrypt/decrypt rather than mac */
+	unsigned long long encrypt_ns, decrypt_ns, mac_ns;
+	unsigned int rekeys;
+	unsigned int writequeue_max; /* high water mark of writequeue_len */
+	/* high water mark of writequeue_len ahead of low delay channel data */
+	unsigned int lowdelay_queue_max;
+	/* Channel totals, also logged for each channel */
+	unsigned long long chan_bytes_in, chan_bytes_out;
+	unsigned int chan_window_stalls;
+	/* Outbound connection hostname lookups */
+	unsigned int resolve_cache_hits, resolve_cache_misses;
+	unsigned int idle_reclaims; /* see DROPBEAR_IDLE_RECLAIM */
+};
+
+#define SES_STAT_ADD(field, n) do { ses.stats.field += (n); } while (0)
+unsigned long long session_stat_clock(void);
+void session_log_stats(const char *reason);
+#else
+#define SES_STAT_ADD(field, n)
+#endif
+
 struct packetlist;
 struct packetlist {
 	struct packetlist *next;
@@ -146,6 +194,8 @@ struct sshsession {
 						passed to packet processing functions positioned past
 						that, see payload_beginning */
 	unsigned int payload_beginning;
+	buffer *decompress_buf; /* Kept for decompressed payloads, ses.payload
+							   points to it while one is processed */
 	unsigned int transseq, recvseq; /* Sequence IDs */
 
 	/* Packet-handling flags */
@@ -155,6 +205,10 @@ struct sshsession {
 	unsigned dataallowed : 1; /* whether we can send data packets or we are in
 								 the middle of a KEX or something */
 
+	unsigned read_paused : 1; /* leave packets unread while a request is
+								 handled asynchronously (PAM auth) */
+	unsigned paused_data : 1; /* more data arrived while read_paused */
+
 	unsigned char requirenext; /* byte indicating what packets we require next, 
 									 or 0x00 for any.  */
 
@@ -168,11 +222,28 @@ struct sshsession {
 	int channel_signal_pending; /* Flag set when the signal pipe is triggered */
 
 	m_list conn_pending;
+#if DROPBEAR_RESOLVE_CACHE_TIME
+	m_list resolve_cache; /* see netio.c */
+#endif
 						
 	/* time of the last packet send/receive, for keepalive. Not real-world clock */
 	time_t last_packet_time_keepalive_sent;
 	time_t last_packet_time_keepalive_recv;
 	time_t last_packet_time_any_sent;
+#if DROPBEAR_IDLE_RECLAIM
+	/* last_packet_time_idle when memory was last reclaimed */
+	time_t idle_reclaim_time;
+	int idle_reclaim_due;
+	struct dropbear_timer reclaim_timer;
+#endif
+
+	/* Session timeouts, see timer.h */
+	struct timer_heap timers;
+	struct dropbear_timer auth_timer;
+	struct dropbear_timer rekey_timer;
+	struct dropbear_timer keepalive_timer;
+	struct dropbear_timer idle_timer;
+	struct dropbear_timer max_duration_timer;
 
 	time_t last_packet_time_idle; /* time of the last packet transmission or receive, for
 								idle timeout purposes so ignores SSH_MSG_IGNORE
@@ -194,6 +265,12 @@ struct sshsession {
 	buffer* kexhashbuf; /* session hash buffer calculated from various packets*/
 	buffer* transkexinit; /* the kexinit packet we send should be kept so we
 							 can add it to the hash when generating keys */
+#if DROPBEAR_KEX_PREGEN
+	/* Our ephemeral kex param for pregen_algo, generated while idle.
+	   Used once by kex_take_param() */
+	const struct dropbear_kex *pregen_algo;
+	void *pregen_param;
+#endif
 
 	/* Enables/disables compression */
 	algo_type *compress_algos_c2s;
@@ -216,14 +293,22 @@ struct sshsession {
 	struct AuthState authstate; /* Common amongst client and server, since most
 								   struct elements are common */
 
+#if DROPBEAR_SESSION_STATS
+	struct session_stats stats;
+#endif
+
 	/* Channel related */
 	struct Channel ** channels; /* these pointers may be null */
 	unsigned int chansize; /* the number of Channel*s allocated for channels */
 	unsigned int chancount; /* the number of Channel*s in use */
+	unsigned int chan_sched_next; /* where the next round of reads starts */
 	const struct ChanType **chantypes; /* The valid channel types */
 
 	/* TCP priority level for the main "port 22" tcp socket */
 	enum dropbear_prio socket_prio;
+	/* whether a low delay channel is open, unlike socket_prio this
+	 * isn't set while there are no channels */
+	int lowdelay_chan;
 
 	/* TCP forwarding - where manage listeners */
 	struct Listener ** listeners;
@@ -235,6 +320,10 @@ struct sshsession {
 
 	/* this is set when we get SIGINT or SIGTERM, the handler is in main.c */
 	volatile int exitflag;
+#if DROPBEAR_SESSION_STATS
+	/* set by the SIGUSR1 handler */
+	volatile int stats_requested;
+#endif
 	/* set once the ses structure (and cli_ses/svr_ses) have been populated to their initial state */
 	int init_done;
 
@@ -243,6 +332,11 @@ struct sshsession {
 #endif
 };
 
+/* Bytes a pre-auth child writes to svr_ses.childpipe for the listener's
+ * connection throttling */
+#define CHILDPIPE_AUTH_FAILED 1
+#define CHILDPIPE_AUTHED 2
+
 struct serversession {
 
 	/* Server specific options */
@@ -125,15 +125,15 @@ static void agentaccept(const struct Listener *UNUSED(listener), int sock) {
 
 }
 
-/* set up the environment variable pointing to the socket. This is called
- * just before command/shell execution, after dropping privileges */
-void svr_agentset(const struct ChanSess * chansess) {
+/* Returns the path of the socket for SSH_AUTH_SOCK, or NULL if agent
+ * forwarding isn't set up. The result must be freed */
+char *svr_agentpath(const struct ChanSess * chansess) {
 
 	char *path = NULL;
 	int len;
 
 	if (chansess->agentlistener == NULL) {
-		return;
+		return NULL;
 	}
 
 	/* 2 for "/" and "\0" */
@@ -141,8 +141,7 @@ void svr_agentset(const struct ChanSess * chansess) {
 
 	path = m_malloc(len);
 	snprintf(path, len, "%s/%s", chansess->agentdir, chansess->agentfile);
-	addnewvar("SSH_AUTH_SOCK", path);
-	m_free(path);
+	return path;
 }
 
 /* close the socket, remove the socket-file */
@@ -35,8 +35,10 @@
 #include "auth.h"
 #include "runopts.h"
 #include "dbrandom.h"
+#include "loginqueue.h"
 
 static int checkusername(const char *username, unsigned int userlen);
+static void childpipe_notify(char msg);
 
 /* initialise the first time for a session, resetting all parameters */
 void svr_authinitialise() {
@@ -190,7 +192,7 @@ out:
 
 #ifdef HAVE_GETGROUPLIST
 /* returns DROPBEAR_SUCCESS or DROPBEAR_FAILURE */
-static int check_group_membership(gid_t check_gid, const char* username, gid_t user_gid) {
+int check_group_membership(gid_t check_gid, const char* username, gid_t user_gid) {
 	int ngroups, i, ret;
 	gid_t *grouplist = NULL;
 	int match = DROPBEAR_FAILURE;
@@ -243,7 +245,9 @@ static int checkusername(const char *username, unsigned int userlen) {
 
 	if (ses.authstate.username == NULL) {
 		/* first request */
-		fill_passwd(username);
+		svr_pwcache_fill_passwd(username);
+		/* one lookup for each connection */
+		svr_pwcache_close();
 		ses.authstate.username = m_strdup(username);
 	} else {
 		/* check username hasn't changed */
@@ -292,7 +296,7 @@ static int checkusername(const char *username, unsigned int userlen) {
 	/* check for login restricted to certain group if desired */
 #ifdef HAVE_GETGROUPLIST
 	if (svr_opts.restrict_group) {
-		if (check_group_membership(svr_opts.restrict_group_gid,
+		if (svr_pwcache_group_member(svr_opts.restrict_group_gid,
 				ses.authstate.pw_name, ses.authstate.pw_gid) == DROPBEAR_FAILURE) {
 			dropbear_log(LOG_WARNING,
 				"Logins are restricted to the group %s but user '%s' is not a member",
@@ -345,6 +349,15 @@ goodshell:
  * incrfail is whether to count this failure in the failure count (which
  * is limited. This function also handles disconnection after too many
  * failures */
+/* Sends one of the CHILDPIPE_ bytes to the listener */
+static void childpipe_notify(char msg) {
+	if (svr_ses.childpipe >= 0) {
+		if (write(svr_ses.childpipe, &msg, 1) != 1) {
+			TRACE(("childpipe write failed: %s", strerror(errno)))
+		}
+	}
+}
+
 void send_msg_userauth_failure(int partial, int incrfail) {
 
 	buffer *typebuf = NULL;
@@ -423,6 +436,11 @@ void send_msg_userauth_failure(int partial, int incrfail) {
 		}
 
 		ses.authstate.failcount++;
+
+		/* Tell the listener, it penalises repeated failures */
+		if (svr_opts.admit_rate) {
+			childpipe_notify(CHILDPIPE_AUTH_FAILED);
+		}
 	}
 
 	if (ses.authstate.failcount > svr_opts.maxauthtries) {
@@ -456,6 +474,15 @@ void send_msg_userauth_success() {
 	 * delayed-zlib mode */
 	ses.authstate.authdone = 1;
 
+#if DROPBEAR_SVR_PUBKEY_AUTH
+	/* no more pubkey queries */
+	svr_pubkey_index_free();
+#endif
+#if DROPBEAR_SVR_LOGINQUEUE
+	/* login records are for this user from now on */
+	loginqueue_bind(ses.authstate.username, svr_ses.remotehost);
+#endif
+
 #if DROPBEAR_SVR_DROP_PRIVS
 	/* Drop privileges as soon as authentication has happened. */
 	svr_switch_user();
@@ -472,7 +499,11 @@ void send_msg_userauth_success() {
 	/* Remove from the list of pre-auth sockets. Should be m_close(), since if
 	 * we fail, we might end up leaking connection slots, and disallow new
 	 * logins - a nasty situation. */							
+	if (svr_opts.admit_global) {
+		childpipe_notify(CHILDPIPE_AUTHED);
+	}
 	m_close(svr_ses.childpipe);
+	svr_ses.childpipe = -1;
 
 	TRACE(("leave send_msg_userauth_success"))
 
@@ -31,6 +31,7 @@
 #include "dbutil.h"
 #include "auth.h"
 #include "runopts.h"
+#include "listener.h"
 
 #if DROPBEAR_SVR_PAM_AUTH
 
@@ -43,8 +44,110 @@
 struct UserDataS {
 	char* user;
 	char* passwd;
+	int helperfd; /* pipe to the session in the PAM helper, otherwise -1 */
 };
 
+#if DROPBEAR_SVR_PAM_ASYNC
+/* With DROPBEAR_SVR_PAM_ASYNC the PAM transaction runs in a helper process
+ * forked for each password attempt. The helper sends messages back over a
+ * pipe, which the session watches as a listener. Each message is a uint32
+ * length then a type byte, and is sent with a single write() no larger
+ * than PIPE_BUF. The session doesn't read further packets from the client
+ * until the helper's result arrives, so replies stay in order. */
+#define PAM_HELPER_BANNER 1 /* string text */
+#define PAM_HELPER_RESULT 2 /* uint32 PAM return code */
+
+/* length, type, string length */
+#define PAM_HELPER_MAX_BANNER (PIPE_BUF - 9)
+
+struct PamHelper {
+	pid_t pid;
+	int valid_user;
+	buffer *readbuf;
+};
+
+static void pam_helper_send(int fd, buffer *msg) {
+	ssize_t len;
+
+	buf_setpos(msg, 0);
+	buf_putint(msg, msg->len - 4);
+	do {
+		len = write(fd, msg->data, msg->len);
+	} while (len < 0 && errno == EINTR);
+	if (len != (ssize_t)msg->len) {
+		TRACE(("pam helper write failed: %s", strerror(errno)))
+	}
+}
+
+/* dropbear_exit() in the helper, the session cleans up after itself */
+static void pam_helper_exit(int exitcode, const char* format, va_list param)
+	ATTRIB_NORETURN;
+
+static void pam_helper_exit(int exitcode, const char* format, va_list param) {
+	char exitmsg[150];
+
+	vsnprintf(exitmsg, sizeof(exitmsg), format, param);
+	dropbear_log(LOG_WARNING, "PAM helper exited: %s", exitmsg);
+	_exit(exitcode);
+}
+
+/* Closes the session's fds in the helper except keep, so that the client's
+ * connection and the daemon's childpipe aren't held while PAM waits.
+ * stdout and stderr stay open for PAM modules and -E logging, unless they
+ * are the client's socket as with inetd */
+static void pam_helper_closefds(int keep) {
+	struct stat sockst, st;
+	int have_sock, nullfd, i;
+
+	have_sock = fstat(ses.sock_in, &sockst) == 0;
+	if (opts.usingsyslog) {
+		/* syslog() opens it again when needed */
+		closelog();
+	}
+	/* the session's fds are below FD_SETSIZE or ses.maxfd, for select() */
+	for (i = STDERR_FILENO + 1; i < MAX(FD_SETSIZE, ses.maxfd + 1); i++) {
+		if (i != keep) {
+			close(i);
+		}
+	}
+
+	nullfd = open(DROPBEAR_PATH_DEVNULL, O_RDWR);
+	for (i = STDIN_FILENO; i <= STDERR_FILENO; i++) {
+		if (i == STDIN_FILENO
+			|| (have_sock && fstat(i, &st) == 0
+				&& st.st_dev == sockst.st_dev && st.st_ino == sockst.st_ino)) {
+			if (nullfd >= 0) {
+				dup2(nullfd, i);
+			} else {
+				close(i);
+			}
+		}
+	}
+	if (nullfd > STDERR_FILENO) {
+		close(nullfd);
+	}
+}
+#endif /* DROPBEAR_SVR_PAM_ASYNC */
+
+/* Shows a PAM message to the user */
+static void pam_send_banner(const struct UserDataS *userData, buffer *banner) {
+#if DROPBEAR_SVR_PAM_ASYNC
+	if (userData->helperfd >= 0) {
+		buffer *msg = buf_new(PIPE_BUF);
+		buf_putint(msg, 0); /* length, filled in by pam_helper_send() */
+		buf_putbyte(msg, PAM_HELPER_BANNER);
+		buf_putstring(msg, (const char*)banner->data,
+			MIN(banner->len, PAM_HELPER_MAX_BANNER));
+		pam_helper_send(userData->helperfd, msg);
+		buf_free(msg);
+		return;
+	}
+#else
+	(void)userData;
+#endif
+	send_msg_userauth_banner(banner);
+}
+
 /* PAM conversation function - for now we only handle one message */
 int 
 pamConvFunc(int num_msg, 
@@ -154,7 +257,7 @@ pamConvFunc(int num_msg,
 				buf_putbytes(pam_err, "\r\n", 2);
 				buf_setpos(pam_err, 0);
 
-				send_msg_userauth_banner(pam_err);
+				pam_send_banner(userDatap, pam_err);
 				buf_free(pam_err);
 			}
 			break;
@@ -171,57 +274,16 @@ pamConvFunc(int num_msg,
 	return rc;
 }
 
-/* Process a password auth request, sending success or failure messages as
- * appropriate. To the client it looks like it's doing normal password auth (as
- * opposed to keyboard-interactive or something), so the pam module has to be
- * fairly standard (ie just "what's your username, what's your password, OK").
- *
- * Keyboard interactive would be a lot nicer, but since PAM is synchronous, it
- * gets very messy trying to send the interactive challenges, and read the
- * interactive responses, over the network. */
-void svr_auth_pam(int valid_user) {
+/* Runs the PAM transaction, returning PAM_SUCCESS if the user gave the
+ * right password and their account may log in */
+static int pam_transaction(struct UserDataS *userData, const char *printable_user) {
 
-	struct UserDataS userData = {NULL, NULL};
 	struct pam_conv pamConv = {
 		pamConvFunc,
-		&userData /* submitted to pamvConvFunc as appdata_ptr */ 
+		userData /* submitted to pamvConvFunc as appdata_ptr */ 
 	};
-	const char* printable_user = NULL;
-
 	pam_handle_t* pamHandlep = NULL;
-
-	char * password = NULL;
-	unsigned int passwordlen;
-
 	int rc = PAM_SUCCESS;
-	unsigned char changepw;
-
-	/* check if client wants to change password */
-	changepw = buf_getbool(ses.payload);
-	if (changepw) {
-		/* not implemented by this server */
-		send_msg_userauth_failure(0, 1);
-		goto cleanup;
-	}
-
-	password = buf_getstring(ses.payload, &passwordlen);
-
-	/* We run the PAM conversation regardless of whether the username is valid
-	in case the conversation function has an inherent delay.
-	Use ses.authstate.username rather than ses.authstate.pw_name.
-	After PAM succeeds we then check the valid_user flag too */
-
-	/* used to pass data to the PAM conversation function - don't bother with
-	 * strdup() etc since these are touched only by our own conversation
-	 * function (above) which takes care of it */
-	userData.user = ses.authstate.username;
-	userData.passwd = password;
-
-	if (ses.authstate.pw_name) {
-		printable_user = ses.authstate.pw_name;
-	} else {
-		printable_user = "<invalid username>";
-	}
 
 	/* Init pam */
 	if ((rc = pam_start("sshd", NULL, &pamConv, &pamHandlep)) != PAM_SUCCESS) {
@@ -257,7 +319,6 @@ void svr_auth_pam(int valid_user) {
 				"Bad PAM password attempt for '%s' from %s",
 				printable_user,
 				svr_ses.addrstring);
-		send_msg_userauth_failure(0, 1);
 		goto cleanup;
 	}
 
@@ -268,15 +329,30 @@ void svr_auth_pam(int valid_user) {
 				"Bad PAM password attempt for '%s' from %s",
 				printable_user,
 				svr_ses.addrstring);
-		send_msg_userauth_failure(0, 1);
 		goto cleanup;
 	}
 
+cleanup:
+	if (pamHandlep != NULL) {
+		TRACE(("pam_end"))
+		(void) pam_end(pamHandlep, 0 /* pam_status */);
+	}
+	return rc;
+}
+
+/* Replies to the client with the result of the PAM transaction */
+static void pam_auth_reply(int valid_user, int rc) {
+
+	if (rc != PAM_SUCCESS) {
+		send_msg_userauth_failure(0, 1);
+		return;
+	}
+
 	if (!valid_user) {
 		/* PAM auth succeeded but the username isn't allowed in for another reason
 		(checkusername() failed) */
 		send_msg_userauth_failure(0, 1);
-		goto cleanup;
+		return;
 	}
 
 	if (svr_opts.multiauthmethod && (ses.authstate.authtypes & ~AUTH_TYPE_PASSWORD)) {
@@ -294,16 +370,217 @@ void svr_auth_pam(int valid_user) {
 			svr_ses.addrstring);
 		send_msg_userauth_success();
 	}
+}
+
+#if DROPBEAR_SVR_PAM_ASYNC
+static void pam_helper_cleanup(const struct Listener *listener) {
+	struct PamHelper *helper = (struct PamHelper*)listener->typedata;
+
+	if (helper->pid > 0) {
+		/* still running, the session is exiting. It is reaped with
+		 * any other children */
+		TRACE(("killing pam helper %d", helper->pid))
+		kill(helper->pid, SIGTERM);
+	}
+	buf_free(helper->readbuf);
+	m_free(helper);
+	ses.read_paused = 0;
+}
+
+/* Finishes the attempt, the helper is reaped with any other children */
+static void pam_helper_done(struct Listener *listener, int rc) {
+	struct PamHelper *helper = (struct PamHelper*)listener->typedata;
+	int valid_user = helper->valid_user;
+
+	TRACE(("pam helper %d done, rc %d", helper->pid, rc))
+	helper->pid = -1;
+	remove_listener(listener);
+	pam_auth_reply(valid_user, rc);
+}
+
+/* Handles messages from the PAM helper */
+static void pam_helper_read(const struct Listener *listener, int sock) {
+	struct PamHelper *helper = (struct PamHelper*)listener->typedata;
+	buffer *buf = helper->readbuf;
+	unsigned int msglen, remain;
+	unsigned char type;
+	ssize_t len;
+
+	buf_setpos(buf, buf->len);
+	len = read(sock, buf_getwriteptr(buf, buf->size - buf->len),
+		buf->size - buf->len);
+	if (len < 0 && (errno == EINTR || errno == EAGAIN)) {
+		return;
+	}
+	if (len <= 0) {
+		dropbear_log(LOG_WARNING, "PAM helper failed");
+		pam_helper_done((struct Listener*)listener, PAM_CONV_ERR);
+		return;
+	}
+	buf_incrwritepos(buf, len);
+	buf_setpos(buf, 0);
+
+	while (buf->len - buf->pos >= 4) {
+		msglen = buf_getint(buf);
+		if (msglen == 0 || msglen > buf->size - 4) {
+			dropbear_exit("Bad PAM helper message");
+		}
+		if (buf->len - buf->pos < msglen) {
+			/* the rest follows */
+			buf_decrpos(buf, 4);
+			break;
+		}
+		type = buf_getbyte(buf);
+		if (type == PAM_HELPER_BANNER && msglen > 4) {
+			buffer *banner = buf_getstringbuf(buf);
+			send_msg_userauth_banner(banner);
+			buf_free(banner);
+		} else if (type == PAM_HELPER_RESULT && msglen == 5) {
+			pam_helper_done((struct Listener*)listener, (int)buf_getint(buf));
+			return;
+		} else {
+			dropbear_exit("Bad PAM helper message");
+		}
+	}
+
+	/* keep a partial message */
+	remain = buf->len - buf->pos;
+	memmove(buf->data, buf_getptr(buf, remain), remain);
+	buf_setlen(buf, remain);
+}
+
+/* Starts the PAM transaction in a helper process, which replies to the
+ * client once it is done. Returns DROPBEAR_FAILURE if the helper couldn't
+ * be started */
+static int pam_helper_start(struct UserDataS *userData,
+		const char *printable_user, int valid_user) {
+	struct PamHelper *helper = NULL;
+	int fds[2];
+	pid_t pid;
+
+	if (pipe(fds) < 0) {
+		TRACE(("pam helper pipe failed: %s", strerror(errno)))
+		return DROPBEAR_FAILURE;
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		TRACE(("pam helper fork failed: %s", strerror(errno)))
+		m_close(fds[0]);
+		m_close(fds[1]);
+		return DROPBEAR_FAILURE;
+	}
+
+	if (pid == 0) {
+		/* helper */
+		buffer *msg = NULL;
+		int rc;
+
+		_dropbear_exit = pam_helper_exit;
+		/* the session's handlers only set flags for its own loop. PAM
+		 * modules may wait for their own children */
+		if (signal(SIGINT, SIG_DFL) == SIG_ERR
+				|| signal(SIGTERM, SIG_DFL) == SIG_ERR
+				|| signal(SIGCHLD, SIG_DFL) == SIG_ERR) {
+			dropbear_exit("signal() error");
+		}
+		pam_helper_closefds(fds[1]);
+
+		userData->helperfd = fds[1];
+		rc = pam_transaction(userData, printable_user);
+		m_burn(userData->passwd, strlen(userData->passwd));
+
+		msg = buf_new(9);
+		buf_putint(msg, 0); /* length, filled in by pam_helper_send() */
+		buf_putbyte(msg, PAM_HELPER_RESULT);
+		buf_putint(msg, rc);
+		pam_helper_send(fds[1], msg);
+		_exit(EXIT_SUCCESS);
+	}
+
+	TRACE(("pam helper pid %d", pid))
+	m_close(fds[1]);
+	setnonblocking(fds[0]);
+
+	helper = (struct PamHelper*)m_malloc(sizeof(*helper));
+	helper->pid = pid;
+	helper->valid_user = valid_user;
+	helper->readbuf = buf_new(PIPE_BUF);
+	if (new_listener(&fds[0], 1, LISTENER_TYPE_DEFAULT, helper,
+			pam_helper_read, pam_helper_cleanup) == NULL) {
+		/* new_listener() closed the pipe */
+		kill(pid, SIGTERM);
+		buf_free(helper->readbuf);
+		m_free(helper);
+		send_msg_userauth_failure(0, 1);
+		return DROPBEAR_SUCCESS;
+	}
+
+	ses.read_paused = 1;
+	ses.paused_data = 0;
+	return DROPBEAR_SUCCESS;
+}
+#endif /* DROPBEAR_SVR_PAM_ASYNC */
+
+/* Process a password auth request, sending success or failure messages as
+ * appropriate. To the client it looks like it's doing normal password auth (as
+ * opposed to keyboard-interactive or something), so the pam module has to be
+ * fairly standard (ie just "what's your username, what's your password, OK").
+ *
+ * Keyboard interactive would be a lot nicer, but since PAM is synchronous, it
+ * gets very messy trying to send the interactive challenges, and read the
+ * interactive responses, over the network. */
+void svr_auth_pam(int valid_user) {
+
+	struct UserDataS userData = {NULL, NULL, -1};
+	const char* printable_user = NULL;
+
+	char * password = NULL;
+	unsigned int passwordlen;
+
+	unsigned char changepw;
+
+	/* check if client wants to change password */
+	changepw = buf_getbool(ses.payload);
+	if (changepw) {
+		/* not implemented by this server */
+		send_msg_userauth_failure(0, 1);
+		goto cleanup;
+	}
+
+	password = buf_getstring(ses.payload, &passwordlen);
+
+	/* We run the PAM conversation regardless of whether the username is valid
+	in case the conversation function has an inherent delay.
+	Use ses.authstate.username rather than ses.authstate.pw_name.
+	After PAM succeeds we then check the valid_user flag too */
+
+	/* used to pass data to the PAM conversation function - don't bother with
+	 * strdup() etc since these are touched only by our own conversation
+	 * function (above) which takes care of it */
+	userData.user = ses.authstate.username;
+	userData.passwd = password;
+
+	if (ses.authstate.pw_name) {
+		printable_user = ses.authstate.pw_name;
+	} else {
+		printable_user = "<invalid username>";
+	}
+
+#if DROPBEAR_SVR_PAM_ASYNC
+	if (pam_helper_start(&userData, printable_user, valid_user) == DROPBEAR_SUCCESS) {
+		goto cleanup;
+	}
+	/* otherwise run it here */
+#endif
+
+	pam_auth_reply(valid_user, pam_transaction(&userData, printable_user));
 		
 cleanup:
 	if (password != NULL) {
 		m_burn(password, passwordlen);
 		m_free(password);
 	}
-	if (pamHandlep != NULL) {
-		TRACE(("pam_end"))
-		(void) pam_end(pamHandlep, 0 /* pam_status */);
-	}
 }
 
 #endif /* DROPBEAR_SVR_PAM_AUTH */
@@ -75,6 +75,36 @@
  * An addition limit DROPBEAR_MAX_LINE_LENGTH (10000) will stop file parsing entirely */
 #define MAX_AUTHKEYS_LINE 3000
 
+/* authorized_keys is read once per session into an index sorted by a hash
+ * of each line's decoded key blob, so a client offering many keys doesn't
+ * rescan the whole file for every query. Lines found in the index are
+ * still checked with checkpubkey_line(), so matching and option parsing
+ * behave as for a linear scan. The index is rebuilt if the file changes. */
+struct authkeys_entry {
+	uint32_t hash;
+	unsigned int line_idx;
+};
+
+struct authkeys_index {
+	char *filename;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	time_t mtime;
+	time_t ctime;
+
+	/* lines that may contain a key, in file order */
+	buffer **lines;
+	int *line_nums;
+	unsigned int num_lines;
+
+	/* sorted by hash then line_idx */
+	struct authkeys_entry *entries;
+	unsigned int num_entries;
+};
+
+static struct authkeys_index *authkeys_index = NULL;
+
 static char * authorized_keys_filepath(void);
 static int checkpubkey(const char* keyalgo, unsigned int keyalgolen,
 		const unsigned char* keyblob, unsigned int keybloblen,
@@ -458,6 +488,183 @@ out:
 	return ret;
 }
 
+/* Adds an index entry for a line at the start of "keytype base64 ...",
+ * line->pos is left somewhere after it */
+static void authkeys_add_candidate(struct authkeys_index *idx, buffer *line) {
+	unsigned char *decoded = NULL;
+	unsigned long decodedlen;
+	unsigned int pos, len;
+	int found_space = 0;
+
+	/* skip the key type */
+	while (line->pos < line->len) {
+		if (buf_getbyte(line) == ' ') {
+			found_space = 1;
+			break;
+		}
+	}
+	if (!found_space) {
+		return;
+	}
+
+	pos = line->pos;
+	for (len = 0; line->pos < line->len; len++) {
+		if (buf_getbyte(line) == ' ') {
+			break;
+		}
+	}
+	if (len == 0) {
+		return;
+	}
+
+	buf_setpos(line, pos);
+	decodedlen = len;
+	decoded = m_malloc(decodedlen);
+	if (base64_decode(buf_getptr(line, len), len, decoded, &decodedlen) == CRYPT_OK) {
+		idx->entries[idx->num_entries].hash = fnv1a_hash(decoded, decodedlen);
+		idx->entries[idx->num_entries].line_idx = idx->num_lines;
+		idx->num_entries++;
+	}
+	m_free(decoded);
+	buf_incrpos(line, len);
+}
+
+/* Adds a line of authorized_keys to the index. The key may either be at
+ * the start of the line or follow an options field, checkpubkey_line()
+ * decides which once it knows the algorithm, so both are indexed. */
+static void authkeys_add_line(struct authkeys_index *idx, buffer *line, int line_num) {
+	unsigned int first_entry = idx->num_entries;
+	int escape, quoted;
+
+	if (line->len < MIN_AUTHKEYS_LINE || line->len > MAX_AUTHKEYS_LINE) {
+		return;
+	}
+
+	/* key at the start of the line */
+	buf_setpos(line, 0);
+	authkeys_add_candidate(idx, line);
+
+	/* key after options, parsed the same way as checkpubkey_line() */
+	buf_setpos(line, 0);
+	while (line->pos < line->len) {
+		const char c = buf_getbyte(line);
+		if (c == ' ' || c == '\t') {
+			continue;
+		} else if (c == '#') {
+			goto done;
+		}
+		buf_decrpos(line, 1);
+		break;
+	}
+	quoted = 0;
+	escape = 0;
+	while (line->pos < line->len) {
+		const char c = buf_getbyte(line);
+		if (!quoted && (c == ' ' || c == '\t')) {
+			break;
+		}
+		escape = (!escape && c == '\\');
+		if (!escape && c == '"') {
+			quoted = !quoted;
+		}
+	}
+	authkeys_add_candidate(idx, line);
+
+done:
+	if (idx->num_entries > first_entry) {
+		buf_setpos(line, 0);
+		idx->lines[idx->num_lines] = buf_new(line->len);
+		buf_putbytes(idx->lines[idx->num_lines], buf_getptr(line, line->len), line->len);
+		idx->line_nums[idx->num_lines] = line_num;
+		idx->num_lines++;
+	}
+}
+
+static int authkeys_entry_cmp(const void *a, const void *b) {
+	const struct authkeys_entry *ea = a, *eb = b;
+	if (ea->hash != eb->hash) {
+		return ea->hash < eb->hash ? -1 : 1;
+	}
+	if (ea->line_idx != eb->line_idx) {
+		return ea->line_idx < eb->line_idx ? -1 : 1;
+	}
+	return 0;
+}
+
+void svr_pubkey_index_free() {
+	unsigned int i;
+
+	if (!authkeys_index) {
+		return;
+	}
+	for (i = 0; i < authkeys_index->num_lines; i++) {
+		buf_burn_free(authkeys_index->lines[i]);
+	}
+	m_free(authkeys_index->lines);
+	m_free(authkeys_index->line_nums);
+	m_free(authkeys_index->entries);
+	m_free(authkeys_index->filename);
+	m_free(authkeys_index);
+}
+
+/* Returns the index for an open authorized_keys, reading the file if
+ * it has changed since the index was built */
+static struct authkeys_index* authkeys_get_index(const char *filename, FILE *authfile) {
+	struct authkeys_index *idx = authkeys_index;
+	struct stat st;
+	buffer *line = NULL;
+	int line_num;
+
+	if (fstat(fileno(authfile), &st) != 0) {
+		TRACE(("authkeys_get_index: fstat failed: %s", strerror(errno)))
+		svr_pubkey_index_free();
+		return NULL;
+	}
+
+	if (idx
+		&& strcmp(idx->filename, filename) == 0
+		&& idx->dev == st.st_dev
+		&& idx->ino == st.st_ino
+		&& idx->size == st.st_size
+		&& idx->mtime == st.st_mtime
+		&& idx->ctime == st.st_ctime) {
+		TRACE(("authkeys_get_index: using cached index, %u keys", idx->num_entries))
+		return idx;
+	}
+
+	svr_pubkey_index_free();
+	idx = m_malloc(sizeof(*idx));
+	idx->filename = m_strdup(filename);
+	idx->dev = st.st_dev;
+	idx->ino = st.st_ino;
+	idx->size = st.st_size;
+	idx->mtime = st.st_mtime;
+	idx->ctime = st.st_ctime;
+	idx->lines = m_malloc(MAX_AUTHKEYS_LINE_COUNT * sizeof(*idx->lines));
+	idx->line_nums = m_malloc(MAX_AUTHKEYS_LINE_COUNT * sizeof(*idx->line_nums));
+	idx->entries = m_malloc(2 * MAX_AUTHKEYS_LINE_COUNT * sizeof(*idx->entries));
+
+	line = buf_new(MAX_AUTHKEYS_LINE);
+	for (line_num = 1; line_num <= MAX_AUTHKEYS_LINE_COUNT; line_num++) {
+		if (buf_getline(line, authfile) == DROPBEAR_FAILURE) {
+			/* EOF reached */
+			TRACE(("authkeys_get_index: authorized_keys EOF reached"))
+			break;
+		}
+		authkeys_add_line(idx, line, line_num);
+	}
+	if (line_num > MAX_AUTHKEYS_LINE_COUNT) {
+		TRACE(("authorized_keys line limit"))
+	}
+	buf_burn_free(line);
+
+	qsort(idx->entries, idx->num_entries, sizeof(*idx->entries), authkeys_entry_cmp);
+	TRACE(("authkeys_get_index: indexed %u keys from %d lines", idx->num_entries, line_num-1))
+
+	authkeys_index = idx;
+	return idx;
+}
+
 /* Returns the full path to the user's authorized_keys file in an
  * allocated string which caller must free. */
 static char *authorized_keys_filepath() {
@@ -488,7 +695,10 @@ static int checkpubkey(const char* keyalgo, unsigned int keyalgolen,
 	char * filename = NULL;
 	int ret = DROPBEAR_FAILURE;
 	buffer * line = NULL;
-	int line_num;
+	struct authkeys_index *idx = NULL;
+	struct authkeys_entry *entry = NULL;
+	uint32_t hash;
+	unsigned int lo, hi, last_idx;
 	uid_t origuid;
 	gid_t origgid;
 
@@ -535,33 +745,53 @@ static int checkpubkey(const char* keyalgo, unsigned int keyalgolen,
 	}
 	TRACE(("checkpubkey: opened authorized_keys OK"))
 
-	line = buf_new(MAX_AUTHKEYS_LINE);
+	idx = authkeys_get_index(filename, authfile);
+	if (idx == NULL) {
+		goto out;
+	}
 
-	/* iterate through the lines */
-	for (line_num = 1; line_num <= MAX_AUTHKEYS_LINE_COUNT; line_num++) {
-		if (buf_getline(line, authfile) == DROPBEAR_FAILURE) {
-			/* EOF reached */
-			TRACE(("checkpubkey: authorized_keys EOF reached"))
-			break;
+	/* find the first entry with a matching hash */
+	hash = fnv1a_hash(keyblob, keybloblen);
+	lo = 0;
+	hi = idx->num_entries;
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+		if (idx->entries[mid].hash < hash) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
 		}
+	}
 
-		ret = checkpubkey_line(line, line_num, filename, keyalgo, keyalgolen,
-			keyblob, keybloblen, ret_options);
+	/* check candidate lines in file order */
+	line = buf_new(MAX_AUTHKEYS_LINE);
+	last_idx = idx->num_lines;
+	for (entry = &idx->entries[lo];
+			entry < &idx->entries[idx->num_entries] && entry->hash == hash;
+			entry++) {
+		const buffer *orig = idx->lines[entry->line_idx];
+		if (entry->line_idx == last_idx) {
+			continue;
+		}
+		last_idx = entry->line_idx;
+
+		/* checkpubkey_line() modifies the buffer */
+		buf_setlen(line, 0);
+		buf_putbytes(line, orig->data, orig->len);
+		buf_setpos(line, 0);
+		ret = checkpubkey_line(line, idx->line_nums[entry->line_idx], filename,
+			keyalgo, keyalgolen, keyblob, keybloblen, ret_options);
 		if (ret == DROPBEAR_SUCCESS) {
 			break;
 		}
 	}
 
-	if (line_num > MAX_AUTHKEYS_LINE_COUNT) {
-		TRACE(("authorized_keys line limit"))
-	}
-
 out:
 	if (authfile) {
 		fclose(authfile);
 	}
 	if (line) {
-		buf_free(line);
+		buf_burn_free(line);
 	}
 	m_free(filename);
 	TRACE(("leave checkpubkey: ret=%d", ret))
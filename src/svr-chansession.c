@@ -35,8 +35,10 @@
 #include "dbrandom.h"
 #include "x11fwd.h"
 #include "agentfwd.h"
+#include "sftp.h"
 #include "runopts.h"
 #include "auth.h"
+#include "loginqueue.h"
 
 /* Handles sessions (either shells or programs) requested by the client */
 
@@ -48,6 +50,9 @@ static int noptycommand(struct Channel *channel, struct ChanSess *chansess);
 static int ptycommand(struct Channel *channel, struct ChanSess *chansess);
 static int sessionwinchange(const struct ChanSess *chansess);
 static void execchild(const void *user_data_chansess);
+#if DROPBEAR_SVR_SPAWN_VFORK
+static int vforkchild(struct Channel *channel, struct ChanSess *chansess);
+#endif
 static void addchildpid(struct ChanSess *chansess, pid_t pid);
 static void sesssigchild_handler(int val);
 static void closechansess(const struct Channel *channel);
@@ -81,6 +86,10 @@ static int sesscheckclose(struct Channel *channel) {
 	if (chansess->exit.exitpid != -1) {
 		channel->flushing = 1;
 	}
+	if (channel->local) {
+		/* the builtin sftp server sets exitpid when it finishes */
+		return chansess->exit.exitpid != -1;
+	}
 	return chansess->pid == 0 || chansess->exit.exitpid != -1;
 }
 
@@ -323,12 +332,16 @@ static void cleanupchansess(const struct Channel *channel) {
 	m_free(chansess->term);
 	m_free(chansess->original_command);
 
+#if DROPBEAR_SFTPSERVER_BUILTIN
+	svr_sftp_cleanup(chansess);
+#endif
+
 	if (chansess->tty) {
 		/* write the utmp/wtmp login record */
 		li = chansess_login_alloc(chansess);
 
 		svr_raise_gid_utmp();
-		login_logout(li);
+		loginqueue_logout(li);
 		svr_restore_gid();
 
 		login_free_entry(li);
@@ -670,10 +683,13 @@ static int sessioncommand(struct Channel *channel, struct ChanSess *chansess,
 
 	unsigned int cmdlen = 0;
 	int ret;
+#if DROPBEAR_SFTPSERVER_BUILTIN
+	int builtin_sftp = 0;
+#endif
 
 	TRACE(("enter sessioncommand %d", channel->index))
 
-	if (chansess->pid != 0) {
+	if (chansess->pid != 0 || channel->local) {
 		/* Note that only one command can _succeed_. The client might try
 		 * one command (which fails), then try another. Ie fallback
 		 * from sftp to scp */
@@ -694,12 +710,17 @@ static int sessioncommand(struct Channel *channel, struct ChanSess *chansess,
 			}
 		}
 		if (issubsys) {
-#if DROPBEAR_SFTPSERVER
+#if DROPBEAR_SFTPSERVER || DROPBEAR_SFTPSERVER_BUILTIN
 			if ((cmdlen == 4) && strncmp(chansess->cmd, "sftp", 4) == 0) {
+				/* The path is still used for $SSH_ORIGINAL_COMMAND
+				 * with a forced command */
 				char *expand_path = expand_homedir_path(SFTPSERVER_PATH);
 				m_free(chansess->cmd);
 				chansess->cmd = m_strdup(expand_path);
 				m_free(expand_path);
+#if DROPBEAR_SFTPSERVER_BUILTIN
+				builtin_sftp = 1;
+#endif
 			} else 
 #endif
 			{
@@ -735,6 +756,22 @@ static int sessioncommand(struct Channel *channel, struct ChanSess *chansess,
 	}
 #endif
 
+#if DROPBEAR_SFTPSERVER_BUILTIN
+	if (chansess->original_command) {
+		/* A forced command replaces the subsystem, unless it asks
+		 * for the builtin server itself */
+		builtin_sftp = strcmp(chansess->cmd, SFTP_BUILTIN_COMMAND) == 0;
+	}
+	if (builtin_sftp) {
+		ret = svr_sftp_start(channel, chansess);
+		if (ret == DROPBEAR_FAILURE) {
+			m_free(chansess->cmd);
+		}
+		TRACE(("leave sessioncommand, builtin sftp"))
+		return ret;
+	}
+#endif
+
 	/* uClinux will vfork(), so there'll be a race as 
 	connection_string is freed below. */
 #if !DROPBEAR_VFORK
@@ -772,9 +809,13 @@ static int noptycommand(struct Channel *channel, struct ChanSess *chansess) {
 	int ret;
 
 	TRACE(("enter noptycommand"))
+#if DROPBEAR_SVR_SPAWN_VFORK
+	ret = vforkchild(channel, chansess);
+#else
 	ret = spawn_command(execchild, chansess, 
 			&channel->writefd, &channel->readfd, &channel->errfd,
 			&chansess->pid);
+#endif
 
 	if (ret == DROPBEAR_FAILURE) {
 		return ret;
@@ -861,9 +902,11 @@ static int ptycommand(struct Channel *channel, struct ChanSess *chansess) {
 		 * terminal used for stdout with the dup2 above, otherwise
 		 * the wtmp login will not be recorded */
 		li = chansess_login_alloc(chansess);
+		/* this child is the login process */
+		li->pid = getpid();
 
 		svr_raise_gid_utmp();
-		login_login(li);
+		loginqueue_login(li);
 		svr_restore_gid();
 
 		login_free_entry(li);
@@ -960,10 +1003,190 @@ static void addchildpid(struct ChanSess *chansess, pid_t pid) {
 
 }
 
+/* Environment variables for a child, as "NAME=value" strings */
+struct childenv {
+	char **vars; /* NULL terminated */
+	unsigned int count;
+	unsigned int size;
+};
+
+/* Takes ownership of var */
+static void childenv_push(struct childenv *env, char *var) {
+	/* room for the terminating NULL */
+	if (env->count + 1 >= env->size) {
+		env->size = MAX(16, env->size * 2);
+		env->vars = m_realloc(env->vars, env->size * sizeof(char*));
+	}
+	env->vars[env->count] = var;
+	env->count++;
+	env->vars[env->count] = NULL;
+}
+
+static void childenv_add(struct childenv *env, const char *param, const char *var) {
+	char *newvar = NULL;
+	unsigned int len;
+
+	len = strlen(param) + strlen(var) + 2; /* 2 is for '=' and '\0' */
+	newvar = m_malloc(len);
+	snprintf(newvar, len, "%s=%s", param, var);
+	childenv_push(env, newvar);
+}
+
+/* The variables a session sets for its command. lang is the daemon's
+ * LANG, which may be NULL */
+static void childenv_session(struct childenv *env,
+		const struct ChanSess *chansess, const char *lang) {
+#if DROPBEAR_SVR_AGENTFWD
+	char *agentpath = NULL;
+#endif
+
+	childenv_add(env, "USER", ses.authstate.pw_name);
+	childenv_add(env, "LOGNAME", ses.authstate.pw_name);
+	childenv_add(env, "HOME", ses.authstate.pw_dir);
+	childenv_add(env, "SHELL", get_user_shell());
+	if (ses.authstate.pw_uid == 0) {
+		childenv_add(env, "PATH", DEFAULT_ROOT_PATH);
+	} else {
+		childenv_add(env, "PATH", DEFAULT_PATH);
+	}
+	if (lang != NULL) {
+		childenv_add(env, "LANG", lang);
+	}
+	if (chansess->term != NULL) {
+		childenv_add(env, "TERM", chansess->term);
+	}
+
+	if (chansess->tty) {
+		childenv_add(env, "SSH_TTY", chansess->tty);
+	}
+	
+	if (chansess->connection_string) {
+		childenv_add(env, "SSH_CONNECTION", chansess->connection_string);
+	}
+
+	if (chansess->client_string) {
+		childenv_add(env, "SSH_CLIENT", chansess->client_string);
+	}
+	
+	if (chansess->original_command) {
+		childenv_add(env, "SSH_ORIGINAL_COMMAND", chansess->original_command);
+	}
+#if DROPBEAR_SVR_PUBKEY_OPTIONS_BUILT
+	if (ses.authstate.pubkey_options
+		&& ses.authstate.pubkey_options->info_env) {
+		childenv_add(env, "SSH_PUBKEYINFO", ses.authstate.pubkey_options->info_env);
+	}
+#endif
+#if DROPBEAR_SVR_AGENTFWD
+	/* set up agent env variable */
+	agentpath = svr_agentpath(chansess);
+	if (agentpath) {
+		childenv_add(env, "SSH_AUTH_SOCK", agentpath);
+		m_free(agentpath);
+	}
+#endif
+}
+
+#if DROPBEAR_SVR_SPAWN_VFORK
+/* Appends the daemon's environment, other than variables already set */
+static void childenv_inherit(struct childenv *env) {
+	unsigned int count = env->count;
+	char **e;
+	unsigned int i;
+
+	for (e = environ; e && *e; e++) {
+		size_t namelen = strcspn(*e, "=") + 1;
+		for (i = 0; i < count; i++) {
+			if (strncmp(env->vars[i], *e, namelen) == 0) {
+				break;
+			}
+		}
+		if (i == count) {
+			childenv_push(env, m_strdup(*e));
+		}
+	}
+}
+
+static void childenv_free(struct childenv *env) {
+	unsigned int i;
+	for (i = 0; i < env->count; i++) {
+		m_free(env->vars[i]);
+	}
+	m_free(env->vars);
+}
+
+/* Starts the command for noptycommand() with vfork(). The child can only
+ * make system calls, so everything execchild() would do is prepared here.
+ * The session already runs as the user. Sessions with X11 forwarding
+ * need xauth run in the child so use execchild() */
+static int vforkchild(struct Channel *channel, struct ChanSess *chansess) {
+	struct spawn_exec exec;
+	struct childenv env;
+	char *argv[4];
+	char *usershell = NULL;
+	char *message = NULL;
+	int keepenv = svr_opts.pass_on_env;
+	int ret;
+
+#if DROPBEAR_X11FWD
+	if (chansess->x11listener != NULL) {
+		return spawn_command(execchild, chansess,
+				&channel->writefd, &channel->readfd, &channel->errfd,
+				&chansess->pid);
+	}
+#endif
+
+#ifdef DEBUG_VALGRIND
+	keepenv = 1;
+#endif
+
+	memset(&env, 0x0, sizeof(env));
+	childenv_session(&env, chansess, getenv("LANG"));
+	if (keepenv) {
+		childenv_inherit(&env);
+	}
+
+	usershell = m_strdup(get_user_shell());
+	shell_command_argv(argv, chansess->cmd, usershell);
+
+	memset(&exec, 0x0, sizeof(exec));
+	exec.path = usershell;
+	exec.argv = argv;
+	exec.envp = env.vars;
+	exec.dir = ses.authstate.pw_dir;
+	exec.maxfd = ses.maxfd;
+	/* the same check as the child's chdir(), for the message */
+	if (access(ses.authstate.pw_dir, X_OK) < 0) {
+		const char *fmt = "Failed chdir '%s': %s\n";
+		const char *err = strerror(errno);
+		unsigned int len = strlen(fmt) + strlen(ses.authstate.pw_dir) + strlen(err);
+		message = m_malloc(len);
+		snprintf(message, len, fmt, ses.authstate.pw_dir, err);
+		exec.message = message;
+		exec.dir = "/";
+	}
+
+	ret = spawn_exec_vfork(&exec,
+			&channel->writefd, &channel->readfd, &channel->errfd,
+			&chansess->pid);
+
+	if (chansess->cmd == NULL) {
+		/* login shell name was allocated */
+		m_free(argv[0]);
+	}
+	m_free(message);
+	m_free(usershell);
+	childenv_free(&env);
+	return ret;
+}
+#endif /* DROPBEAR_SVR_SPAWN_VFORK */
+
 /* Clean up, drop to user privileges, set up the environment and execute
  * the command/shell. This function does not return. */
 static void execchild(const void *user_data) {
 	const struct ChanSess *chansess = user_data;
+	struct childenv env;
+	unsigned int i;
 	char *usershell = NULL;
 	char *cp = NULL;
 	char *envcp = getenv("LANG");
@@ -1003,44 +1226,16 @@ static void execchild(const void *user_data) {
 #endif
 
 	/* set env vars */
-	addnewvar("USER", ses.authstate.pw_name);
-	addnewvar("LOGNAME", ses.authstate.pw_name);
-	addnewvar("HOME", ses.authstate.pw_dir);
-	addnewvar("SHELL", get_user_shell());
-	if (getuid() == 0) {
-		addnewvar("PATH", DEFAULT_ROOT_PATH);
-	} else {
-		addnewvar("PATH", DEFAULT_PATH);
-	}
-	if (cp != NULL) {
-		addnewvar("LANG", cp);
-		m_free(cp);
-	}	
-	if (chansess->term != NULL) {
-		addnewvar("TERM", chansess->term);
-	}
-
-	if (chansess->tty) {
-		addnewvar("SSH_TTY", chansess->tty);
-	}
-	
-	if (chansess->connection_string) {
-		addnewvar("SSH_CONNECTION", chansess->connection_string);
-	}
-
-	if (chansess->client_string) {
-		addnewvar("SSH_CLIENT", chansess->client_string);
-	}
-	
-	if (chansess->original_command) {
-		addnewvar("SSH_ORIGINAL_COMMAND", chansess->original_command);
-	}
-#if DROPBEAR_SVR_PUBKEY_OPTIONS_BUILT
-	if (ses.authstate.pubkey_options
-		&& ses.authstate.pubkey_options->info_env) {
-		addnewvar("SSH_PUBKEYINFO", ses.authstate.pubkey_options->info_env);
+	memset(&env, 0x0, sizeof(env));
+	childenv_session(&env, chansess, cp);
+	m_free(cp);
+	for (i = 0; i < env.count; i++) {
+		/* the string is leaked, that's part of putenv()'s semantics */
+		if (putenv(env.vars[i]) < 0) {
+			dropbear_exit("environ error");
+		}
 	}
-#endif
+	m_free(env.vars);
 
 	/* change directory */
 	if (chdir(ses.authstate.pw_dir) < 0) {
@@ -1056,10 +1251,6 @@ static void execchild(const void *user_data) {
 	/* set up X11 forwarding if enabled */
 	x11setauth(chansess);
 #endif
-#if DROPBEAR_SVR_AGENTFWD
-	/* set up agent env variable */
-	svr_agentset(chansess);
-#endif
 
 	usershell = m_strdup(get_user_shell());
 	run_shell_command(chansess->cmd, ses.maxfd, usershell);
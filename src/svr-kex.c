@@ -225,7 +225,7 @@ static void send_msg_kexdh_reply(mp_int *dh_e, buffer *q_c) {
 #if DROPBEAR_NORMAL_DH
 		case DROPBEAR_KEX_NORMAL_DH:
 			{
-			struct kex_dh_param * dh_param = gen_kexdh_param();
+			struct kex_dh_param * dh_param = kex_take_param();
 			kexdh_comb_key(dh_param, dh_e, svr_opts.hostkey);
 
 			/* put f */
@@ -237,7 +237,7 @@ static void send_msg_kexdh_reply(mp_int *dh_e, buffer *q_c) {
 #if DROPBEAR_ECDH
 		case DROPBEAR_KEX_ECDH:
 			{
-			struct kex_ecdh_param *ecdh_param = gen_kexecdh_param();
+			struct kex_ecdh_param *ecdh_param = kex_take_param();
 			kexecdh_comb_key(ecdh_param, q_c, svr_opts.hostkey);
 
 			buf_put_ecc_raw_pubkey_string(ses.writepayload, &ecdh_param->key);
@@ -248,7 +248,7 @@ static void send_msg_kexdh_reply(mp_int *dh_e, buffer *q_c) {
 #if DROPBEAR_CURVE25519
 		case DROPBEAR_KEX_CURVE25519:
 			{
-			struct kex_curve25519_param *param = gen_kexcurve25519_param();
+			struct kex_curve25519_param *param = kex_take_param();
 			kexcurve25519_comb_key(param, q_c, svr_opts.hostkey);
 
 			buf_putstring(ses.writepayload, param->pub, CURVE25519_LEN);
@@ -259,7 +259,7 @@ static void send_msg_kexdh_reply(mp_int *dh_e, buffer *q_c) {
 #if DROPBEAR_PQHYBRID
 		case DROPBEAR_KEX_PQHYBRID:
 			{
-			struct kex_pqhybrid_param *param = gen_kexpqhybrid_param();
+			struct kex_pqhybrid_param *param = kex_take_param();
 			kexpqhybrid_comb_key(param, q_c, svr_opts.hostkey);
 
 			buf_putbufstring(ses.writepayload, param->concat_public);
@@ -0,0 +1,424 @@
+/*
+ * Dropbear - a SSH2 server
+ * 
+ * Copyright (c) 2026 Matt Johnston
+ * All rights reserved.
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE. */
+
+#include "includes.h"
+#include "dbutil.h"
+#include "loginqueue.h"
+
+#if DROPBEAR_SVR_LOGINQUEUE
+
+/* Login records are written by a helper process that the listening daemon
+ * forks, so sessions don't wait for utmp/wtmp/lastlog I/O.
+ *
+ * The daemon makes a socket pair for each connection and passes one end to
+ * the helper over a control socket. Before a session drops privileges it
+ * binds its socket to the authenticated user and remote host. After that
+ * the helper fills in the user and host itself, only takes a login for a
+ * tty owned by that user, and only takes a logout for a tty that the same
+ * session logged in on, so a session running as the user can't write
+ * records for anyone else. Anything else closes the session's socket.
+ * A session writes each record with a single write() and is the only
+ * writer on its socket, so records arrive whole and in order. When a
+ * session's socket closes, its ttys that are still logged in are logged
+ * out. The helper exits once the daemon and every session have closed
+ * their sockets. */
+
+/* Binds a session to its user, sent before privileges are dropped */
+#define LTYPE_BIND 0
+
+struct loginqueue_session {
+	/* the record being read */
+	struct logininfo rec;
+	size_t have;
+
+	/* the user and host */
+	int bound;
+	struct logininfo bind;
+
+	/* the records written for ttys that are logged in */
+	struct logininfo *logins;
+	unsigned int nlogins;
+};
+
+/* The session's socket, -1 to write records directly */
+static int queue_fd = -1;
+/* The daemon's end of the control socket */
+static int control_fd = -1;
+
+static void loginqueue_exit(int exitcode, const char* format, va_list param)
+	ATTRIB_NORETURN;
+
+static void loginqueue_exit(int exitcode, const char* format, va_list param) {
+	char exitmsg[150];
+
+	vsnprintf(exitmsg, sizeof(exitmsg), format, param);
+	dropbear_log(LOG_WARNING, "Login record helper exited: %s", exitmsg);
+	_exit(exitcode);
+}
+
+/* Writes a stored record with the current time */
+static void loginqueue_record(struct logininfo *li, short int type) {
+	li->type = type;
+	login_set_current_time(li);
+	login_write_record(li);
+}
+
+/* Returns DROPBEAR_FAILURE if the session may not send the record */
+static int loginqueue_handle(struct loginqueue_session *sess) {
+	struct logininfo *rec = &sess->rec;
+	struct logininfo *li = NULL;
+	struct stat st;
+	unsigned int i;
+
+	rec->line[sizeof(rec->line)-1] = '\0';
+	rec->username[sizeof(rec->username)-1] = '\0';
+	rec->hostname[sizeof(rec->hostname)-1] = '\0';
+
+	if (rec->type == LTYPE_BIND) {
+		if (sess->bound) {
+			return DROPBEAR_FAILURE;
+		}
+		login_init_entry(&sess->bind, 0, NULL, rec->hostname, NULL);
+		strlcpy(sess->bind.username, rec->username, sizeof(sess->bind.username));
+		sess->bind.uid = rec->uid;
+		sess->bound = 1;
+		TRACE(("loginqueue: session bound to '%s'", sess->bind.username))
+		return DROPBEAR_SUCCESS;
+	}
+
+	if (!sess->bound) {
+		return DROPBEAR_FAILURE;
+	}
+
+	for (i = 0; i < sess->nlogins; i++) {
+		if (strcmp(sess->logins[i].line, rec->line) == 0) {
+			li = &sess->logins[i];
+			break;
+		}
+	}
+
+	if (rec->type == LTYPE_LOGIN) {
+		if (li || sess->nlogins >= MAX_CHANNELS
+				|| strncmp(rec->line, "/dev/", 5) != 0
+				|| stat(rec->line, &st) < 0
+				|| !S_ISCHR(st.st_mode)
+				|| st.st_uid != (uid_t)sess->bind.uid) {
+			return DROPBEAR_FAILURE;
+		}
+		sess->logins = m_realloc(sess->logins,
+			(sess->nlogins + 1) * sizeof(*sess->logins));
+		li = &sess->logins[sess->nlogins];
+		sess->nlogins++;
+		*li = sess->bind;
+		li->pid = rec->pid;
+		strlcpy(li->line, rec->line, sizeof(li->line));
+		loginqueue_record(li, LTYPE_LOGIN);
+		return DROPBEAR_SUCCESS;
+	}
+
+	if (rec->type == LTYPE_LOGOUT && li) {
+		loginqueue_record(li, LTYPE_LOGOUT);
+		sess->nlogins--;
+		*li = sess->logins[sess->nlogins];
+		return DROPBEAR_SUCCESS;
+	}
+
+	return DROPBEAR_FAILURE;
+}
+
+/* Returns DROPBEAR_FAILURE once the session's socket should be closed */
+static int loginqueue_read(struct loginqueue_session *sess, int fd) {
+	ssize_t len;
+
+	len = read(fd, (unsigned char*)&sess->rec + sess->have,
+		sizeof(sess->rec) - sess->have);
+	if (len < 0 && errno == EINTR) {
+		return DROPBEAR_SUCCESS;
+	}
+	if (len <= 0) {
+		return DROPBEAR_FAILURE;
+	}
+
+	sess->have += len;
+	if (sess->have < sizeof(sess->rec)) {
+		/* a partial record waits for the rest */
+		return DROPBEAR_SUCCESS;
+	}
+	sess->have = 0;
+
+	if (loginqueue_handle(sess) == DROPBEAR_FAILURE) {
+		dropbear_log(LOG_WARNING, "Refused login record type %d for '%s' on '%s'",
+			sess->rec.type, sess->bind.username, sess->rec.line);
+		return DROPBEAR_FAILURE;
+	}
+	return DROPBEAR_SUCCESS;
+}
+
+/* Logs out the ttys that the session left logged in */
+static void loginqueue_close(struct loginqueue_session *sess, int fd) {
+	unsigned int i;
+
+	for (i = 0; i < sess->nlogins; i++) {
+		TRACE(("loginqueue: logging out '%s'", sess->logins[i].line))
+		loginqueue_record(&sess->logins[i], LTYPE_LOGOUT);
+	}
+	m_free(sess->logins);
+	m_close(fd);
+}
+
+static void loginqueue_helper(int control) {
+	/* pfds[0] is the control socket, the rest are sessions with the
+	 * same index in sessions[] */
+	struct pollfd *pfds = NULL;
+	struct loginqueue_session *sessions = NULL;
+	unsigned int nfds = 1, i;
+	int fd;
+
+	/* the helper has no session to clean up */
+	_dropbear_exit = loginqueue_exit;
+#ifdef PR_SET_NAME
+	/* otherwise ps shows another copy of the daemon */
+	prctl(PR_SET_NAME, "dropbear-login", 0, 0);
+#endif
+
+	/* the daemon's handlers only set flags for its own loop */
+	if (signal(SIGINT, SIG_DFL) == SIG_ERR
+			|| signal(SIGTERM, SIG_DFL) == SIG_ERR
+			|| signal(SIGHUP, SIG_DFL) == SIG_ERR
+			|| signal(SIGUSR1, SIG_IGN) == SIG_ERR
+			|| signal(SIGCHLD, SIG_DFL) == SIG_ERR) {
+		dropbear_exit("signal() error");
+	}
+
+	pfds = m_malloc(sizeof(*pfds));
+	sessions = m_malloc(sizeof(*sessions));
+	pfds[0].fd = control;
+	pfds[0].events = POLLIN;
+
+	while (pfds[0].fd >= 0 || nfds > 1) {
+		if (poll(pfds, nfds, -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			dropbear_exit("poll failed: %s", strerror(errno));
+		}
+
+		/* backwards, a closed session is replaced by the last */
+		for (i = nfds - 1; i >= 1; i--) {
+			if (pfds[i].revents == 0) {
+				continue;
+			}
+			if (loginqueue_read(&sessions[i], pfds[i].fd) == DROPBEAR_FAILURE) {
+				loginqueue_close(&sessions[i], pfds[i].fd);
+				nfds--;
+				pfds[i] = pfds[nfds];
+				sessions[i] = sessions[nfds];
+			}
+		}
+
+		if (pfds[0].revents) {
+			fd = recv_fd(control);
+			if (fd == -1) {
+				TRACE(("loginqueue: daemon has gone"))
+				m_close(control);
+				pfds[0].fd = -1;
+			} else if (fd >= 0) {
+				pfds = m_realloc(pfds, (nfds + 1) * sizeof(*pfds));
+				sessions = m_realloc(sessions, (nfds + 1) * sizeof(*sessions));
+				pfds[nfds].fd = fd;
+				pfds[nfds].events = POLLIN;
+				pfds[nfds].revents = 0;
+				memset(&sessions[nfds], 0x0, sizeof(sessions[nfds]));
+				nfds++;
+			}
+		}
+	}
+	_exit(EXIT_SUCCESS);
+}
+
+/* Starts the helper, from the listening daemon. closefds are the daemon's
+ * listening sockets */
+void loginqueue_start(const int *closefds, unsigned int nclosefds) {
+	int fds[2];
+	pid_t pid;
+	unsigned int i;
+
+	if (!LOGIN_RECORD_ANY_PROCESS) {
+		TRACE(("loginqueue: records need the login's tty, not starting"))
+		return;
+	}
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+		dropbear_log(LOG_WARNING, "Login records will be written directly: %s",
+			strerror(errno));
+		return;
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		dropbear_log(LOG_WARNING, "Login records will be written directly: %s",
+			strerror(errno));
+		m_close(fds[0]);
+		m_close(fds[1]);
+		return;
+	}
+
+	if (pid == 0) {
+		/* helper */
+		m_close(fds[1]);
+		for (i = 0; i < nclosefds; i++) {
+			m_close(closefds[i]);
+		}
+		loginqueue_helper(fds[0]);
+		/* not reached */
+	}
+
+	TRACE(("loginqueue: helper pid %d", pid))
+	m_close(fds[0]);
+	/* commands run by sessions mustn't get it */
+	if (fcntl(fds[1], F_SETFD, FD_CLOEXEC) < 0) {
+		TRACE(("cloexec for loginqueue failed: %s", strerror(errno)))
+	}
+	/* a busy helper doesn't hold up the daemon */
+	setnonblocking(fds[1]);
+	control_fd = fds[1];
+}
+
+/* Returns the session's end of a new socket to the helper, from the daemon
+ * before it forks a session. Returns -1 if the session should write its
+ * records directly */
+int loginqueue_new_session(void) {
+	int fds[2];
+	int ret, err;
+
+	if (control_fd < 0) {
+		return -1;
+	}
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+		TRACE(("loginqueue: socketpair failed: %s", strerror(errno)))
+		return -1;
+	}
+
+	ret = send_fd(control_fd, fds[1]);
+	err = errno;
+	m_close(fds[1]);
+	if (ret == DROPBEAR_SUCCESS) {
+		return fds[0];
+	}
+
+	m_close(fds[0]);
+	if (err == EAGAIN || err == EWOULDBLOCK) {
+		TRACE(("loginqueue: helper is busy"))
+		return -1;
+	}
+	dropbear_log(LOG_WARNING, "Login record helper failed, writing directly: %s",
+		strerror(err));
+	m_close(control_fd);
+	control_fd = -1;
+	return -1;
+}
+
+/* Returns the session's socket for a session that is about to re-execute,
+ * so it is kept open, or -1 if there is none */
+int loginqueue_reexec_fd(void) {
+	if (queue_fd >= 0 && fcntl(queue_fd, F_SETFD, 0) < 0) {
+		TRACE(("clearing cloexec for loginqueue failed: %s", strerror(errno)))
+		return -1;
+	}
+	return queue_fd;
+}
+
+/* Called by a forked session with the socket from loginqueue_new_session(),
+ * or by a re-executed session with the "-3" argument. The session doesn't
+ * keep the control socket */
+void loginqueue_setfd(int fd) {
+	m_close(control_fd);
+	control_fd = -1;
+	if (fd >= 0 && fcntl(fd, F_SETFD, FD_CLOEXEC) < 0) {
+		TRACE(("cloexec for loginqueue failed: %s", strerror(errno)))
+	}
+	queue_fd = fd;
+}
+
+/* Sends the record to the helper, or returns DROPBEAR_FAILURE if the
+ * caller should write it directly */
+static int loginqueue_put(const struct logininfo *li) {
+	ssize_t len;
+
+	if (queue_fd < 0) {
+		return DROPBEAR_FAILURE;
+	}
+
+	do {
+		/* blocks if the helper is behind */
+		len = write(queue_fd, li, sizeof(*li));
+	} while (len < 0 && errno == EINTR);
+
+	if (len == (ssize_t)sizeof(*li)) {
+		return DROPBEAR_SUCCESS;
+	}
+
+	/* The helper has gone or refused a record, later records are
+	 * written directly */
+	dropbear_log(LOG_WARNING, "Login record helper failed, writing directly");
+	m_close(queue_fd);
+	queue_fd = -1;
+	return DROPBEAR_FAILURE;
+}
+
+/* Binds the session's socket to the authenticated user, before privileges
+ * are dropped */
+void loginqueue_bind(const char *username, const char *hostname) {
+	struct logininfo li;
+
+	if (queue_fd < 0) {
+		return;
+	}
+	login_init_entry(&li, 0, username, hostname, NULL);
+	li.type = LTYPE_BIND;
+	(void)loginqueue_put(&li);
+}
+
+#endif /* DROPBEAR_SVR_LOGINQUEUE */
+
+static void loginqueue_write(struct logininfo *li) {
+	login_set_current_time(li);
+#if DROPBEAR_SVR_LOGINQUEUE
+	if (loginqueue_put(li) == DROPBEAR_SUCCESS) {
+		return;
+	}
+#endif
+	login_write_record(li);
+}
+
+void loginqueue_login(struct logininfo *li) {
+	li->type = LTYPE_LOGIN;
+	loginqueue_write(li);
+}
+
+void loginqueue_logout(struct logininfo *li) {
+	li->type = LTYPE_LOGOUT;
+	loginqueue_write(li);
+}
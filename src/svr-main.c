@@ -30,11 +30,21 @@
 #include "runopts.h"
 #include "dbrandom.h"
 #include "crypto_desc.h"
+#include "loginqueue.h"
+#include "auth.h"
 
 static size_t listensockets(int *sock, size_t sockcount, int *maxfd);
 static void sigchld_handler(int dummy);
 static void sigsegv_handler(int);
 static void sigintterm_handler(int fish);
+static void listener_wakeup(void);
+/* A self-pipe that signal handlers write to, so the listener's select()
+ * returns for a signal that arrives just before it is called */
+static int listener_wake[2] = {-1, -1};
+#if DROPBEAR_SVR_PWCACHE
+static void sigusr1_handler(int dummy);
+static int pwcache_flush_pending;
+#endif
 static void main_inetd(void);
 static void main_noinetd(int argc, char ** argv, const char* multipath);
 static void commonsetup(void);
@@ -77,6 +87,12 @@ int main(int argc, char ** argv)
 		a FD number from fexecve.
 		Failure doesn't really matter, it's mostly aesthetic */
 		prctl(PR_SET_NAME, basename(argv[0]), 0, 0);
+#endif
+#if DROPBEAR_SVR_LOGINQUEUE
+		loginqueue_setfd(svr_opts.reexec_loginqueue);
+#endif
+#if DROPBEAR_SVR_PWCACHE
+		svr_pwcache_setfd(svr_opts.reexec_pwcache);
 #endif
 		main_inetd();
 		/* notreached */
@@ -128,6 +144,263 @@ static void main_inetd() {
 #endif /* INETD_MODE */
 
 #if NON_INETD_MODE
+/* Admission control for new connections, set with -x. Token buckets count
+ * thousandths of a connection so that refills don't lose precision. */
+
+/* An address prefix that connections are counted against */
+struct admit_key {
+	int family;
+	unsigned char addr[16];
+};
+
+struct admit_source {
+	struct admit_key key;
+	int used;
+	long long tokens;
+	unsigned int failures;
+	/* pre-auth children from this source */
+	unsigned int children;
+	struct timespec last;
+};
+
+/* DROPBEAR_ADMIT_SOURCES entries, allocated if there is a per-source rate */
+static struct admit_source *admit_sources = NULL;
+static long long admit_global_tokens;
+static struct timespec admit_global_last;
+/* Prefixes that have recently authenticated, oldest replaced first */
+static struct admit_key admit_authed[DROPBEAR_ADMIT_AUTHED];
+static unsigned int admit_authed_next;
+
+/* Refused connections since the last log message */
+static unsigned long admit_refused;
+static time_t admit_log_time;
+
+/* Adds tokens for the time since *last, at rate per period_ms. Counts are
+ * long long, an hour at the highest rate doesn't fit a 32 bit long */
+static long long admit_refill(long long tokens, long long burst,
+		long long rate, long long period_ms,
+		struct timespec *last, const struct timespec *now) {
+	long long ms = (long long)(now->tv_sec - last->tv_sec) * 1000
+		+ (now->tv_nsec - last->tv_nsec) / 1000000;
+
+	if (ms <= 0) {
+		return tokens;
+	}
+	*last = *now;
+	/* an hour is long enough to refill any sensible bucket */
+	ms = MIN(ms, 3600000LL);
+	return MIN(tokens + ms * rate * 1000 / period_ms, burst * 1000);
+}
+
+/* Clears the bits of addr after the first bits */
+static void admit_mask(unsigned char *addr, unsigned int len, unsigned int bits) {
+	unsigned int i;
+
+	for (i = 0; i < len; i++) {
+		if (bits >= 8) {
+			bits -= 8;
+		} else {
+			addr[i] &= 0xff << (8 - bits);
+			bits = 0;
+		}
+	}
+}
+
+/* The prefix that addr is counted in, a /24 for IPv4 or /64 for IPv6 */
+static void admit_get_key(const struct sockaddr_storage *addr,
+		struct admit_key *key) {
+	memset(key, 0x0, sizeof(*key));
+	if (addr->ss_family == AF_INET) {
+		const struct sockaddr_in *sin = (const struct sockaddr_in*)addr;
+		key->family = AF_INET;
+		memcpy(key->addr, &sin->sin_addr, 4);
+	}
+	if (addr->ss_family == AF_INET6) {
+		const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6*)addr;
+		if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr)) {
+			key->family = AF_INET;
+			memcpy(key->addr, &sin6->sin6_addr.s6_addr[12], 4);
+		} else {
+			key->family = AF_INET6;
+			memcpy(key->addr, &sin6->sin6_addr, 16);
+		}
+	}
+	if (key->family == AF_INET) {
+		admit_mask(key->addr, 4, DROPBEAR_ADMIT_PREFIX4);
+	} else {
+		admit_mask(key->addr, 16, DROPBEAR_ADMIT_PREFIX6);
+	}
+}
+
+static void admit_source_refill(struct admit_source *src,
+		const struct timespec *now) {
+	src->tokens = admit_refill(src->tokens, svr_opts.admit_burst,
+		svr_opts.admit_rate, 60000, &src->last, now);
+	if (src->tokens == svr_opts.admit_burst * 1000LL) {
+		/* well behaved for long enough */
+		src->failures = 0;
+	}
+}
+
+/* Returns the entry for key. A new source takes an entry that has nothing
+ * to remember, one with a full bucket and no children. Returns NULL if
+ * there isn't one, rather than forgetting a penalty */
+static struct admit_source* admit_lookup(const struct admit_key *key,
+		const struct timespec *now) {
+	struct admit_source *src = NULL;
+	unsigned int i;
+
+	for (i = 0; i < DROPBEAR_ADMIT_SOURCES; i++) {
+		struct admit_source *s = &admit_sources[i];
+		if (s->used) {
+			admit_source_refill(s, now);
+			if (memcmp(&s->key, key, sizeof(*key)) == 0) {
+				return s;
+			}
+			if (s->children == 0 && s->failures == 0
+					&& s->tokens == svr_opts.admit_burst * 1000LL) {
+				/* the same as a new entry */
+				s->used = 0;
+			}
+		}
+		if (!s->used && !src) {
+			src = s;
+		}
+	}
+
+	if (src) {
+		src->key = *key;
+		src->used = 1;
+		src->tokens = svr_opts.admit_burst * 1000LL;
+		src->failures = 0;
+		src->children = 0;
+		src->last = *now;
+	}
+	return src;
+}
+
+static struct admit_key* admit_find_authed(const struct admit_key *key) {
+	unsigned int i;
+
+	if (key->family == 0) {
+		return NULL;
+	}
+	for (i = 0; i < DROPBEAR_ADMIT_AUTHED; i++) {
+		if (memcmp(&admit_authed[i], key, sizeof(*key)) == 0) {
+			return &admit_authed[i];
+		}
+	}
+	return NULL;
+}
+
+/* A child from key authenticated */
+static void admit_authenticated(const struct admit_key *key) {
+	if (key->family == 0 || admit_find_authed(key)) {
+		return;
+	}
+	admit_authed[admit_authed_next] = *key;
+	admit_authed_next = (admit_authed_next + 1) % DROPBEAR_ADMIT_AUTHED;
+}
+
+/* A child reported failed authentication attempts from key. Each one
+ * costs more than the last, until the source has been quiet long enough
+ * for its bucket to refill. */
+static void admit_failed(const struct admit_key *key, struct admit_source *src,
+		unsigned int count) {
+	struct timespec now;
+	struct admit_key *authed = NULL;
+	/* lock out for at most a day */
+	const long long floor = -(long long)svr_opts.admit_rate * 60 * 24 * 1000;
+
+	authed = admit_find_authed(key);
+	if (authed) {
+		memset(authed, 0x0, sizeof(*authed));
+	}
+	if (src == NULL) {
+		return;
+	}
+
+	gettime_wrapper(&now);
+	admit_source_refill(src, &now);
+	while (count--) {
+		src->failures = MIN(src->failures + 1, svr_opts.admit_burst);
+		src->tokens = MAX(src->tokens - (long long)src->failures * 1000, floor);
+	}
+	TRACE(("admission: failures %u tokens %lld", src->failures, src->tokens))
+}
+
+/* Logs refused connections, at most once a minute */
+static void admit_log_refused(const char *addr, const char *why) {
+	time_t now = monotonic_now();
+
+	admit_refused++;
+	if (admit_log_time != 0 && now - admit_log_time < 60) {
+		return;
+	}
+	dropbear_log(LOG_WARNING, "Refused %lu connection%s over the rate limit, "
+		"the last from %s (%s)", admit_refused, admit_refused == 1 ? "" : "s",
+		addr, why);
+	admit_refused = 0;
+	admit_log_time = now;
+}
+
+static void admit_init(void) {
+	if (svr_opts.admit_rate) {
+		admit_sources = m_malloc(DROPBEAR_ADMIT_SOURCES * sizeof(*admit_sources));
+	}
+	admit_global_tokens = svr_opts.admit_global * 1000LL;
+	gettime_wrapper(&admit_global_last);
+}
+
+/* Returns DROPBEAR_SUCCESS and takes a token if a new connection from
+ * key should be accepted. *src_out is set to its source, or NULL if
+ * there is no per-source limit. */
+static int admit_connection(const struct admit_key *key,
+		const char *addrstring, struct admit_source **src_out) {
+	struct admit_source *src = NULL;
+	struct timespec now;
+	long long need = 1000;
+
+	*src_out = NULL;
+	gettime_wrapper(&now);
+
+	if (admit_sources) {
+		src = admit_lookup(key, &now);
+		if (src == NULL) {
+			admit_log_refused(addrstring, "too many sources");
+			return DROPBEAR_FAILURE;
+		}
+		if (src->tokens < 1000) {
+			TRACE(("admission: rejecting %s, tokens %lld", addrstring, src->tokens))
+			admit_log_refused(addrstring, "source rate");
+			return DROPBEAR_FAILURE;
+		}
+	}
+
+	if (svr_opts.admit_global) {
+		admit_global_tokens = admit_refill(admit_global_tokens,
+			svr_opts.admit_global, svr_opts.admit_global, 1000,
+			&admit_global_last, &now);
+		if (!admit_find_authed(key)) {
+			/* keep the lower half of the budget for sources that
+			 * have authenticated, fresh addresses can't use it up */
+			need += svr_opts.admit_global * 500LL;
+		}
+		if (admit_global_tokens < need) {
+			TRACE(("admission: rejecting %s, global tokens %lld", addrstring, admit_global_tokens))
+			admit_log_refused(addrstring, "global rate");
+			return DROPBEAR_FAILURE;
+		}
+		admit_global_tokens -= 1000;
+	}
+
+	if (src) {
+		src->tokens -= 1000;
+	}
+	*src_out = src;
+	return DROPBEAR_SUCCESS;
+}
+
 static void main_noinetd(int argc, char ** argv, const char* multipath) {
 	fd_set fds;
 	unsigned int i, j;
@@ -140,6 +413,8 @@ static void main_noinetd(int argc, char ** argv, const char* multipath) {
 
 	int childpipes[MAX_UNAUTH_CLIENTS];
 	char * preauth_addrs[MAX_UNAUTH_CLIENTS];
+	struct admit_source * preauth_admit[MAX_UNAUTH_CLIENTS];
+	struct admit_key preauth_keys[MAX_UNAUTH_CLIENTS];
 
 	int childsock;
 	int childpipe[2];
@@ -158,6 +433,9 @@ static void main_noinetd(int argc, char ** argv, const char* multipath) {
 		childpipes[i] = -1;
 	}
 	memset(preauth_addrs, 0x0, sizeof(preauth_addrs));
+	memset(preauth_admit, 0x0, sizeof(preauth_admit));
+	memset(preauth_keys, 0x0, sizeof(preauth_keys));
+	admit_init();
 
 	/* Set up the listening sockets */
 	listensockcount = listensockets(listensocks, MAX_LISTEN_ADDR, &maxsock);
@@ -202,6 +480,24 @@ static void main_noinetd(int argc, char ** argv, const char* multipath) {
 		dropbear_log(LOG_INFO, "Not backgrounding");
 	}
 
+#if DROPBEAR_SVR_LOGINQUEUE
+	loginqueue_start(listensocks, listensockcount);
+#endif
+
+#if DROPBEAR_SVR_PWCACHE
+	svr_pwcache_init(listensocks, listensockcount);
+	if (signal(SIGUSR1, sigusr1_handler) == SIG_ERR) {
+		dropbear_exit("signal() error");
+	}
+#endif
+
+#if DROPBEAR_SVR_SNAPSHOT
+	/* after loginqueue_start(), the helper mustn't get it */
+	if (execfd >= 0) {
+		svr_snapshot_create();
+	}
+#endif
+
 	/* create a PID file so that we can be killed easily */
 	pidfile = fopen(svr_opts.pidfile, "w");
 	if (pidfile) {
@@ -209,6 +505,17 @@ static void main_noinetd(int argc, char ** argv, const char* multipath) {
 		fclose(pidfile);
 	}
 
+	if (pipe(listener_wake) < 0) {
+		dropbear_exit("Couldn't create pipe: %s", strerror(errno));
+	}
+	for (i = 0; i < 2; i++) {
+		setnonblocking(listener_wake[i]);
+		if (fcntl(listener_wake[i], F_SETFD, FD_CLOEXEC) < 0) {
+			TRACE(("cloexec for listener pipe failed: %s", strerror(errno)))
+		}
+	}
+	maxsock = MAX(maxsock, listener_wake[0]);
+
 	/* incoming connection select loop */
 	for(;;) {
 
@@ -227,13 +534,27 @@ static void main_noinetd(int argc, char ** argv, const char* multipath) {
 			}
 		}
 
+		dropbear_fd_set(listener_wake[0], &fds);
+
 		val = select(maxsock+1, &fds, NULL, NULL, NULL);
 
+		if (val > 0 && FD_ISSET(listener_wake[0], &fds)) {
+			char c;
+			while (read(listener_wake[0], &c, 1) > 0) {}
+		}
+
 		if (ses.exitflag) {
 			unlink(svr_opts.pidfile);
 			dropbear_close("Terminated by signal");
 		}
 
+#if DROPBEAR_SVR_PWCACHE
+		if (pwcache_flush_pending) {
+			pwcache_flush_pending = 0;
+			svr_pwcache_flush();
+		}
+#endif
+
 		if (val == 0) {
 			/* timeout reached - shouldn't happen. eh */
 			continue;
@@ -247,12 +568,36 @@ static void main_noinetd(int argc, char ** argv, const char* multipath) {
 		}
 
 		/* close fds which have been authed or closed - svr-auth.c handles
-		 * closing the auth sockets on success */
+		 * closing the auth sockets on success. Before that it writes
+		 * CHILDPIPE_ bytes for failed attempts and success. */
 		for (i = 0; i < MAX_UNAUTH_CLIENTS; i++) {
 			if (childpipes[i] >= 0 && FD_ISSET(childpipes[i], &fds)) {
+				char msgbuf[16];
+				unsigned int failed = 0;
+				ssize_t j, len = read(childpipes[i], msgbuf, sizeof(msgbuf));
+				for (j = 0; j < len; j++) {
+					if (msgbuf[j] == CHILDPIPE_AUTH_FAILED) {
+						failed++;
+					} else if (msgbuf[j] == CHILDPIPE_AUTHED) {
+						admit_authenticated(&preauth_keys[i]);
+					}
+				}
+				if (failed) {
+					admit_failed(&preauth_keys[i], preauth_admit[i], failed);
+				}
+				if (len > 0) {
+					continue;
+				}
+				if (len < 0 && errno == EINTR) {
+					continue;
+				}
 				m_close(childpipes[i]);
 				childpipes[i] = -1;
 				m_free(preauth_addrs[i]);
+				if (preauth_admit[i]) {
+					preauth_admit[i]->children--;
+					preauth_admit[i] = NULL;
+				}
 			}
 		}
 
@@ -263,6 +608,14 @@ static void main_noinetd(int argc, char ** argv, const char* multipath) {
 			char *remote_host = NULL, *remote_port = NULL;
 			pid_t fork_ret = 0;
 			size_t conn_idx = 0;
+			struct admit_source *admit_src = NULL;
+			struct admit_key admit_key;
+#if DROPBEAR_SVR_LOGINQUEUE
+			int loginqueue_fd = -1;
+#endif
+#if DROPBEAR_SVR_PWCACHE
+			int pwcache_fd = -1;
+#endif
 			struct sockaddr_storage remoteaddr;
 			socklen_t remoteaddrlen;
 
@@ -300,6 +653,13 @@ static void main_noinetd(int argc, char ** argv, const char* multipath) {
 				goto out;
 			}
 
+			admit_get_key(&remoteaddr, &admit_key);
+			if ((svr_opts.admit_rate || svr_opts.admit_global)
+					&& admit_connection(&admit_key, remote_host, &admit_src)
+						== DROPBEAR_FAILURE) {
+				goto out;
+			}
+
 			seedrandom();
 
 			if (pipe(childpipe) < 0) {
@@ -307,6 +667,13 @@ static void main_noinetd(int argc, char ** argv, const char* multipath) {
 				goto out;
 			}
 
+#if DROPBEAR_SVR_LOGINQUEUE
+			loginqueue_fd = loginqueue_new_session();
+#endif
+#if DROPBEAR_SVR_PWCACHE
+			pwcache_fd = svr_pwcache_new_session();
+#endif
+
 #if DEBUG_NOFORK
 			fork_ret = 0;
 #else
@@ -326,6 +693,11 @@ static void main_noinetd(int argc, char ** argv, const char* multipath) {
 				m_close(childpipe[1]);
 				preauth_addrs[conn_idx] = remote_host;
 				remote_host = NULL;
+				preauth_admit[conn_idx] = admit_src;
+				preauth_keys[conn_idx] = admit_key;
+				if (admit_src) {
+					admit_src->children++;
+				}
 
 			} else {
 
@@ -352,12 +724,34 @@ static void main_noinetd(int argc, char ** argv, const char* multipath) {
 				}
 
 				m_close(childpipe[0]);
+				m_close(listener_wake[0]);
+				m_close(listener_wake[1]);
+				listener_wake[0] = listener_wake[1] = -1;
+
+#if DROPBEAR_SVR_LOGINQUEUE
+				loginqueue_setfd(loginqueue_fd);
+#endif
+#if DROPBEAR_SVR_PWCACHE
+				svr_pwcache_setfd(pwcache_fd);
+#endif
 
 				if (execfd >= 0) {
 #if DROPBEAR_DO_REEXEC
 					/* Add "-2 childpipe[1]" to the args and re-execute ourself. */
-					char **new_argv = m_malloc(sizeof(char*) * (argc+4));
+					char **new_argv = m_malloc(sizeof(char*) * (argc+10));
 					char buf[10];
+#if DROPBEAR_SVR_LOGINQUEUE
+					char loginqueue_buf[12];
+					int loginqueue = loginqueue_reexec_fd();
+#endif
+#if DROPBEAR_SVR_PWCACHE
+					char pwcache_buf[12];
+					int pwcache = svr_pwcache_reexec_fd();
+#endif
+#if DROPBEAR_SVR_SNAPSHOT
+					char snapshot_buf[12];
+					int snapshot = svr_snapshot_reexec_fd();
+#endif
 					int pos0 = 0, new_argc = argc+2;
 
 					/* We need to specially handle "dropbearmulti dropbear". */
@@ -371,6 +765,33 @@ static void main_noinetd(int argc, char ** argv, const char* multipath) {
 					new_argv[new_argc-2] = "-2";
 					snprintf(buf, sizeof(buf), "%d", childpipe[1]);
 					new_argv[new_argc-1] = buf;
+#if DROPBEAR_SVR_LOGINQUEUE
+					/* and "-3 loginqueue" */
+					if (loginqueue >= 0) {
+						new_argv[new_argc] = "-3";
+						snprintf(loginqueue_buf, sizeof(loginqueue_buf), "%d", loginqueue);
+						new_argv[new_argc+1] = loginqueue_buf;
+						new_argc += 2;
+					}
+#endif
+#if DROPBEAR_SVR_PWCACHE
+					/* and "-4 pwcache" */
+					if (pwcache >= 0) {
+						new_argv[new_argc] = "-4";
+						snprintf(pwcache_buf, sizeof(pwcache_buf), "%d", pwcache);
+						new_argv[new_argc+1] = pwcache_buf;
+						new_argc += 2;
+					}
+#endif
+#if DROPBEAR_SVR_SNAPSHOT
+					/* and "-5 snapshot" */
+					if (snapshot >= 0) {
+						new_argv[new_argc] = "-5";
+						snprintf(snapshot_buf, sizeof(snapshot_buf), "%d", snapshot);
+						new_argv[new_argc+1] = snapshot_buf;
+						new_argc += 2;
+					}
+#endif
 					new_argv[new_argc] = NULL;
 
 					if ((dup2(childsock, STDIN_FILENO) < 0)) {
@@ -400,6 +821,12 @@ static void main_noinetd(int argc, char ** argv, const char* multipath) {
 out:
 			/* This section is important for the parent too */
 			m_close(childsock);
+#if DROPBEAR_SVR_LOGINQUEUE
+			m_close(loginqueue_fd);
+#endif
+#if DROPBEAR_SVR_PWCACHE
+			m_close(pwcache_fd);
+#endif
 			if (remote_host) {
 				m_free(remote_host);
 			}
@@ -439,10 +866,33 @@ static void sigsegv_handler(int UNUSED(unused)) {
 	_exit(EXIT_FAILURE);
 }
 
+#if DROPBEAR_SVR_PWCACHE
+/* clear the user cache */
+static void sigusr1_handler(int UNUSED(unused)) {
+	pwcache_flush_pending = 1;
+	listener_wakeup();
+}
+#endif
+
 /* catch ctrl-c or sigterm */
 static void sigintterm_handler(int UNUSED(unused)) {
 
 	ses.exitflag = 1;
+	listener_wakeup();
+}
+
+/* Called from signal handlers */
+static void listener_wakeup(void) {
+	const int saved_errno = errno;
+	char c = 0;
+	int i;
+
+	if (listener_wake[1] >= 0) {
+		i = write(listener_wake[1], &c, 1);
+		/* a full pipe will wake it already */
+		(void)i;
+	}
+	errno = saved_errno;
 }
 
 /* Things used by inetd and non-inetd modes */
@@ -0,0 +1,634 @@
+/*
+ * Dropbear - a SSH2 server
+ * 
+ * Copyright (c) 2026 Matt Johnston
+ * All rights reserved.
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE. */
+
+#include "includes.h"
+#include "dbutil.h"
+#include "session.h"
+#include "auth.h"
+#include "runopts.h"
+#include "atomicio.h"
+#include "loginqueue.h"
+
+#if DROPBEAR_SVR_PWCACHE
+
+/* A cache of user lookups for the daemon's connections, so that repeat
+ * logins don't wait for a slow name service. It holds password hashes, so
+ * it is kept in the memory of a helper that the listening daemon forks,
+ * and pre-auth sessions never share it.
+ *
+ * The daemon makes a socket pair for each connection and passes one end to
+ * the helper. A session sends a single query with the username and gets
+ * back the cached entry, or a miss, without waiting for any lookup. Then
+ * both ends close the socket. On a miss the session looks the user up
+ * itself, and the helper forks a worker to look it up for the cache. Only
+ * the helper's workers fill the cache.
+ *
+ * Entries expire after DROPBEAR_SVR_PWCACHE_TTL seconds. The whole cache
+ * is cleared when /etc/passwd, /etc/shadow or /etc/group change, or when
+ * the daemon gets SIGUSR1, which it passes on as a byte without a socket
+ * on the control socket. */
+
+#define PWCACHE_ENTRIES 64
+/* Lookups for the cache that can run at once */
+#define PWCACHE_WORKERS 4
+/* Seconds before a worker is killed */
+#define PWCACHE_WORKER_TIMEOUT 30
+
+struct pwcache_entry {
+	time_t expires; /* monotonic_now(), 0 if unused or a miss */
+	uid_t uid;
+	gid_t gid;
+	/* the result of check_group_membership() for group_gid */
+	int group_checked;
+	gid_t group_gid;
+	int group_member;
+	char name[MAX_USERNAME_LEN+1];
+	char dir[256];
+	char shell[128];
+	char passwd[256];
+};
+
+struct pwcache_query {
+	char name[MAX_USERNAME_LEN+1];
+};
+
+/* Identifies a version of a local account file */
+struct pwcache_filestamp {
+	ino_t ino;
+	off_t size;
+	time_t mtime;
+	time_t ctime;
+};
+
+static const char *pwcache_filenames[] = {
+	"/etc/passwd",
+	"/etc/shadow",
+	"/etc/group",
+};
+#define PWCACHE_FILES (sizeof(pwcache_filenames) / sizeof(pwcache_filenames[0]))
+
+struct pwcache {
+	struct pwcache_filestamp files[PWCACHE_FILES];
+	struct pwcache_entry entries[PWCACHE_ENTRIES];
+};
+
+struct pwcache_worker {
+	pid_t pid;
+	/* the result isn't stored if the cache was flushed meanwhile */
+	int stale;
+	struct pwcache_filestamp files[PWCACHE_FILES];
+	struct pwcache_entry entry;
+	size_t have;
+};
+
+struct pwcache_session {
+	struct pwcache_query query;
+	size_t have;
+};
+
+/* In the helper */
+static struct pwcache *cache = NULL;
+static struct pwcache_worker workers[PWCACHE_WORKERS];
+static int flush_pending;
+
+/* In the daemon */
+static int control_fd = -1;
+
+/* In a session, its socket and the -G membership from its query */
+static int query_fd = -1;
+static int cached_group_checked;
+static gid_t cached_group_gid;
+static int cached_group_member;
+
+static void pwcache_exit(int exitcode, const char* format, va_list param)
+	ATTRIB_NORETURN;
+
+static void pwcache_exit(int exitcode, const char* format, va_list param) {
+	char exitmsg[150];
+
+	vsnprintf(exitmsg, sizeof(exitmsg), format, param);
+	dropbear_log(LOG_WARNING, "User cache helper exited: %s", exitmsg);
+	_exit(exitcode);
+}
+
+static void pwcache_stamp(struct pwcache_filestamp *stamps) {
+	struct stat st;
+	unsigned int i;
+
+	memset(stamps, 0x0, sizeof(struct pwcache_filestamp) * PWCACHE_FILES);
+	for (i = 0; i < PWCACHE_FILES; i++) {
+		if (stat(pwcache_filenames[i], &st) == 0) {
+			stamps[i].ino = st.st_ino;
+			stamps[i].size = st.st_size;
+			stamps[i].mtime = st.st_mtime;
+			stamps[i].ctime = st.st_ctime;
+		}
+	}
+}
+
+/* Clears the cache if the account files have changed or it was asked to */
+static void pwcache_check(void) {
+	struct pwcache_filestamp stamps[PWCACHE_FILES];
+	unsigned int i;
+
+	if (flush_pending) {
+		flush_pending = 0;
+		dropbear_log(LOG_INFO, "Clearing user cache");
+		memset(cache->entries, 0x0, sizeof(cache->entries));
+		for (i = 0; i < PWCACHE_WORKERS; i++) {
+			workers[i].stale = 1;
+		}
+	}
+
+	pwcache_stamp(stamps);
+	if (memcmp(stamps, cache->files, sizeof(stamps)) != 0) {
+		TRACE(("pwcache: account files changed"))
+		memset(cache, 0x0, sizeof(*cache));
+		memcpy(cache->files, stamps, sizeof(stamps));
+	}
+}
+
+/* Returns the entry for username, or NULL */
+static struct pwcache_entry* pwcache_find(const char *username) {
+	time_t now = monotonic_now();
+	unsigned int i;
+
+	for (i = 0; i < PWCACHE_ENTRIES; i++) {
+		struct pwcache_entry *entry = &cache->entries[i];
+		if (entry->expires > now && strcmp(entry->name, username) == 0) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+/* An entry to replace for username */
+static struct pwcache_entry* pwcache_slot(const char *username) {
+	struct pwcache_entry *oldest = NULL;
+	time_t now = monotonic_now();
+	unsigned int i;
+
+	for (i = 0; i < PWCACHE_ENTRIES; i++) {
+		struct pwcache_entry *entry = &cache->entries[i];
+		if (entry->expires <= now || strcmp(entry->name, username) == 0) {
+			return entry;
+		}
+		if (!oldest || entry->expires < oldest->expires) {
+			oldest = entry;
+		}
+	}
+	return oldest;
+}
+
+static int pwcache_copy(char *dst, const char *src, size_t len) {
+	if (strlen(src) >= len) {
+		return DROPBEAR_FAILURE;
+	}
+	strlcpy(dst, src, len);
+	return DROPBEAR_SUCCESS;
+}
+
+/* Looks up the user and writes the entry to fd, in a worker */
+static void pwcache_lookup(const char *username, int fd) {
+	struct pwcache_entry entry;
+
+	alarm(PWCACHE_WORKER_TIMEOUT);
+
+	memset(&entry, 0x0, sizeof(entry));
+	fill_passwd(username);
+	if (ses.authstate.pw_name
+		&& pwcache_copy(entry.name, ses.authstate.pw_name, sizeof(entry.name)) == DROPBEAR_SUCCESS
+		&& pwcache_copy(entry.dir, ses.authstate.pw_dir, sizeof(entry.dir)) == DROPBEAR_SUCCESS
+		&& pwcache_copy(entry.shell, ses.authstate.pw_shell, sizeof(entry.shell)) == DROPBEAR_SUCCESS
+		&& pwcache_copy(entry.passwd, ses.authstate.pw_passwd, sizeof(entry.passwd)) == DROPBEAR_SUCCESS) {
+		entry.uid = ses.authstate.pw_uid;
+		entry.gid = ses.authstate.pw_gid;
+#ifdef HAVE_GETGROUPLIST
+		if (svr_opts.restrict_group) {
+			entry.group_checked = 1;
+			entry.group_gid = svr_opts.restrict_group_gid;
+			entry.group_member = check_group_membership(entry.group_gid,
+				entry.name, entry.gid);
+		}
+#endif
+		entry.expires = 1;
+	} else {
+		TRACE(("pwcache: '%s' not found or too long to cache", username))
+		memset(&entry, 0x0, sizeof(entry));
+	}
+
+	if (atomicio(vwrite, fd, &entry, sizeof(entry)) != sizeof(entry)) {
+		TRACE(("pwcache: worker write failed"))
+	}
+	m_burn(&entry, sizeof(entry));
+	_exit(EXIT_SUCCESS);
+}
+
+/* Starts a worker to add username to the cache, unless one is already
+ * running for it or there are too many */
+static void pwcache_start_worker(const char *username, struct pollfd *pfds) {
+	int fds[2];
+	pid_t pid;
+	unsigned int i, slot = PWCACHE_WORKERS;
+
+	for (i = 0; i < PWCACHE_WORKERS; i++) {
+		if (pfds[i].fd < 0) {
+			slot = i;
+		} else if (strcmp(workers[i].entry.name, username) == 0) {
+			return;
+		}
+	}
+	if (slot == PWCACHE_WORKERS) {
+		TRACE(("pwcache: too many workers"))
+		return;
+	}
+
+	if (pipe(fds) < 0) {
+		TRACE(("pwcache: pipe failed: %s", strerror(errno)))
+		return;
+	}
+	pid = fork();
+	if (pid < 0) {
+		TRACE(("pwcache: fork failed: %s", strerror(errno)))
+		m_close(fds[0]);
+		m_close(fds[1]);
+		return;
+	}
+	if (pid == 0) {
+		m_close(fds[0]);
+		pwcache_lookup(username, fds[1]);
+		/* not reached */
+	}
+	m_close(fds[1]);
+
+	memset(&workers[slot], 0x0, sizeof(workers[slot]));
+	workers[slot].pid = pid;
+	memcpy(workers[slot].files, cache->files, sizeof(cache->files));
+	/* the name marks the worker as running for it */
+	strlcpy(workers[slot].entry.name, username, sizeof(workers[slot].entry.name));
+	pfds[slot].fd = fds[0];
+	pfds[slot].events = POLLIN;
+	pfds[slot].revents = 0;
+}
+
+/* Reads a worker's result, and stores it once it is complete */
+static void pwcache_worker_read(struct pwcache_worker *worker, struct pollfd *pfd) {
+	ssize_t len;
+
+	len = read(pfd->fd, (unsigned char*)&worker->entry + worker->have,
+		sizeof(worker->entry) - worker->have);
+	if (len < 0 && errno == EINTR) {
+		return;
+	}
+	if (len > 0) {
+		worker->have += len;
+		if (worker->have < sizeof(worker->entry)) {
+			return;
+		}
+		pwcache_check();
+		if (worker->entry.expires && !worker->stale
+				&& memcmp(worker->files, cache->files, sizeof(cache->files)) == 0) {
+			struct pwcache_entry *slot = pwcache_slot(worker->entry.name);
+			memcpy(slot, &worker->entry, sizeof(worker->entry));
+			slot->expires = monotonic_now() + DROPBEAR_SVR_PWCACHE_TTL;
+			TRACE(("pwcache: stored '%s'", slot->name))
+		}
+	}
+
+	/* done, or it failed */
+	m_close(pfd->fd);
+	pfd->fd = -1;
+	while (waitpid(worker->pid, NULL, 0) < 0 && errno == EINTR) {}
+	m_burn(worker, sizeof(*worker));
+}
+
+/* Reads a session's query. Returns DROPBEAR_FAILURE once the session's
+ * socket should be closed */
+static int pwcache_session_read(struct pwcache_session *sess, int fd,
+		struct pollfd *pfds) {
+	struct pwcache_entry *entry = NULL;
+	struct pwcache_entry miss;
+	ssize_t len;
+
+	len = read(fd, (unsigned char*)&sess->query + sess->have,
+		sizeof(sess->query) - sess->have);
+	if (len < 0 && errno == EINTR) {
+		return DROPBEAR_SUCCESS;
+	}
+	if (len <= 0) {
+		return DROPBEAR_FAILURE;
+	}
+	sess->have += len;
+	if (sess->have < sizeof(sess->query)) {
+		return DROPBEAR_SUCCESS;
+	}
+	sess->query.name[sizeof(sess->query.name)-1] = '\0';
+
+	pwcache_check();
+	entry = pwcache_find(sess->query.name);
+	if (entry) {
+		TRACE(("pwcache: found '%s'", entry->name))
+	} else {
+		memset(&miss, 0x0, sizeof(miss));
+		entry = &miss;
+		pwcache_start_worker(sess->query.name, pfds);
+	}
+	/* a new socket has room, so this doesn't block */
+	if (atomicio(vwrite, fd, entry, sizeof(*entry)) != sizeof(*entry)) {
+		TRACE(("pwcache: reply failed"))
+	}
+	/* one query for each connection */
+	return DROPBEAR_FAILURE;
+}
+
+static void pwcache_helper(int control) {
+	/* pfds[] has the workers, then the control socket, then sessions
+	 * with the same index in sessions[] */
+	struct pollfd *pfds = NULL;
+	struct pwcache_session *sessions = NULL;
+	const unsigned int first = PWCACHE_WORKERS + 1;
+	unsigned int nfds = first, i;
+	int fd;
+
+	/* the helper has no session to clean up */
+	_dropbear_exit = pwcache_exit;
+#ifdef PR_SET_NAME
+	prctl(PR_SET_NAME, "dropbear-cache", 0, 0);
+#endif
+
+	if (signal(SIGINT, SIG_DFL) == SIG_ERR
+			|| signal(SIGTERM, SIG_DFL) == SIG_ERR
+			|| signal(SIGHUP, SIG_DFL) == SIG_ERR
+			|| signal(SIGCHLD, SIG_DFL) == SIG_ERR
+			|| signal(SIGALRM, SIG_DFL) == SIG_ERR
+			|| signal(SIGUSR1, SIG_IGN) == SIG_ERR) {
+		dropbear_exit("signal() error");
+	}
+
+	cache = m_malloc(sizeof(*cache));
+	pfds = m_malloc(sizeof(*pfds) * nfds);
+	sessions = m_malloc(sizeof(*sessions) * nfds);
+	for (i = 0; i < PWCACHE_WORKERS; i++) {
+		pfds[i].fd = -1;
+	}
+	pfds[PWCACHE_WORKERS].fd = control;
+	pfds[PWCACHE_WORKERS].events = POLLIN;
+
+	while (pfds[PWCACHE_WORKERS].fd >= 0 || nfds > first) {
+		if (poll(pfds, nfds, -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			dropbear_exit("poll failed: %s", strerror(errno));
+		}
+
+		for (i = 0; i < PWCACHE_WORKERS; i++) {
+			if (pfds[i].fd >= 0 && pfds[i].revents) {
+				pwcache_worker_read(&workers[i], &pfds[i]);
+			}
+		}
+
+		/* backwards, a closed session is replaced by the last */
+		for (i = nfds - 1; i >= first; i--) {
+			if (pfds[i].revents == 0) {
+				continue;
+			}
+			if (pwcache_session_read(&sessions[i], pfds[i].fd, pfds)
+					== DROPBEAR_FAILURE) {
+				m_close(pfds[i].fd);
+				nfds--;
+				pfds[i] = pfds[nfds];
+				sessions[i] = sessions[nfds];
+			}
+		}
+
+		if (pfds[PWCACHE_WORKERS].revents) {
+			fd = recv_fd(control);
+			if (fd == -1) {
+				TRACE(("pwcache: daemon has gone"))
+				m_close(control);
+				pfds[PWCACHE_WORKERS].fd = -1;
+			} else if (fd == -2) {
+				/* cleared before the next query is answered */
+				flush_pending = 1;
+			} else {
+				pfds = m_realloc(pfds, (nfds + 1) * sizeof(*pfds));
+				sessions = m_realloc(sessions, (nfds + 1) * sizeof(*sessions));
+				pfds[nfds].fd = fd;
+				pfds[nfds].events = POLLIN;
+				pfds[nfds].revents = 0;
+				memset(&sessions[nfds], 0x0, sizeof(sessions[nfds]));
+				nfds++;
+			}
+		}
+	}
+	_exit(EXIT_SUCCESS);
+}
+
+/* Starts the helper, from the listening daemon. closefds are the daemon's
+ * listening sockets */
+void svr_pwcache_init(const int *closefds, unsigned int nclosefds) {
+	int fds[2];
+	pid_t pid;
+	unsigned int i;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+		TRACE(("pwcache: socketpair failed: %s", strerror(errno)))
+		return;
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		TRACE(("pwcache: fork failed: %s", strerror(errno)))
+		m_close(fds[0]);
+		m_close(fds[1]);
+		return;
+	}
+
+	if (pid == 0) {
+		/* helper */
+		m_close(fds[1]);
+		for (i = 0; i < nclosefds; i++) {
+			m_close(closefds[i]);
+		}
+#if DROPBEAR_SVR_LOGINQUEUE
+		/* or the login record helper would wait for this one to exit */
+		loginqueue_setfd(-1);
+#endif
+		pwcache_helper(fds[0]);
+		/* not reached */
+	}
+
+	TRACE(("pwcache: helper pid %d", pid))
+	m_close(fds[0]);
+	if (fcntl(fds[1], F_SETFD, FD_CLOEXEC) < 0) {
+		TRACE(("cloexec for pwcache failed: %s", strerror(errno)))
+	}
+	/* a busy helper doesn't hold up the daemon */
+	setnonblocking(fds[1]);
+	control_fd = fds[1];
+}
+
+/* Returns the session's end of a new socket to the helper, from the daemon
+ * before it forks a session, or -1 if the session won't use the cache */
+int svr_pwcache_new_session(void) {
+	int fds[2];
+	int ret, err;
+
+	if (control_fd < 0) {
+		return -1;
+	}
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+		TRACE(("pwcache: socketpair failed: %s", strerror(errno)))
+		return -1;
+	}
+
+	ret = send_fd(control_fd, fds[1]);
+	err = errno;
+	m_close(fds[1]);
+	if (ret == DROPBEAR_SUCCESS) {
+		return fds[0];
+	}
+
+	m_close(fds[0]);
+	if (err == EAGAIN || err == EWOULDBLOCK) {
+		TRACE(("pwcache: helper is busy"))
+		return -1;
+	}
+	dropbear_log(LOG_WARNING, "User cache helper failed: %s", strerror(err));
+	m_close(control_fd);
+	control_fd = -1;
+	return -1;
+}
+
+/* Returns the session's socket for a session that is about to re-execute,
+ * so it is kept open, or -1 if there is none */
+int svr_pwcache_reexec_fd(void) {
+	if (query_fd >= 0 && fcntl(query_fd, F_SETFD, 0) < 0) {
+		TRACE(("clearing cloexec for pwcache failed: %s", strerror(errno)))
+		return -1;
+	}
+	return query_fd;
+}
+
+/* Called by a forked session with the socket from svr_pwcache_new_session(),
+ * or by a re-executed session with the "-4" argument */
+void svr_pwcache_setfd(int fd) {
+	m_close(control_fd);
+	control_fd = -1;
+	if (fd >= 0 && fcntl(fd, F_SETFD, FD_CLOEXEC) < 0) {
+		TRACE(("cloexec for pwcache failed: %s", strerror(errno)))
+	}
+	query_fd = fd;
+}
+
+/* Closes the session's socket once its lookup is done */
+void svr_pwcache_close(void) {
+	m_close(query_fd);
+	query_fd = -1;
+}
+
+/* Empties the cache, when the daemon gets SIGUSR1 */
+void svr_pwcache_flush(void) {
+	char c = 0;
+
+	if (control_fd >= 0 && write(control_fd, &c, 1) != 1) {
+		TRACE(("pwcache: flush failed: %s", strerror(errno)))
+	}
+}
+
+/* As fill_passwd(), but uses the cache */
+void svr_pwcache_fill_passwd(const char *username) {
+	struct pwcache_query query;
+	struct pwcache_entry entry;
+
+	if (query_fd < 0) {
+		fill_passwd(username);
+		return;
+	}
+
+	memset(&query, 0x0, sizeof(query));
+	strlcpy(query.name, username, sizeof(query.name));
+	if (atomicio(vwrite, query_fd, &query, sizeof(query)) != sizeof(query)
+			|| atomicio(read, query_fd, &entry, sizeof(entry)) != sizeof(entry)) {
+		TRACE(("pwcache: query failed"))
+		memset(&entry, 0x0, sizeof(entry));
+	}
+	svr_pwcache_close();
+
+	if (!entry.expires) {
+		fill_passwd(username);
+		return;
+	}
+
+	TRACE(("pwcache: found '%s'", username))
+	entry.name[sizeof(entry.name)-1] = '\0';
+	entry.dir[sizeof(entry.dir)-1] = '\0';
+	entry.shell[sizeof(entry.shell)-1] = '\0';
+	entry.passwd[sizeof(entry.passwd)-1] = '\0';
+	m_free(ses.authstate.pw_name);
+	m_free(ses.authstate.pw_dir);
+	m_free(ses.authstate.pw_shell);
+	m_free(ses.authstate.pw_passwd);
+	ses.authstate.pw_uid = entry.uid;
+	ses.authstate.pw_gid = entry.gid;
+	ses.authstate.pw_name = m_strdup(entry.name);
+	ses.authstate.pw_dir = m_strdup(entry.dir);
+	ses.authstate.pw_shell = m_strdup(entry.shell);
+	ses.authstate.pw_passwd = m_strdup(entry.passwd);
+	cached_group_checked = entry.group_checked;
+	cached_group_gid = entry.group_gid;
+	cached_group_member = entry.group_member;
+	m_burn(&entry, sizeof(entry));
+}
+
+#ifdef HAVE_GETGROUPLIST
+/* As check_group_membership(), but uses the result from the user's
+ * cache entry */
+int svr_pwcache_group_member(gid_t check_gid, const char* username, gid_t user_gid) {
+	if (cached_group_checked && cached_group_gid == check_gid) {
+		TRACE(("pwcache: found group membership for '%s'", username))
+		return cached_group_member;
+	}
+	return check_group_membership(check_gid, username, user_gid);
+}
+#endif
+
+#else /* DROPBEAR_SVR_PWCACHE */
+
+void svr_pwcache_fill_passwd(const char *username) {
+	fill_passwd(username);
+}
+
+#ifdef HAVE_GETGROUPLIST
+int svr_pwcache_group_member(gid_t check_gid, const char* username, gid_t user_gid) {
+	return check_group_membership(check_gid, username, user_gid);
+}
+#endif
+
+void svr_pwcache_close(void) {
+}
+
+#endif /* DROPBEAR_SVR_PWCACHE */
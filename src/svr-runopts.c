@@ -39,6 +39,7 @@ static void addportandaddress(const char* spec);
 static void loadhostkey(const char *keyfile, int fatal_duplicate);
 static void addhostkey(const char *keyfile);
 static void load_banner(void);
+static void parse_admit(char *spec);
 
 static void printhelp(const char * progname) {
 
@@ -88,6 +89,12 @@ static void printhelp(const char * progname) {
 					"-t		Enable two-factor authentication (both password and public key required)\n"
 #endif
 					"-T		Maximum authentication tries (default %d)\n"
+#if NON_INETD_MODE
+					"-x rate[,burst[,global]]\n"
+					"		Limit new connections from each /24 or /64 to rate per\n"
+					"		minute, bursts of burst (default %d), and from all\n"
+					"		sources to global per second\n"
+#endif
 #if DROPBEAR_SVR_LOCALANYFWD
 					"-j		Disable local port/stream forwarding\n"
 #endif
@@ -139,6 +146,9 @@ static void printhelp(const char * progname) {
 					ED25519_PRIV_FILENAME,
 #endif
 					MAX_AUTH_TRIES,
+#if NON_INETD_MODE
+					MAX_UNAUTH_BURST_PER_IP,
+#endif
 					DROPBEAR_MAX_PORTS, DROPBEAR_DEFPORT, DROPBEAR_PIDFILE,
 					DEFAULT_RECV_WINDOW, DEFAULT_KEEPALIVE, DEFAULT_IDLE_TIMEOUT,
 					DEFAULT_MAX_DURATION);
@@ -154,7 +164,11 @@ void svr_getopts(int argc, char ** argv) {
 	char* idle_timeout_arg = NULL;
 	char* max_duration_arg = NULL;
 	char* maxauthtries_arg = NULL;
+	char* admit_arg = NULL;
 	char* reexec_fd_arg = NULL;
+	char* reexec_loginqueue_arg = NULL;
+	char* reexec_pwcache_arg = NULL;
+	char* reexec_snapshot_arg = NULL;
 	char* keyfile = NULL;
 	char *algo_print_arg = NULL;
 	char c;
@@ -178,6 +192,9 @@ void svr_getopts(int argc, char ** argv) {
 	svr_opts.allowblankpass = 0;
 	svr_opts.multiauthmethod = 0;
 	svr_opts.maxauthtries = MAX_AUTH_TRIES;
+	svr_opts.admit_rate = MAX_UNAUTH_RATE_PER_IP;
+	svr_opts.admit_burst = MAX_UNAUTH_BURST_PER_IP;
+	svr_opts.admit_global = MAX_UNAUTH_RATE;
 	svr_opts.inetdmode = 0;
 	svr_opts.portcount = 0;
 	svr_opts.hostkey = NULL;
@@ -196,6 +213,9 @@ void svr_getopts(int argc, char ** argv) {
 #endif
 	svr_opts.pass_on_env = 0;
 	svr_opts.reexec_childpipe = -1;
+	svr_opts.reexec_loginqueue = -1;
+	svr_opts.reexec_pwcache = -1;
+	svr_opts.reexec_snapshot = -1;
 
 #ifndef DISABLE_ZLIB
 	opts.compression = 1;
@@ -290,6 +310,15 @@ void svr_getopts(int argc, char ** argv) {
 				case '2':
 					next = &reexec_fd_arg;
 					break;
+				case '3':
+					next = &reexec_loginqueue_arg;
+					break;
+				case '4':
+					next = &reexec_pwcache_arg;
+					break;
+				case '5':
+					next = &reexec_snapshot_arg;
+					break;
 #endif
 				case 'p':
 					nextisport = 1;
@@ -334,6 +363,11 @@ void svr_getopts(int argc, char ** argv) {
 				case 'T':
 					next = &maxauthtries_arg;
 					break;
+#if NON_INETD_MODE
+				case 'x':
+					next = &admit_arg;
+					break;
+#endif
 #if DROPBEAR_SVR_PASSWORD_AUTH || DROPBEAR_SVR_PAM_AUTH
 				case 's':
 					svr_opts.noauthpass = 1;
@@ -422,12 +456,22 @@ void svr_getopts(int argc, char ** argv) {
 		svr_opts.portcount = 1;
 	}
 
-	if (svr_opts.bannerfile) {
+#if DROPBEAR_SVR_SNAPSHOT
+	if (reexec_snapshot_arg) {
+		if (m_str_to_uint(reexec_snapshot_arg, &svr_opts.reexec_snapshot) == DROPBEAR_FAILURE
+			|| svr_opts.reexec_snapshot < 0) {
+			dropbear_exit("Bad -5");
+		}
+		svr_snapshot_open(svr_opts.reexec_snapshot);
+	}
+#endif
+
+	if (svr_opts.bannerfile && svr_snapshot_banner() == DROPBEAR_FAILURE) {
 		load_banner();
 	}
 
 #ifdef HAVE_GETGROUPLIST
-	if (svr_opts.restrict_group) {
+	if (svr_opts.restrict_group && svr_snapshot_group() == DROPBEAR_FAILURE) {
 		struct group *restrictedgroup = getgrnam(svr_opts.restrict_group);
 
 		if (restrictedgroup){
@@ -450,6 +494,10 @@ void svr_getopts(int argc, char ** argv) {
 		svr_opts.maxauthtries = val;
 	}
 
+	if (admit_arg) {
+		parse_admit(admit_arg);
+	}
+
 
 	if (keepalive_arg) {
 		unsigned int val;
@@ -490,6 +538,20 @@ void svr_getopts(int argc, char ** argv) {
 		}
 	}
 
+	if (reexec_loginqueue_arg) {
+		if (m_str_to_uint(reexec_loginqueue_arg, &svr_opts.reexec_loginqueue) == DROPBEAR_FAILURE
+			|| svr_opts.reexec_loginqueue < 0) {
+			dropbear_exit("Bad -3");
+		}
+	}
+
+	if (reexec_pwcache_arg) {
+		if (m_str_to_uint(reexec_pwcache_arg, &svr_opts.reexec_pwcache) == DROPBEAR_FAILURE
+			|| svr_opts.reexec_pwcache < 0) {
+			dropbear_exit("Bad -4");
+		}
+	}
+
 	if (svr_opts.multiauthmethod && svr_opts.noauthpass) {
 		dropbear_exit("-t and -s are incompatible");
 	}
@@ -553,6 +615,29 @@ static void addportandaddress(const char* spec) {
 	svr_opts.portcount++;
 }
 
+/* "rate[,burst[,global]]" for -x */
+static void parse_admit(char *spec) {
+	char *burst = NULL, *global = NULL;
+
+	burst = strchr(spec, ',');
+	if (burst) {
+		*burst++ = '\0';
+		global = strchr(burst, ',');
+		if (global) {
+			*global++ = '\0';
+		}
+	}
+
+	if (m_str_to_uint(spec, &svr_opts.admit_rate) == DROPBEAR_FAILURE
+		|| (burst && m_str_to_uint(burst, &svr_opts.admit_burst) == DROPBEAR_FAILURE)
+		|| (global && m_str_to_uint(global, &svr_opts.admit_global) == DROPBEAR_FAILURE)
+		|| svr_opts.admit_burst == 0
+		|| svr_opts.admit_rate > 100000 || svr_opts.admit_burst > 100000
+		|| svr_opts.admit_global > 100000) {
+		dropbear_exit("Bad -x argument");
+	}
+}
+
 static void disablekey(enum signature_type type) {
 	int i;
 	TRACE(("Disabling key type %d", type))
@@ -651,20 +736,26 @@ static void addhostkey(const char *keyfile) {
 void load_all_hostkeys() {
 	int i;
 	int any_keys = 0;
+	int from_snapshot;
 #if DROPBEAR_ECDSA
 	int loaded_any_ecdsa = 0;
 #endif
 
 	svr_opts.hostkey = new_sign_key();
 
+	/* A re-executed session may have them from the daemon already */
+	from_snapshot = svr_snapshot_hostkeys() == DROPBEAR_SUCCESS;
+
 	for (i = 0; i < svr_opts.num_hostkey_files; i++) {
 		char *hostkey_file = svr_opts.hostkey_files[i];
-		loadhostkey(hostkey_file, 1);
+		if (!from_snapshot) {
+			loadhostkey(hostkey_file, 1);
+		}
 		m_free(hostkey_file);
 	}
 
 	/* Only load default host keys if a host key is not specified by the user */
-	if (svr_opts.num_hostkey_files == 0) {
+	if (svr_opts.num_hostkey_files == 0 && !from_snapshot) {
 #if DROPBEAR_RSA
 		loadhostkey(RSA_PRIV_FILENAME, 0);
 #endif
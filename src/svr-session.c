@@ -86,6 +86,9 @@ static void
 svr_session_cleanup(void) {
 	svr_pubkey_options_cleanup(ses.authstate.pubkey_options);
 	ses.authstate.pubkey_options = NULL;
+#if DROPBEAR_SVR_PUBKEY_AUTH
+	svr_pubkey_index_free();
+#endif
 
 	m_free(svr_ses.addrstring);
 	m_free(svr_ses.remotehost);
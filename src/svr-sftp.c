@@ -0,0 +1,1392 @@
+/*
+ * Dropbear - a SSH2 server
+ * 
+ * Copyright (c) 2026 Matt Johnston
+ * All rights reserved.
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE. */
+
+/* A SFTP version 3 server (draft-ietf-secsh-filexfer-02) that runs within
+ * the session process, as the channel's ChanLocal.
+ *
+ * Requests are taken straight from the channel's receive buffer. WRITE data
+ * is written to the file with pwrite() from there, without waiting for the
+ * whole request. File data for READ replies is read with pread() directly
+ * into the outgoing channel packets when the reply is sent, so many READs
+ * can be outstanding at little cost. Replies are sent in the order that
+ * requests arrive. */
+
+#include "includes.h"
+#include "dbutil.h"
+#include "session.h"
+#include "buffer.h"
+#include "circbuffer.h"
+#include "channel.h"
+#include "chansession.h"
+#include "sftp.h"
+
+#if DROPBEAR_SFTPSERVER_BUILTIN
+
+#define SFTP_VERSION 3
+
+#define SSH_FXP_INIT 1
+#define SSH_FXP_VERSION 2
+#define SSH_FXP_OPEN 3
+#define SSH_FXP_CLOSE 4
+#define SSH_FXP_READ 5
+#define SSH_FXP_WRITE 6
+#define SSH_FXP_LSTAT 7
+#define SSH_FXP_FSTAT 8
+#define SSH_FXP_SETSTAT 9
+#define SSH_FXP_FSETSTAT 10
+#define SSH_FXP_OPENDIR 11
+#define SSH_FXP_READDIR 12
+#define SSH_FXP_REMOVE 13
+#define SSH_FXP_MKDIR 14
+#define SSH_FXP_RMDIR 15
+#define SSH_FXP_REALPATH 16
+#define SSH_FXP_STAT 17
+#define SSH_FXP_RENAME 18
+#define SSH_FXP_READLINK 19
+#define SSH_FXP_SYMLINK 20
+#define SSH_FXP_STATUS 101
+#define SSH_FXP_HANDLE 102
+#define SSH_FXP_DATA 103
+#define SSH_FXP_NAME 104
+#define SSH_FXP_ATTRS 105
+
+#define SSH_FILEXFER_ATTR_SIZE 0x00000001
+#define SSH_FILEXFER_ATTR_UIDGID 0x00000002
+#define SSH_FILEXFER_ATTR_PERMISSIONS 0x00000004
+#define SSH_FILEXFER_ATTR_ACMODTIME 0x00000008
+#define SSH_FILEXFER_ATTR_EXTENDED 0x80000000
+
+#define SSH_FXF_READ 0x00000001
+#define SSH_FXF_WRITE 0x00000002
+#define SSH_FXF_APPEND 0x00000004
+#define SSH_FXF_CREAT 0x00000008
+#define SSH_FXF_TRUNC 0x00000010
+#define SSH_FXF_EXCL 0x00000020
+
+#define SSH_FX_OK 0
+#define SSH_FX_EOF 1
+#define SSH_FX_NO_SUCH_FILE 2
+#define SSH_FX_PERMISSION_DENIED 3
+#define SSH_FX_FAILURE 4
+#define SSH_FX_BAD_MESSAGE 5
+#define SSH_FX_OP_UNSUPPORTED 8
+
+#define SFTP_MAX_HANDLES 64
+/* Further requests wait until replies have been sent */
+#define SFTP_MAX_REPLIES 128
+/* Longer READs get a short reply, which clients handle */
+#define SFTP_MAX_READ_LEN (256*1024)
+#define SFTP_NAME_BUF_LEN 32768
+/* an index and serial */
+#define SFTP_HANDLE_LEN 8
+/* length, type, id, handle, offset and data length */
+#define SFTP_WRITE_HEADER_LEN (4+1+4+4+SFTP_HANDLE_LEN+8+4)
+/* length, type, id and data length */
+#define SFTP_DATA_HEADER_LEN (4+1+4+4)
+/* uid and gid names remembered for READDIR */
+#define SFTP_NAME_CACHE 16
+
+struct sftp_handle {
+	int in_use;
+	unsigned int serial;
+	int fd; /* -1 for a directory */
+	DIR *dir;
+};
+
+struct sftp_reply {
+	struct sftp_reply *next;
+	/* The reply, or NULL for a READ whose data is read as it is sent */
+	buffer *buf;
+
+	/* READ replies */
+	unsigned int id;
+	int fd;
+	uint64_t offset;
+	unsigned int len;
+	int started;
+	unsigned int sent;
+};
+
+struct sftp_idname {
+	int used;
+	unsigned int id;
+	char name[16];
+};
+
+struct SftpServer {
+	/* relative paths start here, the process's cwd isn't changed */
+	char *home;
+
+	struct sftp_handle handles[SFTP_MAX_HANDLES];
+	unsigned int serial;
+
+	struct sftp_reply *reply_head, *reply_tail;
+	unsigned int reply_count;
+	/* READ replies that haven't read their data yet. Other requests
+	 * wait for these, so that they don't affect the data read */
+	unsigned int pending_reads;
+
+	/* the WRITE that data is currently being written for */
+	unsigned int write_id;
+	unsigned int write_remain;
+	int write_fd;
+	uint64_t write_offset;
+	int write_errno;
+
+	struct sftp_idname users[SFTP_NAME_CACHE], groups[SFTP_NAME_CACHE];
+	unsigned int users_next, groups_next;
+
+	int initialised;
+	int failed;
+	int done;
+};
+
+static void sftp_consume(struct Channel *channel);
+static int sftp_output_ready(struct Channel *channel);
+static unsigned int sftp_output(struct Channel *channel, unsigned char *data,
+		unsigned int maxlen);
+
+static const struct ChanLocal sftp_local = {
+	sftp_consume,
+	sftp_output_ready,
+	sftp_output
+};
+
+static void sftp_fail(struct SftpServer *sftp, const char *msg) {
+	if (!sftp->failed) {
+		dropbear_log(LOG_WARNING, "sftp: %s", msg);
+		sftp->failed = 1;
+	}
+}
+
+static uint64_t buf_getint64(buffer *buf) {
+	uint64_t val = buf_getint(buf);
+	return (val << 32) | buf_getint(buf);
+}
+
+static void buf_putint64(buffer *buf, uint64_t val) {
+	buf_putint(buf, (unsigned int)(val >> 32));
+	buf_putint(buf, (unsigned int)(val & 0xffffffff));
+}
+
+/* Copies from the start of the circular buffer without consuming it */
+static void sftp_peek(const circbuffer *cbuf, unsigned char *out,
+		unsigned int len) {
+	unsigned char *p1, *p2;
+	unsigned int len1, len2, n;
+
+	cbuf_readptrs(cbuf, &p1, &len1, &p2, &len2);
+	n = MIN(len, len1);
+	memcpy(out, p1, n);
+	memcpy(out + n, p2, len - n);
+}
+
+/* Gets a path from a request, relative to the home directory */
+static char* sftp_getpath(const struct SftpServer *sftp, buffer *buf) {
+	char *path = buf_getstring(buf, NULL);
+	char *full = NULL;
+	unsigned int len, homelen;
+
+	if (path[0] == '/') {
+		return path;
+	}
+	homelen = strlen(sftp->home);
+	len = homelen + 1 + strlen(path) + 1;
+	full = m_malloc(len);
+	if (path[0] == '\0') {
+		snprintf(full, len, "%s", sftp->home);
+	} else if (sftp->home[homelen-1] == '/') {
+		snprintf(full, len, "%s%s", sftp->home, path);
+	} else {
+		snprintf(full, len, "%s/%s", sftp->home, path);
+	}
+	m_free(path);
+	return full;
+}
+
+/* Checks that a request has the fields in fmt, without consuming them.
+ * 'i' is a uint32, 'q' a uint64, 's' a string and 'a' attributes */
+static int sftp_check_fields(buffer *buf, const char *fmt) {
+	unsigned int pos = buf->pos;
+	unsigned int flags, need = 0;
+	int ret = DROPBEAR_FAILURE;
+
+	for (; *fmt; fmt++) {
+		switch (*fmt) {
+			case 'i':
+				need = 4;
+				break;
+			case 'q':
+				need = 8;
+				break;
+			case 's':
+				if (buf->len - buf->pos < 4) {
+					goto out;
+				}
+				need = buf_getint(buf);
+				if (need > MAX_STRING_LEN) {
+					goto out;
+				}
+				break;
+			case 'a':
+				if (buf->len - buf->pos < 4) {
+					goto out;
+				}
+				flags = buf_getint(buf);
+				need = 0;
+				if (flags & SSH_FILEXFER_ATTR_SIZE) {
+					need += 8;
+				}
+				if (flags & SSH_FILEXFER_ATTR_UIDGID) {
+					need += 8;
+				}
+				if (flags & SSH_FILEXFER_ATTR_PERMISSIONS) {
+					need += 4;
+				}
+				if (flags & SSH_FILEXFER_ATTR_ACMODTIME) {
+					need += 8;
+				}
+				break;
+			default:
+				dropbear_assert(0);
+		}
+		if (buf->len - buf->pos < need) {
+			goto out;
+		}
+		buf_incrpos(buf, need);
+	}
+	ret = DROPBEAR_SUCCESS;
+
+out:
+	buf_setpos(buf, pos);
+	return ret;
+}
+
+/* The fields after the id for each request type, NULL if it isn't known */
+static const char* request_fields(unsigned char type) {
+	switch (type) {
+		case SSH_FXP_OPEN:
+			return "sia";
+		case SSH_FXP_READ:
+			return "sqi";
+		case SSH_FXP_WRITE:
+			return "sqs";
+		case SSH_FXP_SETSTAT:
+		case SSH_FXP_FSETSTAT:
+		case SSH_FXP_MKDIR:
+			return "sa";
+		case SSH_FXP_RENAME:
+		case SSH_FXP_SYMLINK:
+			return "ss";
+		case SSH_FXP_CLOSE:
+		case SSH_FXP_LSTAT:
+		case SSH_FXP_FSTAT:
+		case SSH_FXP_OPENDIR:
+		case SSH_FXP_READDIR:
+		case SSH_FXP_REMOVE:
+		case SSH_FXP_RMDIR:
+		case SSH_FXP_REALPATH:
+		case SSH_FXP_STAT:
+		case SSH_FXP_READLINK:
+			return "s";
+		default:
+			return NULL;
+	}
+}
+
+/* Replies */
+
+static buffer* reply_new(unsigned int size, unsigned char type, unsigned int id) {
+	buffer *buf = buf_new(size);
+	/* length is filled by reply_finish() */
+	buf_putint(buf, 0);
+	buf_putbyte(buf, type);
+	buf_putint(buf, id);
+	return buf;
+}
+
+static struct sftp_reply* reply_add(struct SftpServer *sftp) {
+	struct sftp_reply *reply = m_malloc(sizeof(*reply));
+	if (sftp->reply_tail) {
+		sftp->reply_tail->next = reply;
+	} else {
+		sftp->reply_head = reply;
+	}
+	sftp->reply_tail = reply;
+	sftp->reply_count++;
+	return reply;
+}
+
+/* Fills in the length, ready to send */
+static buffer* reply_finish(buffer *buf) {
+	STORE32H(buf->len - 4, buf->data);
+	buf_setpos(buf, 0);
+	return buf;
+}
+
+static void reply_queue(struct SftpServer *sftp, buffer *buf) {
+	reply_add(sftp)->buf = reply_finish(buf);
+}
+
+static void reply_pop(struct SftpServer *sftp) {
+	struct sftp_reply *reply = sftp->reply_head;
+	sftp->reply_head = reply->next;
+	if (sftp->reply_head == NULL) {
+		sftp->reply_tail = NULL;
+	}
+	sftp->reply_count--;
+	if (reply->buf) {
+		buf_free(reply->buf);
+	}
+	m_free(reply);
+}
+
+static buffer* status_new(unsigned int id, unsigned int code) {
+	static const char *messages[] = {
+		"Success", "End of file", "No such file", "Permission denied",
+		"Failure", "Bad message", "No connection", "Connection lost",
+		"Operation unsupported"
+	};
+	const char *msg = messages[code];
+	buffer *buf = reply_new(30 + strlen(msg), SSH_FXP_STATUS, id);
+
+	buf_putint(buf, code);
+	buf_putstring(buf, msg, strlen(msg));
+	buf_putstring(buf, "", 0);
+	return reply_finish(buf);
+}
+
+static void send_status(struct SftpServer *sftp, unsigned int id,
+		unsigned int code) {
+	reply_add(sftp)->buf = status_new(id, code);
+}
+
+static unsigned int errno_status(int err) {
+	switch (err) {
+		case 0:
+			return SSH_FX_OK;
+		case ENOENT:
+		case ENOTDIR:
+		case EBADF:
+		case ELOOP:
+			return SSH_FX_NO_SUCH_FILE;
+		case EPERM:
+		case EACCES:
+		case EFAULT:
+			return SSH_FX_PERMISSION_DENIED;
+		case ENAMETOOLONG:
+		case EINVAL:
+			return SSH_FX_BAD_MESSAGE;
+		case ENOSYS:
+			return SSH_FX_OP_UNSUPPORTED;
+		default:
+			return SSH_FX_FAILURE;
+	}
+}
+
+/* Sends the status for the result of a system call */
+static void send_result(struct SftpServer *sftp, unsigned int id, int ret) {
+	send_status(sftp, id, ret < 0 ? errno_status(errno) : SSH_FX_OK);
+}
+
+static void buf_putattrs(buffer *buf, const struct stat *st) {
+	buf_putint(buf, SSH_FILEXFER_ATTR_SIZE | SSH_FILEXFER_ATTR_UIDGID
+		| SSH_FILEXFER_ATTR_PERMISSIONS | SSH_FILEXFER_ATTR_ACMODTIME);
+	buf_putint64(buf, st->st_size);
+	buf_putint(buf, st->st_uid);
+	buf_putint(buf, st->st_gid);
+	buf_putint(buf, st->st_mode);
+	buf_putint(buf, st->st_atime);
+	buf_putint(buf, st->st_mtime);
+}
+
+static void send_attrs(struct SftpServer *sftp, unsigned int id,
+		int ret, const struct stat *st) {
+	buffer *buf;
+
+	if (ret < 0) {
+		send_result(sftp, id, ret);
+		return;
+	}
+	buf = reply_new(64, SSH_FXP_ATTRS, id);
+	buf_putattrs(buf, st);
+	reply_queue(sftp, buf);
+}
+
+/* A NAME reply with a single name, for REALPATH and READLINK */
+static void send_name(struct SftpServer *sftp, unsigned int id, const char *name) {
+	unsigned int len = strlen(name);
+	buffer *buf = reply_new(30 + 2*len, SSH_FXP_NAME, id);
+
+	buf_putint(buf, 1);
+	buf_putstring(buf, name, len);
+	buf_putstring(buf, name, len);
+	/* no attributes */
+	buf_putint(buf, 0);
+	reply_queue(sftp, buf);
+}
+
+/* Handles */
+
+static void send_handle(struct SftpServer *sftp, unsigned int id,
+		int fd, DIR *dir) {
+	unsigned char handle[SFTP_HANDLE_LEN];
+	buffer *buf;
+	unsigned int i;
+
+	for (i = 0; i < SFTP_MAX_HANDLES; i++) {
+		if (!sftp->handles[i].in_use) {
+			break;
+		}
+	}
+	if (i == SFTP_MAX_HANDLES) {
+		if (dir) {
+			closedir(dir);
+		} else {
+			m_close(fd);
+		}
+		send_status(sftp, id, SSH_FX_FAILURE);
+		return;
+	}
+
+	sftp->handles[i].in_use = 1;
+	sftp->handles[i].serial = ++sftp->serial;
+	sftp->handles[i].fd = fd;
+	sftp->handles[i].dir = dir;
+
+	STORE32H(i, handle);
+	STORE32H(sftp->handles[i].serial, handle + 4);
+	buf = reply_new(30, SSH_FXP_HANDLE, id);
+	buf_putstring(buf, (const char*)handle, sizeof(handle));
+	reply_queue(sftp, buf);
+}
+
+/* Returns the handle, or NULL if it isn't valid */
+static struct sftp_handle* handle_lookup(struct SftpServer *sftp,
+		const unsigned char *handle, unsigned int len) {
+	unsigned int i, serial;
+
+	if (len != SFTP_HANDLE_LEN) {
+		return NULL;
+	}
+	LOAD32H(i, handle);
+	LOAD32H(serial, handle + 4);
+	if (i >= SFTP_MAX_HANDLES || !sftp->handles[i].in_use
+			|| sftp->handles[i].serial != serial) {
+		return NULL;
+	}
+	return &sftp->handles[i];
+}
+
+static struct sftp_handle* buf_gethandle(struct SftpServer *sftp, buffer *buf) {
+	unsigned int len = buf_getint(buf);
+	const unsigned char *handle = buf_getptr(buf, len);
+	buf_incrpos(buf, len);
+	return handle_lookup(sftp, handle, len);
+}
+
+static int handle_fd(const struct sftp_handle *handle) {
+	return handle->dir ? dirfd(handle->dir) : handle->fd;
+}
+
+static int handle_close(struct sftp_handle *handle) {
+	int ret = 0;
+	if (handle->dir) {
+		ret = closedir(handle->dir);
+	} else {
+		ret = close(handle->fd);
+	}
+	memset(handle, 0x0, sizeof(*handle));
+	handle->fd = -1;
+	return ret;
+}
+
+/* Attributes sent by the client */
+struct sftp_attrs {
+	unsigned int flags;
+	uint64_t size;
+	unsigned int uid, gid;
+	unsigned int perm;
+	unsigned int atime, mtime;
+};
+
+static void buf_getattrs(buffer *buf, struct sftp_attrs *attrs) {
+	memset(attrs, 0x0, sizeof(*attrs));
+	attrs->flags = buf_getint(buf);
+	if (attrs->flags & SSH_FILEXFER_ATTR_SIZE) {
+		attrs->size = buf_getint64(buf);
+	}
+	if (attrs->flags & SSH_FILEXFER_ATTR_UIDGID) {
+		attrs->uid = buf_getint(buf);
+		attrs->gid = buf_getint(buf);
+	}
+	if (attrs->flags & SSH_FILEXFER_ATTR_PERMISSIONS) {
+		attrs->perm = buf_getint(buf);
+	}
+	if (attrs->flags & SSH_FILEXFER_ATTR_ACMODTIME) {
+		attrs->atime = buf_getint(buf);
+		attrs->mtime = buf_getint(buf);
+	}
+	/* extended attributes are ignored */
+}
+
+/* Applies attributes to path, or fd if path is NULL */
+static int set_attrs(const char *path, int fd, const struct sftp_attrs *attrs) {
+	if (attrs->flags & SSH_FILEXFER_ATTR_SIZE) {
+		if ((path ? truncate(path, attrs->size) : ftruncate(fd, attrs->size)) < 0) {
+			return -1;
+		}
+	}
+	if (attrs->flags & SSH_FILEXFER_ATTR_PERMISSIONS) {
+		mode_t mode = attrs->perm & 07777;
+		if ((path ? chmod(path, mode) : fchmod(fd, mode)) < 0) {
+			return -1;
+		}
+	}
+	if (attrs->flags & SSH_FILEXFER_ATTR_ACMODTIME) {
+		struct timeval tv[2];
+		tv[0].tv_sec = attrs->atime;
+		tv[0].tv_usec = 0;
+		tv[1].tv_sec = attrs->mtime;
+		tv[1].tv_usec = 0;
+		if ((path ? utimes(path, tv) : futimes(fd, tv)) < 0) {
+			return -1;
+		}
+	}
+	if (attrs->flags & SSH_FILEXFER_ATTR_UIDGID) {
+		if ((path ? chown(path, attrs->uid, attrs->gid)
+				: fchown(fd, attrs->uid, attrs->gid)) < 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Requests */
+
+static void sftp_open(struct SftpServer *sftp, unsigned int id, buffer *buf) {
+	char *path = sftp_getpath(sftp, buf);
+	unsigned int pflags = buf_getint(buf);
+	struct sftp_attrs attrs;
+	int flags, fd;
+	mode_t mode = 0666;
+
+	buf_getattrs(buf, &attrs);
+	if (attrs.flags & SSH_FILEXFER_ATTR_PERMISSIONS) {
+		mode = attrs.perm & 0777;
+	}
+
+	if ((pflags & SSH_FXF_READ) && (pflags & SSH_FXF_WRITE)) {
+		flags = O_RDWR;
+	} else if (pflags & SSH_FXF_WRITE) {
+		flags = O_WRONLY;
+	} else {
+		flags = O_RDONLY;
+	}
+	if (pflags & SSH_FXF_APPEND) {
+		flags |= O_APPEND;
+	}
+	if (pflags & SSH_FXF_CREAT) {
+		flags |= O_CREAT;
+	}
+	if (pflags & SSH_FXF_TRUNC) {
+		flags |= O_TRUNC;
+	}
+	if (pflags & SSH_FXF_EXCL) {
+		flags |= O_EXCL;
+	}
+
+	fd = open(path, flags | O_NOCTTY | O_CLOEXEC, mode);
+	if (fd < 0) {
+		send_result(sftp, id, fd);
+	} else {
+		send_handle(sftp, id, fd, NULL);
+	}
+	m_free(path);
+}
+
+static void sftp_opendir(struct SftpServer *sftp, unsigned int id, buffer *buf) {
+	char *path = sftp_getpath(sftp, buf);
+	DIR *dir = opendir(path);
+
+	if (dir == NULL) {
+		send_result(sftp, id, -1);
+	} else {
+		fcntl(dirfd(dir), F_SETFD, FD_CLOEXEC);
+		send_handle(sftp, id, -1, dir);
+	}
+	m_free(path);
+}
+
+/* The mode as "ls -l" shows it, out must have space for 11 chars */
+static void mode_string(mode_t st_mode, char *out) {
+	unsigned int i;
+
+	strcpy(out, "?rwxrwxrwx");
+	if (S_ISREG(st_mode)) {
+		out[0] = '-';
+	} else if (S_ISDIR(st_mode)) {
+		out[0] = 'd';
+	} else if (S_ISLNK(st_mode)) {
+		out[0] = 'l';
+	} else if (S_ISCHR(st_mode)) {
+		out[0] = 'c';
+	} else if (S_ISBLK(st_mode)) {
+		out[0] = 'b';
+	} else if (S_ISFIFO(st_mode)) {
+		out[0] = 'p';
+	} else if (S_ISSOCK(st_mode)) {
+		out[0] = 's';
+	}
+	for (i = 0; i < 9; i++) {
+		if (!(st_mode & (0400 >> i))) {
+			out[i+1] = '-';
+		}
+	}
+	if (st_mode & S_ISUID) {
+		out[3] = (out[3] == 'x') ? 's' : 'S';
+	}
+	if (st_mode & S_ISGID) {
+		out[6] = (out[6] == 'x') ? 's' : 'S';
+	}
+	if (st_mode & S_ISVTX) {
+		out[9] = (out[9] == 'x') ? 't' : 'T';
+	}
+}
+
+/* The name of a uid or gid. Lookups can be slow, so they are cached
+ * rather than repeated for each file in a directory */
+static const char* id_name(struct sftp_idname *cache, unsigned int *next,
+		unsigned int id, int isgroup) {
+	struct sftp_idname *ent = NULL;
+	const char *name = NULL;
+	unsigned int i;
+
+	for (i = 0; i < SFTP_NAME_CACHE; i++) {
+		if (cache[i].used && cache[i].id == id) {
+			return cache[i].name;
+		}
+	}
+
+	if (isgroup) {
+		const struct group *gr = getgrgid(id);
+		if (gr) {
+			name = gr->gr_name;
+		}
+	} else {
+		const struct passwd *pw = getpwuid(id);
+		if (pw) {
+			name = pw->pw_name;
+		}
+	}
+
+	ent = &cache[*next];
+	*next = (*next + 1) % SFTP_NAME_CACHE;
+	ent->used = 1;
+	ent->id = id;
+	if (name) {
+		snprintf(ent->name, sizeof(ent->name), "%s", name);
+	} else {
+		snprintf(ent->name, sizeof(ent->name), "%u", id);
+	}
+	return ent->name;
+}
+
+/* An "ls -l" style line */
+static void long_name(struct SftpServer *sftp, char *out, unsigned int len,
+		const char *name, const struct stat *st) {
+	char mode[11], date[16];
+	const char *fmt, *user, *group;
+	struct tm *tm;
+	time_t now = time(NULL);
+
+	mode_string(st->st_mode, mode);
+
+	user = id_name(sftp->users, &sftp->users_next, st->st_uid, 0);
+	group = id_name(sftp->groups, &sftp->groups_next, st->st_gid, 1);
+
+	/* the year rather than time for files older than six months */
+	if (st->st_mtime + 182*24*60*60 < now || st->st_mtime > now) {
+		fmt = "%b %e  %Y";
+	} else {
+		fmt = "%b %e %H:%M";
+	}
+	date[0] = '\0';
+	tm = localtime(&st->st_mtime);
+	if (tm) {
+		strftime(date, sizeof(date), fmt, tm);
+	}
+
+	snprintf(out, len, "%s %3u %-8s %-8s %8llu %s %s", mode,
+		(unsigned int)st->st_nlink, user, group,
+		(unsigned long long)st->st_size, date, name);
+}
+
+static void sftp_readdir(struct SftpServer *sftp, unsigned int id,
+		struct sftp_handle *handle) {
+	buffer *buf;
+	unsigned int count = 0, count_pos;
+	char longname[1024];
+
+	if (handle == NULL || handle->dir == NULL) {
+		send_status(sftp, id, SSH_FX_FAILURE);
+		return;
+	}
+
+	buf = reply_new(SFTP_NAME_BUF_LEN, SSH_FXP_NAME, id);
+	count_pos = buf->pos;
+	buf_putint(buf, 0);
+
+	for (;;) {
+		long loc = telldir(handle->dir);
+		struct dirent *ent;
+		struct stat st;
+		unsigned int namelen, longlen;
+
+		errno = 0;
+		ent = readdir(handle->dir);
+		if (ent == NULL) {
+			break;
+		}
+		if (fstatat(dirfd(handle->dir), ent->d_name, &st,
+				AT_SYMLINK_NOFOLLOW) < 0) {
+			continue;
+		}
+		long_name(sftp, longname, sizeof(longname), ent->d_name, &st);
+		namelen = strlen(ent->d_name);
+		longlen = strlen(longname);
+		if (buf->size - buf->len < 4 + namelen + 4 + longlen + 64) {
+			/* doesn't fit, it goes in the next reply */
+			seekdir(handle->dir, loc);
+			break;
+		}
+		buf_putstring(buf, ent->d_name, namelen);
+		buf_putstring(buf, longname, longlen);
+		buf_putattrs(buf, &st);
+		count++;
+	}
+
+	if (count == 0) {
+		buf_free(buf);
+		send_status(sftp, id, errno ? errno_status(errno) : SSH_FX_EOF);
+		return;
+	}
+	buf_setpos(buf, count_pos);
+	buf_putint(buf, count);
+	buf_setpos(buf, buf->len);
+	reply_queue(sftp, buf);
+}
+
+static void sftp_realpath(struct SftpServer *sftp, unsigned int id, buffer *buf) {
+	char *path = sftp_getpath(sftp, buf);
+	char resolved[PATH_MAX];
+
+	if (realpath(path, resolved) == NULL) {
+		send_result(sftp, id, -1);
+	} else {
+		send_name(sftp, id, resolved);
+	}
+	m_free(path);
+}
+
+static void sftp_readlink(struct SftpServer *sftp, unsigned int id, buffer *buf) {
+	char *path = sftp_getpath(sftp, buf);
+	char target[PATH_MAX];
+	ssize_t len = readlink(path, target, sizeof(target) - 1);
+
+	if (len < 0) {
+		send_result(sftp, id, -1);
+	} else {
+		target[len] = '\0';
+		send_name(sftp, id, target);
+	}
+	m_free(path);
+}
+
+static void sftp_rename(struct SftpServer *sftp, unsigned int id, buffer *buf) {
+	char *oldpath = sftp_getpath(sftp, buf);
+	char *newpath = sftp_getpath(sftp, buf);
+	struct stat st;
+
+	/* version 3 renames don't replace an existing file */
+	if (lstat(newpath, &st) == 0) {
+		send_status(sftp, id, SSH_FX_FAILURE);
+	} else {
+		send_result(sftp, id, rename(oldpath, newpath));
+	}
+	m_free(oldpath);
+	m_free(newpath);
+}
+
+/* Requests which take a path */
+static void sftp_path_request(struct SftpServer *sftp, unsigned char type,
+		unsigned int id, buffer *buf) {
+	char *path = NULL;
+	struct sftp_attrs attrs;
+	struct stat st;
+
+	if (type == SSH_FXP_SYMLINK) {
+		/* the link's target is stored as it is */
+		path = buf_getstring(buf, NULL);
+	} else {
+		path = sftp_getpath(sftp, buf);
+	}
+
+	switch (type) {
+		case SSH_FXP_STAT:
+			send_attrs(sftp, id, stat(path, &st), &st);
+			break;
+		case SSH_FXP_LSTAT:
+			send_attrs(sftp, id, lstat(path, &st), &st);
+			break;
+		case SSH_FXP_SETSTAT:
+			buf_getattrs(buf, &attrs);
+			send_result(sftp, id, set_attrs(path, -1, &attrs));
+			break;
+		case SSH_FXP_REMOVE:
+			send_result(sftp, id, unlink(path));
+			break;
+		case SSH_FXP_MKDIR:
+			buf_getattrs(buf, &attrs);
+			send_result(sftp, id, mkdir(path,
+				(attrs.flags & SSH_FILEXFER_ATTR_PERMISSIONS)
+				? (attrs.perm & 07777) : 0777));
+			break;
+		case SSH_FXP_RMDIR:
+			send_result(sftp, id, rmdir(path));
+			break;
+		case SSH_FXP_SYMLINK:
+			{
+				/* The target comes first, as OpenSSH sends it. The
+				 * draft has them the other way around */
+				char *linkpath = sftp_getpath(sftp, buf);
+				send_result(sftp, id, symlink(path, linkpath));
+				m_free(linkpath);
+			}
+			break;
+		default:
+			dropbear_assert(0);
+	}
+	m_free(path);
+}
+
+/* Requests which take a handle */
+static void sftp_handle_request(struct SftpServer *sftp, unsigned char type,
+		unsigned int id, buffer *buf) {
+	struct sftp_handle *handle = buf_gethandle(sftp, buf);
+	struct sftp_attrs attrs;
+	struct stat st;
+
+	if (handle == NULL) {
+		send_status(sftp, id, SSH_FX_FAILURE);
+		return;
+	}
+
+	switch (type) {
+		case SSH_FXP_CLOSE:
+			send_result(sftp, id, handle_close(handle));
+			break;
+		case SSH_FXP_READ:
+			{
+				struct sftp_reply *reply;
+				uint64_t offset = buf_getint64(buf);
+				unsigned int len = buf_getint(buf);
+
+				if (handle->dir) {
+					send_status(sftp, id, SSH_FX_FAILURE);
+					break;
+				}
+				/* read when it is sent */
+				reply = reply_add(sftp);
+				reply->id = id;
+				reply->fd = handle->fd;
+				reply->offset = offset;
+				reply->len = MIN(len, SFTP_MAX_READ_LEN);
+				sftp->pending_reads++;
+			}
+			break;
+		case SSH_FXP_FSTAT:
+			send_attrs(sftp, id, fstat(handle_fd(handle), &st), &st);
+			break;
+		case SSH_FXP_FSETSTAT:
+			buf_getattrs(buf, &attrs);
+			send_result(sftp, id, set_attrs(NULL, handle_fd(handle), &attrs));
+			break;
+		case SSH_FXP_READDIR:
+			sftp_readdir(sftp, id, handle);
+			break;
+		case SSH_FXP_WRITE:
+			/* WRITEs with a valid handle are handled by sftp_consume() */
+			send_status(sftp, id, SSH_FX_FAILURE);
+			break;
+		default:
+			dropbear_assert(0);
+	}
+}
+
+/* Handles a request other than WRITE, which has been copied into buf */
+static void sftp_request(struct SftpServer *sftp, buffer *buf) {
+	unsigned char type = buf_getbyte(buf);
+	const char *fields = NULL;
+	unsigned int id;
+
+	TRACE(("sftp request type %d", type))
+
+	if (!sftp->initialised) {
+		buffer *reply;
+
+		if (type != SSH_FXP_INIT) {
+			sftp_fail(sftp, "expected init");
+			return;
+		}
+		/* no extensions */
+		reply = buf_new(9);
+		buf_putint(reply, 0);
+		buf_putbyte(reply, SSH_FXP_VERSION);
+		buf_putint(reply, SFTP_VERSION);
+		reply_queue(sftp, reply);
+		sftp->initialised = 1;
+		return;
+	}
+
+	if (buf->len - buf->pos < 4) {
+		/* there's no id to reply to */
+		sftp_fail(sftp, "truncated request");
+		return;
+	}
+	id = buf_getint(buf);
+
+	fields = request_fields(type);
+	if (fields && sftp_check_fields(buf, fields) == DROPBEAR_FAILURE) {
+		send_status(sftp, id, SSH_FX_BAD_MESSAGE);
+		return;
+	}
+
+	switch (type) {
+		case SSH_FXP_OPEN:
+			sftp_open(sftp, id, buf);
+			break;
+		case SSH_FXP_OPENDIR:
+			sftp_opendir(sftp, id, buf);
+			break;
+		case SSH_FXP_REALPATH:
+			sftp_realpath(sftp, id, buf);
+			break;
+		case SSH_FXP_READLINK:
+			sftp_readlink(sftp, id, buf);
+			break;
+		case SSH_FXP_RENAME:
+			sftp_rename(sftp, id, buf);
+			break;
+		case SSH_FXP_STAT:
+		case SSH_FXP_LSTAT:
+		case SSH_FXP_SETSTAT:
+		case SSH_FXP_REMOVE:
+		case SSH_FXP_MKDIR:
+		case SSH_FXP_RMDIR:
+		case SSH_FXP_SYMLINK:
+			sftp_path_request(sftp, type, id, buf);
+			break;
+		case SSH_FXP_CLOSE:
+		case SSH_FXP_READ:
+		case SSH_FXP_WRITE:
+		case SSH_FXP_FSTAT:
+		case SSH_FXP_FSETSTAT:
+		case SSH_FXP_READDIR:
+			sftp_handle_request(sftp, type, id, buf);
+			break;
+		default:
+			send_status(sftp, id, SSH_FX_OP_UNSUPPORTED);
+			break;
+	}
+}
+
+/* Starts a WRITE request from its header. The data follows in the
+ * channel buffer. Returns DROPBEAR_FAILURE if the handle or lengths
+ * aren't as expected, it is then handled as any other request */
+static int sftp_write_start(struct SftpServer *sftp, const unsigned char *hdr) {
+	unsigned int len, handlelen, datalen;
+	const struct sftp_handle *handle;
+
+	LOAD32H(handlelen, hdr + 9);
+	LOAD32H(len, hdr);
+	LOAD32H(datalen, hdr + 21 + SFTP_HANDLE_LEN);
+	/* datalen is checked after the subtraction, it mustn't wrap */
+	if (handlelen != SFTP_HANDLE_LEN
+			|| len < SFTP_WRITE_HEADER_LEN - 4
+			|| len - (SFTP_WRITE_HEADER_LEN - 4) != datalen) {
+		return DROPBEAR_FAILURE;
+	}
+	LOAD32H(sftp->write_id, hdr + 5);
+	handle = handle_lookup(sftp, hdr + 13, handlelen);
+	LOAD64H(sftp->write_offset, hdr + 13 + SFTP_HANDLE_LEN);
+
+	sftp->write_fd = (handle && !handle->dir) ? handle->fd : -1;
+	sftp->write_errno = 0;
+	sftp->write_remain = datalen;
+	return DROPBEAR_SUCCESS;
+}
+
+/* Writes data for the current WRITE from the channel buffer */
+static void sftp_write_data(struct SftpServer *sftp, circbuffer *cbuf) {
+	unsigned char *p[2];
+	unsigned int plen[2], i;
+
+	cbuf_readptrs(cbuf, &p[0], &plen[0], &p[1], &plen[1]);
+	for (i = 0; i < 2 && sftp->write_remain > 0; i++) {
+		unsigned int len = MIN(plen[i], sftp->write_remain);
+		unsigned int done = 0;
+
+		while (done < len && sftp->write_fd >= 0 && !sftp->write_errno) {
+			ssize_t written = pwrite(sftp->write_fd, p[i] + done, len - done,
+				sftp->write_offset + done);
+			if (written < 0) {
+				if (errno != EINTR) {
+					sftp->write_errno = errno;
+				}
+				continue;
+			}
+			done += written;
+		}
+		/* data after an error is dropped */
+		cbuf_incrread(cbuf, len);
+		sftp->write_offset += len;
+		sftp->write_remain -= len;
+	}
+
+	if (sftp->write_remain == 0) {
+		if (sftp->write_fd < 0) {
+			send_status(sftp, sftp->write_id, SSH_FX_FAILURE);
+		} else {
+			send_status(sftp, sftp->write_id, errno_status(sftp->write_errno));
+		}
+	}
+}
+
+/* ChanLocal consume(), takes requests from the channel */
+static void sftp_consume(struct Channel *channel) {
+	struct SftpServer *sftp = ((struct ChanSess*)channel->typedata)->sftp;
+	circbuffer *cbuf = channel->writebuf;
+	unsigned char hdr[SFTP_WRITE_HEADER_LEN];
+
+	for (;;) {
+		unsigned int used = cbuf_getused(cbuf);
+		unsigned int len;
+		unsigned char type;
+		buffer *buf;
+
+		if (sftp->failed || sftp->done || channel->recv_close) {
+			/* nothing more will be handled */
+			cbuf_incrread(cbuf, used);
+			return;
+		}
+
+		if (sftp->write_remain > 0) {
+			if (used == 0) {
+				break;
+			}
+			sftp_write_data(sftp, cbuf);
+			continue;
+		}
+
+		if (used < 5) {
+			break;
+		}
+		sftp_peek(cbuf, hdr, 5);
+		LOAD32H(len, hdr);
+		type = hdr[4];
+
+		if (sftp->reply_count >= SFTP_MAX_REPLIES
+				|| (type != SSH_FXP_READ && sftp->pending_reads > 0)) {
+			/* wait for replies to be sent */
+			return;
+		}
+
+		if (type == SSH_FXP_WRITE && sftp->initialised) {
+			if (used < SFTP_WRITE_HEADER_LEN) {
+				break;
+			}
+			sftp_peek(cbuf, hdr, SFTP_WRITE_HEADER_LEN);
+			if (sftp_write_start(sftp, hdr) == DROPBEAR_SUCCESS) {
+				cbuf_incrread(cbuf, SFTP_WRITE_HEADER_LEN);
+				continue;
+			}
+		}
+
+		/* Other requests must fit in the channel buffer */
+		if (len == 0 || len > cbuf->size - 4) {
+			sftp_fail(sftp, "bad request length");
+			continue;
+		}
+		if (used < 4 + len) {
+			break;
+		}
+
+		buf = buf_new(4 + len);
+		sftp_peek(cbuf, buf_getwriteptr(buf, 4 + len), 4 + len);
+		buf_incrwritepos(buf, 4 + len);
+		cbuf_incrread(cbuf, 4 + len);
+		buf_setpos(buf, 4);
+		sftp_request(sftp, buf);
+		buf_free(buf);
+	}
+
+	if (channel->recv_eof) {
+		/* an incomplete request can't be finished */
+		cbuf_incrread(cbuf, cbuf_getused(cbuf));
+		sftp->write_remain = 0;
+	}
+}
+
+/* READ replies */
+
+/* Limits the length of a READ reply to the file when it is first sent, or
+ * replaces it with a complete reply */
+static void read_reply_start(struct SftpServer *sftp, struct sftp_reply *reply) {
+	struct stat st;
+
+	reply->started = 1;
+	if (fstat(reply->fd, &st) < 0) {
+		reply->buf = status_new(reply->id, errno_status(errno));
+	} else if (S_ISREG(st.st_mode)) {
+		/* The length is sent before the data, so it can only be the
+		 * length that is currently in the file */
+		uint64_t avail = 0;
+		if ((uint64_t)st.st_size > reply->offset) {
+			avail = st.st_size - reply->offset;
+		}
+		if (avail < reply->len) {
+			reply->len = avail;
+		}
+		if (reply->len == 0) {
+			reply->buf = status_new(reply->id, SSH_FX_EOF);
+		}
+	} else {
+		/* Other files are read all at once */
+		buffer *buf = reply_new(SFTP_DATA_HEADER_LEN + reply->len,
+			SSH_FXP_DATA, reply->id);
+		ssize_t len;
+		do {
+			len = pread(reply->fd, buf_getwriteptr(buf, 4 + reply->len) + 4,
+				reply->len, reply->offset);
+		} while (len < 0 && errno == EINTR);
+		if (len <= 0) {
+			buf_free(buf);
+			reply->buf = status_new(reply->id,
+				len < 0 ? errno_status(errno) : SSH_FX_EOF);
+		} else {
+			buf_putint(buf, len);
+			buf_incrwritepos(buf, len);
+			reply->buf = reply_finish(buf);
+		}
+	}
+
+	if (reply->buf) {
+		sftp->pending_reads--;
+	}
+}
+
+/* Reads READ reply data from pos in the reply */
+static ssize_t read_reply_pread(const struct sftp_reply *reply,
+		unsigned char *data, unsigned int len, unsigned int pos) {
+	ssize_t got;
+
+	do {
+		got = pread(reply->fd, data, len, reply->offset + pos);
+	} while (got < 0 && errno == EINTR);
+	return got;
+}
+
+/* Sends what fits of a READ reply, reading the file into data.
+ *
+ * The first chunk is read before the length is sent, so a file that has
+ * been truncated since read_reply_start() gets a shorter reply, or the
+ * reply is replaced with a status. Once the length has been sent a file
+ * truncated by another process is sent as zeros, the rest of the session's
+ * transfers carry on. */
+static unsigned int read_reply_send(struct SftpServer *sftp,
+		struct sftp_reply *reply, unsigned char *data, unsigned int maxlen) {
+	unsigned int total, len = 0;
+	ssize_t got;
+
+	if (reply->sent == 0) {
+		unsigned int want;
+
+		if (maxlen <= SFTP_DATA_HEADER_LEN) {
+			/* wait until there is room for some data */
+			return 0;
+		}
+		want = MIN(maxlen - SFTP_DATA_HEADER_LEN, reply->len);
+		got = read_reply_pread(reply, data + SFTP_DATA_HEADER_LEN, want, 0);
+		if (got <= 0) {
+			reply->buf = status_new(reply->id,
+				got < 0 ? errno_status(errno) : SSH_FX_EOF);
+			sftp->pending_reads--;
+			return 0;
+		}
+		if ((unsigned int)got < want) {
+			reply->len = got;
+		}
+		STORE32H(1 + 4 + 4 + reply->len, data);
+		data[4] = SSH_FXP_DATA;
+		STORE32H(reply->id, data + 5);
+		STORE32H(reply->len, data + 9);
+		len = SFTP_DATA_HEADER_LEN + got;
+		reply->sent = len;
+	}
+
+	total = SFTP_DATA_HEADER_LEN + reply->len;
+	while (len < maxlen && reply->sent < total) {
+		unsigned int want = MIN(maxlen - len, total - reply->sent);
+
+		got = read_reply_pread(reply, data + len, want,
+			reply->sent - SFTP_DATA_HEADER_LEN);
+		if (got < 0) {
+			/* the length has already been sent */
+			sftp_fail(sftp, strerror(errno));
+			break;
+		}
+		if (got == 0) {
+			TRACE(("sftp: file truncated while reading, sending zeros"))
+			memset(data + len, 0x0, want);
+			got = want;
+		}
+		len += got;
+		reply->sent += got;
+	}
+
+	if (reply->sent == total) {
+		sftp->pending_reads--;
+	}
+	return len;
+}
+
+/* ChanLocal output(), sends replies */
+static unsigned int sftp_output(struct Channel *channel, unsigned char *data,
+		unsigned int maxlen) {
+	struct SftpServer *sftp = ((struct ChanSess*)channel->typedata)->sftp;
+	unsigned int len = 0;
+
+	while (len < maxlen && sftp->reply_head && !sftp->failed) {
+		struct sftp_reply *reply = sftp->reply_head;
+
+		if (!reply->buf && !reply->started) {
+			read_reply_start(sftp, reply);
+		}
+
+		if (reply->buf) {
+			unsigned int n = MIN(maxlen - len, reply->buf->len - reply->buf->pos);
+			memcpy(data + len, buf_getptr(reply->buf, n), n);
+			buf_incrpos(reply->buf, n);
+			len += n;
+			if (reply->buf->pos < reply->buf->len) {
+				break;
+			}
+		} else {
+			len += read_reply_send(sftp, reply, data + len, maxlen - len);
+			if (reply->buf) {
+				/* nothing left to read, sent as a status */
+				continue;
+			}
+			if (reply->sent < SFTP_DATA_HEADER_LEN + reply->len) {
+				break;
+			}
+		}
+		reply_pop(sftp);
+	}
+	return len;
+}
+
+/* ChanLocal output_ready() */
+static int sftp_output_ready(struct Channel *channel) {
+	struct ChanSess *chansess = (struct ChanSess*)channel->typedata;
+	struct SftpServer *sftp = chansess->sftp;
+
+	if (!sftp->done
+			&& (sftp->failed || channel->recv_close
+				|| (channel->recv_eof && cbuf_getused(channel->writebuf) == 0
+					&& sftp->reply_head == NULL))) {
+		TRACE(("sftp finished, failed %d", sftp->failed))
+		sftp->done = 1;
+		/* for the exit-status, as an sftp-server process would */
+		chansess->exit.exitpid = 0;
+		chansess->exit.exitstatus = sftp->failed ? 1 : 0;
+		chansess->exit.exitsignal = -1;
+	}
+
+	if (sftp->done) {
+		return -1;
+	}
+	return sftp->reply_head != NULL;
+}
+
+int svr_sftp_start(struct Channel *channel, struct ChanSess *chansess) {
+	struct SftpServer *sftp;
+	unsigned int i;
+
+	/* Files are accessed by this process, so it must already be the user */
+	if (getuid() != ses.authstate.pw_uid || geteuid() != ses.authstate.pw_uid) {
+		dropbear_log(LOG_WARNING, "Builtin sftp isn't running as the user");
+		return DROPBEAR_FAILURE;
+	}
+
+	sftp = m_malloc(sizeof(*sftp));
+	/* relative paths start at the home directory, as for a shell */
+	if (ses.authstate.pw_dir[0] == '/') {
+		sftp->home = m_strdup(ses.authstate.pw_dir);
+	} else {
+		sftp->home = m_strdup("/");
+	}
+	for (i = 0; i < SFTP_MAX_HANDLES; i++) {
+		sftp->handles[i].fd = -1;
+	}
+	sftp->write_fd = -1;
+	chansess->sftp = sftp;
+
+	channel_set_local(channel, &sftp_local);
+	return DROPBEAR_SUCCESS;
+}
+
+void svr_sftp_cleanup(struct ChanSess *chansess) {
+	struct SftpServer *sftp = chansess->sftp;
+	unsigned int i;
+
+	if (sftp == NULL) {
+		return;
+	}
+
+	while (sftp->reply_head) {
+		reply_pop(sftp);
+	}
+	for (i = 0; i < SFTP_MAX_HANDLES; i++) {
+		if (sftp->handles[i].in_use) {
+			handle_close(&sftp->handles[i]);
+		}
+	}
+	m_free(sftp->home);
+	m_free(sftp);
+	chansess->sftp = NULL;
+}
+
+#endif /* DROPBEAR_SFTPSERVER_BUILTIN */
@@ -0,0 +1,276 @@
+/*
+ * Dropbear - a SSH2 server
+ * 
+ * Copyright (c) 2026 Matt Johnston
+ * All rights reserved.
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE. */
+
+#include "includes.h"
+#include "dbutil.h"
+#include "buffer.h"
+#include "signkey.h"
+#include "dbrandom.h"
+#include "runopts.h"
+
+#if DROPBEAR_SVR_SNAPSHOT
+
+#include <sys/mman.h>
+
+/* A snapshot of the startup state that a re-executed session would
+ * otherwise read from files: the host keys, the banner and the -G group.
+ * The listening daemon writes it to a sealed memfd once it has loaded
+ * them, and passes it to each re-executed session with -5. The session
+ * reads it while parsing options and drops it once the host keys are
+ * loaded, since it holds the private keys.
+ *
+ * Sessions get what the daemon loaded at startup, as they do without
+ * re-exec. Host keys generated later by -R are read from their files at
+ * key exchange as before. */
+
+#define SNAPSHOT_MAGIC 0x64627331 /* "dbs1" */
+#define SNAPSHOT_MAX_SIZE (17 + MAX_BANNER_SIZE + MAX_HOSTKEYS*(4 + MAX_PRIVKEY_SIZE))
+
+/* Key types a host key can have, see loadhostkey() */
+static const enum signkey_type snapshot_key_types[] = {
+#if DROPBEAR_RSA
+	DROPBEAR_SIGNKEY_RSA,
+#endif
+#if DROPBEAR_DSS
+	DROPBEAR_SIGNKEY_DSS,
+#endif
+#if DROPBEAR_ECDSA
+#if DROPBEAR_ECC_256
+	DROPBEAR_SIGNKEY_ECDSA_NISTP256,
+#endif
+#if DROPBEAR_ECC_384
+	DROPBEAR_SIGNKEY_ECDSA_NISTP384,
+#endif
+#if DROPBEAR_ECC_521
+	DROPBEAR_SIGNKEY_ECDSA_NISTP521,
+#endif
+#endif /* DROPBEAR_ECDSA */
+#if DROPBEAR_ED25519
+	DROPBEAR_SIGNKEY_ED25519,
+#endif
+	DROPBEAR_SIGNKEY_NONE
+};
+
+/* The daemon's memfd */
+static int snapshot_fd = -1;
+
+/* A session's copy, positioned at the host keys */
+static buffer *snapshot = NULL;
+static buffer *snapshot_banner = NULL;
+static gid_t snapshot_group_gid;
+
+static void snapshot_write(int fd, buffer *buf) {
+	ssize_t len;
+
+	buf_setpos(buf, 0);
+	while (buf->pos < buf->len) {
+		len = write(fd, buf_getptr(buf, buf->len - buf->pos), buf->len - buf->pos);
+		if (len < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			dropbear_exit("Failed writing startup snapshot: %s", strerror(errno));
+		}
+		buf_incrpos(buf, len);
+	}
+}
+
+/* Creates the snapshot, in the listening daemon once the host keys are
+ * loaded */
+void svr_snapshot_create(void) {
+	buffer *buf = NULL;
+	buffer *keybuf = NULL;
+	unsigned int i, nkeys = 0, nkeys_pos;
+	void **key;
+	int fd;
+
+	fd = memfd_create("dropbear-snapshot", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0) {
+		TRACE(("snapshot: memfd_create failed: %s", strerror(errno)))
+		return;
+	}
+
+	buf = buf_new(SNAPSHOT_MAX_SIZE);
+	buf_putint(buf, SNAPSHOT_MAGIC);
+	buf_putbyte(buf, svr_opts.banner != NULL);
+	if (svr_opts.banner) {
+		buf_putbufstring(buf, svr_opts.banner);
+	}
+#ifdef HAVE_GETGROUPLIST
+	buf_putint(buf, svr_opts.restrict_group ? svr_opts.restrict_group_gid : 0);
+#else
+	buf_putint(buf, 0);
+#endif
+
+	nkeys_pos = buf->pos;
+	buf_putint(buf, 0);
+	for (i = 0; snapshot_key_types[i] != DROPBEAR_SIGNKEY_NONE; i++) {
+		key = signkey_key_ptr(svr_opts.hostkey, snapshot_key_types[i]);
+		if (key && *key) {
+			keybuf = buf_new(MAX_PRIVKEY_SIZE);
+			buf_put_priv_key(keybuf, svr_opts.hostkey, snapshot_key_types[i]);
+			buf_putbufstring(buf, keybuf);
+			buf_burn_free(keybuf);
+			nkeys++;
+		}
+	}
+	buf_setpos(buf, nkeys_pos);
+	buf_putint(buf, nkeys);
+
+	snapshot_write(fd, buf);
+	buf_burn_free(buf);
+
+	if (fcntl(fd, F_ADD_SEALS,
+			F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0) {
+		TRACE(("snapshot: sealing failed: %s", strerror(errno)))
+		m_close(fd);
+		return;
+	}
+
+	TRACE(("snapshot: %u host keys", nkeys))
+	snapshot_fd = fd;
+}
+
+/* Returns the snapshot for a session that is about to re-execute, so it
+ * is kept open, or -1 if there is none */
+int svr_snapshot_reexec_fd(void) {
+	if (snapshot_fd >= 0 && fcntl(snapshot_fd, F_SETFD, 0) < 0) {
+		TRACE(("clearing cloexec for snapshot failed: %s", strerror(errno)))
+		return -1;
+	}
+	return snapshot_fd;
+}
+
+/* Called by a re-executed session with the "-5" argument */
+void svr_snapshot_open(int fd) {
+	buffer *buf = NULL;
+	struct stat st;
+	ssize_t len;
+	int seals;
+
+	seals = fcntl(fd, F_GET_SEALS);
+	if (seals < 0 || !(seals & F_SEAL_WRITE)
+			|| fstat(fd, &st) < 0 || st.st_size > SNAPSHOT_MAX_SIZE) {
+		dropbear_exit("Bad -5");
+	}
+
+	buf = buf_new(st.st_size);
+	do {
+		len = pread(fd, buf_getwriteptr(buf, st.st_size), st.st_size, 0);
+	} while (len < 0 && errno == EINTR);
+	m_close(fd);
+	if (len != st.st_size) {
+		dropbear_exit("Bad -5");
+	}
+	buf_incrwritepos(buf, len);
+	buf_setpos(buf, 0);
+
+	if (buf_getint(buf) != SNAPSHOT_MAGIC) {
+		dropbear_exit("Bad -5");
+	}
+	if (buf_getbool(buf)) {
+		snapshot_banner = buf_getstringbuf(buf);
+	}
+	snapshot_group_gid = buf_getint(buf);
+	snapshot = buf;
+}
+
+/* Sets svr_opts.banner from the snapshot. Returns DROPBEAR_FAILURE if
+ * there is no snapshot and the banner file should be read */
+int svr_snapshot_banner(void) {
+	if (!snapshot) {
+		return DROPBEAR_FAILURE;
+	}
+	svr_opts.banner = snapshot_banner;
+	snapshot_banner = NULL;
+	return DROPBEAR_SUCCESS;
+}
+
+#ifdef HAVE_GETGROUPLIST
+/* Sets svr_opts.restrict_group_gid from the snapshot. Returns
+ * DROPBEAR_FAILURE if there is no snapshot and the group should be
+ * looked up */
+int svr_snapshot_group(void) {
+	if (!snapshot) {
+		return DROPBEAR_FAILURE;
+	}
+	svr_opts.restrict_group_gid = snapshot_group_gid;
+	return DROPBEAR_SUCCESS;
+}
+#endif
+
+/* Loads the host keys from the snapshot into svr_opts.hostkey and drops
+ * the snapshot. Returns DROPBEAR_FAILURE if there is no snapshot and the
+ * host key files should be read */
+int svr_snapshot_hostkeys(void) {
+	buffer *keybuf = NULL;
+	enum signkey_type type;
+	unsigned int i, nkeys;
+
+	if (!snapshot) {
+		return DROPBEAR_FAILURE;
+	}
+
+	/* as readhostkey() would */
+	addrandom(buf_getptr(snapshot, snapshot->len - snapshot->pos),
+		snapshot->len - snapshot->pos);
+
+	nkeys = buf_getint(snapshot);
+	for (i = 0; i < nkeys; i++) {
+		keybuf = buf_getstringbuf(snapshot);
+		type = DROPBEAR_SIGNKEY_ANY;
+		if (buf_get_priv_key(keybuf, svr_opts.hostkey, &type) == DROPBEAR_FAILURE) {
+			dropbear_exit("Bad host key in startup snapshot");
+		}
+		buf_burn_free(keybuf);
+	}
+
+	buf_burn_free(snapshot);
+	snapshot = NULL;
+	if (snapshot_banner) {
+		/* unused */
+		buf_free(snapshot_banner);
+		snapshot_banner = NULL;
+	}
+	TRACE(("snapshot: loaded %u host keys", nkeys))
+	return DROPBEAR_SUCCESS;
+}
+
+#else /* DROPBEAR_SVR_SNAPSHOT */
+
+int svr_snapshot_banner(void) {
+	return DROPBEAR_FAILURE;
+}
+
+#ifdef HAVE_GETGROUPLIST
+int svr_snapshot_group(void) {
+	return DROPBEAR_FAILURE;
+}
+#endif
+
+int svr_snapshot_hostkeys(void) {
+	return DROPBEAR_FAILURE;
+}
+
+#endif /* DROPBEAR_SVR_SNAPSHOT */
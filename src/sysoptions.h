@@ -60,6 +60,40 @@
 #ifndef DROPBEAR_KEXGUESS2
 #define DROPBEAR_KEXGUESS2 1
 #endif
+/* Generate the ephemeral key exchange keypair ahead of time when the session
+ * is otherwise idle - while waiting for the peer's kexdh init, or once a rekey
+ * is approaching. Reduces handshake latency and the stall during rekeying. */
+#ifndef DROPBEAR_KEX_PREGEN
+#define DROPBEAR_KEX_PREGEN 1
+#endif
+/* Rekey is "approaching" after this much of KEX_REKEY_DATA or KEX_REKEY_TIMEOUT */
+#ifndef KEX_PREGEN_DATA
+#define KEX_PREGEN_DATA (KEX_REKEY_DATA / 8 * 7)
+#endif
+#ifndef KEX_PREGEN_TIMEOUT
+#define KEX_PREGEN_TIMEOUT (KEX_REKEY_TIMEOUT / 8 * 7)
+#endif
+
+/* Outbound connections try addresses in parallel as RFC8305 "Happy Eyeballs",
+ * starting another attempt if the previous one hasn't completed after
+ * this many milliseconds (RFC8305 recommends 250) */
+#ifndef DROPBEAR_CONNECT_ATTEMPT_DELAY
+#define DROPBEAR_CONNECT_ATTEMPT_DELAY 250
+#endif
+/* Concurrent attempts for a single outbound connection */
+#ifndef DROPBEAR_CONNECT_MAX_ATTEMPTS
+#define DROPBEAR_CONNECT_MAX_ATTEMPTS 4
+#endif
+/* Look up hostnames for outbound connections (dbclient and tcp forwards)
+ * in a helper process, so that a slow DNS server doesn't stall the rest
+ * of the session */
+#ifndef DROPBEAR_ASYNC_RESOLVE
+#define DROPBEAR_ASYNC_RESOLVE 1
+#endif
+/* Number of hostnames kept for DROPBEAR_RESOLVE_CACHE_TIME */
+#ifndef DROPBEAR_RESOLVE_CACHE_SIZE
+#define DROPBEAR_RESOLVE_CACHE_SIZE 16
+#endif
 
 /* Minimum key sizes for DSS and RSA */
 #ifndef MIN_DSS_KEYLEN
@@ -206,7 +240,8 @@
 /* hashes which will be linked and registered */
 #define DROPBEAR_SHA1 (DROPBEAR_RSA_SHA1 || DROPBEAR_DSS \
 				|| DROPBEAR_SHA1_HMAC || DROPBEAR_SHA1_96_HMAC \
-				|| DROPBEAR_DH_GROUP1 || DROPBEAR_DH_GROUP14_SHA1 )
+				|| DROPBEAR_DH_GROUP1 || DROPBEAR_DH_GROUP14_SHA1 \
+				|| DROPBEAR_CLI_HASHED_KNOWNHOSTS )
 /* sha256 is always used for fingerprints and dbrandom */
 #define DROPBEAR_SHA256 1
 #define DROPBEAR_SHA384 (DROPBEAR_ECC_384)
@@ -321,14 +356,23 @@
 #define DROPBEAR_SVR_LOCALANYFWD ((DROPBEAR_SVR_LOCALTCPFWD) || (DROPBEAR_SVR_LOCALSTREAMFWD))
 #define DROPBEAR_SVR_REMOTEANYFWD ((DROPBEAR_SVR_REMOTETCPFWD) || (DROPBEAR_SVR_REMOTESTREAMFWD))
 
+#if DROPBEAR_SVR_SPLICE_FWD && DROPBEAR_SVR_LOCALANYFWD \
+	&& defined(HAVE_SPLICE) && !DROPBEAR_FUZZ
+#define DROPBEAR_CHANNEL_SPLICE 1
+#else
+#define DROPBEAR_CHANNEL_SPLICE 0
+#endif
+
 #define DROPBEAR_LISTENERS \
    ((DROPBEAR_CLI_REMOTETCPFWD) || (DROPBEAR_CLI_LOCALTCPFWD) || \
 	(DROPBEAR_SVR_REMOTEANYFWD) || (DROPBEAR_SVR_LOCALANYFWD) || \
-	(DROPBEAR_SVR_AGENTFWD) || (DROPBEAR_X11FWD))
+	(DROPBEAR_SVR_AGENTFWD) || (DROPBEAR_X11FWD) || (DROPBEAR_CLI_MULTIPLEX) || \
+	(DROPBEAR_SVR_PAM_ASYNC))
 
 #define DROPBEAR_CLI_MULTIHOP ((DROPBEAR_CLI_NETCAT) && (DROPBEAR_CLI_PROXYCMD))
 
-#define ENABLE_CONNECT_UNIX ((DROPBEAR_CLI_AGENTFWD) || (DROPBEAR_USE_PRNGD))
+#define ENABLE_CONNECT_UNIX ((DROPBEAR_CLI_AGENTFWD) || (DROPBEAR_USE_PRNGD) \
+	|| (DROPBEAR_CLI_MULTIPLEX))
 
 /* if we're using authorized_keys or known_hosts */ 
 #define DROPBEAR_KEY_LINES ((DROPBEAR_CLIENT) || (DROPBEAR_SVR_PUBKEY_AUTH))
@@ -414,6 +458,40 @@
 #define DROPBEAR_VFORK 1
 #endif
 
+#if !NON_INETD_MODE || DROPBEAR_FUZZ
+#undef DROPBEAR_SVR_LOGINQUEUE
+#define DROPBEAR_SVR_LOGINQUEUE 0
+#endif
+
+#if !NON_INETD_MODE || DROPBEAR_FUZZ
+#undef DROPBEAR_SVR_PWCACHE
+#define DROPBEAR_SVR_PWCACHE 0
+#endif
+
+#if !DROPBEAR_DO_REEXEC || !NON_INETD_MODE || DROPBEAR_FUZZ \
+	|| !defined(HAVE_MEMFD_CREATE)
+#undef DROPBEAR_SVR_SNAPSHOT
+#define DROPBEAR_SVR_SNAPSHOT 0
+#endif
+
+#if !DROPBEAR_SVR_PAM_AUTH || DROPBEAR_VFORK || DROPBEAR_FUZZ
+#undef DROPBEAR_SVR_PAM_ASYNC
+#define DROPBEAR_SVR_PAM_ASYNC 0
+#endif
+
+#if !DROPBEAR_RSA || DROPBEAR_VFORK || DROPBEAR_FUZZ
+#undef DROPBEAR_RSA_PARALLEL_KEYGEN
+#define DROPBEAR_RSA_PARALLEL_KEYGEN 0
+#endif
+
+/* The vfork()ed child can't change user */
+#if DROPBEAR_SVR_VFORK_EXEC && !DROPBEAR_VFORK && !DROPBEAR_FUZZ \
+	&& (DROPBEAR_SVR_DROP_PRIVS || !DROPBEAR_SVR_MULTIUSER)
+#define DROPBEAR_SVR_SPAWN_VFORK 1
+#else
+#define DROPBEAR_SVR_SPAWN_VFORK 0
+#endif
+
 #ifndef DROPBEAR_LISTEN_BACKLOG
 #if MAX_UNAUTH_CLIENTS > MAX_CHANNELS
 #define DROPBEAR_LISTEN_BACKLOG MAX_UNAUTH_CLIENTS
@@ -422,6 +500,20 @@
 #endif
 #endif
 
+/* Number of source prefixes tracked for MAX_UNAUTH_RATE_PER_IP. New
+ * sources are refused while all of them have pending penalties */
+#define DROPBEAR_ADMIT_SOURCES 1024
+/* Number of recently authenticated prefixes that can use all of
+ * MAX_UNAUTH_RATE */
+#define DROPBEAR_ADMIT_AUTHED 256
+/* Prefix lengths that sources are counted by */
+#define DROPBEAR_ADMIT_PREFIX4 24
+#define DROPBEAR_ADMIT_PREFIX6 64
+
+#if MAX_UNAUTH_BURST_PER_IP <= 0
+#error "MAX_UNAUTH_BURST_PER_IP must be at least 1"
+#endif
+
 /* free memory before exiting */
 #define DROPBEAR_CLEANUP 1
 
@@ -467,6 +559,11 @@
 #error DROPBEAR_SVR_DROP_PRIVS needs DROPBEAR_SVR_MULTIUSER
 #endif
 
+/* The builtin sftp server runs in the session process */
+#if DROPBEAR_SFTPSERVER_BUILTIN && !(DROPBEAR_SVR_DROP_PRIVS || !DROPBEAR_SVR_MULTIUSER)
+#error DROPBEAR_SFTPSERVER_BUILTIN requires DROPBEAR_SVR_DROP_PRIVS or !DROPBEAR_SVR_MULTIUSER
+#endif
+
 #if !(DROPBEAR_SVR_DROP_PRIVS || !DROPBEAR_SVR_MULTIUSER) \
    && (DROPBEAR_SVR_LOCALSTREAMFWD || DROPBEAR_SVR_LOCALSTREAMFWD)
 #error stream forwarding requires DROPBEAR_SVR_DROP_PRIVS or !DROPBEAR_SVR_MULTIUSER
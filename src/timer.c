@@ -0,0 +1,188 @@
+/*
+ * Dropbear - a SSH2 server
+ * 
+ * Copyright (c) 2026 Matt Johnston
+ * All rights reserved.
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE. */
+
+#include "includes.h"
+#include "dbutil.h"
+#include "session.h"
+#include "timer.h"
+
+static int ts_before(const struct timespec *a, const struct timespec *b) {
+	if (a->tv_sec != b->tv_sec) {
+		return a->tv_sec < b->tv_sec;
+	}
+	return a->tv_nsec < b->tv_nsec;
+}
+
+static int timer_before(const struct dropbear_timer *a,
+		const struct dropbear_timer *b) {
+	return ts_before(&a->deadline, &b->deadline);
+}
+
+static void heap_place(unsigned int i, struct dropbear_timer *timer) {
+	ses.timers.items[i] = timer;
+	timer->pos = i + 1;
+}
+
+static void heap_up(unsigned int i) {
+	struct dropbear_timer *timer = ses.timers.items[i];
+	while (i > 0) {
+		unsigned int parent = (i - 1) / 2;
+		if (!timer_before(timer, ses.timers.items[parent])) {
+			break;
+		}
+		heap_place(i, ses.timers.items[parent]);
+		i = parent;
+	}
+	heap_place(i, timer);
+}
+
+static void heap_down(unsigned int i) {
+	struct dropbear_timer *timer = ses.timers.items[i];
+	for (;;) {
+		unsigned int child = 2 * i + 1;
+		if (child >= ses.timers.count) {
+			break;
+		}
+		if (child + 1 < ses.timers.count
+				&& timer_before(ses.timers.items[child+1], ses.timers.items[child])) {
+			child++;
+		}
+		if (!timer_before(ses.timers.items[child], timer)) {
+			break;
+		}
+		heap_place(i, ses.timers.items[child]);
+		i = child;
+	}
+	heap_place(i, timer);
+}
+
+void timer_init(struct dropbear_timer *timer, void (*cb)(void *arg), void *arg) {
+	memset(timer, 0x0, sizeof(*timer));
+	timer->cb = cb;
+	timer->arg = arg;
+}
+
+static void timer_set(struct dropbear_timer *timer, const struct timespec *deadline) {
+	unsigned int i;
+
+	timer_cancel(timer);
+	timer->deadline = *deadline;
+
+	if (ses.timers.count == ses.timers.size) {
+		ses.timers.size = MAX(8, ses.timers.size * 2);
+		ses.timers.items = m_realloc(ses.timers.items,
+			ses.timers.size * sizeof(*ses.timers.items));
+	}
+	i = ses.timers.count++;
+	heap_place(i, timer);
+	heap_up(i);
+}
+
+void timer_at(struct dropbear_timer *timer, time_t when) {
+	struct timespec deadline;
+	deadline.tv_sec = when;
+	deadline.tv_nsec = 0;
+	timer_set(timer, &deadline);
+}
+
+void timer_after_ms(struct dropbear_timer *timer, long ms) {
+	struct timespec deadline;
+	gettime_wrapper(&deadline);
+	deadline.tv_sec += ms / 1000;
+	deadline.tv_nsec += (ms % 1000) * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+	timer_set(timer, &deadline);
+}
+
+void timer_cancel(struct dropbear_timer *timer) {
+	unsigned int i;
+	struct dropbear_timer *last;
+
+	if (!timer->pos) {
+		return;
+	}
+	i = timer->pos - 1;
+	timer->pos = 0;
+	ses.timers.count--;
+	if (i == ses.timers.count) {
+		return;
+	}
+	/* move the last item into the gap, it may need to go either way */
+	last = ses.timers.items[ses.timers.count];
+	heap_place(i, last);
+	heap_up(i);
+	heap_down(last->pos - 1);
+}
+
+int timer_pending(const struct dropbear_timer *timer) {
+	return timer->pos != 0;
+}
+
+long timer_next_ms(void) {
+	const struct timespec *deadline;
+	struct timespec now;
+	time_t sec;
+
+	if (ses.timers.count == 0) {
+		return -1;
+	}
+	deadline = &ses.timers.items[0]->deadline;
+	gettime_wrapper(&now);
+	sec = deadline->tv_sec - now.tv_sec;
+	if (sec < 0 || (sec == 0 && deadline->tv_nsec <= now.tv_nsec)) {
+		return 0;
+	}
+	sec = MIN(sec, LONG_MAX / 1000 - 1);
+	/* round up, so the timer is due when we wake */
+	return sec * 1000L + (deadline->tv_nsec - now.tv_nsec + 999999L) / 1000000L;
+}
+
+void timer_run(void) {
+	struct timespec now;
+	/* Timers set again by a callback wait for the next call */
+	unsigned int n = ses.timers.count;
+
+	gettime_wrapper(&now);
+	while (n-- > 0 && ses.timers.count > 0) {
+		struct dropbear_timer *timer = ses.timers.items[0];
+		if (ts_before(&now, &timer->deadline)) {
+			break;
+		}
+		timer_cancel(timer);
+		timer->cb(timer->arg);
+	}
+}
+
+void timer_cleanup(void) {
+	unsigned int i;
+	for (i = 0; i < ses.timers.count; i++) {
+		ses.timers.items[i]->pos = 0;
+	}
+	m_free(ses.timers.items);
+	ses.timers.count = 0;
+	ses.timers.size = 0;
+}
@@ -0,0 +1,62 @@
+/*
+ * Dropbear - a SSH2 server
+ * 
+ * Copyright (c) 2026 Matt Johnston
+ * All rights reserved.
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE. */
+
+#ifndef DROPBEAR_TIMER_H_
+#define DROPBEAR_TIMER_H_
+
+#include "includes.h"
+
+/* One-shot timers for the session loop. A timer is embedded in whatever
+ * owns it and is kept in a min-heap in ses.timers while it is set, so
+ * the loop only has to look at the earliest deadline. Callbacks that
+ * watch a time which can move (such as the last packet time) simply set
+ * the timer again when they find it hasn't expired yet. */
+struct dropbear_timer {
+	struct timespec deadline;
+	void (*cb)(void *arg);
+	void *arg;
+	unsigned int pos; /* index in the heap plus one, 0 when not set */
+};
+
+struct timer_heap {
+	struct dropbear_timer **items;
+	unsigned int count;
+	unsigned int size;
+};
+
+void timer_init(struct dropbear_timer *timer, void (*cb)(void *arg), void *arg);
+/* Sets the timer to fire once monotonic_now() reaches when */
+void timer_at(struct dropbear_timer *timer, time_t when);
+/* Sets the timer to fire after ms milliseconds */
+void timer_after_ms(struct dropbear_timer *timer, long ms);
+void timer_cancel(struct dropbear_timer *timer);
+int timer_pending(const struct dropbear_timer *timer);
+/* Milliseconds until the earliest timer is due, 0 if one is already due,
+ * or -1 if none are set */
+long timer_next_ms(void);
+/* Runs the callbacks of timers that are due */
+void timer_run(void);
+void timer_cleanup(void);
+
+#endif /* DROPBEAR_TIMER_H_ */
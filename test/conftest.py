@@ -8,6 +8,12 @@ def pytest_addoption(parser):
     parser.addoption("--remote", type=str, help="remote host")
     parser.addoption("--user", type=str, help="optional username")
     parser.addoption("--ssh-keygen", type=str, default="ssh-keygen")
+    parser.addoption("--bench", type=str, help="run benchmarks, writing JSON results to this file")
+    parser.addoption("--bench-time", type=float, default=3, help="seconds for each handshake benchmark")
+    parser.addoption("--bench-size", type=int, default=64, help="MB sent for each throughput benchmark")
+    parser.addoption("--bench-clients", type=int, default=8, help="concurrent clients for handshake benchmarks")
+    parser.addoption("--bench-channels", type=int, default=4, help="concurrent channels for throughput benchmarks")
+    parser.addoption("--bench-ssh", type=str, default="ssh", help="OpenSSH client for key exchange benchmarks")
 
 def pytest_configure(config):
     opt = config.option
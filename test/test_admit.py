@@ -0,0 +1,41 @@
+from test_dropbear import *
+import socket
+import time
+
+# Tests for the -x connection rate limit
+
+def banner(port):
+	""" Returns the start of the server's ident, empty if it was refused """
+	with socket.create_connection((LOCALADDR, int(port)), timeout=10) as s:
+		return s.recv(8)
+
+def test_admit_refill(request):
+	port = free_port()
+	# 60 per minute, bursts of 2
+	with own_dropbear(request, port, "-x", "60,2") as p:
+		assert banner(port) == b"SSH-2.0-"
+		assert banner(port) == b"SSH-2.0-"
+		# over the burst
+		assert banner(port) == b""
+		# refilled at one a second
+		time.sleep(1.5)
+		assert banner(port) == b"SSH-2.0-"
+	assert any("over the rate limit" in l for l in p.output)
+
+def test_admit_failures(request, tmp_path):
+	port = free_port()
+	# no keys, a wrong password
+	env = dict(os.environ, HOME=str(tmp_path), DROPBEAR_PASSWORD="wrong")
+	# 6 per minute, bursts of 2
+	with own_dropbear(request, port, "-x", "6,2", "-T", "1") as p:
+		# a failed attempt costs a token as well as the connection
+		r = dbclient(request, "true", port=port, env=env, capture_output=True)
+		assert r.returncode != 0
+		assert banner(port) == b""
+
+def test_admit_off(request):
+	port = free_port()
+	# off by default
+	with own_dropbear(request, port):
+		for _ in range(5):
+			assert banner(port) == b"SSH-2.0-"
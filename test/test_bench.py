@@ -0,0 +1,291 @@
+from test_dropbear import *
+import json
+import shutil
+import socket
+import struct
+
+# End-to-end benchmarks against a local dropbear server.
+# These are skipped unless --bench=results.json is given, eg
+#   make -C test bench
+# The output file is written at the end of the run, sorted so that
+# results from different builds can be compared with diff.
+
+@pytest.fixture(scope="session")
+def bench_results(request):
+	opt = request.config.option
+	if not opt.bench:
+		pytest.skip("benchmarks need --bench")
+	if opt.remote:
+		pytest.skip("benchmarks only run against a local dropbear")
+
+	res = {
+		"dropbear_version": subprocess.run(opt.dropbear.split() + ["-V"],
+			capture_output=True, text=True).stderr.strip(),
+		"params": {
+			"time": opt.bench_time,
+			"size_mb": opt.bench_size,
+			"clients": opt.bench_clients,
+			"channels": opt.bench_channels,
+		},
+		"throughput": [],
+		"handshake": [],
+	}
+	yield res
+
+	res["throughput"].sort(key=lambda r: (r["cipher"], r["mac"] or "", r["channels"]))
+	res["handshake"].sort(key=lambda r: (r["client"], r["kex"], r["hostkey"]))
+	with open(opt.bench, "w") as f:
+		json.dump(res, f, indent=1, sort_keys=True)
+		f.write("\n")
+	print(f"Wrote benchmark results to {opt.bench}")
+
+def client_args(request, port, *args):
+	opt = request.config.option
+	# -yy since the benchmark servers use temporary hostkeys
+	return opt.dbclient.split() + ["-yy", LOCALADDR, "-p", str(port)] + list(args)
+
+def client_algos(request, flag):
+	""" The list printed by dbclient -c help or -m help """
+	opt = request.config.option
+	r = subprocess.run(opt.dbclient.split() + [flag, "help"],
+		capture_output=True, text=True)
+	for l in r.stderr.splitlines():
+		if "Available" in l:
+			return l.split(": ")[-1].strip().split(",")
+	raise Exception(f"Couldn't parse {flag} help: {r.stderr}")
+
+def is_aead(cipher):
+	return "poly1305" in cipher or "gcm" in cipher
+
+def percentile(samples, p):
+	s = sorted(samples)
+	return s[min(len(s)-1, int(len(s) * p / 100))]
+
+class Sink(socketserver.ThreadingMixIn, socketserver.TCPServer):
+	""" Discards incoming data, closing the socket on EOF """
+	allow_reuse_address = True
+	daemon_threads = True
+
+	def __init__(self):
+		super().__init__((LOCALADDR, 0), self.Handler)
+		self.port = self.server_address[1]
+
+	class Handler(socketserver.BaseRequestHandler):
+		def handle(self):
+			while self.request.recv(65536):
+				pass
+
+	def __enter__(self):
+		self.server_thread = threading.Thread(target=self.serve_forever)
+		self.server_thread.daemon = True
+		self.server_thread.start()
+		return self
+
+	def __exit__(self, *exc_stuff):
+		self.shutdown()
+		self.server_thread.join()
+
+def wait_listening(port, proc, timeout=10):
+	end = time.time() + timeout
+	while time.time() < end:
+		assert proc.poll() is None, "client exited early"
+		try:
+			with socket.create_connection((LOCALADDR, port), timeout=1):
+				return
+		except OSError:
+			time.sleep(0.05)
+	raise Exception(f"Nothing listening on port {port}")
+
+def send_through(port, size):
+	""" Sends size bytes through a forwarded port, returning once the
+	far end has read it all and closed """
+	block = os.urandom(65536)
+	with socket.create_connection((LOCALADDR, port)) as s:
+		sent = 0
+		while sent < size:
+			n = min(len(block), size - sent)
+			s.sendall(block[:n])
+			sent += n
+		s.shutdown(socket.SHUT_WR)
+		while s.recv(65536):
+			pass
+
+def test_bench_throughput(request, dropbear, bench_results):
+	""" MB/s through a local forward for each cipher/MAC, with one channel
+	and with several concurrent channels over the same connection """
+	opt = request.config.option
+	size = opt.bench_size * 1024 * 1024
+	macs = client_algos(request, "-m")
+	for cipher in client_algos(request, "-c"):
+		for mac in macs[:1] if is_aead(cipher) else macs:
+			with Sink() as sink:
+				fwdport = free_port()
+				args = client_args(request, opt.port, "-N", "-c", cipher, "-m", mac,
+					"-L", f"{LOCALADDR}:{fwdport}:{LOCALADDR}:{sink.port}")
+				p = subprocess.Popen(args, stdin=subprocess.DEVNULL)
+				try:
+					wait_listening(fwdport, p)
+					for channels in sorted({1, opt.bench_channels}):
+						each = size // channels
+						threads = [threading.Thread(target=send_through, args=(fwdport, each))
+							for _ in range(channels)]
+						t = time.monotonic()
+						for th in threads:
+							th.start()
+						for th in threads:
+							th.join()
+						t = time.monotonic() - t
+						bench_results["throughput"].append({
+							"cipher": cipher,
+							"mac": None if is_aead(cipher) else mac,
+							"channels": channels,
+							"bytes": each * channels,
+							"seconds": round(t, 3),
+							"mb_per_s": round(each * channels / t / 1e6, 2),
+							})
+				finally:
+					p.terminate()
+					p.wait()
+
+def handshake_run(request, cmd_for_client):
+	""" Runs connections from concurrent clients for --bench-time seconds.
+	Returns (connections, failures, elapsed, time to shell samples) """
+	opt = request.config.option
+	samples = []
+	failures = []
+	lock = threading.Lock()
+	end = time.monotonic() + opt.bench_time
+
+	def worker():
+		while time.monotonic() < end:
+			t = time.monotonic()
+			p = subprocess.Popen(cmd_for_client(), stdin=subprocess.DEVNULL,
+				stdout=subprocess.PIPE, stderr=subprocess.DEVNULL, text=True)
+			# time until the remote shell has run a command. Shell startup
+			# files may print other output first.
+			tts = None
+			for l in p.stdout:
+				if l.strip() == "ready":
+					tts = time.monotonic() - t
+					break
+			p.stdout.read()
+			ok = p.wait() == 0 and tts is not None
+			with lock:
+				if ok:
+					samples.append(tts)
+				else:
+					failures.append(p.returncode)
+
+	start = time.monotonic()
+	threads = [threading.Thread(target=worker) for _ in range(opt.bench_clients)]
+	for th in threads:
+		th.start()
+	for th in threads:
+		th.join()
+	elapsed = time.monotonic() - start
+	if failures and not samples:
+		return None
+	return len(samples), len(failures), elapsed, samples
+
+def handshake_result(client, kex, hostkey, run):
+	n, failures, elapsed, samples = run
+	return {
+		"client": client,
+		"kex": kex,
+		"hostkey": hostkey,
+		"connections": n,
+		"failures": failures,
+		"handshakes_per_s": round(n / elapsed, 2),
+		"time_to_shell_p50_ms": round(percentile(samples, 50) * 1000, 2),
+		"time_to_shell_p99_ms": round(percentile(samples, 99) * 1000, 2),
+		}
+
+@pytest.fixture(scope="module")
+def bench_servers(request, bench_results, tmp_path_factory):
+	""" A dropbear server for each hostkey type that dropbearkey can make,
+	returns a dict of hostkey type to port """
+	opt = request.config.option
+	d = tmp_path_factory.mktemp("benchkeys")
+	servers = {}
+	procs = []
+	for kt, extra in (("ed25519", []), ("ecdsa", ["-s", "256"]),
+			("ecdsa", ["-s", "384"]), ("ecdsa", ["-s", "521"]), ("rsa", []), ("dss", [])):
+		name = kt + "".join(extra[1:])
+		keyfile = str(d / name)
+		r = subprocess.run(opt.dropbearkey.split() + ["-t", kt, "-f", keyfile] + extra,
+			capture_output=True)
+		if r.returncode != 0:
+			# not compiled in
+			continue
+		port = free_port()
+		p = subprocess.Popen(opt.dropbear.split() + ["-p", f"{LOCALADDR}:{port}",
+			"-r", keyfile, "-F", "-E"], stderr=subprocess.PIPE, text=True)
+		for l in p.stderr:
+			if "Not backgrounding" in l:
+				break
+		assert p.poll() is None
+		# discard log output
+		threading.Thread(target=p.stderr.read, daemon=True).start()
+		procs.append(p)
+		servers[name] = port
+	yield servers
+	for p in procs:
+		p.terminate()
+		p.wait()
+
+def test_bench_handshake(request, bench_servers, bench_results):
+	""" Handshakes per second and time to shell with dbclient, using its
+	default key exchange """
+	for hostkey, port in bench_servers.items():
+		run = handshake_run(request, lambda: client_args(request, port, "echo ready"))
+		assert run, f"dbclient connections failed for {hostkey}"
+		bench_results["handshake"].append(
+			handshake_result("dbclient", "default", hostkey, run))
+
+def server_kex_algos(port):
+	""" Reads the key exchange methods from the server's KEXINIT """
+	with socket.create_connection((LOCALADDR, port), timeout=10) as s:
+		f = s.makefile("rb")
+		s.sendall(b"SSH-2.0-benchprobe\r\n")
+		while not f.readline().startswith(b"SSH-"):
+			pass
+		plen, padlen = struct.unpack(">IB", f.read(5))
+		payload = f.read(plen - 1)[:plen - 1 - padlen]
+	# msg type and cookie, then the kex name-list
+	assert payload[0] == 20
+	(l,) = struct.unpack(">I", payload[17:21])
+	names = payload[21:21+l].decode().split(",")
+	return [n for n in names if not n.startswith(("ext-info", "kex-strict", "kexguess"))]
+
+def test_bench_kex(request, bench_servers, bench_results, tmp_path):
+	""" Handshakes per second for each key exchange/hostkey combination.
+	dbclient can't choose the key exchange method so this uses OpenSSH """
+	opt = request.config.option
+	ssh = shutil.which(opt.bench_ssh)
+	if not ssh:
+		pytest.skip(f"{opt.bench_ssh} not found")
+	# OpenSSH can't read dropbear format keys
+	ident = str(tmp_path / "id_bench")
+	r = subprocess.run(opt.dropbearconvert.split() + ["dropbear", "openssh",
+		os.path.expanduser("~/.ssh/id_dropbear"), ident], capture_output=True)
+	if r.returncode != 0:
+		pytest.skip("Couldn't convert ~/.ssh/id_dropbear for OpenSSH")
+	ssh_supported = subprocess.run([ssh, "-Q", "kex"],
+		capture_output=True, text=True).stdout.split()
+
+	for hostkey, port in bench_servers.items():
+		for kex in server_kex_algos(port):
+			if kex not in ssh_supported:
+				continue
+			def cmd():
+				return [ssh, "-F", "/dev/null", "-i", ident, "-p", str(port),
+					"-o", "BatchMode=yes", "-o", "IdentitiesOnly=yes",
+					"-o", "StrictHostKeyChecking=no", "-o", "UserKnownHostsFile=/dev/null",
+					"-o", "LogLevel=ERROR", "-o", f"KexAlgorithms={kex}",
+					"-o", "HostKeyAlgorithms=+ssh-rsa,ssh-dss",
+					LOCALADDR, "echo ready"]
+			run = handshake_run(request, cmd)
+			if not run:
+				# eg OpenSSH refusing a key type
+				continue
+			bench_results["handshake"].append(handshake_result("openssh", kex, hostkey, run))
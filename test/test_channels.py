@@ -92,6 +92,32 @@ def test_netcat(request, dropbear, size):
 		assert r.stdout == dat2
 		assert tcp.inbound() == dat1
 
+def test_netcat_slow_reader(request, dropbear):
+	""" A forward to a socket that stops reading, so the server has to
+	queue data for it, then reads it all
+	"""
+	opt = request.config.option
+	if opt.remote:
+		pytest.xfail("don't know netcat address for remote")
+
+	dat = os.urandom(8_000_000)
+	got = []
+	with socket.create_server(("localhost", 0)) as l:
+		port = l.getsockname()[1]
+		def sink():
+			c, _ = l.accept()
+			# more than the socket buffers hold
+			time.sleep(1)
+			got.append(readall_socket(c))
+			c.close()
+		t = threading.Thread(target=sink, daemon=True)
+		t.start()
+		r = dbclient(request, "-B", f"localhost:{port}", input=dat,
+			capture_output=True, timeout=30)
+		r.check_returncode()
+		t.join(30)
+	assert got[0] == dat
+
 @pytest.mark.parametrize("size", [1, 4000, 40000])
 @pytest.mark.parametrize("fwd_flag", "LR")
 def test_tcpflushout(request, dropbear, size, fwd_flag):
@@ -7,6 +7,8 @@ import time
 import socketserver
 import threading
 import queue
+import socket
+import contextlib
 
 import pytest
 
@@ -19,12 +21,104 @@ def dropbear(request):
 		yield None
 		return
 
+	with own_dropbear(request, opt.port) as p:
+		yield p
+
+def children(pid):
+	""" Returns the pids of a process's children """
+	found = []
+	for d in os.listdir("/proc"):
+		if not d.isdigit():
+			continue
+		try:
+			with open("/proc/%s/stat" % d) as f:
+				stat = f.read()
+		except OSError:
+			continue
+		# the fields after the command name, which can have spaces
+		fields = stat[stat.rindex(")")+2:].split()
+		if int(fields[1]) == pid and fields[0] != "Z":
+			found.append(int(d))
+	return found
+
+def running(pid):
+	try:
+		with open("/proc/%d/stat" % pid) as f:
+			stat = f.read()
+	except OSError:
+		return False
+	return stat[stat.rindex(")")+2] != "Z"
+
+def daemon_helpers(p):
+	""" Returns the pids of the helpers forked by a daemon that has just
+	started, in the order they were started """
+	helpers = []
+	# started just after "Not backgrounding"
+	for _ in range(10):
+		time.sleep(0.1)
+		found = children(p.pid)
+		if found and found == helpers:
+			break
+		helpers = found
+	return sorted(helpers)
+
+def process_name(pid):
+	try:
+		with open("/proc/%d/comm" % pid) as f:
+			return f.read().strip()
+	except OSError:
+		return None
+
+def daemon_helper(p, name):
+	""" Returns the pid of the helper that a daemon which has just started
+	forked and named, or None """
+	# started just after "Not backgrounding", named once running
+	for _ in range(20):
+		for c in children(p.pid):
+			if process_name(c) == name:
+				return c
+		time.sleep(0.1)
+	return None
+
+@contextlib.contextmanager
+def helper_dropbear(request, name):
+	""" Runs a daemon, yields it and the pid of its helper named name.
+	Skipped if there is no such helper """
+	if not os.path.isdir("/proc/self"):
+		pytest.skip("needs /proc")
+	port = free_port()
+	with own_dropbear(request, port) as p:
+		helper = daemon_helper(p, name)
+		if helper is None:
+			pytest.skip("%s isn't running" % name)
+		p.port = port
+		yield p, helper
+
+def wait_gone(pid, timeout=10):
+	end = time.time() + timeout
+	while time.time() < end:
+		if not running(pid):
+			return True
+		time.sleep(0.1)
+	return False
+
+def free_port():
+	with socket.socket() as s:
+		s.bind((LOCALADDR, 0))
+		return str(s.getsockname()[1])
+
+@contextlib.contextmanager
+def own_dropbear(request, port, *extra_args, hostkey=None):
+	""" Runs a dropbear server on port with extra arguments.
+	Yields the Popen, its stderr is read when it exits
+	"""
+	opt = request.config.option
 	# split so that "dropbearmulti dropbear" works
 	args = opt.dropbear.split() + [
-		"-p", LOCALADDR + ":" + opt.port, # bind locally only
-		"-r", opt.hostkey,
+		"-p", LOCALADDR + ":" + port, # bind locally only
+		"-r", hostkey or opt.hostkey,
 		"-F", "-E",
-		]
+		] + list(extra_args)
 	print("subprocess args: ", args)
 
 	p = subprocess.Popen(args, stderr=subprocess.PIPE, text=True)
@@ -35,10 +129,13 @@ def dropbear(request):
 	# Check it's still running
 		assert p.poll() is None
 	# Ready
-	yield p
-	p.terminate()
+	try:
+		yield p
+	finally:
+		p.terminate()
 	print("Terminated dropbear. Flushing output:")
 	lines = [l.rstrip() for l in p.stderr]
+	p.output = lines
 	for l in lines:
 		print(l)
 
@@ -53,7 +150,8 @@ def dbclient(request, *args, **kwargs):
 	opt = request.config.option
 	host = opt.remote or LOCALADDR
 	# split so that "dropbearmulti dbclient" works
-	base_args = opt.dbclient.split() + ["-y", host, "-p", opt.port]
+	port = kwargs.pop("port", opt.port)
+	base_args = opt.dbclient.split() + ["-y", host, "-p", port]
 	if opt.user:
 		base_args.extend(['-l', opt.user])
 	full_args = base_args + list(args)
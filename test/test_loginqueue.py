@@ -0,0 +1,42 @@
+from test_dropbear import *
+import signal
+
+# Tests for the login record helper forked by the listening daemon
+
+def login_dropbear(request):
+	return helper_dropbear(request, "dropbear-login")
+
+def test_loginqueue_sigterm(request):
+	with login_dropbear(request) as (p, helper):
+		# the helper doesn't keep the daemon's handler
+		os.kill(helper, signal.SIGTERM)
+		assert wait_gone(helper)
+		# sessions write their records directly
+		r = dbclient(request, "echo ok", port=p.port, capture_output=True, text=True)
+		assert r.stdout.strip() == "ok"
+
+def test_loginqueue_session(request):
+	with login_dropbear(request) as (p, helper):
+		# logged in and out by the helper
+		m, s = pty.openpty()
+		r = dbclient(request, "-t", "tty", port=p.port, stdin=s,
+			capture_output=True, text=True)
+		assert r.stdout.split()[-1].startswith("/dev/")
+		# sessions don't pass their socket to commands
+		r = dbclient(request, "ls /proc/self/fd", port=p.port,
+			capture_output=True, text=True)
+		assert sorted(r.stdout.split()) == ["0", "1", "2", "3"]
+		assert running(helper)
+	assert not any("login record" in l.lower() for l in p.output)
+
+def test_loginqueue_exit(request):
+	with login_dropbear(request) as (p, helper):
+		s = dbclient(request, "sleep 2", port=p.port, background=True)
+		time.sleep(0.5)
+		p.terminate()
+		p.wait()
+		# kept for the session
+		time.sleep(0.5)
+		assert running(helper)
+		s.wait(timeout=10)
+		assert wait_gone(helper)
@@ -0,0 +1,55 @@
+from test_dropbear import *
+import socket
+import struct
+import array
+
+# Tests for dbclient connection sharing with ControlMaster/ControlPath
+
+@pytest.fixture
+def mux_master(request, dropbear, tmp_path):
+	path = str(tmp_path / "mux")
+	# the master's own command prints its session's pid
+	m = dbclient(request, "-o", "ControlMaster=yes", "-o", "ControlPath=" + path,
+		"echo $PPID; sleep 30", background=True, stdout=subprocess.PIPE, text=True)
+	ppid = m.stdout.readline().strip()
+	assert os.path.exists(path)
+	yield (path, ppid)
+	m.terminate()
+	m.wait()
+
+def mux_client(request, path, *args, **kwargs):
+	return dbclient(request, "-o", "ControlPath=" + path, *args, **kwargs)
+
+def test_mux_command(request, mux_master):
+	path, ppid = mux_master
+	r = mux_client(request, path, "echo $PPID", capture_output=True, text=True)
+	r.check_returncode()
+	# run by the master's session, not a new connection
+	assert r.stdout.strip() == ppid
+
+def test_mux_roundtrip(request, mux_master):
+	path, _ = mux_master
+	dat = os.urandom(100_000)
+	r = mux_client(request, path, "cat; exit 7", input=dat, capture_output=True)
+	assert r.returncode == 7
+	assert r.stdout == dat
+
+def test_mux_stalled_client(request, mux_master):
+	path, ppid = mux_master
+	# a client that connects and never sends its request doesn't hold up others
+	with socket.socket(socket.AF_UNIX) as s:
+		s.connect(path)
+		r = mux_client(request, path, "echo $PPID", capture_output=True, text=True)
+		assert r.stdout.strip() == ppid
+
+def test_mux_bad_fds(request, mux_master):
+	path, ppid = mux_master
+	# the wrong number of fds is refused
+	with socket.socket(socket.AF_UNIX) as s:
+		s.connect(path)
+		s.sendmsg([struct.pack(">I", 4)],
+			[(socket.SOL_SOCKET, socket.SCM_RIGHTS, array.array("i", [0, 1, 2, 0, 1]))])
+		s.settimeout(10)
+		assert s.recv(10) == b""
+	r = mux_client(request, path, "echo $PPID", capture_output=True, text=True)
+	assert r.stdout.strip() == ppid
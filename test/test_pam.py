@@ -0,0 +1,51 @@
+from test_dropbear import *
+
+# Tests for PAM password auth, which runs in a helper process.
+# Skipped if the server isn't built with PAM
+
+@pytest.fixture(scope="module")
+def pam_built(request):
+	binary = request.config.option.dropbear.split()[0]
+	with open(binary, "rb") as f:
+		if b"pam_authenticate" not in f.read():
+			pytest.skip("PAM isn't built")
+
+def open_fds(pid):
+	return sorted(os.listdir("/proc/%d/fd" % pid))
+
+def wrong_password(tmp_path):
+	# no keys, so only the password is tried
+	return dict(os.environ, HOME=str(tmp_path), DROPBEAR_PASSWORD="wrong")
+
+def test_pam_bad_password(request, pam_built, tmp_path):
+	port = free_port()
+	with own_dropbear(request, port, "-T", "1") as p:
+		r = dbclient(request, "true", port=port, env=wrong_password(tmp_path),
+			capture_output=True, timeout=30)
+		assert r.returncode != 0
+	assert any("Bad PAM password attempt" in l for l in p.output)
+
+def test_pam_disconnect(request, pam_built, tmp_path):
+	if not os.path.isdir("/proc/self"):
+		pytest.skip("needs /proc")
+	port = free_port()
+	with own_dropbear(request, port, "-T", "1") as p:
+		helpers = daemon_helpers(p)
+		daemon_fds = open_fds(p.pid)
+		c = dbclient(request, "true", port=port, env=wrong_password(tmp_path),
+			background=True, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+		time.sleep(1)
+		# the session, and its PAM helper if PAM is still working
+		procs = [s for s in children(p.pid) if s not in helpers]
+		assert procs
+		procs += children(procs[0])
+		c.kill()
+		c.wait()
+		# The session kills the helper rather than waiting for PAM. Neither
+		# holds the daemon's childpipe, so the unauthed slot is freed
+		end = time.time() + 1.5
+		while time.time() < end and (any(running(s) for s in procs)
+				or open_fds(p.pid) != daemon_fds):
+			time.sleep(0.1)
+		assert not any(running(s) for s in procs)
+		assert open_fds(p.pid) == daemon_fds
@@ -0,0 +1,40 @@
+from test_dropbear import *
+import signal
+
+# Tests for the user lookup cache kept by a helper of the listening daemon
+
+def cache_dropbear(request):
+	return helper_dropbear(request, "dropbear-cache")
+
+def login(request, p):
+	r = dbclient(request, "echo ok", port=p.port, capture_output=True, text=True)
+	return r.stdout.split()[-1:] == ["ok"]
+
+def test_pwcache_repeat(request):
+	with cache_dropbear(request) as (p, helper):
+		# a miss, then found
+		assert login(request, p)
+		assert login(request, p)
+		# sessions don't map the cache
+		r = dbclient(request, "grep -c pwcache /proc/$PPID/maps", port=p.port,
+			capture_output=True, text=True)
+		assert r.stdout.split()[-1] == "0"
+		assert running(helper)
+
+def test_pwcache_flush(request):
+	with cache_dropbear(request) as (p, helper):
+		assert login(request, p)
+		# passed on by the daemon
+		os.kill(p.pid, signal.SIGUSR1)
+		assert login(request, p)
+		assert running(helper)
+	assert any("Clearing user cache" in l for l in p.output)
+
+def test_pwcache_helper_gone(request):
+	with cache_dropbear(request) as (p, helper):
+		os.kill(helper, signal.SIGTERM)
+		assert wait_gone(helper)
+		# sessions look users up themselves
+		assert login(request, p)
+		assert login(request, p)
+	assert any("User cache helper failed" in l for l in p.output)
@@ -0,0 +1,258 @@
+from test_dropbear import *
+import struct
+import pwd
+import select
+
+# Tests for the builtin SFTP server, skipped if it isn't built
+
+FXP_INIT = 1
+FXP_VERSION = 2
+FXP_OPEN = 3
+FXP_CLOSE = 4
+FXP_READ = 5
+FXP_WRITE = 6
+FXP_OPENDIR = 11
+FXP_READDIR = 12
+FXP_REALPATH = 16
+FXP_STATUS = 101
+FXP_HANDLE = 102
+FXP_DATA = 103
+FXP_NAME = 104
+
+FX_OK = 0
+FX_EOF = 1
+FX_BAD_MESSAGE = 5
+
+FXF_READ = 1
+FXF_WRITE = 2
+FXF_CREAT = 8
+FXF_TRUNC = 0x10
+
+def string(s):
+	if isinstance(s, str):
+		s = s.encode()
+	return struct.pack(">I", len(s)) + s
+
+class Reply:
+	def __init__(self, body):
+		self.type = body[0]
+		self.id, = struct.unpack(">I", body[1:5])
+		self.data = body[5:]
+		self.pos = 0
+
+	def int(self):
+		v, = struct.unpack(">I", self.data[self.pos:self.pos+4])
+		self.pos += 4
+		return v
+
+	def string(self):
+		n = self.int()
+		s = self.data[self.pos:self.pos+n]
+		self.pos += n
+		return s
+
+	def status(self):
+		assert self.type == FXP_STATUS
+		return self.int()
+
+class Sftp:
+	def __init__(self, proc):
+		self.proc = proc
+		self.next_id = 1
+
+	def send_raw(self, body):
+		self.proc.stdin.write(struct.pack(">I", len(body)) + body)
+		self.proc.stdin.flush()
+
+	def send(self, type, payload):
+		""" Returns the request id """
+		i = self.next_id
+		self.next_id += 1
+		self.send_raw(bytes([type]) + struct.pack(">I", i) + payload)
+		return i
+
+	def recv(self):
+		hdr = self.proc.stdout.read(4)
+		if len(hdr) < 4:
+			return None
+		n, = struct.unpack(">I", hdr)
+		return Reply(self.proc.stdout.read(n))
+
+	def call(self, type, payload):
+		i = self.send(type, payload)
+		r = self.recv()
+		assert r.id == i
+		return r
+
+	def open(self, path, flags):
+		r = self.call(FXP_OPEN, string(path) + struct.pack(">II", flags, 0))
+		assert r.type == FXP_HANDLE, r.status()
+		return r.string()
+
+	def close(self, handle):
+		assert self.call(FXP_CLOSE, string(handle)).status() == FX_OK
+
+def sftp_connect(request, port):
+	""" Returns a Sftp after INIT, or None if the server doesn't reply """
+	p = dbclient(request, "-s", "sftp", port=port, background=True,
+		stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+	s = Sftp(p)
+	s.send_raw(bytes([FXP_INIT]) + struct.pack(">I", 3))
+	r = s.recv()
+	if r is None:
+		p.wait()
+		return None
+	assert r.type == FXP_VERSION
+	return s
+
+@pytest.fixture(scope="module")
+def sftp_port(request):
+	port = free_port()
+	with own_dropbear(request, port, "-c", "internal-sftp"):
+		s = sftp_connect(request, port)
+		if s is None:
+			pytest.skip("builtin sftp isn't built")
+		s.proc.stdin.close()
+		s.proc.wait(timeout=10)
+		yield port
+
+@pytest.fixture
+def sftp(request, sftp_port):
+	s = sftp_connect(request, sftp_port)
+	yield s
+	s.proc.stdin.close()
+	s.proc.wait(timeout=10)
+
+def test_sftp_put_get(sftp, tmp_path):
+	path = str(tmp_path / "f")
+	dat = os.urandom(300_000)
+	chunk = 32768
+
+	h = sftp.open(path, FXF_WRITE | FXF_CREAT | FXF_TRUNC)
+	ids = [sftp.send(FXP_WRITE, string(h) + struct.pack(">Q", off)
+		+ string(dat[off:off+chunk])) for off in range(0, len(dat), chunk)]
+	for i in ids:
+		r = sftp.recv()
+		assert r.id == i and r.status() == FX_OK
+	sftp.close(h)
+	with open(path, "rb") as f:
+		assert f.read() == dat
+
+	h = sftp.open(path, FXF_READ)
+	got = b""
+	while True:
+		r = sftp.call(FXP_READ, string(h) + struct.pack(">QI", len(got), chunk))
+		if r.type == FXP_STATUS:
+			assert r.status() == FX_EOF
+			break
+		assert r.type == FXP_DATA
+		got += r.string()
+	sftp.close(h)
+	assert got == dat
+
+def test_sftp_read_truncate(sftp, tmp_path):
+	path = tmp_path / "f"
+	dat = os.urandom(8_000_000)
+	path.write_bytes(dat)
+	chunk = 256*1024
+	# below where the client stops reading
+	keep = 100_000
+
+	h = sftp.open(str(path), FXF_READ)
+	ids = [sftp.send(FXP_READ, string(h) + struct.pack(">QI", off, chunk))
+		for off in range(0, len(dat), chunk)]
+	# the window fills part way through the replies
+	time.sleep(0.5)
+	os.truncate(path, keep)
+
+	for i, off in zip(ids, range(0, len(dat), chunk)):
+		r = sftp.recv()
+		assert r.id == i
+		if r.type == FXP_STATUS:
+			assert r.status() == FX_EOF
+			assert off >= keep
+			continue
+		assert r.type == FXP_DATA
+		got = r.string()
+		# what was there when it was read
+		n = max(0, min(len(got), keep - off))
+		assert got[:n] == dat[off:off+n]
+	# the session carries on
+	sftp.close(h)
+	r = sftp.call(FXP_REALPATH, string(str(tmp_path)))
+	assert r.type == FXP_NAME
+
+def test_sftp_write_wrap(sftp, tmp_path):
+	h = sftp.open(str(tmp_path / "w"), FXF_WRITE | FXF_CREAT)
+	# A WRITE header is 33 bytes, but this packet is 24. The data length
+	# is read from the next request's id, and the WRITE's length plus it
+	# wraps to 20. It's a bad message, not 4GB of data
+	sftp.send_raw(bytes([FXP_WRITE]) + struct.pack(">I", 1) + string(h)
+		+ b"\0\0\0")
+	realpath_id = 2**32 - 29 + 20
+	sftp.proc.stdin.write(struct.pack(">IBI", 5 + len(string(".")),
+		FXP_REALPATH, realpath_id) + string("."))
+	sftp.proc.stdin.flush()
+
+	# nothing would come back
+	assert select.select([sftp.proc.stdout], [], [], 10)[0]
+	r = sftp.recv()
+	assert r.id == 1 and r.status() == FX_BAD_MESSAGE
+	r = sftp.recv()
+	assert r.id == realpath_id and r.type == FXP_NAME
+
+def test_sftp_readdir(sftp, tmp_path):
+	names = set(random_alnum(10) for _ in range(50))
+	for n in names:
+		(tmp_path / n).write_text(n)
+	user = pwd.getpwuid(os.getuid()).pw_name
+
+	r = sftp.call(FXP_OPENDIR, string(str(tmp_path)))
+	h = r.string()
+	seen = set()
+	while True:
+		r = sftp.call(FXP_READDIR, string(h))
+		if r.type == FXP_STATUS:
+			assert r.status() == FX_EOF
+			break
+		assert r.type == FXP_NAME
+		for _ in range(r.int()):
+			name = r.string().decode()
+			longname = r.string().decode()
+			# flags and the attributes, which are all sent
+			r.pos += 4 + 8 + 4 + 4 + 4 + 4 + 4
+			seen.add(name)
+			if name in names:
+				assert longname.split()[2] == user[:15]
+	sftp.close(h)
+	assert names <= seen
+
+def test_sftp_home(sftp):
+	# relative paths are from the home directory
+	home = os.path.realpath(pwd.getpwuid(os.getuid()).pw_dir)
+	for p in ("", "."):
+		r = sftp.call(FXP_REALPATH, string(p))
+		assert r.type == FXP_NAME and r.int() == 1
+		assert r.string().decode() == home
+
+def test_sftp_bad_message(sftp, tmp_path):
+	# a READ without its offset and length
+	r = sftp.call(FXP_READ, string(b"12345678"))
+	assert r.status() == FX_BAD_MESSAGE
+	# a string longer than the request
+	r = sftp.call(FXP_OPENDIR, struct.pack(">I", 1000) + b"/tmp")
+	assert r.status() == FX_BAD_MESSAGE
+	# still running
+	r = sftp.call(FXP_REALPATH, string(str(tmp_path)))
+	assert r.type == FXP_NAME
+
+def test_sftp_truncated(request, sftp, sftp_port):
+	# without an id only the channel is closed
+	sftp.send_raw(bytes([FXP_OPEN]))
+	assert sftp.recv() is None
+	assert sftp.proc.wait(timeout=10) != 0
+	# the server carries on
+	s = sftp_connect(request, sftp_port)
+	assert s is not None
+	s.proc.stdin.close()
+	s.proc.wait(timeout=10)
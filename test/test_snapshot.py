@@ -0,0 +1,38 @@
+from test_dropbear import *
+import shutil
+
+# Tests for the startup snapshot passed to re-executed sessions
+
+def keygen_args(request):
+	prog = request.config.option.dropbear.split()
+	if len(prog) > 1:
+		# dropbearmulti
+		return prog[:1] + ["dropbearkey"]
+	return [os.path.join(os.path.dirname(prog[0]), "dropbearkey")]
+
+def test_snapshot_hostkey(request, tmp_path):
+	opt = request.config.option
+	if opt.remote:
+		pytest.skip("needs a local server")
+	key = tmp_path / "hostkey"
+	shutil.copy(opt.hostkey, key)
+	# same type as the test host key, so the client compares them
+	newkey = tmp_path / "newkey"
+	subprocess.run(keygen_args(request) + ["-t", "ecdsa", "-f", str(newkey)],
+		check=True, capture_output=True)
+	# known_hosts is kept in the temporary home
+	home = tmp_path / "home"
+	home.mkdir()
+	env = dict(os.environ, HOME=str(home))
+	ident = os.path.expanduser("~/.ssh/id_dropbear")
+	port = free_port()
+	with own_dropbear(request, port, hostkey=str(key)) as p:
+		r = dbclient(request, "-i", ident, "echo ok", port=port, env=env,
+			capture_output=True, text=True)
+		assert r.stdout.split()[-1:] == ["ok"]
+		# Sessions still offer the key the daemon loaded, the client
+		# would reject a changed host key
+		shutil.copy(newkey, key)
+		r = dbclient(request, "-i", ident, "echo ok", port=port, env=env,
+			capture_output=True, text=True)
+		assert r.stdout.split()[-1:] == ["ok"], r.stderr